@@ -0,0 +1,631 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Aggregate function types
+#define AGG_COUNT               0
+#define AGG_SUM                 1
+#define AGG_MIN                 2
+#define AGG_MAX                 3
+#define AGG_AVG                 4
+#define AGG_COUNT_DISTINCT      5
+
+#define AGG_MIN_SLOTS           1024
+#define AGG_PARTITION_BITS      4
+#define AGG_PARTITIONS          (1 << AGG_PARTITION_BITS)
+#define AGG_MAX_DEPTH           8           // each level uses the next AGG_PARTITION_BITS bits of the hash
+
+//
+// Group-by aggregation.
+//
+// Groups live in an open-addressing hash table (linear probing); each group's key (its
+// group-by column values, NUL-separated) and aggregate state are allocated from an arena,
+// so per-group overhead is small and freeing is cheap. Exact "count-distinct" uses a second
+// open-addressing table keyed on (group, value).
+//
+// Input rows are first projected down to just the columns we need. When the table's memory
+// use exceeds the limit, rows for existing groups continue to be aggregated in memory, but
+// rows for new groups are written to one of AGG_PARTITIONS spill files chosen by hash bits.
+// After the in-memory groups are output and freed, each spill file is aggregated in turn
+// (recursively, using the next hash bits, up to AGG_MAX_DEPTH levels).
+//
+
+struct agg_func {
+    int                 type;
+    char                *name;              // result column name, e.g. "sum(price)"
+    char                *colspec;           // column name or number, or NULL
+    size_t              col;                // index into projected row
+};
+
+struct agg_state {
+    uint64_t            count;
+    double              sum;
+    long long           isum;
+    int                 integral;           // all values summed so far were integers and "isum" hasn't overflowed
+    char                *str;               // current minimum or maximum
+};
+
+struct agg_group {
+    uint64_t            hash;
+    char                *key;
+    size_t              keylen;
+    struct agg_state    *states;
+};
+
+struct agg_distinct {
+    uint64_t            hash;
+    size_t              group;
+    const char          *value;             // NULL if slot is empty
+};
+
+struct agg_table {
+    int                 depth;
+    size_t              *slots;             // group index plus one, or zero if empty
+    size_t              num_slots;
+    struct agg_group    *groups;            // in order of first appearance
+    size_t              num_groups;
+    size_t              alloc_groups;
+    struct agg_distinct *distinct;
+    size_t              num_distinct;
+    size_t              num_distinct_slots;
+    struct arena        *arena;
+    size_t              memory;             // not including the arena
+    struct spill        *partitions[AGG_PARTITIONS];
+    int                 spilling;
+};
+
+struct agg {
+    char                **group_specs;
+    size_t              num_group;
+    struct agg_func     *funcs;
+    size_t              num_funcs;
+    size_t              *proj;              // input column for each projected column
+    size_t              num_proj;
+    char                **names;            // result column names
+    size_t              num_names;
+    size_t              memory_limit;
+    struct agg_table    *table;
+    char                **values;           // projected row
+    char                **result;           // result row
+    char                *keybuf;
+    size_t              keyalloc;
+};
+
+static struct agg_table *agg_table_create(int depth);
+static void agg_table_add(struct agg *agg, struct agg_table *t, char *const *values);
+static void agg_table_finish(struct agg *agg, struct agg_table *t,
+    void (*emit)(void *arg, char *const *fields, size_t num), void *arg);
+static void agg_table_grow(struct agg_table *t);
+static void agg_update(struct agg *agg, struct agg_table *t, size_t group, char *const *values);
+static int agg_distinct_add(struct agg_table *t, size_t group, const char *value);
+static void agg_distinct_grow(struct agg_table *t);
+static char *agg_format(const struct agg_func *func, const struct agg_state *state);
+static int agg_number(const char *value, double *dp, long long *llp, int *integralp);
+static int agg_compare(const char *value1, const char *value2);
+static char **agg_split(const char *list, const char *desc, size_t *nump);
+
+//
+// Parse the "--group-by" column list and "--agg" function list.
+//
+struct agg *
+agg_create(const char *group_by, const char *aggs, size_t memory_limit)
+{
+    static const struct {
+        const char  *name;
+        int         type;
+    } types[] = {
+        { "count",          AGG_COUNT },
+        { "sum",            AGG_SUM },
+        { "min",            AGG_MIN },
+        { "max",            AGG_MAX },
+        { "avg",            AGG_AVG },
+        { "count-distinct", AGG_COUNT_DISTINCT },
+    };
+    struct agg_func *func;
+    struct agg *agg;
+    char **specs;
+    size_t num_specs;
+    size_t namelen;
+    char *paren;
+    size_t i;
+    size_t j;
+
+    if ((agg = calloc(1, sizeof(*agg))) == NULL)
+        err(1, "calloc");
+    agg->memory_limit = memory_limit;
+    if (group_by != NULL)
+        agg->group_specs = agg_split(group_by, "group-by", &agg->num_group);
+    specs = agg_split(aggs, "agg", &num_specs);
+    if ((agg->funcs = calloc(num_specs, sizeof(*agg->funcs))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < num_specs; i++) {
+        func = &agg->funcs[agg->num_funcs++];
+        func->name = specs[i];
+        namelen = strlen(specs[i]);
+        if ((paren = strchr(specs[i], '(')) != NULL) {
+            if (specs[i][namelen - 1] != ')' || paren[1] == ')')
+                errx(1, "invalid aggregate function \"%s\"", specs[i]);
+            namelen = paren - specs[i];
+            if ((func->colspec = strndup(paren + 1, strlen(paren + 1) - 1)) == NULL)
+                err(1, "strndup");
+        }
+        for (j = 0; j < sizeof(types) / sizeof(*types); j++) {
+            if (strlen(types[j].name) == namelen && strncmp(types[j].name, specs[i], namelen) == 0)
+                break;
+        }
+        if (j == sizeof(types) / sizeof(*types))
+            errx(1, "unknown aggregate function \"%.*s\"", (int)namelen, specs[i]);
+        func->type = types[j].type;
+        if ((func->type == AGG_COUNT) != (func->colspec == NULL))
+            errx(1, "invalid aggregate function \"%s\"", specs[i]);
+    }
+    free(specs);
+    return agg;
+}
+
+//
+// Resolve column names (if "names" is not NULL) or numbers to input columns.
+//
+void
+agg_resolve(struct agg *agg, char *const *names, size_t num_names)
+{
+    size_t i;
+
+    if ((agg->proj = calloc(agg->num_group + agg->num_funcs, sizeof(*agg->proj))) == NULL)
+        err(1, "calloc");
+    if ((agg->names = calloc(agg->num_group + agg->num_funcs, sizeof(*agg->names))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < agg->num_group; i++) {
+        agg->proj[agg->num_proj++] = find_column(agg->group_specs[i], names, num_names);
+        agg->names[agg->num_names++] = agg->group_specs[i];
+    }
+    for (i = 0; i < agg->num_funcs; i++) {
+        if (agg->funcs[i].colspec != NULL) {
+            agg->funcs[i].col = agg->num_proj;
+            agg->proj[agg->num_proj++] = find_column(agg->funcs[i].colspec, names, num_names);
+        }
+        agg->names[agg->num_names++] = agg->funcs[i].name;
+    }
+    if ((agg->values = calloc(agg->num_proj + 1, sizeof(*agg->values))) == NULL)
+        err(1, "calloc");
+    if ((agg->result = calloc(agg->num_names, sizeof(*agg->result))) == NULL)
+        err(1, "calloc");
+    agg->keyalloc = 64;
+    if ((agg->keybuf = malloc(agg->keyalloc)) == NULL)
+        err(1, "malloc");
+    agg->table = agg_table_create(0);
+}
+
+void
+agg_column_names(const struct agg *agg, char *const **namesp, size_t *nump)
+{
+    *namesp = agg->names;
+    *nump = agg->num_names;
+}
+
+void
+agg_add(struct agg *agg, char *const *fields, size_t num)
+{
+    static char empty[] = "";
+    size_t i;
+
+    for (i = 0; i < agg->num_proj; i++)
+        agg->values[i] = agg->proj[i] < num ? fields[agg->proj[i]] : empty;
+    agg_table_add(agg, agg->table, agg->values);
+}
+
+//
+// Output one row per group, then free everything.
+//
+void
+agg_finish(struct agg *agg, void (*emit)(void *arg, char *const *fields, size_t num), void *arg)
+{
+    size_t i;
+
+    if (agg->table != NULL)
+        agg_table_finish(agg, agg->table, emit, arg);
+    for (i = 0; i < agg->num_group; i++)
+        free(agg->group_specs[i]);
+    for (i = 0; i < agg->num_funcs; i++) {
+        free(agg->funcs[i].name);
+        free(agg->funcs[i].colspec);
+    }
+    free(agg->group_specs);
+    free(agg->funcs);
+    free(agg->proj);
+    free(agg->names);
+    free(agg->values);
+    free(agg->result);
+    free(agg->keybuf);
+    free(agg);
+}
+
+static struct agg_table *
+agg_table_create(int depth)
+{
+    struct agg_table *t;
+
+    if ((t = calloc(1, sizeof(*t))) == NULL)
+        err(1, "calloc");
+    t->depth = depth;
+    t->num_slots = AGG_MIN_SLOTS;
+    if ((t->slots = calloc(t->num_slots, sizeof(*t->slots))) == NULL)
+        err(1, "calloc");
+    t->memory = t->num_slots * sizeof(*t->slots);
+    t->arena = arena_create();
+    return t;
+}
+
+static void
+agg_table_add(struct agg *agg, struct agg_table *t, char *const *values)
+{
+    struct agg_group *group;
+    size_t keylen = 0;
+    uint64_t hash;
+    size_t slot;
+    size_t len;
+    size_t i;
+
+    // Build key
+    for (i = 0; i < agg->num_group; i++) {
+        len = strlen(values[i]) + 1;
+        if (keylen + len > agg->keyalloc) {
+            agg->keyalloc = (keylen + len) * 2;
+            if ((agg->keybuf = realloc(agg->keybuf, agg->keyalloc)) == NULL)
+                err(1, "realloc");
+        }
+        memcpy(agg->keybuf + keylen, values[i], len);
+        keylen += len;
+    }
+    hash = hash_bytes(agg->keybuf, keylen);
+
+    // Find existing group
+    for (slot = hash & (t->num_slots - 1); t->slots[slot] != 0; slot = (slot + 1) & (t->num_slots - 1)) {
+        group = &t->groups[t->slots[slot] - 1];
+        if (group->hash == hash && group->keylen == keylen && memcmp(group->key, agg->keybuf, keylen) == 0) {
+            agg_update(agg, t, t->slots[slot] - 1, values);
+            return;
+        }
+    }
+
+    // New group; if we're over the memory limit, spill it to a partition instead
+    if (t->spilling) {
+        i = (hash >> (64 - AGG_PARTITION_BITS * (t->depth + 1))) & (AGG_PARTITIONS - 1);
+        if (t->partitions[i] == NULL)
+            t->partitions[i] = spill_create();
+        spill_write(t->partitions[i], 0, values, agg->num_proj);
+        return;
+    }
+
+    // Add new group
+    if (t->num_groups == t->alloc_groups) {
+        t->memory -= t->alloc_groups * sizeof(*t->groups);
+        t->alloc_groups = t->alloc_groups > 0 ? t->alloc_groups * 2 : 64;
+        if ((t->groups = realloc(t->groups, t->alloc_groups * sizeof(*t->groups))) == NULL)
+            err(1, "realloc");
+        t->memory += t->alloc_groups * sizeof(*t->groups);
+    }
+    group = &t->groups[t->num_groups];
+    group->hash = hash;
+    group->keylen = keylen;
+    group->key = arena_alloc(t->arena, keylen);
+    memcpy(group->key, agg->keybuf, keylen);
+    group->states = arena_alloc(t->arena, agg->num_funcs * sizeof(*group->states));
+    memset(group->states, 0, agg->num_funcs * sizeof(*group->states));
+    for (i = 0; i < agg->num_funcs; i++)
+        group->states[i].integral = 1;
+    t->slots[slot] = ++t->num_groups;
+    if (t->num_groups * 4 > t->num_slots * 3)
+        agg_table_grow(t);
+    agg_update(agg, t, t->num_groups - 1, values);
+
+    // Start spilling if we've gone over the limit
+    if (agg->memory_limit != 0 && t->memory + arena_size(t->arena) > agg->memory_limit && t->depth < AGG_MAX_DEPTH)
+        t->spilling = 1;
+}
+
+static void
+agg_table_finish(struct agg *agg, struct agg_table *t, void (*emit)(void *arg, char *const *fields, size_t num), void *arg)
+{
+    struct spill *partitions[AGG_PARTITIONS];
+    struct agg_table *sub;
+    struct agg_group *group;
+    const int depth = t->depth;
+    char **fields;
+    size_t num;
+    size_t i;
+    size_t j;
+    char *key;
+
+    // Output groups
+    for (i = 0; i < t->num_groups; i++) {
+        group = &t->groups[i];
+        key = group->key;
+        for (j = 0; j < agg->num_group; j++) {
+            agg->result[j] = key;
+            key += strlen(key) + 1;
+        }
+        for (j = 0; j < agg->num_funcs; j++)
+            agg->result[agg->num_group + j] = agg_format(&agg->funcs[j], &group->states[j]);
+        (*emit)(arg, agg->result, agg->num_names);
+        for (j = 0; j < agg->num_funcs; j++) {
+            free(agg->result[agg->num_group + j]);
+            free(group->states[j].str);
+        }
+    }
+
+    // Free table
+    memcpy(partitions, t->partitions, sizeof(partitions));
+    arena_destroy(t->arena);
+    free(t->slots);
+    free(t->groups);
+    free(t->distinct);
+    free(t);
+
+    // Aggregate spilled partitions
+    for (i = 0; i < AGG_PARTITIONS; i++) {
+        if (partitions[i] == NULL)
+            continue;
+        spill_rewind(partitions[i]);
+        sub = agg_table_create(depth + 1);
+        while (spill_read(partitions[i], NULL, &fields, &num)) {
+            agg_table_add(agg, sub, fields);
+            while (num > 0)
+                free(fields[--num]);
+            free(fields);
+        }
+        spill_destroy(partitions[i]);
+        agg_table_finish(agg, sub, emit, arg);
+    }
+}
+
+static void
+agg_table_grow(struct agg_table *t)
+{
+    size_t slot;
+    size_t i;
+
+    free(t->slots);
+    t->memory -= t->num_slots * sizeof(*t->slots);
+    t->num_slots *= 2;
+    t->memory += t->num_slots * sizeof(*t->slots);
+    if ((t->slots = calloc(t->num_slots, sizeof(*t->slots))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < t->num_groups; i++) {
+        for (slot = t->groups[i].hash & (t->num_slots - 1); t->slots[slot] != 0; slot = (slot + 1) & (t->num_slots - 1))
+            ;
+        t->slots[slot] = i + 1;
+    }
+}
+
+static void
+agg_update(struct agg *agg, struct agg_table *t, size_t group, char *const *values)
+{
+    struct agg_state *const states = t->groups[group].states;
+    const struct agg_func *func;
+    struct agg_state *state;
+    const char *value;
+    long long ll;
+    int integral;
+    double d;
+    int cmp;
+    size_t i;
+
+    for (i = 0; i < agg->num_funcs; i++) {
+        func = &agg->funcs[i];
+        state = &states[i];
+        value = values[func->col];
+        switch (func->type) {
+        case AGG_COUNT:
+            state->count++;
+            break;
+        case AGG_SUM:
+        case AGG_AVG:
+            if (!agg_number(value, &d, &ll, &integral))
+                break;
+            state->count++;
+            state->sum += d;
+            if (state->integral && (!integral || __builtin_add_overflow(state->isum, ll, &state->isum)))
+                state->integral = 0;
+            break;
+        case AGG_MIN:
+        case AGG_MAX:
+            if (*value == '\0')
+                break;
+            if (state->str != NULL) {
+                cmp = agg_compare(value, state->str);
+                if (func->type == AGG_MIN ? cmp >= 0 : cmp <= 0)
+                    break;
+                t->memory -= strlen(state->str);
+                free(state->str);
+            }
+            if ((state->str = strdup(value)) == NULL)
+                err(1, "strdup");
+            t->memory += strlen(state->str);
+            break;
+        case AGG_COUNT_DISTINCT:
+            if (*value != '\0' && agg_distinct_add(t, group, value))
+                state->count++;
+            break;
+        default:
+            errx(1, "internal error");
+        }
+    }
+}
+
+// Add (group, value) to the distinct set; returns non-zero if it was not already present
+static int
+agg_distinct_add(struct agg_table *t, size_t group, const char *value)
+{
+    const uint64_t hash = hash_bytes(value, strlen(value)) ^ (group * 0x9e3779b97f4a7c15ULL);
+    struct agg_distinct *entry;
+    size_t mask;
+    size_t slot;
+    size_t len;
+
+    if ((t->num_distinct + 1) * 4 > t->num_distinct_slots * 3)
+        agg_distinct_grow(t);
+    mask = t->num_distinct_slots - 1;
+    for (slot = hash & mask; (entry = &t->distinct[slot])->value != NULL; slot = (slot + 1) & mask) {
+        if (entry->hash == hash && entry->group == group && strcmp(entry->value, value) == 0)
+            return 0;
+    }
+    len = strlen(value) + 1;
+    entry->value = memcpy(arena_alloc(t->arena, len), value, len);
+    entry->hash = hash;
+    entry->group = group;
+    t->num_distinct++;
+    return 1;
+}
+
+static void
+agg_distinct_grow(struct agg_table *t)
+{
+    struct agg_distinct *const old = t->distinct;
+    const size_t num_old = t->num_distinct_slots;
+    size_t slot;
+    size_t i;
+
+    t->memory -= num_old * sizeof(*t->distinct);
+    t->num_distinct_slots = num_old > 0 ? num_old * 2 : AGG_MIN_SLOTS;
+    t->memory += t->num_distinct_slots * sizeof(*t->distinct);
+    if ((t->distinct = calloc(t->num_distinct_slots, sizeof(*t->distinct))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < num_old; i++) {
+        if (old[i].value == NULL)
+            continue;
+        for (slot = old[i].hash & (t->num_distinct_slots - 1);
+          t->distinct[slot].value != NULL; slot = (slot + 1) & (t->num_distinct_slots - 1))
+            ;
+        t->distinct[slot] = old[i];
+    }
+    free(old);
+}
+
+// Format an aggregate result; caller must free it
+static char *
+agg_format(const struct agg_func *func, const struct agg_state *state)
+{
+    char *result;
+    int r;
+
+    switch (func->type) {
+    case AGG_COUNT:
+    case AGG_COUNT_DISTINCT:
+        r = asprintf(&result, "%llu", (unsigned long long)state->count);
+        break;
+    case AGG_SUM:
+        if (state->count == 0)
+            r = asprintf(&result, "%s", "");
+        else if (state->integral)
+            r = asprintf(&result, "%lld", state->isum);
+        else
+            r = asprintf(&result, "%.15g", state->sum);
+        break;
+    case AGG_AVG:
+        if (state->count == 0)
+            r = asprintf(&result, "%s", "");
+        else
+            r = asprintf(&result, "%.15g", (state->integral ? (double)state->isum : state->sum) / state->count);
+        break;
+    case AGG_MIN:
+    case AGG_MAX:
+        r = asprintf(&result, "%s", state->str != NULL ? state->str : "");
+        break;
+    default:
+        errx(1, "internal error");
+    }
+    if (r == -1)
+        err(1, "asprintf");
+    return result;
+}
+
+// Parse a number, allowing surrounding whitespace; also report whether it's an integer that fits in a long long
+static int
+agg_number(const char *value, double *dp, long long *llp, int *integralp)
+{
+    char *eptr;
+
+    errno = 0;
+    *dp = strtod(value, &eptr);
+    if (eptr == value)
+        return 0;
+    while (isspace((unsigned char)*eptr))
+        eptr++;
+    if (*eptr != '\0')
+        return 0;
+    errno = 0;
+    *llp = strtoll(value, &eptr, 10);
+    while (isspace((unsigned char)*eptr))
+        eptr++;
+    *integralp = *eptr == '\0' && errno != ERANGE;
+    return 1;
+}
+
+// Compare numerically if both values are numbers, otherwise as strings
+static int
+agg_compare(const char *value1, const char *value2)
+{
+    long long ll;
+    double d1;
+    double d2;
+    int integral;
+
+    if (agg_number(value1, &d1, &ll, &integral) && agg_number(value2, &d2, &ll, &integral))
+        return d1 < d2 ? -1 : d1 > d2 ? 1 : 0;
+    return strcmp(value1, value2);
+}
+
+// Split a comma-separated list, ignoring commas within parentheses
+static char **
+agg_split(const char *list, const char *desc, size_t *nump)
+{
+    const char *start;
+    char **items = NULL;
+    size_t num = 0;
+    int depth = 0;
+
+    for (start = list; ; list++) {
+        if (*list == '(')
+            depth++;
+        else if (*list == ')')
+            depth--;
+        else if ((*list != ',' || depth > 0) && *list != '\0')
+            continue;
+        else {
+            if (list == start)
+                errx(1, "invalid argument to \"--%s\"", desc);
+            if ((items = realloc(items, (num + 1) * sizeof(*items))) == NULL)
+                err(1, "realloc");
+            if ((items[num++] = strndup(start, list - start)) == NULL)
+                err(1, "strndup");
+            if (*list == '\0')
+                break;
+            start = list + 1;
+        }
+    }
+    *nump = num;
+    return items;
+}
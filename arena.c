@@ -0,0 +1,101 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <err.h>
+#include <stdlib.h>
+
+#define ARENA_CHUNK_SIZE        (64 * 1024)
+
+//
+// An arena hands out memory from large chunks and frees it all at once. It's used
+// for the many small allocations made while aggregating or sorting, which would
+// otherwise pay malloc()'s per-allocation overhead in both time and space.
+//
+
+struct arena_chunk {
+    struct arena_chunk  *next;
+    size_t              used;
+    size_t              size;
+    char                data[];
+};
+
+struct arena {
+    struct arena_chunk  *chunks;
+    size_t              size;               // total bytes obtained from malloc()
+};
+
+struct arena *
+arena_create(void)
+{
+    struct arena *arena;
+
+    if ((arena = calloc(1, sizeof(*arena))) == NULL)
+        err(1, "calloc");
+    return arena;
+}
+
+// Free everything allocated so far, but keep the arena for reuse
+void
+arena_reset(struct arena *arena)
+{
+    struct arena_chunk *chunk;
+
+    while ((chunk = arena->chunks) != NULL) {
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+    arena->size = 0;
+}
+
+void
+arena_destroy(struct arena *arena)
+{
+    arena_reset(arena);
+    free(arena);
+}
+
+// Allocate memory aligned for any pointer or double
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk = arena->chunks;
+    void *ptr;
+
+    size = (size + 7) & ~(size_t)7;
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        const size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+
+        if ((chunk = malloc(sizeof(*chunk) + chunk_size)) == NULL)
+            err(1, "malloc");
+        chunk->next = arena->chunks;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        arena->chunks = chunk;
+        arena->size += sizeof(*chunk) + chunk_size;
+    }
+    ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+size_t
+arena_size(const struct arena *arena)
+{
+    return arena->size;
+}
@@ -0,0 +1,784 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE            0
+#endif
+
+#define CHECK_BLOCK_SIZE        (256 * 1024)            // scan this much for structure, then encoding
+#define CHECK_MIN_PER_THREAD    ((size_t)8 * 1024 * 1024)
+#define CHECK_MAX_THREADS       16
+#define CHECK_MAX_ISSUES        100                     // report at most this many problems
+
+// Scanner states
+#define ST_RECORD               0                       // between records
+#define ST_FIELD                1                       // start of a field, skipping whitespace
+#define ST_UNQUOTED             2                       // in an unquoted value
+#define ST_QUOTED               3                       // in a quoted value
+#define ST_QUOTE                4                       // just after a quote in a quoted value
+#define ST_AFTER                5                       // after a quoted value, expecting whitespace
+
+// Problems
+#define ISSUE_RAGGED            0
+#define ISSUE_CHARACTER         1
+#define ISSUE_EOF               2
+#define ISSUE_ILLEGAL           3
+#define ISSUE_TRUNCATED         4
+
+// Word-at-a-time byte search: ONES times a byte repeats it, and HAS_ZERO() is non-zero if any byte is zero
+#define ONES                    ((uint64_t)0x0101010101010101)
+#define HAS_ZERO(v)             (((v) - ONES) & ~(v) & (ONES << 7))
+
+//
+// Fast CSV validation and record counting.
+//
+// Rather than parsing each record into fields, this just follows the structure of the input
+// with a small state machine that counts records, fields, and lines, using the same rules as
+// the parser. Between the characters that matter (separators, newlines, and quotes), it skips
+// eight bytes at a time. Character encoding is checked in a separate pass over each block
+// while it's still in the cache: UTF-8 directly, other encodings with iconv(3).
+//
+// A regular file is mapped into memory and divided into chunks that are scanned in parallel,
+// each starting just after a newline. Each chunk is scanned on the assumption that it begins
+// between records; when the chunks are put back together, if a chunk didn't end between
+// records (e.g., a quoted value contains a newline right at the boundary), the next chunk is
+// scanned again starting from where the previous one actually ended. So the results are
+// always the same as a sequential scan.
+//
+// Problems are reported as warnings instead of stopping at the first one.
+//
+
+struct check_issue {
+    uint64_t            line;
+    int                 type;
+    size_t              num;                    // fields, or the unexpected character
+    size_t              seq;                    // keeps problems on the same line in order
+};
+
+// Scanner state, which carries over from one piece of input to the next
+struct check_state {
+    int                 state;
+    int                 skip_lf;                // ignore an LF following a CR
+    int                 first;                  // the next record is the first in the input
+    size_t              fields;                 // separators seen so far in the current record
+    uint64_t            line;
+    uint64_t            record_line;            // line where the current record started
+};
+
+// Results of scanning part of the input
+struct check_result {
+    struct check_state  st;
+    uint64_t            records;
+    uint64_t            ragged;
+    uint64_t            errors;
+    struct check_issue  issues[CHECK_MAX_ISSUES];
+    size_t              num_issues;
+    uint64_t            enc_line;               // lines seen by the encoding check
+    int                 enc_cr;                 // the previous byte was a CR
+    uint64_t            enc_errors;
+    struct check_issue  enc_issues[CHECK_MAX_ISSUES];
+    size_t              num_enc_issues;
+    unsigned int        utf8_need;              // remaining continuation bytes
+    unsigned char       utf8_lo;                // allowed range for the next continuation byte
+    unsigned char       utf8_hi;
+    iconv_t             icd;
+    char                carry[8];               // incomplete multibyte sequence (iconv only)
+    size_t              carry_len;
+    char                *obuf;
+};
+
+// Scanning configuration
+struct check {
+    int                 quote;
+    int                 fsep;
+    unsigned char       space[256];             // isspace(3), but not the field separator
+    size_t              expected;               // number of separators in the first record
+    int                 count_only;
+    const char          *encoding;              // NULL if not checking encoding
+    int                 utf8;
+};
+
+// A chunk scanned by its own thread
+struct check_job {
+    const struct check  *c;
+    const char          *data;
+    size_t              len;
+    struct check_result res;
+    pthread_t           thread;
+};
+
+static size_t check_scan(const struct check *c, struct check_result *res, const char *data, size_t len, int first);
+static void check_eof(const struct check *c, struct check_result *res);
+static void check_encoding(const struct check *c, struct check_result *res, const char *data, size_t len, int last);
+static void check_utf8(const struct check *c, struct check_result *res, const char *data, size_t len);
+static void check_iconv(struct check_result *res, const char *data, size_t len, int last);
+static void check_lines(struct check_result *res, const char *data, size_t len);
+static inline void check_line(struct check_result *res, int ch);
+static void check_issue(struct check_issue *issues, size_t *nump, uint64_t *countp, uint64_t line, int type, size_t num);
+static void check_init(const struct check *c, struct check_result *res);
+static void check_chunk(struct check_job *job);
+static void *check_job_main(void *arg);
+static void check_relocate(struct check_issue *issues, size_t num, uint64_t base);
+static int check_report(const struct check *c, struct check_job *jobs, size_t num_jobs, int header);
+static int check_issue_cmp(const void *ptr1, const void *ptr2);
+
+//
+// Scan the input and report on it. If "count_only" is set, just output the number of data records;
+// otherwise, also check that every record has the same number of fields as the first and, if "encoding"
+// is not NULL, that the input is valid in that character encoding. Returns the exit status.
+//
+int
+check_input(FILE *fp, const char *name, int quote, int fsep, int header, const char *encoding, int count_only)
+{
+    struct check_job jobs[CHECK_MAX_THREADS];
+    struct check_result *res;
+    struct check c;
+    struct stat sb;
+    const char *data;
+    char *map = NULL;
+    size_t map_len = 0;
+    size_t num_jobs;
+    size_t start;
+    size_t size;
+    size_t end;
+    off_t offset;
+    long ncpu;
+    size_t i;
+    int status;
+    int ch;
+
+    // Initialize
+    memset(&c, 0, sizeof(c));
+    c.quote = quote;
+    c.fsep = fsep;
+    for (ch = 0; ch < 256; ch++)
+        c.space[ch] = isspace(ch) && ch != fsep;
+    c.count_only = count_only;
+    if (!count_only && encoding != NULL && strcasecmp(encoding, "ISO-8859-1") != 0 && strcasecmp(encoding, "LATIN1") != 0) {
+        c.encoding = encoding;
+        c.utf8 = strcasecmp(encoding, "UTF-8") == 0 || strcasecmp(encoding, "UTF8") == 0;
+    }
+
+    // Not a regular file? Then just read it a block at a time
+    if (fstat(fileno(fp), &sb) == -1 || !S_ISREG(sb.st_mode) || (offset = ftello(fp)) == -1) {
+        int known = 0;
+        char *buf;
+        size_t len;
+
+        if ((buf = malloc(CHECK_BLOCK_SIZE)) == NULL)
+            err(1, "malloc");
+        check_init(&c, &jobs[0].res);
+        jobs[0].res.st.line = 1;
+        jobs[0].res.st.first = 1;
+        jobs[0].res.enc_line = 1;
+        while ((len = fread(buf, 1, CHECK_BLOCK_SIZE, fp)) > 0) {
+            start = 0;
+            if (!known) {                               // find the number of fields in the first record
+                start = check_scan(&c, &jobs[0].res, buf, len, 1);
+                if ((known = jobs[0].res.records > 0))
+                    c.expected = jobs[0].res.st.fields;
+            }
+            (void)check_scan(&c, &jobs[0].res, buf + start, len - start, 0);
+            check_encoding(&c, &jobs[0].res, buf, len, 0);
+        }
+        if (ferror(fp))
+            err(1, "%s", name);
+        free(buf);
+        check_encoding(&c, &jobs[0].res, NULL, 0, 1);
+        check_eof(&c, &jobs[0].res);
+        if (!known)
+            c.expected = jobs[0].res.st.fields;
+        return check_report(&c, jobs, 1, header);
+    }
+
+    // Map the file into memory
+    size = sb.st_size > offset ? sb.st_size - offset : 0;
+    data = NULL;
+    if (size > 0) {
+        const long page_size = sysconf(_SC_PAGESIZE);
+        const off_t map_offset = offset & ~(off_t)(page_size - 1);
+        int flags = MAP_PRIVATE;
+
+        // Fault in all the pages up front (much faster than one at a time), unless that would crowd out everything else
+        map_len = size + (offset - map_offset);
+        if (map_len / page_size < (size_t)sysconf(_SC_PHYS_PAGES) / 4)
+            flags |= MAP_POPULATE;
+        if ((map = mmap(NULL, map_len, PROT_READ, flags, fileno(fp), map_offset)) == MAP_FAILED)
+            err(1, "%s: mmap", name);
+        (void)posix_madvise(map, map_len, POSIX_MADV_SEQUENTIAL);
+        data = map + (offset - map_offset);
+    }
+
+    // Find the number of fields in the first record
+    res = &jobs[0].res;
+    check_init(&c, res);
+    res->st.line = 1;
+    res->st.first = 1;
+    res->enc_line = 1;
+    start = check_scan(&c, res, data, size, 1);
+    check_encoding(&c, res, data, start, 0);
+    c.expected = res->st.fields;
+
+    // Divide the rest into chunks, each starting just after a newline
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    num_jobs = (size - start) / CHECK_MIN_PER_THREAD;
+    if (num_jobs > (size_t)ncpu)
+        num_jobs = ncpu;
+    if (num_jobs > CHECK_MAX_THREADS)
+        num_jobs = CHECK_MAX_THREADS;
+    if (num_jobs < 1)
+        num_jobs = 1;
+    for (i = 0; i < num_jobs; i++) {
+        jobs[i].c = &c;
+        jobs[i].data = data + start;
+        end = i == num_jobs - 1 ? size : start + (size - start) / (num_jobs - i);
+        while (end < size && data[end - 1] != '\n')
+            end++;
+        jobs[i].len = end - start;
+        start = end;
+    }
+
+    // Scan the chunks in parallel; the first one continues on from the first record
+    for (i = 1; i < num_jobs; i++) {
+        check_init(&c, &jobs[i].res);
+        if ((errno = pthread_create(&jobs[i].thread, NULL, check_job_main, &jobs[i])) != 0)
+            err(1, "pthread_create");
+    }
+    check_chunk(&jobs[0]);
+    for (i = 1; i < num_jobs; i++) {
+        if ((errno = pthread_join(jobs[i].thread, NULL)) != 0)
+            err(1, "pthread_join");
+    }
+
+    // Put the results back together, rescanning any chunk that didn't actually start between records
+    for (i = 1; i < num_jobs; i++) {
+        const struct check_state *const prev = &jobs[i - 1].res.st;
+
+        res = &jobs[i].res;
+        check_relocate(res->enc_issues, res->num_enc_issues, jobs[i - 1].res.enc_line);
+        res->enc_line += jobs[i - 1].res.enc_line;
+        if (prev->state != ST_RECORD || prev->skip_lf) {
+            res->st = *prev;
+            res->records = 0;
+            res->ragged = 0;
+            res->errors = 0;
+            res->num_issues = 0;
+            (void)check_scan(&c, res, jobs[i].data, jobs[i].len, 0);
+        } else {
+            check_relocate(res->issues, res->num_issues, prev->line);
+            res->st.line += prev->line;
+            res->st.record_line += prev->line;
+        }
+    }
+    check_eof(&c, &jobs[num_jobs - 1].res);
+    status = check_report(&c, jobs, num_jobs, header);
+    if (map != NULL)
+        munmap(map, map_len);
+    return status;
+}
+
+// Helper thread entry point
+static void *
+check_job_main(void *arg)
+{
+    check_chunk(arg);
+    return NULL;
+}
+
+// Scan a chunk a block at a time, checking the structure and then the encoding of each block
+static void
+check_chunk(struct check_job *job)
+{
+    size_t off;
+    size_t len;
+
+    for (off = 0; off < job->len; off += len) {
+        len = job->len - off < CHECK_BLOCK_SIZE ? job->len - off : CHECK_BLOCK_SIZE;
+        (void)check_scan(job->c, &job->res, job->data + off, len, 0);
+        check_encoding(job->c, &job->res, job->data + off, len, 0);
+    }
+    check_encoding(job->c, &job->res, NULL, 0, 1);
+}
+
+static void
+check_init(const struct check *c, struct check_result *res)
+{
+    memset(res, 0, sizeof(*res));
+    res->utf8_lo = 0x80;
+    res->utf8_hi = 0xbf;
+    res->icd = (iconv_t)-1;
+    if (c->encoding != NULL && !c->utf8) {
+        if ((res->icd = iconv_open("UTF-8", c->encoding)) == (iconv_t)-1)
+            err(1, "iconv_open: \"%s\"", c->encoding);
+        if ((res->obuf = malloc(4 * CHECK_BLOCK_SIZE)) == NULL)
+            err(1, "malloc");
+    }
+}
+
+// Make a chunk's line numbers, which start from zero, relative to the line where the chunk actually starts
+static void
+check_relocate(struct check_issue *issues, size_t num, uint64_t base)
+{
+    size_t i;
+
+    for (i = 0; i < num; i++)
+        issues[i].line += base;
+}
+
+// Finish a record, checking its number of fields
+static inline void
+check_end_record(const struct check *c, struct check_result *res, struct check_state *st)
+{
+    st->line++;
+    st->state = ST_RECORD;
+    res->records++;
+    if (st->first)
+        st->first = 0;
+    else if (!c->count_only && st->fields != c->expected)
+        check_issue(res->issues, &res->num_issues, &res->ragged, st->record_line, ISSUE_RAGGED, st->fields + 1);
+}
+
+//
+// Follow the structure of some input, continuing from the previous state.
+// If "first" is set, stop after the first record. Returns how many bytes were consumed.
+//
+static size_t
+check_scan(const struct check *c, struct check_result *res, const char *data, size_t len, int first)
+{
+    const unsigned char *ptr = (const unsigned char *)data;
+    const unsigned char *const end = ptr + len;
+    const uint64_t fsep_mask = ONES * (unsigned char)c->fsep;
+    const uint64_t quote_mask = ONES * (unsigned char)c->quote;
+    const uint64_t lf_mask = ONES * '\n';
+    const uint64_t cr_mask = ONES * '\r';
+    struct check_state st = res->st;
+    uint64_t w;
+    int ch;
+
+    while (ptr < end) {
+        ch = *ptr++;
+        switch (st.state) {
+        case ST_RECORD:
+            if (ch == '\n' && st.skip_lf) {
+                st.skip_lf = 0;
+                continue;
+            }
+            st.skip_lf = 0;
+            if (ch == '\n' || ch == '\r') {          // skip blank line
+                st.line++;
+                st.skip_lf = ch == '\r';
+                continue;
+            }
+            st.state = ST_FIELD;
+            st.fields = 0;
+            st.record_line = st.line;
+            // FALLTHROUGH
+        case ST_FIELD:
+            if (ch == '\n' || ch == '\r') {
+                st.skip_lf = ch == '\r';
+                break;
+            }
+            if (c->space[ch])
+                continue;
+            if (ch == c->quote) {
+                st.state = ST_QUOTED;
+                continue;
+            }
+            st.state = ST_UNQUOTED;
+            // FALLTHROUGH
+        case ST_UNQUOTED:
+            while (1) {
+                if (ch == c->fsep) {
+                    st.fields++;
+                    st.state = ST_FIELD;
+                    break;
+                }
+                if (ch == '\n' || ch == '\r') {
+                    st.skip_lf = ch == '\r';
+                    break;
+                }
+
+                // Skip ahead to the next separator, CR, or LF
+                while (end - ptr >= 8) {
+                    memcpy(&w, ptr, 8);
+                    if ((HAS_ZERO(w ^ fsep_mask) | HAS_ZERO(w ^ lf_mask) | HAS_ZERO(w ^ cr_mask)) != 0)
+                        break;
+                    ptr += 8;
+                }
+                if (ptr == end)
+                    break;
+                ch = *ptr++;
+            }
+            if (st.state == ST_UNQUOTED && (ch == '\n' || ch == '\r'))
+                break;
+            continue;
+        case ST_QUOTED:
+            while (1) {
+                if (ch == c->quote) {
+                    st.state = ST_QUOTE;
+                    break;
+                }
+                if (ch == '\n')
+                    st.line++;
+
+                // Skip ahead to the next quote or LF
+                while (end - ptr >= 8) {
+                    memcpy(&w, ptr, 8);
+                    if ((HAS_ZERO(w ^ quote_mask) | HAS_ZERO(w ^ lf_mask)) != 0)
+                        break;
+                    ptr += 8;
+                }
+                if (ptr == end)
+                    break;
+                ch = *ptr++;
+            }
+            continue;
+        case ST_QUOTE:
+            if (ch == c->quote) {                   // doubled quote
+                st.state = ST_QUOTED;
+                continue;
+            }
+            if (ch == '\r') {
+                st.skip_lf = 1;
+                break;
+            }
+            st.state = ST_AFTER;
+            // FALLTHROUGH
+        case ST_AFTER:
+            if (ch == '\n')
+                break;
+            if (ch == c->fsep) {
+                st.fields++;
+                st.state = ST_FIELD;
+            } else if (!c->space[ch]) {
+                check_issue(res->issues, &res->num_issues, &res->errors, st.line, ISSUE_CHARACTER, ch);
+                st.state = ST_UNQUOTED;             // treat the rest as part of the value
+            }
+            continue;
+        default:
+            errx(1, "internal error");
+        }
+
+        // Finish record
+        check_end_record(c, res, &st);
+        if (first)
+            break;
+    }
+    res->st = st;
+    return ptr - (const unsigned char *)data;
+}
+
+// Handle the end of the input
+static void
+check_eof(const struct check *c, struct check_result *res)
+{
+    switch (res->st.state) {
+    case ST_RECORD:
+        break;
+    case ST_QUOTED:                                 // don't also complain about the number of fields
+        check_issue(res->issues, &res->num_issues, &res->errors, res->st.line, ISSUE_EOF, 0);
+        res->st.fields = c->expected;
+        // FALLTHROUGH
+    default:
+        check_end_record(c, res, &res->st);
+        break;
+    }
+}
+
+// Check the character encoding of some input; if "last" is set, this is the end of the input
+static void
+check_encoding(const struct check *c, struct check_result *res, const char *data, size_t len, int last)
+{
+    if (c->encoding == NULL)
+        return;
+    if (c->utf8) {
+        check_utf8(c, res, data, len);
+        if (last && res->utf8_need > 0)
+            check_issue(res->enc_issues, &res->num_enc_issues, &res->enc_errors, res->enc_line, ISSUE_TRUNCATED, 0);
+    } else
+        check_iconv(res, data, len, last);
+}
+
+// Validate UTF-8, skipping ASCII eight bytes at a time
+static void
+check_utf8(const struct check *c, struct check_result *res, const char *data, size_t len)
+{
+    const unsigned char *ptr = (const unsigned char *)data;
+    const unsigned char *const end = ptr + len;
+    uint64_t w;
+    int ch;
+
+    while (ptr < end) {
+
+        // Skip ASCII, counting lines
+        if (res->utf8_need == 0) {
+            while (end - ptr >= 8) {
+                memcpy(&w, ptr, 8);
+                if ((w & (ONES << 7)) != 0)
+                    break;
+                if ((HAS_ZERO(w ^ (ONES * '\n')) | HAS_ZERO(w ^ (ONES * '\r'))) != 0)
+                    check_lines(res, (const char *)ptr, 8);
+                else
+                    res->enc_cr = 0;
+                ptr += 8;
+            }
+            if (ptr == end)
+                break;
+        }
+        ch = *ptr++;
+        check_line(res, ch);
+
+        // Continuation byte expected?
+        if (res->utf8_need > 0) {
+            if (ch >= res->utf8_lo && ch <= res->utf8_hi) {
+                res->utf8_need--;
+                res->utf8_lo = 0x80;
+                res->utf8_hi = 0xbf;
+                continue;
+            }
+            check_issue(res->enc_issues, &res->num_enc_issues, &res->enc_errors, res->enc_line,
+              ch == c->fsep || ch == c->quote || ch == '\n' || ch == '\r' ? ISSUE_TRUNCATED : ISSUE_ILLEGAL, 0);
+            res->utf8_need = 0;
+            res->utf8_lo = 0x80;
+            res->utf8_hi = 0xbf;
+            if (ch >= 0x80)
+                continue;
+        }
+
+        // Lead byte: see how many continuation bytes follow, excluding overlong forms, surrogates, and beyond U+10FFFF
+        if (ch < 0x80)
+            continue;
+        if (ch >= 0xc2 && ch <= 0xdf)
+            res->utf8_need = 1;
+        else if (ch >= 0xe0 && ch <= 0xef) {
+            res->utf8_need = 2;
+            if (ch == 0xe0)
+                res->utf8_lo = 0xa0;
+            else if (ch == 0xed)
+                res->utf8_hi = 0x9f;
+        } else if (ch >= 0xf0 && ch <= 0xf4) {
+            res->utf8_need = 3;
+            if (ch == 0xf0)
+                res->utf8_lo = 0x90;
+            else if (ch == 0xf4)
+                res->utf8_hi = 0x8f;
+        } else
+            check_issue(res->enc_issues, &res->num_enc_issues, &res->enc_errors, res->enc_line, ISSUE_ILLEGAL, 0);
+    }
+}
+
+// Validate some other encoding by converting it to UTF-8
+static void
+check_iconv(struct check_result *res, const char *data, size_t len, int last)
+{
+    char ibuf[sizeof(res->carry) + 1];
+    char *iptr;
+    char *optr;
+    size_t iremain;
+    size_t oremain;
+
+    // Finish any multibyte sequence left over from last time, one byte at a time
+    while (res->carry_len > 0 && len > 0) {
+        memcpy(ibuf, res->carry, res->carry_len);
+        ibuf[res->carry_len] = *data++;
+        len--;
+        check_line(res, (unsigned char)ibuf[res->carry_len]);
+        iptr = ibuf;
+        iremain = res->carry_len + 1;
+        optr = res->obuf;
+        oremain = 4 * CHECK_BLOCK_SIZE;
+        res->carry_len = 0;
+        if (iconv(res->icd, &iptr, &iremain, &optr, &oremain) != (size_t)-1)
+            break;
+        if (errno == EINVAL && iremain < sizeof(res->carry)) {
+            memcpy(res->carry, iptr, iremain);
+            res->carry_len = iremain;
+            continue;
+        }
+        check_issue(res->enc_issues, &res->num_enc_issues, &res->enc_errors, res->enc_line, ISSUE_ILLEGAL, 0);
+        (void)iconv(res->icd, NULL, NULL, NULL, NULL);
+    }
+    if (last && res->carry_len > 0) {
+        check_issue(res->enc_issues, &res->num_enc_issues, &res->enc_errors, res->enc_line, ISSUE_TRUNCATED, 0);
+        res->carry_len = 0;
+    }
+
+    // Convert the rest, skipping over bad bytes
+    iptr = (char *)(uintptr_t)data;             // iconv(3) doesn't modify the input
+    iremain = len;
+    while (iremain > 0) {
+        optr = res->obuf;
+        oremain = 4 * CHECK_BLOCK_SIZE;
+        if (iconv(res->icd, &iptr, &iremain, &optr, &oremain) != (size_t)-1 || errno == E2BIG)
+            continue;
+        check_lines(res, data, iptr - data);
+        data = iptr;
+        if (errno == EINVAL && iremain < sizeof(res->carry)) {
+            check_lines(res, iptr, iremain);
+            memcpy(res->carry, iptr, iremain);
+            res->carry_len = iremain;
+            return;
+        }
+        check_issue(res->enc_issues, &res->num_enc_issues, &res->enc_errors, res->enc_line, ISSUE_ILLEGAL, 0);
+        (void)iconv(res->icd, NULL, NULL, NULL, NULL);
+        iptr++;
+        iremain--;
+    }
+    check_lines(res, data, iptr - data);
+}
+
+// Count lines the way the parser does, where CR, LF, and CR-LF each end a line
+static void
+check_lines(struct check_result *res, const char *data, size_t len)
+{
+    while (len-- > 0)
+        check_line(res, (unsigned char)*data++);
+}
+
+static inline void
+check_line(struct check_result *res, int ch)
+{
+    if (ch == '\r' || (ch == '\n' && !res->enc_cr))
+        res->enc_line++;
+    res->enc_cr = ch == '\r';
+}
+
+// Record a problem
+static void
+check_issue(struct check_issue *issues, size_t *nump, uint64_t *countp, uint64_t line, int type, size_t num)
+{
+    if (*nump < CHECK_MAX_ISSUES) {
+        issues[*nump].line = line;
+        issues[*nump].type = type;
+        issues[*nump].num = num;
+        (*nump)++;
+    }
+    (*countp)++;
+}
+
+// Report problems and totals, and return exit status
+static int
+check_report(const struct check *c, struct check_job *jobs, size_t num_jobs, int header)
+{
+    struct check_issue *issues;
+    struct check_result *res;
+    uint64_t records = 0;
+    uint64_t ragged = 0;
+    uint64_t errors = 0;
+    uint64_t enc_errors = 0;
+    uint64_t problems;
+    size_t num_issues = 0;
+    size_t i;
+    size_t j;
+
+    // Gather totals and problems
+    if ((issues = calloc(num_jobs, 2 * CHECK_MAX_ISSUES * sizeof(*issues))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < num_jobs; i++) {
+        res = &jobs[i].res;
+        records += res->records;
+        ragged += res->ragged;
+        errors += res->errors;
+        enc_errors += res->enc_errors;
+        for (j = 0; j < res->num_issues; j++) {
+            issues[num_issues] = res->issues[j];
+            issues[num_issues].seq = num_issues;
+            num_issues++;
+        }
+        for (j = 0; j < res->num_enc_issues; j++) {
+            issues[num_issues] = res->enc_issues[j];
+            issues[num_issues].seq = CHECK_MAX_THREADS * CHECK_MAX_ISSUES + num_issues;
+            num_issues++;
+        }
+        if (res->icd != (iconv_t)-1)
+            iconv_close(res->icd);
+        free(res->obuf);
+    }
+    if (header && records > 0)
+        records--;
+    problems = ragged + errors + enc_errors;
+
+    // Report the first few problems, in order
+    qsort(issues, num_issues, sizeof(*issues), check_issue_cmp);
+    for (i = 0; i < num_issues && i < CHECK_MAX_ISSUES; i++) {
+        const struct check_issue *const issue = &issues[i];
+        const unsigned long long line = issue->line;
+
+        switch (issue->type) {
+        case ISSUE_RAGGED:
+            warnx("line %llu: found %zu fields but expected %zu", line, issue->num, c->expected + 1);
+            break;
+        case ISSUE_CHARACTER:
+            warnx("line %llu: unexpected character \"%c\"", line, (int)issue->num);
+            break;
+        case ISSUE_EOF:
+            warnx("line %llu: premature EOF", line);
+            break;
+        case ISSUE_ILLEGAL:
+            warnx("line %llu: %s multibyte sequence", line, "illegal");
+            break;
+        case ISSUE_TRUNCATED:
+            warnx("line %llu: %s multibyte sequence", line, "truncated");
+            break;
+        default:
+            errx(1, "internal error");
+        }
+    }
+    if (problems > CHECK_MAX_ISSUES)
+        warnx("%llu more problem(s) not shown", (unsigned long long)(problems - CHECK_MAX_ISSUES));
+    free(issues);
+
+    // Report totals
+    if (c->count_only)
+        printf("%llu\n", (unsigned long long)records);
+    else {
+        printf("records: %llu\n", (unsigned long long)records);
+        printf("fields: %zu\n", records > 0 || header ? c->expected + 1 : 0);
+        printf("ragged: %llu\n", (unsigned long long)ragged);
+        printf("errors: %llu\n", (unsigned long long)errors);
+        if (c->encoding != NULL)
+            printf("encoding errors: %llu\n", (unsigned long long)enc_errors);
+    }
+    return problems > 0 ? 1 : 0;
+}
+
+static int
+check_issue_cmp(const void *ptr1, const void *ptr2)
+{
+    const struct check_issue *const issue1 = ptr1;
+    const struct check_issue *const issue2 = ptr2;
+
+    if (issue1->line != issue2->line)
+        return issue1->line < issue2->line ? -1 : 1;
+    return issue1->seq < issue2->seq ? -1 : issue1->seq > issue2->seq ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC        "csvprintf checkpoint 1"
+
+//
+// A checkpoint records where we were at a record boundary: input position, line and record
+// numbers, and how much output had been written. Because it's taken at a record boundary,
+// there is no parser state to save beyond the position.
+//
+// The output is flushed and synced to disk before the checkpoint is written, so the output
+// always contains at least what the checkpoint claims; on resume, anything beyond that is
+// truncated away and regenerated. The checkpoint file itself is replaced atomically.
+//
+// File format: a magic line, then one "name value" line per field.
+//
+
+static const struct checkpoint_field {
+    const char  *name;
+    size_t      offset;
+} checkpoint_fields[] = {
+    { "quote",          offsetof(struct checkpoint, quote) },
+    { "fsep",           offsetof(struct checkpoint, fsep) },
+    { "input_offset",   offsetof(struct checkpoint, input_offset) },
+    { "linenum",        offsetof(struct checkpoint, linenum) },
+    { "recnum",         offsetof(struct checkpoint, recnum) },
+    { "datanum",        offsetof(struct checkpoint, datanum) },
+    { "emitted",        offsetof(struct checkpoint, emitted) },
+    { "output_offset",  offsetof(struct checkpoint, output_offset) },
+};
+#define CHECKPOINT_NUM_FIELDS   (sizeof(checkpoint_fields) / sizeof(*checkpoint_fields))
+
+//
+// Flush the output and save a checkpoint; fills in ck->output_offset.
+//
+void
+checkpoint_save(const char *path, struct checkpoint *ck, FILE *out)
+{
+    char *tmp;
+    FILE *fp;
+    off_t off;
+    size_t i;
+
+    // Make sure the output is really there
+    if (fflush(out) == EOF)
+        err(1, "write");
+    if ((off = lseek(fileno(out), 0, SEEK_CUR)) == -1)
+        err(1, "output");
+    ck->output_offset = off;
+    if (fsync(fileno(out)) == -1 && errno != EINVAL)
+        err(1, "fsync");
+
+    // Write new checkpoint and move it into place
+    if (asprintf(&tmp, "%s.tmp", path) == -1)
+        err(1, "asprintf");
+    if ((fp = fopen(tmp, "w")) == NULL)
+        err(1, "%s", tmp);
+    fprintf(fp, "%s\n", CHECKPOINT_MAGIC);
+    for (i = 0; i < CHECKPOINT_NUM_FIELDS; i++)
+        fprintf(fp, "%s %" PRIu64 "\n", checkpoint_fields[i].name, *(uint64_t *)((char *)ck + checkpoint_fields[i].offset));
+    if (fflush(fp) == EOF || fsync(fileno(fp)) == -1)
+        err(1, "%s", tmp);
+    if (fclose(fp) == EOF)
+        err(1, "%s", tmp);
+    if (rename(tmp, path) == -1)
+        err(1, "%s", path);
+    free(tmp);
+}
+
+//
+// Load a checkpoint; returns zero if there isn't one.
+//
+int
+checkpoint_load(const char *path, struct checkpoint *ck)
+{
+    char name[32];
+    char line[128];
+    uint64_t value;
+    unsigned int found = 0;
+    FILE *fp;
+    size_t i;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        if (errno == ENOENT)
+            return 0;
+        err(1, "%s", path);
+    }
+    memset(ck, 0, sizeof(*ck));
+    if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, CHECKPOINT_MAGIC "\n") != 0)
+        errx(1, "%s: not a csvprintf checkpoint file", path);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "%31s %" SCNu64, name, &value) != 2)
+            errx(1, "%s: invalid checkpoint file", path);
+        for (i = 0; i < CHECKPOINT_NUM_FIELDS; i++) {
+            if (strcmp(name, checkpoint_fields[i].name) == 0) {
+                *(uint64_t *)((char *)ck + checkpoint_fields[i].offset) = value;
+                found |= 1 << i;
+                break;
+            }
+        }
+    }
+    if (ferror(fp))
+        err(1, "%s", path);
+    fclose(fp);
+    if (found != (1 << CHECKPOINT_NUM_FIELDS) - 1)
+        errx(1, "%s: incomplete checkpoint file", path);
+    return 1;
+}
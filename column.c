@@ -0,0 +1,42 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <ctype.h>
+#include <err.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Map a column name or number (starting from one) to a column index
+size_t
+find_column(const char *spec, char *const *names, size_t num_names)
+{
+    unsigned long col;
+    char *eptr;
+    size_t i;
+
+    for (i = 0; names != NULL && i < num_names; i++) {
+        if (strcmp(names[i], spec) == 0)
+            return i;
+    }
+    col = strtoul(spec, &eptr, 10);
+    if (!isdigit((unsigned char)*spec) || *eptr != '\0' || col == 0 || col == ULONG_MAX)
+        errx(1, "column \"%s\" not found", spec);
+    return col - 1;
+}
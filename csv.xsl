@@ -4,12 +4,12 @@
 
     <xsl:output method="text" encoding="UTF-8" media-type="text/csv"/>
 
-    <xsl:template match="/csv/row">
+    <xsl:template match="/csv/row|/csv/r">
         <xsl:apply-templates select="*"/>
         <xsl:value-of select="'&#10;'"/>
     </xsl:template>
 
-    <xsl:template match="/csv/row/*">
+    <xsl:template match="/csv/row/*|/csv/r/*">
         <xsl:if test="position() &gt; 1">
             <xsl:value-of select="','"/>
         </xsl:if>
@@ -18,6 +18,201 @@
 // 
 
 #include "config.h"
+#include "libcsvprintf.h"
 
-extern const char *const csvprintf_version;
+#include <iconv.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Data block passed between threads
+struct ring_block {
+    char    *buf;
+    size_t  len;
+    size_t  size;
+};
+
+// Main thread phases, for "--stats"
+enum {
+    STATS_PARSE,
+    STATS_TRANSCODE,
+    STATS_OUTPUT,
+    STATS_PROCESS,
+    STATS_INPUT_WAIT,
+    STATS_OUTPUT_WAIT,
+    STATS_NUM_PHASES
+};
+
+// Totals reported by "--stats"
+#define STATS_UNKNOWN           UINT64_MAX  // total that couldn't be measured
+struct stats_totals {
+    uint64_t    records;
+    uint64_t    fields;
+    uint64_t    max_width;
+    uint64_t    bytes_in;
+    uint64_t    bytes_out;
+    uint64_t    allocations;
+};
+
+// Position saved by "--checkpoint"
+struct checkpoint {
+    uint64_t    quote;
+    uint64_t    fsep;
+    uint64_t    input_offset;
+    uint64_t    linenum;
+    uint64_t    recnum;
+    uint64_t    datanum;
+    uint64_t    emitted;
+    uint64_t    output_offset;
+};
+
+struct agg;
+struct arena;
+struct index;
+struct join;
+struct keyset;
+struct partition;
+struct profile;
+struct ring;
+struct sorter;
+struct spill;
+struct sqlite_output;
+struct unique;
+struct uring;
+
+// arena.c
+extern struct arena *arena_create(void);
+extern void arena_reset(struct arena *arena);
+extern void arena_destroy(struct arena *arena);
+extern void *arena_alloc(struct arena *arena, size_t size);
+extern size_t arena_size(const struct arena *arena);
+
+// join.c
+extern struct join *join_create(const char *on, int left);
+extern void join_load_names(struct join *j, char *const *names, size_t num_names);
+extern void join_load(struct join *j, char *const *fields, size_t num);
+extern void join_resolve(struct join *j, char *const *names, size_t num_names);
+extern void join_column_names(const struct join *j, char *const **namesp, size_t *nump);
+extern size_t join_num_columns(const struct join *j);
+extern int join_is_left(const struct join *j);
+extern int join_lookup(const struct join *j, char *const *fields, size_t num, char *const **matchp, size_t *nump);
+extern void join_free(struct join *j);
+
+// keyset.c
+extern struct keyset *keyset_load(const char *path);
+extern int keyset_contains(const struct keyset *ks, const char *key);
+extern void keyset_free(struct keyset *ks);
+
+// partition.c
+extern struct partition *partition_create(const char *by, const char *template, unsigned long num, size_t memory_limit,
+    void (*begin)(void *arg, FILE *fp), void (*end)(void *arg, FILE *fp), void *arg);
+extern void partition_resolve(struct partition *p, char *const *names, size_t num_names);
+extern FILE *partition_select(struct partition *p, char *const *fields, size_t num);
+extern void partition_finish(struct partition *p);
+
+// profile.c
+extern struct profile *profile_create(void);
+extern void profile_resolve(struct profile *p, char *const *names, size_t num_names);
+extern void profile_column_names(const char *const **namesp, size_t *nump);
+extern void profile_add(struct profile *p, char *const *fields, size_t num);
+extern void profile_finish(struct profile *p, void (*emit)(void *arg, char *const *fields, size_t num), void *arg);
+
+// ring.c
+extern struct ring *ring_create(unsigned int nblocks, size_t blocksize);
+extern void ring_destroy(struct ring *ring);
+extern struct ring_block *ring_get_free(struct ring *ring);
+extern void ring_put_full(struct ring *ring, struct ring_block *block);
+extern void ring_close(struct ring *ring);
+extern int ring_has_full(struct ring *ring);
+extern struct ring_block *ring_get_full(struct ring *ring);
+extern void ring_put_free(struct ring *ring, struct ring_block *block);
+extern void ring_abort(struct ring *ring);
+
+// agg.c
+extern struct agg *agg_create(const char *group_by, const char *aggs, size_t memory_limit);
+extern void agg_resolve(struct agg *agg, char *const *names, size_t num_names);
+extern void agg_column_names(const struct agg *agg, char *const **namesp, size_t *nump);
+extern void agg_add(struct agg *agg, char *const *fields, size_t num);
+extern void agg_finish(struct agg *agg, void (*emit)(void *arg, char *const *fields, size_t num), void *arg);
+
+// check.c
+extern int check_input(FILE *fp, const char *name, int quote, int fsep, int header, const char *encoding, int count_only);
 
+// checkpoint.c
+extern void checkpoint_save(const char *path, struct checkpoint *ck, FILE *out);
+extern int checkpoint_load(const char *path, struct checkpoint *ck);
+
+// column.c
+extern size_t find_column(const char *spec, char *const *names, size_t num_names);
+
+// emit.c
+extern size_t utf8_convert(iconv_t icd, const char *ibuf, char **obufp, size_t *allocp);
+extern void utf8_strerror(int errnum, int linenum, char *buf, size_t size);
+
+// hash.c
+extern uint64_t hash_bytes(const void *data, size_t len);
+
+// index.c
+extern struct index *index_create(unsigned long interval);
+extern void index_free(struct index *idx);
+extern void index_add(struct index *idx, uint64_t recnum, uint64_t offset, uint64_t linenum);
+extern uint64_t index_num_records(const struct index *idx);
+extern uint64_t index_lookup(const struct index *idx, uint64_t recnum, uint64_t *offsetp, uint64_t *linenump);
+extern uint64_t index_split(const struct index *idx, unsigned long slice, unsigned long num);
+extern void index_save(const struct index *idx, const char *path, int input_fd, int quote, int fsep);
+extern struct index *index_load(const char *path, int input_fd, int quote, int fsep);
+
+// input.c
+extern FILE *input_open(const char *path, int threaded);
+extern FILE *input_follow(const char *path);
+extern void input_set_idle(void (*idle)(void *arg), void *arg);
+
+// output.c
+extern FILE *output_open(int fd, const char *spec);
+extern uint64_t output_bytes(void);
+
+// sort.c
+extern struct sorter *sort_create(const char *spec, size_t memory_limit);
+extern void sort_resolve(struct sorter *s, char *const *names, size_t num_names);
+extern void sort_add(struct sorter *s, char *const *fields, size_t num, int linenum);
+extern void sort_finish(struct sorter *s, void (*emit)(void *arg, char *const *fields, size_t num, int linenum), void *arg);
+
+// spill.c
+extern struct spill *spill_create(void);
+extern void spill_destroy(struct spill *spill);
+extern uint64_t spill_num_rows(const struct spill *spill);
+extern void spill_write(struct spill *spill, uint64_t tag, char *const *fields, size_t num);
+extern void spill_rewind(struct spill *spill);
+extern int spill_read(struct spill *spill, uint64_t *tagp, char ***fieldsp, size_t *nump);
+
+// sqlite.c
+extern struct sqlite_output *sqlite_output_open(const char *path, const char *table, const char *encoding,
+    int use_names, uint64_t batch, int bulk);
+extern void sqlite_output_set_names(struct sqlite_output *s, char *const *names, size_t num_names,
+    const char *prefix, char *const *allowed, size_t num_allowed);
+extern void sqlite_output_add(struct sqlite_output *s, char *const *fields, size_t num, int linenum);
+extern void sqlite_output_close(struct sqlite_output *s);
+
+// stats.c
+extern void stats_start(int progress);
+extern int stats_phase(int phase);
+extern void stats_progress(uint64_t records, uint64_t bytes);
+extern void stats_finish(const struct stats_totals *totals);
+
+// unique.c
+extern struct unique *unique_create(const char *cols, int approximate, size_t memory_limit);
+extern void unique_resolve(struct unique *u, char *const *names, size_t num_names);
+extern int unique_check(struct unique *u, char *const *fields, size_t num);
+extern void unique_free(struct unique *u);
+
+// uring.c
+extern void uring_enable(void);
+extern struct uring *uring_create(unsigned int entries);
+extern void uring_destroy(struct uring *u);
+extern void uring_read(struct uring *u, int fd, void *buf, size_t len, uint64_t offset, unsigned int tag);
+extern void uring_write(struct uring *u, int fd, const void *buf, size_t len, uint64_t offset, unsigned int tag);
+extern void uring_submit(struct uring *u);
+extern int uring_wait(struct uring *u, unsigned int *tagp);
+
+// gitrev.c
+extern const char *const csvprintf_version;
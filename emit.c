@@ -0,0 +1,1304 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <iconv.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define XML_OUTPUT_ENCODING     "UTF-8"
+
+//
+// Record emitters for the XML, JSON, bash, and raw output formats.
+//
+// An emitter converts field values to UTF-8 (for XML and JSON) in its own scratch buffers,
+// so the caller's fields are never modified. Which columns to include, and under what names,
+// is worked out once when the column names are set rather than for every record.
+//
+// Output goes to a stdio stream, or into a caller-supplied buffer via csv_emitter_format(),
+// which works like snprintf(3).
+//
+// A record can also be output a piece at a time, for fields too big to hold in memory at once
+// (see csv_parser_set_chunk()). Each piece is converted and escaped on its own, with any
+// multibyte sequence split between pieces carried over to the next one, so the scratch space
+// needed depends only on the size of the pieces.
+//
+// Errors are returned rather than reported, with a message saved for csv_emitter_error(). Only
+// setting names and converting to UTF-8 can fail, so the output routines themselves don't check.
+//
+
+struct csv_emitter {
+    int             format;
+    int             use_names;
+    int             terminator;             // raw record terminator, or -1 for none
+    int             compact;                // CSV_COMPACT flags (XML and JSON only)
+    int             header_pending;         // compact JSON column names are yet to be output
+    size_t          row_fields;             // number of fields output so far in the current JSON record
+    iconv_t         icd;                    // NULL for bash
+    char            **names;
+    size_t          num_names;
+    char            *prefix;
+    unsigned char   *allowed;               // whether each named column is in the allowed list
+    unsigned char   *include;               // whether to output each named column
+    int             restricted;             // there is an allowed list
+    char            **conv;                 // UTF-8 converted fields
+    size_t          *conv_alloc;
+    size_t          num_conv;
+    size_t          field_col;              // current field being output a piece at a time
+    int             field_skip;             // current field is not included in the output
+    int             field_nul;              // current field had a NUL, which ends its value
+    char            carry[8];               // incomplete multibyte sequence from the previous piece
+    char            escape[16];             // scratch space for escape_xml_char()
+    size_t          carry_len;
+    char            *piece;                 // scratch buffers for converting pieces
+    size_t          piece_alloc;
+    char            *piece_in;
+    size_t          piece_in_alloc;
+    FILE            *buf_fp;                // for csv_emitter_format()
+    char            *target;
+    size_t          target_size;
+    size_t          target_len;
+    char            error[256];             // description of the last error
+};
+
+static const char *bash_special_vars[] = {
+    "BASH", "BASHOPTS", "BASHPID", "BASH_ALIASES", "BASH_ARGC", "BASH_ARGV", "BASH_CMDS", "BASH_COMMAND",
+    "BASH_EXECUTION_STRING", "BASH_LINENO", "BASH_LOADABLES_PATH", "BASH_REMATCH", "BASH_SOURCE", "BASH_SUBSHELL",
+    "BASH_VERSINFO", "BASH_VERSION", "COMP_CWORD", "COMP_KEY", "COMP_LINE", "COMP_POINT", "COMP_TYPE", "COMP_WORDBREAKS",
+    "COMP_WORDS", "COPROC", "DIRSTACK", "EUID", "FUNCNAME", "GROUPS", "HISTCMD", "HOSTNAME", "HOSTTYPE", "LINENO",
+    "MACHTYPE", "MAPFILE", "OLDPWD", "OPTARG", "OPTIND", "OSTYPE", "PIPESTATUS", "PPID", "PWD", "RANDOM", "READLINE_LINE",
+    "READLINE_POINT", "REPLY", "SECONDS", "SHELLOPTS", "SHLVL", "UID", "BASH_COMPAT", "BASH_ENV", "BASH_XTRACEFD", "CDPATH",
+    "CHILD_MAX", "COLUMNS", "COMPREPLY", "EMACS", "ENV", "EXECIGNORE", "FCEDIT", "FIGNORE", "FUNCNEST", "GLOBIGNORE",
+    "HISTCONTROL", "HISTFILE", "HISTFILESIZE", "HISTIGNORE", "HISTSIZE", "HISTTIMEFORMAT", "HOME", "HOSTFILE", "IFS",
+    "IGNOREEOF", "INPUTRC", "LANG", "LC_ALL", "LC_COLLATE", "LC_CTYPE", "LC_MESSAGES", "LC_NUMERIC", "LC_TIME", "LINES",
+    "MAIL", "MAILCHECK", "MAILPATH", "OPTERR", "PATH", "POSIXLY_CORRECT", "PROMPT_COMMAND", "PROMPT_DIRTRIM", "PS0", "PS1",
+    "PS2", "PS3", "PS4", "SHELL", "TIMEFORMAT", "TMOUT", "TMPDIR", "auto_resume", "histchars"
+};
+#define NUM_BASH_SPECIAL_VARS   (sizeof(bash_special_vars) / sizeof(*bash_special_vars))
+
+static void emit_json(struct csv_emitter *e, FILE *out, char *const *fields, size_t num);
+static void emit_xml(struct csv_emitter *e, FILE *out, char *const *fields, size_t num);
+static void emit_bash(struct csv_emitter *e, FILE *out, char *const *fields, size_t num);
+static void emit_raw(struct csv_emitter *e, FILE *out, char *const *fields, size_t num);
+static int emit_include(const struct csv_emitter *e, size_t col);
+static char *const *convert_fields(struct csv_emitter *e, char *const *fields, size_t num, int linenum);
+static size_t convert_piece(struct csv_emitter *e, const char *data, size_t len, int linenum);
+static void free_names(struct csv_emitter *e);
+static int check_names(struct csv_emitter *e);
+static int emit_fail(struct csv_emitter *e, int errnum, const char *fmt, ...);
+static int json_objects(const struct csv_emitter *e);
+static void print_json_header(struct csv_emitter *e, FILE *out);
+static void print_json_key(struct csv_emitter *e, FILE *out, size_t col);
+static void print_xml_row(const struct csv_emitter *e, FILE *out, int close);
+static void print_xml_tag(struct csv_emitter *e, FILE *out, size_t col, int close);
+static void print_xml_chars(struct csv_emitter *e, FILE *out, const char *ptr, size_t len);
+static void print_xml_tag_name(FILE *out, const char *tag);
+static void print_json_string(FILE *out, const char *string);
+static void print_json_chars(FILE *out, const char *ptr, size_t len);
+static void print_bash_name(FILE *out, const char *string);
+static void print_bash_value(FILE *out, const char *string);
+static char bash_name_safe(char ch, int first);
+static int decode_utf8(const char *const obuf, size_t olen, int *lenp);
+static const char *escape_xml_char(struct csv_emitter *e, int uchar);
+static ssize_t buffer_cookie_write(void *cookie, const char *buf, size_t len);
+#if !HAVE_FOPENCOOKIE
+static int buffer_cookie_write_int(void *cookie, const char *buf, int len);
+#endif
+
+//
+// Create an emitter. Input is assumed to be in the given character encoding (XML and JSON only).
+// If "use_names" is set, column names are used in the output (for XML tags, JSON object keys,
+// or bash variable names) once they have been set. Returns NULL (with errno set) if the format
+// or encoding isn't supported or there's not enough memory.
+//
+struct csv_emitter *
+csv_emitter_create(int format, int use_names, const char *encoding)
+{
+    struct csv_emitter *e;
+    int errnum;
+
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+        return NULL;
+    e->format = format;
+    e->use_names = use_names;
+    e->terminator = '\n';
+    switch (format) {
+    case CSV_EMIT_XML:
+    case CSV_EMIT_JSON:
+        if ((e->icd = iconv_open(XML_OUTPUT_ENCODING, encoding)) == (iconv_t)-1) {
+            e->icd = NULL;
+            goto fail;
+        }
+        break;
+    case CSV_EMIT_BASH:
+    case CSV_EMIT_RAW:
+        break;
+    default:
+        errno = EINVAL;
+        goto fail;
+    }
+    if ((e->prefix = strdup("")) == NULL)
+        goto fail;
+    return e;
+
+fail:
+    errnum = errno;
+    csv_emitter_free(e);
+    errno = errnum;
+    return NULL;
+}
+
+void
+csv_emitter_free(struct csv_emitter *e)
+{
+    size_t i;
+
+    if (e->icd != NULL)
+        (void)iconv_close(e->icd);
+    free_names(e);
+    free(e->prefix);
+    for (i = 0; i < e->num_conv; i++)
+        free(e->conv[i]);
+    free(e->conv);
+    free(e->conv_alloc);
+    free(e->piece);
+    free(e->piece_in);
+    if (e->buf_fp != NULL)
+        fclose(e->buf_fp);
+    free(e);
+}
+
+//
+// Set the column names (which must already be UTF-8 for XML and JSON; see csv_emitter_to_utf8()),
+// an optional prefix for each name, and an optional list of the only names to output.
+// Returns zero, or -1 (leaving no names set) if the names can't be used in the output format.
+//
+int
+csv_emitter_set_names(struct csv_emitter *e, char *const *names, size_t num_names,
+    const char *prefix, char *const *allowed, size_t num_allowed)
+{
+    char *new_prefix;
+    size_t i;
+    size_t j;
+
+    // Free old names
+    free_names(e);
+    if ((new_prefix = strdup(prefix != NULL ? prefix : "")) == NULL)
+        return emit_fail(e, errno, "strdup");
+    free(e->prefix);
+    e->prefix = new_prefix;
+
+    // Copy new names
+    if ((e->names = calloc(num_names > 0 ? num_names : 1, sizeof(*e->names))) == NULL
+      || (e->allowed = calloc(num_names > 0 ? num_names : 1, sizeof(*e->allowed))) == NULL
+      || (e->include = calloc(num_names > 0 ? num_names : 1, sizeof(*e->include))) == NULL) {
+        emit_fail(e, errno, "calloc");
+        goto fail;
+    }
+    for (e->num_names = 0; e->num_names < num_names; e->num_names++) {
+        if ((e->names[e->num_names] = strdup(names[e->num_names])) == NULL) {
+            emit_fail(e, errno, "strdup");
+            goto fail;
+        }
+    }
+
+    // Determine which columns to output
+    e->restricted = num_allowed > 0;
+    for (i = 0; i < num_names; i++) {
+        e->allowed[i] = 1;
+        if (e->restricted) {
+            for (j = 0; j < num_allowed && strcmp(allowed[j], names[i]) != 0; j++)
+                ;
+            e->allowed[i] = j < num_allowed;
+        }
+        e->include[i] = e->allowed[i];
+
+        // Elide any BASH special variable names
+        if (e->format == CSV_EMIT_BASH && e->use_names) {
+            char *name;
+
+            if (asprintf(&name, "%s%s", e->prefix, names[i]) == -1) {
+                emit_fail(e, errno, "asprintf");
+                goto fail;
+            }
+            for (j = 0; j < NUM_BASH_SPECIAL_VARS; j++) {
+                if (strcmp(bash_special_vars[j], name) == 0) {
+                    e->include[i] = 0;
+                    break;
+                }
+            }
+            free(name);
+        }
+    }
+
+    // Check for illegal or duplicate column names
+    if (check_names(e) == -1)
+        goto fail;
+    return 0;
+
+fail:
+    free_names(e);
+    return -1;
+}
+
+//
+// Set the character that follows each record in raw format (default newline), or -1 for none.
+//
+void
+csv_emitter_set_terminator(struct csv_emitter *e, int terminator)
+{
+    e->terminator = terminator;
+}
+
+//
+// Set compact output flags (XML and JSON only). With CSV_COMPACT, XML records are written one per
+// line without indentation, and JSON records using column names are written as arrays, preceded by
+// a single array containing the column names. CSV_COMPACT_SHORT_TAGS (which implies CSV_COMPACT)
+// also makes XML use "r" and "c1", "c2", etc. for tag names instead of "row" and column names.
+//
+void
+csv_emitter_set_compact(struct csv_emitter *e, int flags)
+{
+    if ((flags & CSV_COMPACT_SHORT_TAGS) != 0)
+        flags |= CSV_COMPACT;
+    e->compact = flags;
+}
+
+//
+// Convert a string to UTF-8 (for XML and JSON); caller must free the result. Returns NULL on error.
+//
+char *
+csv_emitter_to_utf8(struct csv_emitter *e, const char *string, int linenum)
+{
+    char *result = NULL;
+    size_t alloc = 0;
+
+    if (e->icd == NULL) {
+        if ((result = strdup(string)) == NULL)
+            emit_fail(e, errno, "strdup");
+        return result;
+    }
+    if (utf8_convert(e->icd, string, &result, &alloc) == (size_t)-1) {
+        utf8_strerror(errno, linenum, e->error, sizeof(e->error));
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+//
+// Describe the last error.
+//
+const char *
+csv_emitter_error(const struct csv_emitter *e)
+{
+    return e->error;
+}
+
+//
+// Output whatever precedes the first record.
+//
+void
+csv_emitter_begin(struct csv_emitter *e, FILE *out)
+{
+    if (e->format == CSV_EMIT_XML) {
+        fprintf(out, "<?xml version=\"1.0\" encoding=\"%s\"?>\n", XML_OUTPUT_ENCODING);
+        fprintf(out, "<csv>\n");
+    }
+
+    // Compact JSON column names go first, but may not be known yet
+    if (e->format == CSV_EMIT_JSON && e->use_names && (e->compact & CSV_COMPACT) != 0) {
+        e->header_pending = 1;
+        if (e->names != NULL)
+            print_json_header(e, out);
+    }
+}
+
+//
+// Output whatever follows the last record.
+//
+void
+csv_emitter_end(struct csv_emitter *e, FILE *out)
+{
+    if (e->header_pending && e->names != NULL)
+        print_json_header(e, out);
+    if (e->format == CSV_EMIT_XML)
+        fprintf(out, "</csv>\n");
+}
+
+//
+// Output one record. Returns zero, or -1 if the record can't be converted (nothing is output).
+//
+int
+csv_emitter_write(struct csv_emitter *e, FILE *out, char *const *fields, size_t num, int linenum)
+{
+    char *const *utf8;
+
+    if ((utf8 = csv_emitter_convert(e, fields, num, linenum)) == NULL)
+        return -1;
+    csv_emitter_write_utf8(e, out, utf8, num, linenum);
+    return 0;
+}
+
+//
+// Convert a record's fields to UTF-8 (XML and JSON only; otherwise, they are returned as is).
+// The result is valid until the next call, and can be given to csv_emitter_write_utf8() for any
+// emitter with the same input encoding, so a record output several ways is only converted once.
+// Returns NULL on error.
+//
+char *const *
+csv_emitter_convert(struct csv_emitter *e, char *const *fields, size_t num, int linenum)
+{
+    if (e->icd == NULL)
+        return fields;
+    return convert_fields(e, fields, num, linenum);
+}
+
+//
+// Output one record whose fields have already been converted by csv_emitter_convert().
+//
+void
+csv_emitter_write_utf8(struct csv_emitter *e, FILE *out, char *const *fields, size_t num, int linenum)
+{
+    switch (e->format) {
+    case CSV_EMIT_JSON:
+        emit_json(e, out, fields, num);
+        break;
+    case CSV_EMIT_XML:
+        emit_xml(e, out, fields, num);
+        break;
+    case CSV_EMIT_BASH:
+        emit_bash(e, out, fields, num);
+        break;
+    case CSV_EMIT_RAW:
+        emit_raw(e, out, fields, num);
+        break;
+    default:
+        break;
+    }
+}
+
+//
+// Output one record a piece at a time (XML, JSON, and raw only): call csv_emitter_begin_record(),
+// then for each field csv_emitter_begin_field(), csv_emitter_field_data() any number of times,
+// and csv_emitter_end_field(), then csv_emitter_end_record(). The output is the same as from
+// csv_emitter_write(), except that a conversion error may be found after part of it is written.
+// The functions that return int return zero, or -1 on error.
+//
+int
+csv_emitter_begin_record(struct csv_emitter *e, FILE *out)
+{
+    switch (e->format) {
+    case CSV_EMIT_JSON:
+        if (e->header_pending && e->names != NULL)
+            print_json_header(e, out);
+        fprintf(out, "\x1e%c", json_objects(e) ? '{' : '[');
+        e->row_fields = 0;
+        break;
+    case CSV_EMIT_XML:
+        print_xml_row(e, out, 0);
+        break;
+    case CSV_EMIT_RAW:
+        break;
+    default:
+        return emit_fail(e, 0, "bash records can't be output a piece at a time");
+    }
+    return 0;
+}
+
+int
+csv_emitter_begin_field(struct csv_emitter *e, FILE *out, size_t col, int linenum)
+{
+    e->field_col = col;
+    e->field_skip = !emit_include(e, col);
+    e->field_nul = 0;
+    e->carry_len = 0;
+    if (e->field_skip)
+        return 0;
+    if (e->icd != NULL && iconv(e->icd, NULL, NULL, NULL, NULL) == (size_t)-1)
+        return emit_fail(e, errno, "iconv");
+    switch (e->format) {
+    case CSV_EMIT_JSON:
+        print_json_key(e, out, col);
+        putc('"', out);
+        break;
+    case CSV_EMIT_XML:
+        print_xml_tag(e, out, col, 0);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+int
+csv_emitter_field_data(struct csv_emitter *e, FILE *out, const char *data, size_t len, int linenum)
+{
+    const char *nul;
+    size_t olen;
+
+    // Ignore anything after a NUL, as csv_emitter_write() would
+    if (e->field_skip || e->field_nul)
+        return 0;
+    if ((nul = memchr(data, '\0', len)) != NULL) {
+        len = nul - data;
+        e->field_nul = 1;
+    }
+
+    // Raw output needs no conversion
+    if (e->format == CSV_EMIT_RAW) {
+        fwrite(data, 1, len, out);
+        return 0;
+    }
+
+    // Convert and escape
+    if ((olen = convert_piece(e, data, len, linenum)) == (size_t)-1)
+        return -1;
+    if (e->format == CSV_EMIT_JSON)
+        print_json_chars(out, e->piece, olen);
+    else
+        print_xml_chars(e, out, e->piece, olen);
+    return 0;
+}
+
+int
+csv_emitter_end_field(struct csv_emitter *e, FILE *out, int linenum)
+{
+    if (e->field_skip)
+        return 0;
+    if (e->carry_len > 0)
+        return emit_fail(e, 0, "line %d: %s multibyte sequence", linenum, "truncated");
+    switch (e->format) {
+    case CSV_EMIT_JSON:
+        putc('"', out);
+        break;
+    case CSV_EMIT_XML:
+        print_xml_tag(e, out, e->field_col, 1);
+        break;
+    case CSV_EMIT_RAW:
+        putc('\0', out);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+void
+csv_emitter_end_record(struct csv_emitter *e, FILE *out)
+{
+    switch (e->format) {
+    case CSV_EMIT_JSON:
+        fprintf(out, "%c\n", json_objects(e) ? '}' : ']');
+        break;
+    case CSV_EMIT_XML:
+        print_xml_row(e, out, 1);
+        break;
+    case CSV_EMIT_RAW:
+        if (e->terminator != -1)
+            putc(e->terminator, out);
+        break;
+    default:
+        break;
+    }
+}
+
+//
+// Format one record into the given buffer, like snprintf(3): at most "size" bytes are written,
+// including a terminating NUL, and the return value is the full length of the output, or
+// (size_t)-1 on error.
+//
+size_t
+csv_emitter_format(struct csv_emitter *e, char *buf, size_t size, char *const *fields, size_t num, int linenum)
+{
+    // Create our stream
+    if (e->buf_fp == NULL) {
+#if HAVE_FOPENCOOKIE
+        cookie_io_functions_t funcs;
+
+        memset(&funcs, 0, sizeof(funcs));
+        funcs.write = buffer_cookie_write;
+        if ((e->buf_fp = fopencookie(e, "w", funcs)) == NULL) {
+            emit_fail(e, errno, "fopencookie");
+            return (size_t)-1;
+        }
+#else
+        if ((e->buf_fp = funopen(e, NULL, buffer_cookie_write_int, NULL, NULL)) == NULL) {
+            emit_fail(e, errno, "funopen");
+            return (size_t)-1;
+        }
+#endif
+    }
+
+    // Format the record
+    e->target = buf;
+    e->target_size = size;
+    e->target_len = 0;
+    if (csv_emitter_write(e, e->buf_fp, fields, num, linenum) == -1)
+        return (size_t)-1;
+    if (fflush(e->buf_fp) == EOF) {
+        emit_fail(e, errno, "fflush");
+        return (size_t)-1;
+    }
+    if (size > 0)
+        buf[e->target_len < size ? e->target_len : size - 1] = '\0';
+    return e->target_len;
+}
+
+static void
+emit_json(struct csv_emitter *e, FILE *out, char *const *fields, size_t num)
+{
+    size_t col;
+
+    // Output column names first if needed
+    if (e->header_pending && e->names != NULL)
+        print_json_header(e, out);
+
+    // Output row
+    fprintf(out, "\x1e%c", json_objects(e) ? '{' : '[');
+    e->row_fields = 0;
+    for (col = 0; col < num; col++) {
+
+        // Check whether column should be included
+        if (!emit_include(e, col))
+            continue;
+
+        // Add comma and column name (if using object notation)
+        print_json_key(e, out, col);
+
+        // Add column value
+        putc('"', out);
+        print_json_string(out, fields[col]);
+        putc('"', out);
+    }
+    fprintf(out, "%c\n", json_objects(e) ? '}' : ']');
+}
+
+static void
+emit_xml(struct csv_emitter *e, FILE *out, char *const *fields, size_t num)
+{
+    size_t col;
+
+    // Output columns for row
+    print_xml_row(e, out, 0);
+    for (col = 0; col < num; col++) {
+
+        // Check whether column should be included
+        if (!emit_include(e, col))
+            continue;
+
+        // Output XML tags and characters, escaped as needed
+        print_xml_tag(e, out, col, 0);
+        print_xml_chars(e, out, fields[col], strlen(fields[col]));
+        print_xml_tag(e, out, col, 1);
+    }
+    print_xml_row(e, out, 1);
+}
+
+static void
+emit_bash(struct csv_emitter *e, FILE *out, char *const *fields, size_t num)
+{
+    size_t col;
+
+    // Start array (if needed)
+    if (!e->use_names)
+        fprintf(out, "ROW=(");
+
+    // Output row
+    for (col = 0; col < num; col++) {
+
+        // Check whether column should be included
+        if (!emit_include(e, col))
+            continue;
+
+        // Add space
+        if (col > 0 || !e->use_names)
+            putc(' ', out);
+
+        // Add column name (if using column names)
+        if (e->use_names) {
+            if (col < e->num_names) {
+                print_bash_name(out, e->prefix);
+                print_bash_name(out, e->names[col]);
+            } else
+                fprintf(out, "col%d", (int)col + 1);
+            putc('=', out);
+        }
+
+        // Add column value
+        print_bash_value(out, fields[col]);
+
+        // Add separator
+        if (e->use_names)
+            putc(';', out);
+    }
+
+    // End array (if needed)
+    if (!e->use_names)
+        fprintf(out, " )");
+
+    // End line
+    fprintf(out, "\n");
+}
+
+// Output each field followed by NUL, with no quoting or escaping
+static void
+emit_raw(struct csv_emitter *e, FILE *out, char *const *fields, size_t num)
+{
+    size_t col;
+
+    for (col = 0; col < num; col++) {
+        if (!emit_include(e, col))
+            continue;
+        fputs(fields[col], out);
+        putc('\0', out);
+    }
+    if (e->terminator != -1)
+        putc(e->terminator, out);
+}
+
+// Determine whether to output the given column (raw format selects columns even without using names)
+static int
+emit_include(const struct csv_emitter *e, size_t col)
+{
+    if (!e->use_names && e->format != CSV_EMIT_RAW)
+        return 1;
+    if (col >= e->num_names)
+        return !e->restricted;
+    return e->include[col];
+}
+
+// Free the column names
+static void
+free_names(struct csv_emitter *e)
+{
+    size_t i;
+
+    for (i = 0; i < e->num_names; i++)
+        free(e->names[i]);
+    free(e->names);
+    free(e->allowed);
+    free(e->include);
+    e->names = NULL;
+    e->allowed = NULL;
+    e->include = NULL;
+    e->num_names = 0;
+}
+
+// Check for illegal or duplicate column names
+static int
+check_names(struct csv_emitter *e)
+{
+    size_t i;
+    size_t j;
+
+    switch (e->format) {
+    case CSV_EMIT_JSON:
+        for (i = 0; i + 1 < e->num_names; i++) {
+            if (!e->allowed[i])
+                continue;
+            for (j = i + 1; j < e->num_names; j++) {
+                if (strcmp(e->names[i], e->names[j]) == 0)
+                    return emit_fail(e, 0, "duplicate column name \"%s\"", e->names[i]);
+            }
+        }
+        break;
+    case CSV_EMIT_BASH:
+        for (i = 0; i < e->num_names; i++) {
+            char *namei;
+
+            if (!e->allowed[i])
+                continue;
+            if (asprintf(&namei, "%s%s", e->prefix, e->names[i]) == -1)
+                return emit_fail(e, errno, "asprintf");
+            if (*namei == '\0') {
+                free(namei);
+                return emit_fail(e, 0, "illegal empty string column name");
+            }
+            for (j = i + 1; j < e->num_names; j++) {
+                char *namej;
+                int same = 1;
+                int k;
+
+                if (asprintf(&namej, "%s%s", e->prefix, e->names[j]) == -1) {
+                    free(namei);
+                    return emit_fail(e, errno, "asprintf");
+                }
+                for (k = 0; namei[k] != '\0' || namej[k] != '\0'; k++) {
+                    if (namei[k] == '\0' || namej[k] == '\0'
+                      || bash_name_safe(namei[k], k == 0) != bash_name_safe(namej[k], k == 0)) {
+                        same = 0;
+                        break;
+                    }
+                }
+                if (same) {
+                    emit_fail(e, 0, "duplicate (bash variable) column names \"%s\" and \"%s\"", namei, namej);
+                    free(namei);
+                    free(namej);
+                    return -1;
+                }
+                free(namej);
+            }
+            free(namei);
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+// Convert fields to UTF-8 encoding (XML and JSON only); returns NULL on error
+static char *const *
+convert_fields(struct csv_emitter *e, char *const *fields, size_t num, int linenum)
+{
+    size_t col;
+
+    // Get enough scratch buffers
+    if (num > e->num_conv) {
+        char **conv;
+        size_t *conv_alloc;
+
+        if ((conv = realloc(e->conv, num * sizeof(*e->conv))) == NULL) {
+            emit_fail(e, errno, "realloc");
+            return NULL;
+        }
+        e->conv = conv;
+        if ((conv_alloc = realloc(e->conv_alloc, num * sizeof(*e->conv_alloc))) == NULL) {
+            emit_fail(e, errno, "realloc");
+            return NULL;
+        }
+        e->conv_alloc = conv_alloc;
+        memset(e->conv + e->num_conv, 0, (num - e->num_conv) * sizeof(*e->conv));
+        memset(e->conv_alloc + e->num_conv, 0, (num - e->num_conv) * sizeof(*e->conv_alloc));
+        e->num_conv = num;
+    }
+
+    // Convert columns
+    for (col = 0; col < num; col++) {
+        if (utf8_convert(e->icd, fields[col], &e->conv[col], &e->conv_alloc[col]) == (size_t)-1) {
+            utf8_strerror(errno, linenum, e->error, sizeof(e->error));
+            return NULL;
+        }
+    }
+    return e->conv;
+}
+
+// Convert a piece of a field to UTF-8, carrying over any incomplete multibyte sequence at the end;
+// returns the length of the result, or (size_t)-1 on error
+static size_t
+convert_piece(struct csv_emitter *e, const char *data, size_t len, int linenum)
+{
+    char *iptr;
+    char *optr;
+    size_t iremain;
+    size_t oremain;
+
+    // Prepend the incomplete sequence from last time
+    if (e->carry_len > 0) {
+        if (e->piece_in_alloc < e->carry_len + len) {
+            char *piece_in;
+
+            if ((piece_in = realloc(e->piece_in, e->carry_len + len)) == NULL) {
+                emit_fail(e, errno, "realloc");
+                return (size_t)-1;
+            }
+            e->piece_in = piece_in;
+            e->piece_in_alloc = e->carry_len + len;
+        }
+        memcpy(e->piece_in, e->carry, e->carry_len);
+        memcpy(e->piece_in + e->carry_len, data, len);
+        data = e->piece_in;
+        len += e->carry_len;
+        e->carry_len = 0;
+    }
+
+    // Ensure buffer is big enough
+    oremain = 64 + 4 * len;
+    if (e->piece_alloc < oremain) {
+        free(e->piece);
+        e->piece_alloc = 0;
+        if ((e->piece = malloc(oremain)) == NULL) {
+            emit_fail(e, errno, "malloc");
+            return (size_t)-1;
+        }
+        e->piece_alloc = oremain;
+    }
+
+    // Convert piece
+    iptr = (char *)(uintptr_t)data;             // iconv(3) doesn't modify the input
+    iremain = len;
+    optr = e->piece;
+    if (iconv(e->icd, &iptr, &iremain, &optr, &oremain) == (size_t)-1) {
+        if (errno == EINVAL && iremain <= sizeof(e->carry)) {
+            memcpy(e->carry, iptr, iremain);
+            e->carry_len = iremain;
+        } else {
+            utf8_strerror(errno, linenum, e->error, sizeof(e->error));
+            return (size_t)-1;
+        }
+    }
+    return optr - e->piece;
+}
+
+// Convert a string to UTF-8 encoding into a reusable buffer; returns the length, or (size_t)-1 with errno set
+size_t
+utf8_convert(iconv_t icd, const char *ibuf, char **obufp, size_t *allocp)
+{
+    char *iptr;
+    char *optr;
+    size_t iremain;
+    size_t oremain;
+    size_t olen;
+
+    // Ensure buffer is big enough
+    iremain = strlen(ibuf);
+    oremain = 64 + 4 * iremain;
+    if (*allocp < oremain + 1) {
+        free(*obufp);
+        *allocp = 0;
+        if ((*obufp = malloc(oremain + 1)) == NULL)
+            return (size_t)-1;
+        *allocp = oremain + 1;
+    }
+
+    // Convert string
+    iptr = (char *)(uintptr_t)ibuf;             // iconv(3) doesn't modify the input
+    optr = *obufp;
+    if (iconv(icd, NULL, NULL, NULL, NULL) == (size_t)-1
+      || iconv(icd, &iptr, &iremain, &optr, &oremain) == (size_t)-1)
+        return (size_t)-1;
+    olen = optr - *obufp;
+    (*obufp)[olen] = '\0';
+    return olen;
+}
+
+// Describe a utf8_convert() error
+void
+utf8_strerror(int errnum, int linenum, char *buf, size_t size)
+{
+    switch (errnum) {
+    case EILSEQ:
+        snprintf(buf, size, "line %d: %s multibyte sequence", linenum, "illegal");
+        break;
+    case EINVAL:
+        snprintf(buf, size, "line %d: %s multibyte sequence", linenum, "truncated");
+        break;
+    case ENOMEM:
+        snprintf(buf, size, "malloc: %s", strerror(errnum));
+        break;
+    default:
+        snprintf(buf, size, "line %d: iconv: %s", linenum, strerror(errnum));
+        break;
+    }
+}
+
+// Determine whether JSON records are objects, rather than arrays
+static int
+json_objects(const struct csv_emitter *e)
+{
+    return e->use_names && (e->compact & CSV_COMPACT) == 0;
+}
+
+// Output the array of (included) column names that precedes compact JSON records
+static void
+print_json_header(struct csv_emitter *e, FILE *out)
+{
+    size_t count = 0;
+    size_t col;
+
+    e->header_pending = 0;
+    fprintf(out, "\x1e[");
+    for (col = 0; col < e->num_names; col++) {
+        if (!emit_include(e, col))
+            continue;
+        if (count++ > 0)
+            putc(',', out);
+        putc('"', out);
+        print_json_string(out, e->prefix);
+        print_json_string(out, e->names[col]);
+        putc('"', out);
+    }
+    fprintf(out, "]\n");
+}
+
+// Output the comma (if needed) and column name (if using object notation) preceding a JSON value
+static void
+print_json_key(struct csv_emitter *e, FILE *out, size_t col)
+{
+    if (e->row_fields++ > 0)
+        putc(',', out);
+    if (json_objects(e)) {
+        if (col < e->num_names) {
+            putc('"', out);
+            print_json_string(out, e->prefix);
+            print_json_string(out, e->names[col]);
+            putc('"', out);
+        } else
+            fprintf(out, "\"col%d\"", (int)col + 1);
+        putc(':', out);
+    }
+}
+
+// Output the XML opening or closing tag for a row
+static void
+print_xml_row(const struct csv_emitter *e, FILE *out, int close)
+{
+    const char *const tag = (e->compact & CSV_COMPACT_SHORT_TAGS) != 0 ? "r" : "row";
+    const int compact = (e->compact & CSV_COMPACT) != 0;
+
+    fputs(close ? compact ? "</" : "  </" : compact ? "<" : "  <", out);
+    fputs(tag, out);
+    fputs(close || !compact ? ">\n" : ">", out);
+}
+
+// Output the XML opening or closing tag for a column
+static void
+print_xml_tag(struct csv_emitter *e, FILE *out, size_t col, int close)
+{
+    const int compact = (e->compact & CSV_COMPACT) != 0;
+    const int short_tags = (e->compact & CSV_COMPACT_SHORT_TAGS) != 0;
+
+    // Determine whether we can actually use column name for XML tag name
+    const int use_name_this_tag = e->use_names && !short_tags && col < e->num_names
+      && (*e->prefix != '\0' || *e->names[col] != '\0');
+
+    fputs(close ? "</" : compact ? "<" : "    <", out);
+    if (use_name_this_tag) {
+        print_xml_tag_name(out, e->prefix);
+        print_xml_tag_name(out, e->names[col]);
+    } else {
+        char buf[32];
+        char *ptr = buf + sizeof(buf);
+        size_t num = col + 1;
+
+        // Format the column number ourselves; this is a hot spot for large XML documents
+        *--ptr = '\0';
+        do
+            *--ptr = '0' + num % 10;
+        while ((num /= 10) > 0);
+        fputs(short_tags ? "c" : "col", out);
+        fputs(ptr, out);
+    }
+    fputs(close && !compact ? ">\n" : ">", out);
+}
+
+// Output UTF-8 characters as XML, escaped as needed
+static void
+print_xml_chars(struct csv_emitter *e, FILE *out, const char *ptr, size_t len)
+{
+    const char *esc;
+    int uchar;
+    int uclen;
+    int i;
+
+    while (len > 0) {
+        uchar = decode_utf8(ptr, len, &uclen);
+        if (uchar == -1)
+            fputs("\xef\xbf\xbd", out);      // U+FFFD REPLACEMENT CHARACTER
+        else if ((esc = escape_xml_char(e, uchar)) != NULL)
+            fprintf(out, "%s", esc);
+        else {
+            for (i = 0; i < uclen; i++)
+                putc(ptr[i], out);
+        }
+        ptr += uclen;
+        len -= uclen;
+    }
+}
+
+// Output XML tag name, substituting invalid characters
+static void
+print_xml_tag_name(FILE *out, const char *tag)
+{
+    size_t len = strlen(tag);
+    int first = 1;
+    int uchar;
+    int uclen;
+    int ok;
+    int i;
+
+    while (len > 0) {
+        uchar = decode_utf8(tag, len, &uclen);
+        if (first) {
+            ok = isalpha(uchar) || uchar == '_';
+            first = 0;
+        } else
+            ok = isalpha(uchar) || isdigit(uchar) || uchar == '_' || uchar == '-' || uchar == '.';
+        if (!ok)
+            putc('_', out);
+        else {
+            for (i = 0; i < uclen; i++)
+                putc(tag[i], out);
+        }
+        tag += uclen;
+        len -= uclen;
+    }
+}
+
+// Get the escape sequence for an XML character, or NULL if it needs none; the result may be in the emitter's scratch space
+static const char *
+escape_xml_char(struct csv_emitter *e, int uchar)
+{
+    switch (uchar) {
+    case '>':
+        return "&gt;";
+        break;
+    case '<':
+        return "&lt;";
+        break;
+    case '&':
+        return "&amp;";
+        break;
+    default:
+
+        // Pass valid and unrestricted characters through (but not CR)
+        // http://en.wikipedia.org/wiki/Valid_characters_in_XML
+        if ((uchar == '\n' || uchar == '\t'
+            || (uchar >= 0x0020 && uchar <= 0xd7ff)
+            || (uchar >= 0xe000 && uchar <= 0xfffd)
+            || (uchar >= 0x10000 && uchar <= 0x10ffff))
+          && !((uchar >= 0x007f && uchar <= 0x0084) || (uchar >= 0x0086 && uchar <= 0x009F)))
+            return NULL;
+
+        // Escape other characters
+        snprintf(e->escape, sizeof(e->escape), "&#%u;", uchar);
+        return e->escape;
+    }
+}
+
+static void
+print_bash_name(FILE *out, const char *string)
+{
+    int i;
+
+    for (i = 0; string[i] != '\0'; i++)
+        putc(bash_name_safe(string[i], i == 0), out);
+}
+
+static void
+print_bash_value(FILE *out, const char *string)
+{
+    int single_quotes = 1;
+    int i;
+
+    // See if plain single quotes will work
+    for (i = 0; string[i] != '\0'; i++) {
+        if (string[i] == '\'' || !isprint((unsigned char)string[i])) {
+            single_quotes = 0;
+            break;
+        }
+    }
+
+    // Output value
+    if (single_quotes)
+        fprintf(out, "'%s'", string);
+    else {
+        fprintf(out, "$'");
+        for (i = 0; string[i] != '\0'; i++) {
+            switch (string[i]) {
+            case '\'':
+                fprintf(out, "\\'");
+                break;
+            case '\\':
+                fprintf(out, "\\\\");
+                break;
+            case '\b':
+                fprintf(out, "\\b");
+                break;
+            case '\f':
+                fprintf(out, "\\f");
+                break;
+            case '\n':
+                fprintf(out, "\\n");
+                break;
+            case '\r':
+                fprintf(out, "\\r");
+                break;
+            case '\t':
+                fprintf(out, "\\t");
+                break;
+            case '\v':
+                fprintf(out, "\\v");
+                break;
+            default:
+                if (isprint((unsigned char)string[i]))
+                    putc((unsigned char)string[i], out);
+                else
+                    fprintf(out, "\\x%02x", (unsigned char)string[i]);
+                break;
+            }
+        }
+        putc('\'', out);
+    }
+}
+
+static char
+bash_name_safe(char ch, int first)
+{
+    if (isupper((unsigned char)ch) || islower((unsigned char)ch) || ch == '_')
+        return ch;
+    if (!first && isdigit((unsigned char)ch))
+        return ch;
+    return '_';
+}
+
+// Output JSON string
+static void
+print_json_string(FILE *out, const char *string)
+{
+    print_json_chars(out, string, strlen(string));
+}
+
+// Output UTF-8 characters as part of a JSON string
+static void
+print_json_chars(FILE *out, const char *ptr, size_t len)
+{
+    int uchar;
+    int uclen;
+
+    while (len > 0) {
+        uchar = decode_utf8(ptr, len, &uclen);
+        switch (uchar) {
+        case -1:
+            fprintf(out, "\\ufffd");
+            break;
+        case '"':
+            fprintf(out, "\\\"");
+            break;
+        case '\\':
+            fprintf(out, "\\\\");
+            break;
+        case '\b':
+            fprintf(out, "\\b");
+            break;
+        case '\f':
+            fprintf(out, "\\f");
+            break;
+        case '\n':
+            fprintf(out, "\\n");
+            break;
+        case '\r':
+            fprintf(out, "\\r");
+            break;
+        case '\t':
+            fprintf(out, "\\t");
+            break;
+        default:
+            if (isprint(uchar))
+                fprintf(out, "%c", uchar);
+            else
+                fprintf(out, "\\u%04x", uchar);
+            break;
+        }
+        ptr += uclen;
+        len -= uclen;
+    }
+}
+
+// Decode UTF-8 character, or return -1 for an invalid byte (iconv(3) output shouldn't contain any)
+static int
+decode_utf8(const char *const obuf, size_t olen, int *lenp)
+{
+    int uchar;
+    int uclen;
+    int i = 0;
+
+    if ((obuf[i] & 0x80) == 0x00) {
+        uclen = 1;
+        uchar = obuf[i] & 0x7f;
+    } else if ((obuf[i] & 0xe0) == 0xc0 && i + 1 < olen) {
+        uclen = 2;
+        uchar = ((obuf[i] & 0x1f) <<  6)
+          | ((obuf[i + 1] & 0x3f) <<  0);
+    } else if ((obuf[i] & 0xf0) == 0xe0 && i + 2 < olen) {
+        uclen = 3;
+        uchar = ((obuf[i] & 0x0f) << 12)
+          | ((obuf[i + 1] & 0x3f) <<  6)
+          | ((obuf[i + 2] & 0x3f) <<  0);
+    } else if ((obuf[i] & 0xf8) == 0xf0 && i + 3 < olen) {
+        uclen = 4;
+        uchar = ((obuf[i] & 0x07) << 18)
+          | ((obuf[i + 1] & 0x3f) << 12)
+          | ((obuf[i + 2] & 0x3f) <<  6)
+          | ((obuf[i + 3] & 0x3f) <<  0);
+    } else if ((obuf[i] & 0xfc) == 0xf8 && i + 4 < olen) {
+        uclen = 5;
+        uchar = ((obuf[i] & 0x03) << 24)
+          | ((obuf[i + 1] & 0x3f) << 18)
+          | ((obuf[i + 2] & 0x3f) << 12)
+          | ((obuf[i + 3] & 0x3f) <<  6)
+          | ((obuf[i + 4] & 0x3f) <<  0);
+    } else if ((obuf[i] & 0xfe) == 0xfc && i + 5 < olen) {
+        uclen = 6;
+        uchar = ((obuf[i] & 0x01) << 30)
+          | ((obuf[i + 1] & 0x3f) << 24)
+          | ((obuf[i + 2] & 0x3f) << 18)
+          | ((obuf[i + 3] & 0x3f) << 12)
+          | ((obuf[i + 4] & 0x3f) <<  6)
+          | ((obuf[i + 5] & 0x3f) <<  0);
+    } else {
+        uclen = 1;
+        uchar = -1;
+    }
+
+    // Done
+    *lenp = uclen;
+    return uchar;
+}
+
+// Append output to the csv_emitter_format() buffer
+static ssize_t
+buffer_cookie_write(void *cookie, const char *buf, size_t len)
+{
+    struct csv_emitter *const e = cookie;
+
+    if (e->target_len < e->target_size) {
+        const size_t room = e->target_size - e->target_len;
+
+        memcpy(e->target + e->target_len, buf, len < room ? len : room);
+    }
+    e->target_len += len;
+    return len;
+}
+
+#if !HAVE_FOPENCOOKIE
+static int
+buffer_cookie_write_int(void *cookie, const char *buf, int len)
+{
+    return (int)buffer_cookie_write(cookie, buf, len);
+}
+#endif
+
+// Save an error message, like err(3) if "errnum" is not zero and errx(3) otherwise, and return -1
+static int
+emit_fail(struct csv_emitter *e, int errnum, const char *fmt, ...)
+{
+    va_list args;
+    size_t len;
+
+    va_start(args, fmt);
+    vsnprintf(e->error, sizeof(e->error), fmt, args);
+    va_end(args);
+    if (errnum != 0 && (len = strlen(e->error)) < sizeof(e->error))
+        snprintf(e->error + len, sizeof(e->error) - len, ": %s", strerror(errnum));
+    return -1;
+}
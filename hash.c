@@ -0,0 +1,70 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_PRIME1             0x9e3779b185ebca87ULL
+#define HASH_PRIME2             0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3             0x165667b19e3779f9ULL
+#define HASH_PRIME4             0x85ebca77c2b2ae63ULL
+#define HASH_PRIME5             0x27d4eb2f165667c5ULL
+
+#define HASH_ROTL(x, r)         (((x) << (r)) | ((x) >> (64 - (r))))
+
+//
+// Fast 64-bit hash (the short-input path of xxHash64), which consumes eight bytes
+// at a time and has good avalanche, so any subset of the bits can be used.
+//
+uint64_t
+hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *ptr = data;
+    uint64_t hash = HASH_PRIME5 + len;
+    uint64_t word;
+    uint32_t half;
+
+    while (len >= 8) {
+        memcpy(&word, ptr, 8);
+        word *= HASH_PRIME2;
+        word = HASH_ROTL(word, 31);
+        word *= HASH_PRIME1;
+        hash ^= word;
+        hash = HASH_ROTL(hash, 27) * HASH_PRIME1 + HASH_PRIME4;
+        ptr += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        memcpy(&half, ptr, 4);
+        hash ^= (uint64_t)half * HASH_PRIME1;
+        hash = HASH_ROTL(hash, 23) * HASH_PRIME2 + HASH_PRIME3;
+        ptr += 4;
+        len -= 4;
+    }
+    while (len-- > 0) {
+        hash ^= *ptr++ * HASH_PRIME5;
+        hash = HASH_ROTL(hash, 11) * HASH_PRIME1;
+    }
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
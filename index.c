@@ -0,0 +1,241 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC             "CSVPIDX1"
+#define INDEX_MAGIC_LEN         8
+
+//
+// An index records the byte offset and line number of every Nth CSV record (counting from
+// record #1, which includes any header row). Every entry is at a record boundary, so there
+// is no quote state to save: parsing can always resume at an entry with a fresh parser.
+//
+// File format: magic bytes, then these unsigned LEB128 varints:
+//
+//  - interval, quote char, separator char
+//  - input file size and modification time (to detect stale indexes)
+//  - total number of records
+//  - number of entries, followed by that many (offset delta, line number delta) pairs
+//
+
+struct index_entry {
+    uint64_t    offset;
+    uint64_t    linenum;
+};
+
+struct index {
+    uint64_t            interval;
+    uint64_t            num_records;
+    struct index_entry  *entries;
+    size_t              num_entries;
+    size_t              alloc;
+};
+
+static void write_varint(FILE *fp, uint64_t value);
+static uint64_t read_varint(FILE *fp, const char *path);
+
+struct index *
+index_create(unsigned long interval)
+{
+    struct index *idx;
+
+    if ((idx = calloc(1, sizeof(*idx))) == NULL)
+        err(1, "calloc");
+    idx->interval = interval;
+    return idx;
+}
+
+void
+index_free(struct index *idx)
+{
+    free(idx->entries);
+    free(idx);
+}
+
+//
+// Note that record number "recnum" (starting from one) starts at the given offset and line number.
+//
+void
+index_add(struct index *idx, uint64_t recnum, uint64_t offset, uint64_t linenum)
+{
+    struct index_entry *entry;
+
+    idx->num_records = recnum;
+    if ((recnum - 1) % idx->interval != 0)
+        return;
+    if (idx->num_entries == idx->alloc) {
+        size_t new_alloc = idx->alloc == 0 ? 1024 : idx->alloc * 2;
+        struct index_entry *new_entries;
+
+        if ((new_entries = realloc(idx->entries, new_alloc * sizeof(*idx->entries))) == NULL)
+            err(1, "realloc");
+        idx->entries = new_entries;
+        idx->alloc = new_alloc;
+    }
+    entry = &idx->entries[idx->num_entries++];
+    entry->offset = offset;
+    entry->linenum = linenum;
+}
+
+uint64_t
+index_num_records(const struct index *idx)
+{
+    return idx->num_records;
+}
+
+//
+// Find the closest indexed record at or before record number "recnum".
+// Returns that record's number and sets *offsetp and *linenump.
+//
+uint64_t
+index_lookup(const struct index *idx, uint64_t recnum, uint64_t *offsetp, uint64_t *linenump)
+{
+    size_t i;
+
+    if (recnum == 0 || idx->num_entries == 0) {
+        *offsetp = 0;
+        *linenump = 1;
+        return 1;
+    }
+    if ((i = (recnum - 1) / idx->interval) >= idx->num_entries)
+        i = idx->num_entries - 1;
+    *offsetp = idx->entries[i].offset;
+    *linenump = idx->entries[i].linenum;
+    return 1 + i * idx->interval;
+}
+
+//
+// Record number (starting from one) of the first record in each of "num" roughly equal
+// slices of the input. The slice boundaries fall on indexed records, so workers can seek directly.
+//
+uint64_t
+index_split(const struct index *idx, unsigned long slice, unsigned long num)
+{
+    uint64_t entry;
+
+    if (slice == 0 || idx->num_entries == 0)
+        return 1;
+    entry = (uint64_t)idx->num_entries * slice / num;
+    return 1 + entry * idx->interval;
+}
+
+void
+index_save(const struct index *idx, const char *path, int input_fd, int quote, int fsep)
+{
+    struct index_entry prev;
+    struct stat sb;
+    FILE *fp;
+    size_t i;
+
+    if (fstat(input_fd, &sb) == -1)
+        err(1, "fstat");
+    if ((fp = fopen(path, "w")) == NULL)
+        err(1, "%s", path);
+    fwrite(INDEX_MAGIC, 1, INDEX_MAGIC_LEN, fp);
+    write_varint(fp, idx->interval);
+    write_varint(fp, quote);
+    write_varint(fp, fsep);
+    write_varint(fp, sb.st_size);
+    write_varint(fp, sb.st_mtime);
+    write_varint(fp, idx->num_records);
+    write_varint(fp, idx->num_entries);
+    memset(&prev, 0, sizeof(prev));
+    for (i = 0; i < idx->num_entries; i++) {
+        write_varint(fp, idx->entries[i].offset - prev.offset);
+        write_varint(fp, idx->entries[i].linenum - prev.linenum);
+        prev = idx->entries[i];
+    }
+    if (fclose(fp) == EOF)
+        err(1, "%s", path);
+}
+
+//
+// Load an index and verify it matches the input file and parsing parameters.
+//
+struct index *
+index_load(const char *path, int input_fd, int quote, int fsep)
+{
+    char magic[INDEX_MAGIC_LEN];
+    struct index_entry prev;
+    struct index *idx;
+    struct stat sb;
+    FILE *fp;
+    size_t i;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        err(1, "%s", path);
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0)
+        errx(1, "%s: not a csvprintf index file", path);
+    idx = index_create(read_varint(fp, path));
+    if (idx->interval == 0)
+        errx(1, "%s: invalid index file", path);
+    if (read_varint(fp, path) != quote || read_varint(fp, path) != fsep)
+        errx(1, "%s: index was built with different quote or separator characters", path);
+    if (fstat(input_fd, &sb) == -1)
+        err(1, "fstat");
+    if (read_varint(fp, path) != sb.st_size || read_varint(fp, path) != sb.st_mtime)
+        errx(1, "%s: index is out of date", path);
+    idx->num_records = read_varint(fp, path);
+    idx->num_entries = idx->alloc = read_varint(fp, path);
+    if ((idx->entries = calloc(idx->num_entries, sizeof(*idx->entries))) == NULL)
+        err(1, "calloc");
+    memset(&prev, 0, sizeof(prev));
+    for (i = 0; i < idx->num_entries; i++) {
+        idx->entries[i].offset = prev.offset + read_varint(fp, path);
+        idx->entries[i].linenum = prev.linenum + read_varint(fp, path);
+        prev = idx->entries[i];
+    }
+    fclose(fp);
+    return idx;
+}
+
+static void
+write_varint(FILE *fp, uint64_t value)
+{
+    while (value >= 0x80) {
+        putc((value & 0x7f) | 0x80, fp);
+        value >>= 7;
+    }
+    putc(value, fp);
+}
+
+static uint64_t
+read_varint(FILE *fp, const char *path)
+{
+    uint64_t value = 0;
+    int shift = 0;
+    int ch;
+
+    do {
+        if ((ch = getc(fp)) == EOF || shift > 63)
+            errx(1, "%s: truncated or invalid index file", path);
+        value |= (uint64_t)(ch & 0x7f) << shift;
+        shift += 7;
+    } while ((ch & 0x80) != 0);
+    return value;
+}
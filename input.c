@@ -0,0 +1,854 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if HAVE_LIBZ
+#include <zlib.h>
+#endif
+#if HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#if HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#define INPUT_BLOCK_SIZE        (128 * 1024)
+#define INPUT_NUM_BLOCKS        8
+#define INPUT_URING_DEPTH       (INPUT_NUM_BLOCKS / 2)
+#define MAX_MAGIC_LEN           6
+
+// How often to check for rotation (or, without inotify, for new data) when following
+#define FOLLOW_POLL_MILLIS      1000
+#define FOLLOW_SLEEP_MILLIS     100
+
+struct input;
+
+// Compressed input format
+struct codec {
+    const char          *name;
+    const char          *magic;
+    size_t              magic_len;
+    void                (*decompress)(struct input *in);    // NULL if not compiled in
+};
+
+// Input state, used as the stdio cookie
+struct input {
+    const char          *path;
+    int                 fd;
+    const struct codec  *codec;                 // NULL for uncompressed input
+    void                (*reader)(struct input *in);    // helper thread function, if any
+    char                prefix[MAX_MAGIC_LEN];  // bytes consumed while sniffing
+    size_t              prefix_len;
+    size_t              prefix_off;
+    struct ring         *ring;                  // data from helper thread, if any
+    struct ring_block   *block;                 // block currently being consumed
+    size_t              block_off;
+    pthread_t           thread;
+    char                error[256];             // helper thread's error, reported by the main thread
+    int                 follow;                 // wait for more data at EOF
+    off_t               offset;                 // current offset, when following
+    dev_t               dev;                    // identity of the file being followed
+    ino_t               ino;
+    int                 ifd;                    // inotify descriptor, or -1
+    int                 wd;                     // inotify watch, or -1
+};
+
+#if HAVE_LIBZ
+static void decompress_gzip(struct input *in);
+#endif
+#if HAVE_LIBLZMA
+static void decompress_xz(struct input *in);
+#endif
+#if HAVE_LIBZSTD
+static void decompress_zstd(struct input *in);
+#endif
+static void read_plain(struct input *in);
+static void read_uring(struct input *in);
+static void *input_main(void *arg);
+static ssize_t input_read_raw(struct input *in, void *buf, size_t len);
+static ssize_t input_read_fd(struct input *in, void *buf, size_t len);
+static ssize_t input_read_follow(struct input *in, void *buf, size_t len);
+static void input_follow_open(struct input *in, int fd);
+static void input_follow_wait(struct input *in);
+static ssize_t input_cookie_read(void *cookie, char *buf, size_t len);
+#if !HAVE_FOPENCOOKIE
+static int input_cookie_read_int(void *cookie, char *buf, int len);
+#endif
+static int input_cookie_close(void *cookie);
+static int magic_match(const struct input *in, const struct codec *codec);
+static void input_fail(struct input *in, int errnum, const char *fmt, ...);
+
+static void (*input_idle)(void *arg);          // called before waiting for input
+static void *input_idle_arg;
+
+static const struct codec codecs[] = {
+#if HAVE_LIBZ
+    { "gzip",   "\x1f\x8b",                     2,  decompress_gzip },
+#else
+    { "gzip",   "\x1f\x8b",                     2,  NULL },
+#endif
+#if HAVE_LIBLZMA
+    { "xz",     "\xfd\x37\x7a\x58\x5a\x00",     6,  decompress_xz },
+#else
+    { "xz",     "\xfd\x37\x7a\x58\x5a\x00",     6,  NULL },
+#endif
+#if HAVE_LIBZSTD
+    { "zstd",   "\x28\xb5\x2f\xfd",             4,  decompress_zstd },
+#else
+    { "zstd",   "\x28\xb5\x2f\xfd",             4,  NULL },
+#endif
+};
+#define NUM_CODECS              (sizeof(codecs) / sizeof(*codecs))
+
+//
+// Open input file ("-" means standard input).
+//
+// Compressed input is detected by its magic bytes and decompressed on a helper thread
+// into a ring of blocks which the returned stream consumes. If "threaded" is set,
+// uncompressed input is also read by a helper thread, which hides read latency.
+//
+FILE *
+input_open(const char *path, int threaded)
+{
+    struct input *in;
+    struct stat sb;
+    int may_match;
+    off_t start;
+    ssize_t r;
+    FILE *fp;
+    int i;
+
+    // Open file
+    if ((in = calloc(1, sizeof(*in))) == NULL)
+        err(1, "calloc");
+    if (strcmp(path, "-") == 0) {
+        in->path = "stdin";
+        in->fd = STDIN_FILENO;
+    } else {
+        in->path = path;
+        if ((in->fd = open(path, O_RDONLY)) == -1)
+            err(1, "%s", path);
+    }
+
+    // Sniff magic bytes; stop as soon as nothing can match, so we don't stall on a slow pipe
+    start = lseek(in->fd, 0, SEEK_CUR);
+    do {
+        if ((r = input_read_fd(in, in->prefix + in->prefix_len, MAX_MAGIC_LEN - in->prefix_len)) == -1)
+            err(1, "%s", in->path);
+        if (r == 0)
+            break;
+        in->prefix_len += r;
+        for (may_match = 0, i = 0; i < NUM_CODECS && !may_match; i++)
+            may_match = magic_match(in, &codecs[i]) && in->prefix_len < codecs[i].magic_len;
+    } while (may_match);
+    for (i = 0; i < NUM_CODECS; i++) {
+        if (in->prefix_len >= codecs[i].magic_len && magic_match(in, &codecs[i])) {
+            in->codec = &codecs[i];
+            break;
+        }
+    }
+
+    // Uncompressed and seekable? Then just rewind and use plain stdio
+    if (in->codec == NULL && !threaded && start != -1 && lseek(in->fd, start, SEEK_SET) != -1) {
+        if ((fp = fdopen(in->fd, "r")) == NULL)
+            err(1, "%s", in->path);
+        free(in);
+        return fp;
+    }
+
+    // Start helper thread
+    if (in->codec != NULL) {
+        if ((in->reader = in->codec->decompress) == NULL)
+            errx(1, "%s: %s-compressed input is not supported by this build", in->path, in->codec->name);
+    } else if (threaded)
+        in->reader = fstat(in->fd, &sb) == 0 && S_ISREG(sb.st_mode) && start != -1 ? read_uring : read_plain;
+    if (in->reader != NULL) {
+        in->ring = ring_create(INPUT_NUM_BLOCKS, INPUT_BLOCK_SIZE);
+        if ((errno = pthread_create(&in->thread, NULL, input_main, in)) != 0)
+            err(1, "pthread_create");
+    }
+
+    // Wrap in a stdio stream
+#if HAVE_FOPENCOOKIE
+    {
+        cookie_io_functions_t funcs;
+
+        memset(&funcs, 0, sizeof(funcs));
+        funcs.read = input_cookie_read;
+        funcs.close = input_cookie_close;
+        if ((fp = fopencookie(in, "r", funcs)) == NULL)
+            err(1, "fopencookie");
+    }
+#else
+    if ((fp = funopen(in, input_cookie_read_int, NULL, NULL, input_cookie_close)) == NULL)
+        err(1, "funopen");
+#endif
+    return fp;
+}
+
+//
+// Configure a function to be called whenever reading would have to wait for more input.
+//
+void
+input_set_idle(void (*idle)(void *arg), void *arg)
+{
+    input_idle = idle;
+    input_idle_arg = arg;
+}
+
+//
+// Open a regular file for following: instead of returning EOF, reads block until more data is
+// appended. If the file is truncated, reading starts over from the beginning; if it's replaced
+// (e.g., by log rotation), reading continues with the new file once the old one is finished.
+//
+FILE *
+input_follow(const char *path)
+{
+    struct input *in;
+    FILE *fp;
+    int fd;
+
+    if ((in = calloc(1, sizeof(*in))) == NULL)
+        err(1, "calloc");
+    in->path = path;
+    in->follow = 1;
+    in->fd = -1;
+    in->ifd = -1;
+    in->wd = -1;
+#if HAVE_SYS_INOTIFY_H
+    if ((in->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+        err(1, "inotify_init1");
+#endif
+    if ((fd = open(path, O_RDONLY)) == -1)
+        err(1, "%s", path);
+    input_follow_open(in, fd);
+
+    // Wrap in a stdio stream
+#if HAVE_FOPENCOOKIE
+    {
+        cookie_io_functions_t funcs;
+
+        memset(&funcs, 0, sizeof(funcs));
+        funcs.read = input_cookie_read;
+        funcs.close = input_cookie_close;
+        if ((fp = fopencookie(in, "r", funcs)) == NULL)
+            err(1, "fopencookie");
+    }
+#else
+    if ((fp = funopen(in, input_cookie_read_int, NULL, NULL, input_cookie_close)) == NULL)
+        err(1, "funopen");
+#endif
+    return fp;
+}
+
+// Start following the given file
+static void
+input_follow_open(struct input *in, int fd)
+{
+    struct stat sb;
+
+    if (fstat(fd, &sb) == -1)
+        err(1, "%s", in->path);
+    if (!S_ISREG(sb.st_mode))
+        errx(1, "%s: following requires a regular file", in->path);
+    if (in->fd != -1)
+        (void)close(in->fd);
+    in->fd = fd;
+    in->dev = sb.st_dev;
+    in->ino = sb.st_ino;
+    in->offset = 0;
+#if HAVE_SYS_INOTIFY_H
+    if (in->wd != -1)
+        (void)inotify_rm_watch(in->ifd, in->wd);
+    if ((in->wd = inotify_add_watch(in->ifd, in->path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)) == -1)
+        err(1, "%s: inotify_add_watch", in->path);
+#endif
+}
+
+// Read from a followed file, waiting at EOF until there's something to read
+static ssize_t
+input_read_follow(struct input *in, void *buf, size_t len)
+{
+    struct stat sb;
+    ssize_t r;
+    int fd;
+
+    while (1) {
+        if ((r = input_read_fd(in, buf, len)) == -1)
+            err(1, "%s", in->path);
+        if (r > 0) {
+            in->offset += r;
+            return r;
+        }
+
+        // Truncated? Then start over
+        if (fstat(in->fd, &sb) == -1)
+            err(1, "%s", in->path);
+        if (sb.st_size < in->offset) {
+            if (lseek(in->fd, 0, SEEK_SET) == -1)
+                err(1, "%s", in->path);
+            in->offset = 0;
+            continue;
+        }
+
+        // Replaced with a different file? We've read all of the old one, so switch over
+        if (stat(in->path, &sb) == 0
+          && (sb.st_dev != in->dev || sb.st_ino != in->ino)
+          && (fd = open(in->path, O_RDONLY)) != -1) {
+            input_follow_open(in, fd);
+            continue;
+        }
+
+        // Wait for something to happen
+        input_follow_wait(in);
+    }
+}
+
+// Wait until the followed file (probably) changes
+static void
+input_follow_wait(struct input *in)
+{
+    int phase;
+#if HAVE_SYS_INOTIFY_H
+    char events[4096];
+    struct pollfd pfd;
+#endif
+
+    if (input_idle != NULL)
+        (*input_idle)(input_idle_arg);
+    phase = stats_phase(STATS_INPUT_WAIT);
+#if HAVE_SYS_INOTIFY_H
+
+    // Wait for an event, but not forever, because a replacement file only shows up as a new name
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = in->ifd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, FOLLOW_POLL_MILLIS) == -1 && errno != EINTR)
+        err(1, "poll");
+
+    // Discard the events; we just look at the file again
+    while (read(in->ifd, events, sizeof(events)) > 0)
+        ;
+#else
+    (void)poll(NULL, 0, FOLLOW_SLEEP_MILLIS);
+#endif
+    stats_phase(phase);
+}
+
+static int
+magic_match(const struct input *in, const struct codec *codec)
+{
+    size_t len = in->prefix_len < codec->magic_len ? in->prefix_len : codec->magic_len;
+
+    return memcmp(in->prefix, codec->magic, len) == 0;
+}
+
+// Helper thread entry point
+static void *
+input_main(void *arg)
+{
+    struct input *const in = arg;
+
+    (*in->reader)(in);
+    ring_close(in->ring);
+    return NULL;
+}
+
+// Read uncompressed input; blocks are handed off as soon as each read(2) returns
+static void
+read_plain(struct input *in)
+{
+    struct ring_block *block;
+    ssize_t r;
+
+    while ((block = ring_get_free(in->ring)) != NULL) {
+        if ((r = input_read_raw(in, block->buf, block->size)) == -1) {
+            input_fail(in, errno, "%s", in->path);
+            return;
+        }
+        block->len = r;
+        ring_put_full(in->ring, block);
+        if (block->len == 0)
+            break;
+    }
+}
+
+//
+// Read a regular file using io_uring(7), keeping several reads outstanding at once.
+//
+// Each block is read at its own file offset, so the kernel can work on all of them in parallel;
+// they're handed off in file order as they finish. A read that comes up short is continued;
+// one that returns nothing means we've reached the end of the file.
+//
+static void
+read_uring(struct input *in)
+{
+    struct {
+        struct ring_block   *block;
+        uint64_t            offset;
+        size_t              done;
+        int                 busy;
+    } slots[INPUT_URING_DEPTH];
+    struct ring_block *block;
+    struct uring *u;
+    unsigned int head = 0;
+    unsigned int count = 0;
+    unsigned int tag;
+    uint64_t offset;
+    off_t pos;
+    int eof = 0;
+    int r;
+
+    // Fall back to read(2) if io_uring is not enabled or not available
+    if ((u = uring_create(INPUT_URING_DEPTH)) == NULL) {
+        read_plain(in);
+        return;
+    }
+
+    // Re-read the sniffed bytes from the file itself
+    if ((pos = lseek(in->fd, 0, SEEK_CUR)) == -1) {
+        input_fail(in, errno, "%s", in->path);
+        goto done;
+    }
+    offset = pos - in->prefix_len;
+    in->prefix_off = in->prefix_len;
+
+    // Keep reads outstanding until we reach the end of the file
+    while (!eof || count > 0) {
+
+        // Start reading into as many blocks as we can
+        while (!eof && count < INPUT_URING_DEPTH) {
+            if ((block = ring_get_free(in->ring)) == NULL)
+                goto abort;
+            tag = (head + count++) % INPUT_URING_DEPTH;
+            slots[tag].block = block;
+            slots[tag].offset = offset;
+            slots[tag].done = 0;
+            slots[tag].busy = 1;
+            uring_read(u, in->fd, block->buf, block->size, offset, tag);
+            offset += block->size;
+        }
+        uring_submit(u);
+
+        // Hand off the next block once it's finished; anything after a short block is past EOF
+        if (!slots[head].busy) {
+            block = slots[head].block;
+            block->len = eof ? 0 : slots[head].done;
+            eof |= block->len < block->size;
+            ring_put_full(in->ring, block);
+            head = (head + 1) % INPUT_URING_DEPTH;
+            count--;
+            continue;
+        }
+
+        // Wait for a read to finish; retry or continue it if it came up short
+        if ((r = uring_wait(u, &tag)) < 0 && r != -EINTR && r != -EAGAIN) {
+            input_fail(in, -r, "%s", in->path);
+            slots[tag].busy = 0;
+            goto abort;
+        }
+        block = slots[tag].block;
+        if (r > 0)
+            slots[tag].done += r;
+        if (r != 0 && slots[tag].done < block->size) {
+            uring_read(u, in->fd, block->buf + slots[tag].done,
+              block->size - slots[tag].done, slots[tag].offset + slots[tag].done, tag);
+            continue;
+        }
+        slots[tag].busy = 0;
+    }
+    goto done;
+
+abort:
+    // Let any outstanding reads finish before their blocks go away
+    while (count-- > 0) {
+        if (slots[(head + count) % INPUT_URING_DEPTH].busy)
+            (void)uring_wait(u, &tag);
+    }
+done:
+    uring_destroy(u);
+}
+
+#if HAVE_LIBZ
+static void
+decompress_gzip(struct input *in)
+{
+    struct ring_block *block = NULL;
+    unsigned char *ibuf;
+    int in_member = 0;
+    int full = 0;
+    z_stream z;
+    ssize_t r;
+    int zr;
+
+    if ((ibuf = malloc(INPUT_BLOCK_SIZE)) == NULL) {
+        input_fail(in, errno, "malloc");
+        return;
+    }
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 32) != Z_OK) {                   // 15 + 32 means auto-detect gzip or zlib header
+        input_fail(in, 0, "%s: gzip: %s", in->path, "can't initialize decompressor");
+        goto done;
+    }
+    while (1) {
+
+        // Get more input, unless the decompressor still has output pending
+        if (z.avail_in == 0 && !full) {
+            if ((r = input_read_raw(in, ibuf, INPUT_BLOCK_SIZE)) == -1) {
+                input_fail(in, errno, "%s", in->path);
+                goto done;
+            }
+            if (r == 0)
+                break;
+            z.next_in = ibuf;
+            z.avail_in = r;
+        }
+
+        // Get output block
+        if (block == NULL && (block = ring_get_free(in->ring)) == NULL)
+            goto done;
+
+        // Decompress
+        z.next_out = (unsigned char *)block->buf + block->len;
+        z.avail_out = block->size - block->len;
+        if (z.avail_in > 0)
+            in_member = 1;
+        zr = inflate(&z, Z_NO_FLUSH);
+        block->len = block->size - z.avail_out;
+        switch (zr) {
+        case Z_STREAM_END:                                      // handle concatenated gzip members
+            if (inflateReset(&z) != Z_OK) {
+                input_fail(in, 0, "%s: gzip: %s", in->path, "can't reset decompressor");
+                goto done;
+            }
+            in_member = 0;
+            break;
+        case Z_OK:
+        case Z_BUF_ERROR:
+            break;
+        default:
+            input_fail(in, 0, "%s: gzip: %s", in->path, z.msg != NULL ? z.msg : "decompression error");
+            goto done;
+        }
+
+        // Hand off full blocks
+        if ((full = block->len == block->size)) {
+            ring_put_full(in->ring, block);
+            block = NULL;
+        }
+    }
+    if (in_member) {
+        input_fail(in, 0, "%s: gzip: %s", in->path, "truncated input");
+        goto done;
+    }
+    if (block != NULL)
+        ring_put_full(in->ring, block);
+done:
+    inflateEnd(&z);
+    free(ibuf);
+}
+#endif
+
+#if HAVE_LIBLZMA
+static void
+decompress_xz(struct input *in)
+{
+    lzma_stream s = LZMA_STREAM_INIT;
+    struct ring_block *block = NULL;
+    lzma_action action = LZMA_RUN;
+    unsigned char *ibuf;
+    lzma_ret lr;
+    ssize_t r;
+
+    if ((ibuf = malloc(INPUT_BLOCK_SIZE)) == NULL) {
+        input_fail(in, errno, "malloc");
+        return;
+    }
+    if (lzma_stream_decoder(&s, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+        input_fail(in, 0, "%s: xz: %s", in->path, "can't initialize decompressor");
+        goto done;
+    }
+    while (1) {
+
+        // Get more input
+        if (s.avail_in == 0 && action == LZMA_RUN) {
+            if ((r = input_read_raw(in, ibuf, INPUT_BLOCK_SIZE)) == -1) {
+                input_fail(in, errno, "%s", in->path);
+                goto done;
+            }
+            if (r == 0)
+                action = LZMA_FINISH;
+            s.next_in = ibuf;
+            s.avail_in = r;
+        }
+
+        // Get output block
+        if (block == NULL && (block = ring_get_free(in->ring)) == NULL)
+            goto done;
+
+        // Decompress
+        s.next_out = (unsigned char *)block->buf + block->len;
+        s.avail_out = block->size - block->len;
+        lr = lzma_code(&s, action);
+        block->len = block->size - s.avail_out;
+        if (block->len == block->size) {
+            ring_put_full(in->ring, block);
+            block = NULL;
+        }
+        switch (lr) {
+        case LZMA_OK:
+            continue;
+        case LZMA_STREAM_END:
+            break;
+        case LZMA_BUF_ERROR:
+            input_fail(in, 0, "%s: xz: %s", in->path, "truncated input");
+            goto done;
+        case LZMA_MEM_ERROR:
+            input_fail(in, 0, "%s: xz: %s", in->path, "out of memory");
+            goto done;
+        case LZMA_FORMAT_ERROR:
+        case LZMA_DATA_ERROR:
+        default:
+            input_fail(in, 0, "%s: xz: %s", in->path, "corrupt input");
+            goto done;
+        }
+        break;
+    }
+    if (block != NULL)
+        ring_put_full(in->ring, block);
+done:
+    lzma_end(&s);
+    free(ibuf);
+}
+#endif
+
+#if HAVE_LIBZSTD
+static void
+decompress_zstd(struct input *in)
+{
+    struct ring_block *block = NULL;
+    ZSTD_DStream *zs;
+    ZSTD_inBuffer zin;
+    ZSTD_outBuffer zout;
+    size_t zr = 0;
+    void *ibuf;
+    int full = 0;
+    ssize_t r;
+
+    if ((ibuf = malloc(INPUT_BLOCK_SIZE)) == NULL) {
+        input_fail(in, errno, "malloc");
+        return;
+    }
+    zin.src = ibuf;
+    zin.size = 0;
+    zin.pos = 0;
+    if ((zs = ZSTD_createDStream()) == NULL || ZSTD_isError(ZSTD_initDStream(zs))) {
+        input_fail(in, 0, "%s: zstd: %s", in->path, "can't initialize decompressor");
+        goto done;
+    }
+    while (1) {
+
+        // Get more input, unless the decompressor still has output pending
+        if (zin.pos == zin.size && !full) {
+            if ((r = input_read_raw(in, ibuf, INPUT_BLOCK_SIZE)) == -1) {
+                input_fail(in, errno, "%s", in->path);
+                goto done;
+            }
+            if (r == 0)
+                break;
+            zin.size = r;
+            zin.pos = 0;
+        }
+
+        // Get output block
+        if (block == NULL && (block = ring_get_free(in->ring)) == NULL)
+            goto done;
+
+        // Decompress (this handles concatenated frames automatically)
+        zout.dst = block->buf;
+        zout.size = block->size;
+        zout.pos = block->len;
+        if (ZSTD_isError(zr = ZSTD_decompressStream(zs, &zout, &zin))) {
+            input_fail(in, 0, "%s: zstd: %s", in->path, ZSTD_getErrorName(zr));
+            goto done;
+        }
+        block->len = zout.pos;
+
+        // Hand off full blocks
+        if ((full = block->len == block->size)) {
+            ring_put_full(in->ring, block);
+            block = NULL;
+        }
+    }
+    if (zr != 0) {
+        input_fail(in, 0, "%s: zstd: %s", in->path, "truncated input");
+        goto done;
+    }
+    if (block != NULL)
+        ring_put_full(in->ring, block);
+done:
+    ZSTD_freeDStream(zs);
+    free(ibuf);
+}
+#endif
+
+// Read raw input, starting with any bytes consumed while sniffing
+static ssize_t
+input_read_raw(struct input *in, void *buf, size_t len)
+{
+    ssize_t r;
+
+    if (in->prefix_off < in->prefix_len) {
+        r = in->prefix_len - in->prefix_off < len ? in->prefix_len - in->prefix_off : len;
+        memcpy(buf, in->prefix + in->prefix_off, r);
+        in->prefix_off += r;
+        return r;
+    }
+    return input_read_fd(in, buf, len);
+}
+
+// Read from the file descriptor; returns -1 with errno set on error
+static ssize_t
+input_read_fd(struct input *in, void *buf, size_t len)
+{
+    ssize_t r;
+
+    while ((r = read(in->fd, buf, len)) == -1 && errno == EINTR)
+        ;
+    return r;
+}
+
+static ssize_t
+input_cookie_read(void *cookie, char *buf, size_t len)
+{
+    struct input *const in = cookie;
+    size_t num;
+    ssize_t r;
+    int phase;
+
+    // Following a file?
+    if (in->follow)
+        return input_read_follow(in, buf, len);
+
+    // No helper thread?
+    if (in->ring == NULL) {
+        if (input_idle != NULL && in->prefix_off == in->prefix_len) {
+            struct pollfd pfd;
+
+            memset(&pfd, 0, sizeof(pfd));
+            pfd.fd = in->fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 0) == 0)
+                (*input_idle)(input_idle_arg);
+        }
+        if ((r = input_read_raw(in, buf, len)) == -1)
+            err(1, "%s", in->path);
+        return r;
+    }
+
+    // Get the next non-empty block from the helper thread
+    while (in->block == NULL || in->block_off == in->block->len) {
+        if (in->block != NULL) {
+            ring_put_free(in->ring, in->block);
+            in->block = NULL;
+        }
+        if (input_idle != NULL && !ring_has_full(in->ring))
+            (*input_idle)(input_idle_arg);
+        phase = stats_phase(STATS_INPUT_WAIT);
+        in->block = ring_get_full(in->ring);
+        stats_phase(phase);
+        if (in->block == NULL) {
+            if (*in->error != '\0')
+                errx(1, "%s", in->error);
+            return 0;
+        }
+        in->block_off = 0;
+    }
+
+    // Copy out data
+    num = in->block->len - in->block_off < len ? in->block->len - in->block_off : len;
+    memcpy(buf, in->block->buf + in->block_off, num);
+    in->block_off += num;
+    return num;
+}
+
+#if !HAVE_FOPENCOOKIE
+static int
+input_cookie_read_int(void *cookie, char *buf, int len)
+{
+    return (int)input_cookie_read(cookie, buf, len);
+}
+#endif
+
+static int
+input_cookie_close(void *cookie)
+{
+    struct input *const in = cookie;
+
+    if (in->ring != NULL) {
+        ring_abort(in->ring);
+        if (in->block != NULL)
+            ring_put_free(in->ring, in->block);
+        if ((errno = pthread_join(in->thread, NULL)) != 0)
+            err(1, "pthread_join");
+        ring_destroy(in->ring);
+    }
+    if (in->fd != STDIN_FILENO)
+        (void)close(in->fd);
+    if (in->ifd != -1 && in->follow)
+        (void)close(in->ifd);
+    free(in);
+    return 0;
+}
+
+//
+// Record an error in the helper thread, like err(3) if "errnum" is not zero and errx(3) otherwise.
+//
+// The helper thread must not exit the process itself, because the main thread could be in the middle
+// of writing output. Instead, it stops, and the main thread reports the error once it has consumed
+// everything the helper thread handed off before the error.
+//
+static void
+input_fail(struct input *in, int errnum, const char *fmt, ...)
+{
+    va_list args;
+    size_t len;
+
+    va_start(args, fmt);
+    vsnprintf(in->error, sizeof(in->error), fmt, args);
+    va_end(args);
+    if (errnum != 0 && (len = strlen(in->error)) < sizeof(in->error))
+        snprintf(in->error + len, sizeof(in->error) - len, ": %s", strerror(errnum));
+}
@@ -0,0 +1,228 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JOIN_MIN_SLOTS          1024
+
+//
+// Hash join against a lookup table.
+//
+// The lookup file is loaded once into an open-addressing hash table keyed on its join column,
+// with each record's remaining fields copied into an arena. Each main input record's join
+// column is then looked up, and the matching lookup fields are appended to the record.
+// If the lookup file contains duplicate keys, the first record wins.
+//
+
+struct join_entry {
+    uint64_t            hash;
+    const char          *key;               // NULL if slot is empty
+    char                **fields;           // lookup fields, not including the key
+    size_t              num;
+};
+
+struct join {
+    char                *main_spec;         // main input join column
+    char                *lookup_spec;       // lookup file join column
+    size_t              main_col;
+    size_t              lookup_col;
+    int                 left;               // left join (keep records with no match)
+    char                **names;            // lookup column names, not including the key
+    size_t              num_names;
+    size_t              num_columns;        // number of lookup columns appended to each record
+    struct join_entry   *slots;
+    size_t              num_slots;
+    size_t              num_entries;
+    struct arena        *arena;
+};
+
+static void join_grow(struct join *j);
+
+//
+// Create a join; "on" is "col" if both files use the same column, or "maincol=lookupcol".
+//
+struct join *
+join_create(const char *on, int left)
+{
+    const char *const equals = strchr(on, '=');
+    struct join *j;
+
+    if ((j = calloc(1, sizeof(*j))) == NULL)
+        err(1, "calloc");
+    if (equals != NULL) {
+        j->main_spec = strndup(on, equals - on);
+        j->lookup_spec = strdup(equals + 1);
+    } else {
+        j->main_spec = strdup(on);
+        j->lookup_spec = strdup(on);
+    }
+    if (j->main_spec == NULL || j->lookup_spec == NULL)
+        err(1, "strdup");
+    if (*j->main_spec == '\0' || *j->lookup_spec == '\0')
+        errx(1, "invalid argument to \"--%s\"", "on");
+    j->left = left;
+    j->num_slots = JOIN_MIN_SLOTS;
+    if ((j->slots = calloc(j->num_slots, sizeof(*j->slots))) == NULL)
+        err(1, "calloc");
+    j->arena = arena_create();
+    return j;
+}
+
+// Resolve the lookup file's join column, given its column names (or NULL if it has no header row)
+void
+join_load_names(struct join *j, char *const *names, size_t num_names)
+{
+    size_t i;
+
+    j->lookup_col = find_column(j->lookup_spec, names, num_names);
+    if (names == NULL)
+        return;
+    if (j->lookup_col >= num_names)
+        errx(1, "column \"%s\" not found in lookup file", j->lookup_spec);
+    if ((j->names = calloc(num_names, sizeof(*j->names))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < num_names; i++) {
+        if (i != j->lookup_col && (j->names[j->num_names++] = strdup(names[i])) == NULL)
+            err(1, "strdup");
+    }
+    j->num_columns = j->num_names;
+}
+
+// Add a lookup file record
+void
+join_load(struct join *j, char *const *fields, size_t num)
+{
+    struct join_entry *entry;
+    const char *key;
+    uint64_t hash;
+    size_t slot;
+    size_t len;
+    size_t i;
+
+    // Find slot; first record wins
+    key = j->lookup_col < num ? fields[j->lookup_col] : "";
+    hash = hash_bytes(key, strlen(key));
+    for (slot = hash & (j->num_slots - 1); (entry = &j->slots[slot])->key != NULL; slot = (slot + 1) & (j->num_slots - 1)) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0)
+            return;
+    }
+
+    // Copy record into the arena
+    len = strlen(key) + 1;
+    entry->hash = hash;
+    entry->key = memcpy(arena_alloc(j->arena, len), key, len);
+    entry->fields = arena_alloc(j->arena, (num > 0 ? num : 1) * sizeof(*entry->fields));
+    entry->num = 0;
+    for (i = 0; i < num; i++) {
+        if (i == j->lookup_col)
+            continue;
+        len = strlen(fields[i]) + 1;
+        entry->fields[entry->num++] = memcpy(arena_alloc(j->arena, len), fields[i], len);
+    }
+    if (j->names == NULL && entry->num > j->num_columns)
+        j->num_columns = entry->num;
+    if (++j->num_entries * 4 > j->num_slots * 3)
+        join_grow(j);
+}
+
+// Resolve the main input's join column
+void
+join_resolve(struct join *j, char *const *names, size_t num_names)
+{
+    j->main_col = find_column(j->main_spec, names, num_names);
+}
+
+void
+join_column_names(const struct join *j, char *const **namesp, size_t *nump)
+{
+    *namesp = j->names;
+    *nump = j->num_names;
+}
+
+size_t
+join_num_columns(const struct join *j)
+{
+    return j->num_columns;
+}
+
+int
+join_is_left(const struct join *j)
+{
+    return j->left;
+}
+
+//
+// Find the lookup record matching a main input record. Returns zero if there is none.
+//
+int
+join_lookup(const struct join *j, char *const *fields, size_t num, char *const **matchp, size_t *nump)
+{
+    const char *const key = j->main_col < num ? fields[j->main_col] : "";
+    const uint64_t hash = hash_bytes(key, strlen(key));
+    const struct join_entry *entry;
+    size_t slot;
+
+    for (slot = hash & (j->num_slots - 1); (entry = &j->slots[slot])->key != NULL; slot = (slot + 1) & (j->num_slots - 1)) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            *matchp = entry->fields;
+            *nump = entry->num;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+join_free(struct join *j)
+{
+    size_t i;
+
+    for (i = 0; i < j->num_names; i++)
+        free(j->names[i]);
+    free(j->names);
+    free(j->main_spec);
+    free(j->lookup_spec);
+    free(j->slots);
+    arena_destroy(j->arena);
+    free(j);
+}
+
+static void
+join_grow(struct join *j)
+{
+    struct join_entry *const old = j->slots;
+    const size_t num_old = j->num_slots;
+    size_t slot;
+    size_t i;
+
+    j->num_slots *= 2;
+    if ((j->slots = calloc(j->num_slots, sizeof(*j->slots))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < num_old; i++) {
+        if (old[i].key == NULL)
+            continue;
+        for (slot = old[i].hash & (j->num_slots - 1); j->slots[slot].key != NULL; slot = (slot + 1) & (j->num_slots - 1))
+            ;
+        j->slots[slot] = old[i];
+    }
+    free(old);
+}
@@ -0,0 +1,185 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// A set of keys (one per line in a file) laid out for fast membership tests.
+//
+// All the keys live in one buffer. The set itself is a sorted array of key pointers stored in
+// Eytzinger (BFS) order, where the children of element k are at 2k and 2k+1; a binary search
+// then walks forward through memory, the top levels of the tree share a few cache lines, and
+// the next levels can be prefetched. Next to each pointer we keep the key's first eight bytes,
+// packed big-endian, so most comparisons don't need to touch the key itself. That's sixteen
+// bytes per key plus the key bytes, much less than a general-purpose hash table.
+//
+
+struct keyset {
+    char                *buf;               // all the keys, NUL-terminated
+    const char          **keys;             // keys[1..num] in Eytzinger order
+    uint64_t            *prefixes;          // first eight bytes of each key
+    size_t              num;
+};
+
+static size_t keyset_build(struct keyset *ks, const char **sorted, size_t i, size_t k);
+static uint64_t keyset_prefix(const char *key);
+static int keyset_cmp(const void *ptr1, const void *ptr2);
+
+struct keyset *
+keyset_load(const char *path)
+{
+    struct keyset *ks;
+    const char **sorted;
+    size_t *offsets = NULL;
+    size_t alloc_offsets = 0;
+    size_t num_offsets = 0;
+    size_t buflen = 0;
+    size_t bufalloc = 0;
+    char *line = NULL;
+    size_t linealloc = 0;
+    ssize_t len;
+    size_t i;
+    size_t j;
+    FILE *fp;
+
+    if ((ks = calloc(1, sizeof(*ks))) == NULL)
+        err(1, "calloc");
+
+    // Read keys into one buffer, ignoring line terminators
+    fp = input_open(path, 0);
+    while ((len = getline(&line, &linealloc, fp)) != -1) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len > 0 && line[len - 1] == '\r')
+            line[--len] = '\0';
+        if (buflen + len + 1 > bufalloc) {
+            bufalloc = (buflen + len + 1) * 2;
+            if ((ks->buf = realloc(ks->buf, bufalloc)) == NULL)
+                err(1, "realloc");
+        }
+        if (num_offsets == alloc_offsets) {
+            alloc_offsets = alloc_offsets > 0 ? alloc_offsets * 2 : 1024;
+            if ((offsets = realloc(offsets, alloc_offsets * sizeof(*offsets))) == NULL)
+                err(1, "realloc");
+        }
+        memcpy(ks->buf + buflen, line, len + 1);
+        offsets[num_offsets++] = buflen;
+        buflen += len + 1;
+    }
+    if (ferror(fp))
+        err(1, "%s", path);
+    fclose(fp);
+    free(line);
+    if (buflen < bufalloc && (ks->buf = realloc(ks->buf, buflen > 0 ? buflen : 1)) == NULL)
+        err(1, "realloc");
+
+    // Sort and remove duplicates
+    if ((sorted = malloc((num_offsets > 0 ? num_offsets : 1) * sizeof(*sorted))) == NULL)
+        err(1, "malloc");
+    for (i = 0; i < num_offsets; i++)
+        sorted[i] = ks->buf + offsets[i];
+    free(offsets);
+    qsort(sorted, num_offsets, sizeof(*sorted), keyset_cmp);
+    for (i = j = 0; i < num_offsets; i++) {
+        if (j == 0 || strcmp(sorted[i], sorted[j - 1]) != 0)
+            sorted[j++] = sorted[i];
+    }
+    ks->num = j;
+
+    // Build Eytzinger layout
+    if ((ks->keys = malloc((ks->num + 1) * sizeof(*ks->keys))) == NULL)
+        err(1, "malloc");
+    if ((ks->prefixes = malloc((ks->num + 1) * sizeof(*ks->prefixes))) == NULL)
+        err(1, "malloc");
+    keyset_build(ks, sorted, 0, 1);
+    free(sorted);
+    return ks;
+}
+
+int
+keyset_contains(const struct keyset *ks, const char *key)
+{
+    const uint64_t prefix = keyset_prefix(key);
+    size_t k = 1;
+    int diff;
+
+    while (k <= ks->num) {
+#ifdef __GNUC__
+        if (k * 8 <= ks->num)
+            __builtin_prefetch(&ks->prefixes[k * 8]);     // great-grandchildren
+#endif
+        if (prefix != ks->prefixes[k])
+            diff = prefix < ks->prefixes[k] ? -1 : 1;
+        else if ((prefix & 0xff) == 0)         // both keys end within the prefix
+            return 1;
+        else if ((diff = strcmp(key + 8, ks->keys[k] + 8)) == 0)
+            return 1;
+        k = 2 * k + (diff > 0);
+    }
+    return 0;
+}
+
+void
+keyset_free(struct keyset *ks)
+{
+    free(ks->buf);
+    free(ks->keys);
+    free(ks->prefixes);
+    free(ks);
+}
+
+// In-order traversal of the implicit tree, filling in sorted keys; returns the next sorted index
+static size_t
+keyset_build(struct keyset *ks, const char **sorted, size_t i, size_t k)
+{
+    if (k > ks->num)
+        return i;
+    i = keyset_build(ks, sorted, i, 2 * k);
+    ks->keys[k] = sorted[i];
+    ks->prefixes[k] = keyset_prefix(sorted[i]);
+    i++;
+    return keyset_build(ks, sorted, i, 2 * k + 1);
+}
+
+// Pack the first eight bytes (zero padded) so integer order matches strcmp() order
+static uint64_t
+keyset_prefix(const char *key)
+{
+    uint64_t prefix = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        prefix <<= 8;
+        if (*key != '\0')
+            prefix |= (unsigned char)*key++;
+    }
+    return prefix;
+}
+
+static int
+keyset_cmp(const void *ptr1, const void *ptr2)
+{
+    const char *const key1 = *(const char *const *)ptr1;
+    const char *const key2 = *(const char *const *)ptr2;
+
+    return strcmp(key1, key2);
+}
@@ -0,0 +1,99 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+
+//
+// libcsvprintf - CSV parsing and XML/JSON/bash/raw record formatting
+//
+// Parsers and emitters hold all of their own state, so any number of them may be used at once.
+// Nothing here exits: functions that can fail return -1 (or NULL, or (size_t)-1 for csv_emitter_format()),
+// and csv_parser_error() and csv_emitter_error() describe what went wrong. After a parse error,
+// the parser may only be freed.
+//
+
+#ifndef LIBCSVPRINTF_H
+#define LIBCSVPRINTF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Emitter output formats
+#define CSV_EMIT_XML            1
+#define CSV_EMIT_JSON           2
+#define CSV_EMIT_BASH           3
+#define CSV_EMIT_RAW            4           // fields terminated by NUL, unescaped
+
+// Emitter compact output flags (XML and JSON only)
+#define CSV_COMPACT             0x01        // no XML indentation; JSON column names once, then arrays
+#define CSV_COMPACT_SHORT_TAGS  0x02        // XML tags "r" and "c1", "c2", etc.
+
+struct csv_parser;
+struct csv_emitter;
+
+// One parsed record; the fields belong to the parser and are valid until the next call to csv_parser_next()
+struct csv_record {
+    char        **fields;
+    size_t      num;
+    int         linenum;                // line number where the record starts
+    uint64_t    offset;                 // byte offset where the record starts
+};
+
+// Parser
+extern struct csv_parser *csv_parser_create(FILE *fp, int quote, int fsep);
+extern int csv_parser_next(struct csv_parser *p, struct csv_record *rec);
+extern int csv_parser_seek(struct csv_parser *p, uint64_t offset, int linenum);
+extern uint64_t csv_parser_offset(const struct csv_parser *p);
+extern int csv_parser_linenum(const struct csv_parser *p);
+extern uint64_t csv_parser_allocations(const struct csv_parser *p);
+extern const char *csv_parser_error(const struct csv_parser *p);
+extern void csv_parser_set_max_field(struct csv_parser *p, size_t max);
+extern void csv_parser_set_chunk(struct csv_parser *p, size_t size,
+    void (*chunk)(void *arg, char *const *fields, size_t col, const char *data, size_t len), void *arg);
+extern void csv_parser_free(struct csv_parser *p);
+
+// Emitter
+extern struct csv_emitter *csv_emitter_create(int format, int use_names, const char *encoding);
+extern int csv_emitter_set_names(struct csv_emitter *e, char *const *names, size_t num_names,
+    const char *prefix, char *const *allowed, size_t num_allowed);
+extern void csv_emitter_set_terminator(struct csv_emitter *e, int terminator);
+extern void csv_emitter_set_compact(struct csv_emitter *e, int flags);
+extern char *csv_emitter_to_utf8(struct csv_emitter *e, const char *string, int linenum);
+extern void csv_emitter_begin(struct csv_emitter *e, FILE *out);
+extern int csv_emitter_write(struct csv_emitter *e, FILE *out, char *const *fields, size_t num, int linenum);
+extern char *const *csv_emitter_convert(struct csv_emitter *e, char *const *fields, size_t num, int linenum);
+extern void csv_emitter_write_utf8(struct csv_emitter *e, FILE *out, char *const *fields, size_t num, int linenum);
+extern int csv_emitter_begin_record(struct csv_emitter *e, FILE *out);
+extern int csv_emitter_begin_field(struct csv_emitter *e, FILE *out, size_t col, int linenum);
+extern int csv_emitter_field_data(struct csv_emitter *e, FILE *out, const char *data, size_t len, int linenum);
+extern int csv_emitter_end_field(struct csv_emitter *e, FILE *out, int linenum);
+extern void csv_emitter_end_record(struct csv_emitter *e, FILE *out);
+extern size_t csv_emitter_format(struct csv_emitter *e, char *buf, size_t size,
+    char *const *fields, size_t num, int linenum);
+extern void csv_emitter_end(struct csv_emitter *e, FILE *out);
+extern const char *csv_emitter_error(const struct csv_emitter *e);
+extern void csv_emitter_free(struct csv_emitter *e);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* LIBCSVPRINTF_H */
@@ -17,86 +17,261 @@
 
 #include "csvprintf.h"
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <assert.h>
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
-#include <iconv.h>
+#include <getopt.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define DEFAULT_QUOTE_CHAR      '"'
 #define DEFAULT_FSEP_CHAR       ','
-#define XML_OUTPUT_ENCODING     "UTF-8"
 
 #define MODE_NORMAL             0           // normal mode
 #define MODE_XML_PLAIN          1           // plain XML mode
 #define MODE_XML_NAMES          2           // XML mode with names
 #define MODE_JSON               3           // JSON mode
 #define MODE_BASH               4           // bash mode
-
-struct col {
-    char    *buf;
-    size_t  len;
-    size_t  alloc;
-};
-
+#define MODE_INDEX              5           // build index mode
+#define MODE_SPLITS             6           // print index split points mode
+#define MODE_SQLITE             7           // SQLite output mode
+#define MODE_RAW                8           // NUL-terminated raw fields mode
+#define MODE_CHECK              9           // validate input mode
+#define MODE_COUNT              10          // count records mode
+#define MODE_OUTS               11          // output only to "--out" files
+
+#define FLUSH_DEFAULT           0           // stdio's usual buffering
+#define FLUSH_RECORD            1           // flush after every record
+#define FLUSH_SIZE              2           // flush when the buffer is full
+#define FLUSH_TIME              3           // flush within a time limit
+#define FLUSH_AUTO              4           // large buffer, but flush within a time limit
+
+#define FLUSH_AUTO_BUFFER_SIZE  (1024 * 1024)
+#define FLUSH_AUTO_MILLIS       100
+
+#define DEFAULT_INDEX_INTERVAL  4096
+#define CHECKPOINT_MILLIS       10000       // how often to save a checkpoint
+#define CHECKPOINT_RECORDS      1024        // how often to check the time for a checkpoint
+#define DEFAULT_SQLITE_TABLE    "csv"
+#define DEFAULT_TRANSACTION_SIZE 10000
+#define DEFAULT_MEMORY_LIMIT    ((size_t)256 * 1024 * 1024)
+#define STREAM_CHUNK_SIZE       (64 * 1024) // output bigger fields a piece at a time
+#define OUT_BUFFER_SIZE         (1024 * 1024) // stdio buffer for each "--out" file
+
+// Long options without a short equivalent
+#define OPT_COMPRESS            256
+#define OPT_PIPELINE            257
+#define OPT_BUILD_INDEX         258
+#define OPT_INDEX               259
+#define OPT_INDEX_INTERVAL      260
+#define OPT_RANGE               261
+#define OPT_SPLITS              262
+#define OPT_LIMIT               263
+#define OPT_SAMPLE              264
+#define OPT_SEED                265
+#define OPT_EVERY               266
+#define OPT_GROUP_BY            267
+#define OPT_AGG                 268
+#define OPT_MEMORY_LIMIT        269
+#define OPT_SORT_BY             270
+#define OPT_UNIQUE              271
+#define OPT_UNIQUE_BY           272
+#define OPT_UNIQUE_APPROX       273
+#define OPT_JOIN                274
+#define OPT_ON                  275
+#define OPT_JOIN_TYPE           276
+#define OPT_KEEP_KEYS           277
+#define OPT_DROP_KEYS           278
+#define OPT_KEY                 279
+#define OPT_PROFILE             280
+#define OPT_STATS               281
+#define OPT_PROGRESS            282
+#define OPT_FOLLOW              283
+#define OPT_FLUSH               284
+#define OPT_CHECKPOINT          285
+#define OPT_RESUME              286
+#define OPT_SQLITE              287
+#define OPT_TABLE               288
+#define OPT_TRANSACTION_SIZE    289
+#define OPT_BULK_LOAD           290
+#define OPT_RECORD_TERMINATOR   291
+#define OPT_MAX_FIELD_SIZE      292
+#define OPT_IO_URING            293
+#define OPT_PARTITION_BY        294
+#define OPT_PARTITIONS          295
+#define OPT_OUTPUT_TEMPLATE     296
+#define OPT_CHECK               297
+#define OPT_COUNT               298
+#define OPT_OUT                 299
+#define OPT_COMPACT             300
+#define OPT_SHORT_TAGS          301
+
+// A row; if "alloc" is zero, the fields are borrowed from the parser and not freed
 struct row {
     char    **fields;
     size_t  num;
     size_t  alloc;
 };
 
-static int quote = DEFAULT_QUOTE_CHAR;
-static int fsep = DEFAULT_FSEP_CHAR;
-
-static const char *bash_special_vars[] = {
-    "BASH", "BASHOPTS", "BASHPID", "BASH_ALIASES", "BASH_ARGC", "BASH_ARGV", "BASH_CMDS", "BASH_COMMAND",
-    "BASH_EXECUTION_STRING", "BASH_LINENO", "BASH_LOADABLES_PATH", "BASH_REMATCH", "BASH_SOURCE", "BASH_SUBSHELL",
-    "BASH_VERSINFO", "BASH_VERSION", "COMP_CWORD", "COMP_KEY", "COMP_LINE", "COMP_POINT", "COMP_TYPE", "COMP_WORDBREAKS",
-    "COMP_WORDS", "COPROC", "DIRSTACK", "EUID", "FUNCNAME", "GROUPS", "HISTCMD", "HOSTNAME", "HOSTTYPE", "LINENO",
-    "MACHTYPE", "MAPFILE", "OLDPWD", "OPTARG", "OPTIND", "OSTYPE", "PIPESTATUS", "PPID", "PWD", "RANDOM", "READLINE_LINE",
-    "READLINE_POINT", "REPLY", "SECONDS", "SHELLOPTS", "SHLVL", "UID", "BASH_COMPAT", "BASH_ENV", "BASH_XTRACEFD", "CDPATH",
-    "CHILD_MAX", "COLUMNS", "COMPREPLY", "EMACS", "ENV", "EXECIGNORE", "FCEDIT", "FIGNORE", "FUNCNEST", "GLOBIGNORE",
-    "HISTCONTROL", "HISTFILE", "HISTFILESIZE", "HISTIGNORE", "HISTSIZE", "HISTTIMEFORMAT", "HOME", "HOSTFILE", "IFS",
-    "IGNOREEOF", "INPUTRC", "LANG", "LC_ALL", "LC_COLLATE", "LC_CTYPE", "LC_MESSAGES", "LC_NUMERIC", "LC_TIME", "LINES",
-    "MAIL", "MAILCHECK", "MAILPATH", "OPTERR", "PATH", "POSIXLY_CORRECT", "PROMPT_COMMAND", "PROMPT_DIRTRIM", "PS0", "PS1",
-    "PS2", "PS3", "PS4", "SHELL", "TIMEFORMAT", "TMOUT", "TMPDIR", "auto_resume", "histchars"
+// How to output data rows
+struct emit {
+    int             mode;
+    FILE            *out;
+    struct csv_emitter *emitter;            // XML, JSON, and bash modes only
+    struct sqlite_output *sqlite;           // SQLite mode only
+    struct partition *partition;            // if not NULL, output goes to the file it picks instead
+    char            *format;
+    int             nargs;
+    unsigned int    *args;
+    const char      *path;                  // "--out" file
+    struct row      columns;                // "--out" columns to include, if not all
+    struct emit     *next;                  // another output for the same rows
+};
+
+// Output of a data row whose big fields are passed along a piece at a time by the parser
+struct stream {
+    const struct emit   *em;
+    const struct csv_parser *parser;
+    int                 active;             // the current record will be output
+    int                 started;            // output of the current record has begun
+    int                 open;               // the column before "next_col" hasn't been finished
+    size_t              next_col;           // next column whose output hasn't begun
+};
+
+// Reservoir sample of data rows
+struct sample_row {
+    struct row      row;
+    uint64_t        datanum;                // for restoring input order
+    int             linenum;
+};
+
+struct sample {
+    struct sample_row   *rows;
+    size_t              size;
+    size_t              num;
+    uint64_t            seen;
+    uint64_t            rng;
+};
+
+// Output state for rows produced after the input has been read
+struct result_output {
+    const struct emit   *em;
+    struct sorter       *sorter;            // if not NULL, send rows here instead
+    uint64_t            limit;
+    uint64_t            emitted;
+    int                 linenum;
+};
+
+static uint64_t num_allocations;            // row memory allocations, for "--stats"
+
+static const struct option long_options[] = {
+    { "compress",       required_argument,  NULL,   OPT_COMPRESS },
+    { "pipeline",       no_argument,        NULL,   OPT_PIPELINE },
+    { "build-index",    required_argument,  NULL,   OPT_BUILD_INDEX },
+    { "index",          required_argument,  NULL,   OPT_INDEX },
+    { "index-interval", required_argument,  NULL,   OPT_INDEX_INTERVAL },
+    { "range",          required_argument,  NULL,   OPT_RANGE },
+    { "splits",         required_argument,  NULL,   OPT_SPLITS },
+    { "limit",          required_argument,  NULL,   OPT_LIMIT },
+    { "sample",         required_argument,  NULL,   OPT_SAMPLE },
+    { "seed",           required_argument,  NULL,   OPT_SEED },
+    { "every",          required_argument,  NULL,   OPT_EVERY },
+    { "group-by",       required_argument,  NULL,   OPT_GROUP_BY },
+    { "agg",            required_argument,  NULL,   OPT_AGG },
+    { "memory-limit",   required_argument,  NULL,   OPT_MEMORY_LIMIT },
+    { "sort-by",        required_argument,  NULL,   OPT_SORT_BY },
+    { "unique",         no_argument,        NULL,   OPT_UNIQUE },
+    { "unique-by",      required_argument,  NULL,   OPT_UNIQUE_BY },
+    { "unique-approx",  no_argument,        NULL,   OPT_UNIQUE_APPROX },
+    { "join",           required_argument,  NULL,   OPT_JOIN },
+    { "on",             required_argument,  NULL,   OPT_ON },
+    { "join-type",      required_argument,  NULL,   OPT_JOIN_TYPE },
+    { "keep-keys",      required_argument,  NULL,   OPT_KEEP_KEYS },
+    { "drop-keys",      required_argument,  NULL,   OPT_DROP_KEYS },
+    { "key",            required_argument,  NULL,   OPT_KEY },
+    { "profile",        no_argument,        NULL,   OPT_PROFILE },
+    { "stats",          no_argument,        NULL,   OPT_STATS },
+    { "progress",       no_argument,        NULL,   OPT_PROGRESS },
+    { "follow",         no_argument,        NULL,   OPT_FOLLOW },
+    { "flush",          required_argument,  NULL,   OPT_FLUSH },
+    { "checkpoint",     required_argument,  NULL,   OPT_CHECKPOINT },
+    { "resume",         no_argument,        NULL,   OPT_RESUME },
+    { "sqlite",         required_argument,  NULL,   OPT_SQLITE },
+    { "table",          required_argument,  NULL,   OPT_TABLE },
+    { "transaction-size", required_argument, NULL,  OPT_TRANSACTION_SIZE },
+    { "bulk-load",      no_argument,        NULL,   OPT_BULK_LOAD },
+    { "record-terminator", required_argument, NULL, OPT_RECORD_TERMINATOR },
+    { "max-field-size", required_argument,  NULL,   OPT_MAX_FIELD_SIZE },
+    { "io-uring",       no_argument,        NULL,   OPT_IO_URING },
+    { "partition-by",   required_argument,  NULL,   OPT_PARTITION_BY },
+    { "partitions",     required_argument,  NULL,   OPT_PARTITIONS },
+    { "output-template", required_argument, NULL,   OPT_OUTPUT_TEMPLATE },
+    { "check",          no_argument,        NULL,   OPT_CHECK },
+    { "count",          no_argument,        NULL,   OPT_COUNT },
+    { "out",            required_argument,  NULL,   OPT_OUT },
+    { "compact",        no_argument,        NULL,   OPT_COMPACT },
+    { "short-tags",     no_argument,        NULL,   OPT_SHORT_TAGS },
+    { "help",           no_argument,        NULL,   'h' },
+    { "version",        no_argument,        NULL,   'v' },
+    { NULL,             0,                  NULL,   0 }
 };
-#define NUM_BASH_SPECIAL_VARS   (sizeof(bash_special_vars) / sizeof(*bash_special_vars))
 
 static int parsechar(const char *str);
+static uint64_t parsecount(const char *optname, const char *str, int allow_zero);
+static void parserange(const char *optname, const char *str, uint64_t *startp, uint64_t *endp);
+static size_t parsesize(const char *optname, const char *str);
+static void parseflush(const char *str, int *modep, size_t *sizep, uint64_t *millisp);
+static void parseout(const char *str, struct emit *em);
+static uint64_t now_millis(void);
+static void flush_idle(void *arg);
+static void save_checkpoint(const char *path, FILE *out, const struct csv_parser *parser, int quote, int fsep,
+    uint64_t recnum, uint64_t datanum, uint64_t emitted);
 static int parsefmt(char *fmt, const struct row *column_names, unsigned int **argsp);
-static int readcol(FILE *fp, struct row *row, int *linenum);
-static int readqcol(FILE *fp, struct col *col, int *linenum);
-static int readuqcol(FILE *fp, struct col *col, int *linenum);
-static int readch(FILE *fp, int collapse);
+static void ownrow(struct row *row);
 static void freerow(struct row *row);
-static void print_xml_tag_name(const char *tag, int linenum);
-static void print_json_string(const char *string, int linenum);
-static void print_bash_name(const char *string);
-static void print_bash_value(const char *string);
-static char bash_name_safe(char ch, int first);
-static int decode_utf8(const char *const obuf, size_t olen, int *lenp, int linenum);
-static void convert_to_utf8(iconv_t icd, struct row *row, int linenum);
-static const char *escape_xml_char(int uchar);
+static void emit_row(const struct emit *em, struct row *row, int linenum);
+static void emit_one(const struct emit *em, struct row *row, char *const **utf8p, int linenum);
+static void out_open(struct emit *o, int read_column_names, int use_column_names, int terminator, int compact,
+    const char *encoding);
+static void out_set_names(struct emit *o, const struct row *names, int names_utf8, const char *prefix, int linenum);
+static void out_close(struct emit *o);
+static void stream_chunk(void *arg, char *const *fields, size_t col, const char *data, size_t len);
+static void stream_finish(struct stream *st, const struct row *row, int linenum);
+static void partition_begin(void *arg, FILE *fp);
+static void partition_end(void *arg, FILE *fp);
+static struct sample *sample_create(size_t size, uint64_t seed);
+static void sample_add(struct sample *sample, struct row *row, int linenum);
+static void sample_emit(struct sample *sample, struct result_output *ro);
+static int sample_cmp(const void *ptr1, const void *ptr2);
+static void agg_setup(struct agg *agg, char *const *names, size_t num_names, struct row *agg_names);
+static void join_setup(struct join *join, const char *path, int read_column_names, int quote, int fsep);
+static int join_row(struct join *join, struct row *row, size_t width);
+static void output_result(struct result_output *ro, struct row *row, int linenum);
+static void output_summary_fields(void *arg, char *const *fields, size_t num);
+static void output_fields(void *arg, char *const *fields, size_t num, int linenum);
 static char *eatwidthprec(const char *fspec, const char *desc, const struct row *column_names,
     char *s, int *nargs, unsigned int *args);
 static char *eataccessor(const char *fspec, const char *desc, const struct row *column_names,
     char *s, int *nargs, unsigned int *args);
-static void addcolumn(struct row *row, const struct col *col);
 static void addstring(struct row *row, const char *const string);
 static int findstring(struct row *row, const char *const string);
-static int findstring2(const char *const *list, size_t num, const char *const string);
 static void growrow(struct row *row);
-static void addchar(struct col *col, int ch);
-static void trim(struct col *col);
+static struct csv_parser *parser_open(FILE *fp, int quote, int fsep);
+static int parser_next(struct csv_parser *parser, struct csv_record *rec);
+static void parser_seek(struct csv_parser *parser, uint64_t offset, int linenum);
+static struct csv_emitter *emitter_open(int format, int use_names, const char *encoding);
+static void emitter_fail(const struct csv_emitter *emitter);
 static void usage(void);
 static void version(void);
 
@@ -106,16 +281,97 @@ main(int argc, char **argv)
     const char *input = "-";
     const char *encoding = "ISO-8859-1";
     const char *name_prefix = "";
+    const char *compress = NULL;
+    const char *build_index = NULL;
+    const char *use_index = NULL;
+    const char *group_by = NULL;
+    const char *agg_funcs = NULL;
+    const char *sort_by = NULL;
+    const char *unique_by = NULL;
+    const char *join_file = NULL;
+    const char *join_on = NULL;
+    const char *keys_file = NULL;
+    const char *key_spec = NULL;
+    const char *checkpoint_file = NULL;
+    const char *sqlite_file = NULL;
+    const char *sqlite_table = DEFAULT_SQLITE_TABLE;
+    const char *partition_by = NULL;
+    const char *output_template = NULL;
     char *format = NULL;
-    iconv_t icd = NULL;
+    struct csv_emitter *emitter = NULL;
+    struct sqlite_output *sqlite = NULL;
+    struct csv_parser *parser;
+    struct csv_record rec;
     FILE *fp = NULL;
+    FILE *out = stdout;
+    struct index *index_in = NULL;
+    struct index *index_out = NULL;
+    struct sample *sample = NULL;
+    struct agg *agg = NULL;
+    struct sorter *sorter = NULL;
+    struct unique *unique = NULL;
+    struct join *join = NULL;
+    struct keyset *keys = NULL;
+    struct profile *profile = NULL;
+    struct partition *partition = NULL;
+    struct result_output results;
+    struct stats_totals totals;
+    struct checkpoint ck;
+    struct emit em;
+    struct emit *emits;                         // first output in the chain
+    struct emit *outs = NULL;                   // "--out" outputs
+    struct emit *o;
+    struct stream stream;
     struct row row;
     struct row column_names;
     struct row allowed_column_names;
+    struct row result_names;                    // column names for aggregation or profile output
+    struct row *output_names;                   // column names for output
     unsigned int *args = NULL;
+    unsigned long index_interval = DEFAULT_INDEX_INTERVAL;
+    unsigned long num_splits = 0;
+    unsigned long num_partitions = 0;           // partition by hash into this many files, or zero for by value
+    size_t sample_size = 0;
+    size_t memory_limit = DEFAULT_MEMORY_LIMIT;
+    size_t max_field_size = 0;                  // maximum size of an input field, if any
+    size_t join_width = 0;                      // number of main input columns before joined columns
+    size_t num_outs = 0;
+    size_t key_col = 0;
+    uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    uint64_t limit = UINT64_MAX;                // maximum number of data records to output
+    uint64_t every = 1;                         // output every n'th data record
+    uint64_t emitted = 0;                       // number of data records output
+    uint64_t range_start = 1;                   // first data record to output (starting from one)
+    uint64_t range_end = UINT64_MAX;            // last data record to output
+    uint64_t recnum = 0;                        // number of records read, including any header row
+    uint64_t datanum = 0;                       // number of data records read
+    uint64_t transaction_size = DEFAULT_TRANSACTION_SIZE;
+    int quote = DEFAULT_QUOTE_CHAR;
+    int fsep = DEFAULT_FSEP_CHAR;
     int mode = -1;
     int read_column_names = 0;                  // strip off first row containing column names
     int use_column_names = 0;                   // use column names from first row in output
+    int pipeline = 0;                           // use reader and writer threads
+    int unique_records = 0;                     // omit duplicate records
+    int unique_approx = 0;                      // use a Bloom filter to detect duplicates
+    int left_join = 0;
+    int drop_keys = 0;                          // omit (rather than keep) records whose key is in keys_file
+    int profile_columns = 0;                    // output column statistics instead of records
+    int show_stats = 0;                         // report runtime statistics on exit
+    off_t stdout_start = -1;                    // initial position of regular file stdout, for "--stats"
+    int show_progress = 0;                      // report progress periodically
+    int follow = 0;                             // wait for more input at EOF, flushing each record
+    int flush_mode = FLUSH_DEFAULT;
+    size_t flush_size = 0;                      // output buffer size, if not the default
+    uint64_t flush_millis = 0;                  // maximum time output may sit in the buffer, if any
+    uint64_t last_flush = 0;
+    uint64_t last_checkpoint = 0;
+    int resume = 0;                             // resume from the checkpoint, if any
+    int bulk_load = 0;                          // trade database safety for speed
+    int terminator = '\n';                      // raw mode record terminator, or -1 for none
+    int compact = 0;                            // compact XML and JSON output flags
+    int resume_pending = 0;                     // a checkpoint was loaded but we haven't skipped to it yet
+    int streaming = 0;                          // output big fields a piece at a time as they're parsed
     int first_row = 0;
     int nargs = 0;
     int file_done;
@@ -127,10 +383,189 @@ main(int argc, char **argv)
     memset(&row, 0, sizeof(row));
     memset(&column_names, 0, sizeof(column_names));
     memset(&allowed_column_names, 0, sizeof(allowed_column_names));
+    memset(&result_names, 0, sizeof(result_names));
+    memset(&totals, 0, sizeof(totals));
 
     // Parse command line
-    while ((ch = getopt(argc, argv, "bc:e:f:hijnp:q:s:vxX")) != -1) {
+    while ((ch = getopt_long(argc, argv, "0bc:e:f:hijnp:q:s:vxX", long_options, NULL)) != -1) {
         switch (ch) {
+        case OPT_COMPRESS:
+            compress = optarg;
+            break;
+        case OPT_PIPELINE:
+            pipeline = 1;
+            break;
+        case OPT_IO_URING:
+            uring_enable();
+            pipeline = 1;
+            break;
+        case OPT_BUILD_INDEX:
+            if (mode != -1 && mode != MODE_INDEX)
+                errx(1, "flag \"--%s\" conflicts with previous mode flag", "build-index");
+            mode = MODE_INDEX;
+            build_index = optarg;
+            break;
+        case OPT_INDEX:
+            use_index = optarg;
+            break;
+        case OPT_INDEX_INTERVAL:
+            index_interval = parsecount("index-interval", optarg, 0);
+            break;
+        case OPT_RANGE:
+            parserange("range", optarg, &range_start, &range_end);
+            break;
+        case OPT_SPLITS:
+            if (mode != -1 && mode != MODE_SPLITS)
+                errx(1, "flag \"--%s\" conflicts with previous mode flag", "splits");
+            mode = MODE_SPLITS;
+            num_splits = parsecount("splits", optarg, 0);
+            break;
+        case OPT_LIMIT:
+            limit = parsecount("limit", optarg, 0);
+            break;
+        case OPT_SAMPLE:
+            sample_size = parsecount("sample", optarg, 0);
+            break;
+        case OPT_SEED:
+            seed = parsecount("seed", optarg, 1);
+            break;
+        case OPT_EVERY:
+            every = parsecount("every", optarg, 0);
+            break;
+        case OPT_GROUP_BY:
+            group_by = optarg;
+            break;
+        case OPT_AGG:
+            agg_funcs = optarg;
+            break;
+        case OPT_MEMORY_LIMIT:
+            memory_limit = parsesize("memory-limit", optarg);
+            break;
+        case OPT_MAX_FIELD_SIZE:
+            if ((max_field_size = parsesize("max-field-size", optarg)) == 0)
+                errx(1, "invalid argument to \"--%s\"", "max-field-size");
+            break;
+        case OPT_SORT_BY:
+            sort_by = optarg;
+            break;
+        case OPT_PARTITION_BY:
+            partition_by = optarg;
+            break;
+        case OPT_PARTITIONS:
+            if ((num_partitions = parsecount("partitions", optarg, 0)) > INT_MAX)
+                errx(1, "invalid argument to \"--%s\"", "partitions");
+            break;
+        case OPT_OUTPUT_TEMPLATE:
+            output_template = optarg;
+            break;
+        case OPT_UNIQUE:
+            unique_records = 1;
+            break;
+        case OPT_UNIQUE_BY:
+            unique_by = optarg;
+            break;
+        case OPT_UNIQUE_APPROX:
+            unique_approx = 1;
+            break;
+        case OPT_JOIN:
+            join_file = optarg;
+            break;
+        case OPT_ON:
+            join_on = optarg;
+            break;
+        case OPT_KEEP_KEYS:
+        case OPT_DROP_KEYS:
+            if (keys_file != NULL)
+                errx(1, "only one of \"--%s\" and \"--%s\" may be given", "keep-keys", "drop-keys");
+            keys_file = optarg;
+            drop_keys = ch == OPT_DROP_KEYS;
+            break;
+        case OPT_KEY:
+            key_spec = optarg;
+            break;
+        case OPT_PROFILE:
+            profile_columns = 1;
+            break;
+        case OPT_STATS:
+            show_stats = 1;
+            break;
+        case OPT_PROGRESS:
+            show_progress = 1;
+            break;
+        case OPT_FOLLOW:
+            follow = 1;
+            break;
+        case OPT_FLUSH:
+            parseflush(optarg, &flush_mode, &flush_size, &flush_millis);
+            break;
+        case OPT_CHECKPOINT:
+            checkpoint_file = optarg;
+            break;
+        case OPT_RESUME:
+            resume = 1;
+            break;
+        case OPT_SQLITE:
+            if (mode != -1 && mode != MODE_SQLITE)
+                errx(1, "flag \"--%s\" conflicts with previous mode flag", "sqlite");
+            mode = MODE_SQLITE;
+            sqlite_file = optarg;
+            break;
+        case OPT_TABLE:
+            sqlite_table = optarg;
+            break;
+        case OPT_TRANSACTION_SIZE:
+            transaction_size = parsecount("transaction-size", optarg, 0);
+            break;
+        case OPT_BULK_LOAD:
+            bulk_load = 1;
+            break;
+        case OPT_RECORD_TERMINATOR:
+            if (*optarg == '\0')
+                terminator = -1;
+            else if (strcmp(optarg, "\\n") == 0)
+                terminator = '\n';
+            else if (strcmp(optarg, "\\0") == 0)
+                terminator = '\0';
+            else if ((terminator = parsechar(optarg)) == -1)
+                errx(1, "invalid argument to \"--%s\"", "record-terminator");
+            break;
+        case OPT_COMPACT:
+            compact |= CSV_COMPACT;
+            break;
+        case OPT_SHORT_TAGS:
+            compact |= CSV_COMPACT | CSV_COMPACT_SHORT_TAGS;
+            break;
+        case OPT_CHECK:
+            if (mode != -1 && mode != MODE_CHECK)
+                errx(1, "flag \"--%s\" conflicts with previous mode flag", "check");
+            mode = MODE_CHECK;
+            break;
+        case OPT_COUNT:
+            if (mode != -1 && mode != MODE_COUNT)
+                errx(1, "flag \"--%s\" conflicts with previous mode flag", "count");
+            mode = MODE_COUNT;
+            break;
+        case OPT_OUT:
+            if ((outs = realloc(outs, (num_outs + 1) * sizeof(*outs))) == NULL)
+                err(1, "realloc");
+            parseout(optarg, &outs[num_outs]);
+            if (outs[num_outs].mode == MODE_XML_NAMES)
+                read_column_names = 1;
+            num_outs++;
+            break;
+        case '0':
+            if (mode != -1 && mode != MODE_RAW)
+                errx(1, "flag \"%c\" conflicts with previous mode flag", ch);
+            mode = MODE_RAW;
+            break;
+        case OPT_JOIN_TYPE:
+            if (strcmp(optarg, "inner") == 0)
+                left_join = 0;
+            else if (strcmp(optarg, "left") == 0)
+                left_join = 1;
+            else
+                errx(1, "invalid argument to \"--%s\"", "join-type");
+            break;
         case 'b':
             if (mode != -1 && mode != MODE_BASH)
                 errx(1, "flag \"%c\" conflicts with previous mode flag", ch);
@@ -191,7 +626,7 @@ main(int argc, char **argv)
         }
     }
     if (mode == -1)
-        mode = MODE_NORMAL;
+        mode = num_outs > 0 && optind == argc ? MODE_OUTS : MODE_NORMAL;
     argc -= optind;
     argv += optind;
     if (argc != (mode == MODE_NORMAL ? 1 : 0)) {
@@ -208,6 +643,163 @@ main(int argc, char **argv)
         err(1, "quote and field separators cannot be the same character");
     if (allowed_column_names.num > 0 && !read_column_names)
         err(1, "\"-c\" flag requires \"-n\" flag");
+    if (mode == MODE_SPLITS && use_index == NULL)
+        errx(1, "\"--%s\" flag requires \"--%s\" flag", "splits", "index");
+    if (mode == MODE_INDEX && use_index != NULL)
+        errx(1, "\"--%s\" and \"--%s\" flags are incompatible", "build-index", "index");
+    if (resume && checkpoint_file == NULL)
+        errx(1, "\"--%s\" flag requires \"--%s\" flag", "resume", "checkpoint");
+    if (checkpoint_file != NULL) {
+        if (mode == MODE_INDEX || mode == MODE_SPLITS || use_index != NULL)
+            errx(1, "\"--%s\" is incompatible with indexing", "checkpoint");
+        if (follow || compress != NULL || pipeline)
+            errx(1, "\"--%s\" is incompatible with \"--%s\"", "checkpoint", follow ? "follow" : compress != NULL ? "compress" : "pipeline");
+        if (group_by != NULL || agg_funcs != NULL || sort_by != NULL || sample_size > 0 || profile_columns
+          || unique_records || unique_by != NULL || unique_approx)
+            errx(1, "\"--%s\" is incompatible with flags that remember earlier records", "checkpoint");
+    }
+    if (mode == MODE_SQLITE) {
+        if (compress != NULL || checkpoint_file != NULL || follow)
+            errx(1, "\"--%s\" is incompatible with \"--%s\"", "sqlite", compress != NULL ? "compress" : checkpoint_file != NULL ? "checkpoint" : "follow");
+    }
+    if (partition_by != NULL || output_template != NULL || num_partitions > 0) {
+        if (partition_by == NULL || output_template == NULL)
+            errx(1, "\"--%s\" and \"--%s\" flags must be used together", "partition-by", "output-template");
+        if (mode == MODE_INDEX || mode == MODE_SPLITS || mode == MODE_SQLITE)
+            errx(1, "\"--%s\" is incompatible with \"--%s\"", "partition-by",
+              mode == MODE_INDEX ? "build-index" : mode == MODE_SPLITS ? "splits" : "sqlite");
+        if (compress != NULL || checkpoint_file != NULL || follow)
+            errx(1, "\"--%s\" is incompatible with \"--%s\"", "partition-by",
+              compress != NULL ? "compress" : checkpoint_file != NULL ? "checkpoint" : "follow");
+    }
+    if (mode == MODE_CHECK || mode == MODE_COUNT) {
+        const char *flag = NULL;
+
+        // These read every record, and would otherwise be silently ignored
+        if (follow)
+            flag = "follow";
+        else if (use_index != NULL)
+            flag = "index";
+        else if (checkpoint_file != NULL)
+            flag = "checkpoint";
+        else if (partition_by != NULL)
+            flag = "partition-by";
+        else if (num_outs > 0)
+            flag = "out";
+        else if (limit != UINT64_MAX)
+            flag = "limit";
+        else if (range_start != 1 || range_end != UINT64_MAX)
+            flag = "range";
+        else if (every > 1)
+            flag = "every";
+        else if (sample_size > 0)
+            flag = "sample";
+        else if (keys_file != NULL)
+            flag = drop_keys ? "drop-keys" : "keep-keys";
+        else if (join_file != NULL)
+            flag = "join";
+        else if (unique_records || unique_by != NULL || unique_approx)
+            flag = unique_by != NULL ? "unique-by" : unique_approx ? "unique-approx" : "unique";
+        else if (group_by != NULL || agg_funcs != NULL)
+            flag = group_by != NULL ? "group-by" : "agg";
+        else if (sort_by != NULL)
+            flag = "sort-by";
+        else if (profile_columns)
+            flag = "profile";
+        if (flag != NULL)
+            errx(1, "\"--%s\" is incompatible with \"--%s\"", mode == MODE_CHECK ? "check" : "count", flag);
+    }
+    if (num_outs > 0) {
+        for (o = outs; o < outs + num_outs; o++) {
+            if (o->columns.num > 0 && !read_column_names)
+                errx(1, "\"--%s\" columns require \"-n\" flag", "out");
+        }
+        if (mode == MODE_INDEX || mode == MODE_SPLITS)
+            errx(1, "\"--%s\" is incompatible with \"--%s\"", "out", mode == MODE_INDEX ? "build-index" : "splits");
+        if (partition_by != NULL || checkpoint_file != NULL || follow)
+            errx(1, "\"--%s\" is incompatible with \"--%s\"", "out",
+              partition_by != NULL ? "partition-by" : checkpoint_file != NULL ? "checkpoint" : "follow");
+    }
+    if (follow) {
+        if (strcmp(input, "-") == 0)
+            errx(1, "\"--%s\" flag requires \"-f\" flag", "follow");
+        if (mode == MODE_INDEX || mode == MODE_SPLITS || use_index != NULL)
+            errx(1, "\"--%s\" is incompatible with indexing", "follow");
+        if (group_by != NULL || agg_funcs != NULL || sort_by != NULL || sample_size > 0 || profile_columns)
+            errx(1, "\"--%s\" is incompatible with flags that output records only at the end of the input", "follow");
+    }
+
+    // Just checking the input structure?
+    if (mode == MODE_CHECK || mode == MODE_COUNT) {
+        int status;
+
+        fp = input_open(input, 0);
+        status = check_input(fp, input, quote, fsep, read_column_names, encoding, mode == MODE_COUNT);
+        fclose(fp);
+        return status;
+    }
+
+    // Set up aggregation
+    if (group_by != NULL || agg_funcs != NULL) {
+        if (mode == MODE_INDEX || mode == MODE_SPLITS)
+            errx(1, "aggregation is incompatible with \"--%s\"", mode == MODE_INDEX ? "build-index" : "splits");
+        if (sample_size > 0)
+            errx(1, "aggregation is incompatible with \"--%s\"", "sample");
+        if (allowed_column_names.num > 0)
+            errx(1, "aggregation is incompatible with \"-c\"");
+        agg = agg_create(group_by, agg_funcs != NULL ? agg_funcs : "count", memory_limit);
+    }
+
+    // Set up profiling
+    if (profile_columns) {
+        const char *const *names;
+        size_t num_names;
+        size_t i;
+
+        if (mode == MODE_INDEX || mode == MODE_SPLITS)
+            errx(1, "\"--%s\" is incompatible with \"--%s\"", "profile", mode == MODE_INDEX ? "build-index" : "splits");
+        if (agg != NULL)
+            errx(1, "\"--%s\" is incompatible with aggregation", "profile");
+        if (sample_size > 0)
+            errx(1, "\"--%s\" is incompatible with \"--%s\"", "profile", "sample");
+        if (allowed_column_names.num > 0)
+            errx(1, "\"--%s\" is incompatible with \"-c\"", "profile");
+        profile = profile_create();
+        profile_column_names(&names, &num_names);
+        for (i = 0; i < num_names; i++)
+            addstring(&result_names, names[i]);
+    }
+
+    // Load key file
+    if (keys_file != NULL || key_spec != NULL) {
+        if (keys_file == NULL || key_spec == NULL)
+            errx(1, "\"--%s\" requires \"--%s\" or \"--%s\"", "key", "keep-keys", "drop-keys");
+        keys = keyset_load(keys_file);
+    }
+
+    // Load lookup file for join (before opening the main input, because we share the parser)
+    if (join_file != NULL || join_on != NULL) {
+        if (join_file == NULL || join_on == NULL)
+            errx(1, "\"--%s\" and \"--%s\" flags must be used together", "join", "on");
+        if (mode == MODE_INDEX || mode == MODE_SPLITS)
+            errx(1, "\"--%s\" is incompatible with \"--%s\"", "join", mode == MODE_INDEX ? "build-index" : "splits");
+        join = join_create(join_on, left_join);
+        join_setup(join, join_file, read_column_names, quote, fsep);
+    }
+
+    // Set up duplicate detection
+    if (unique_records || unique_by != NULL || unique_approx) {
+        if (unique_records && unique_by != NULL)
+            errx(1, "\"--%s\" and \"--%s\" flags are incompatible", "unique", "unique-by");
+        unique = unique_create(unique_by, unique_approx, memory_limit);
+    }
+
+    // Set up sorting
+    if (sort_by != NULL) {
+        if (mode == MODE_INDEX || mode == MODE_SPLITS)
+            errx(1, "\"--%s\" is incompatible with \"--%s\"", "sort-by", mode == MODE_INDEX ? "build-index" : "splits");
+        sorter = sort_create(sort_by, memory_limit);
+    }
 
     // Get and (maybe) parse format string (normal mode only)
     if (mode == MODE_NORMAL) {
@@ -218,67 +810,311 @@ main(int argc, char **argv)
             nargs = parsefmt(format, NULL, &args);
     }
 
-    // Open input
-    if (strcmp(input, "-") == 0)
-        fp = stdin;
-    else if ((fp = fopen(input, "r")) == NULL)
-        err(1, "%s", input);
+    // Open input (decompressing if needed)
+    if (follow)
+        fp = input_follow(input);
+    else
+        fp = input_open(input, pipeline);
+    parser = parser_open(fp, quote, fsep);
+    csv_parser_set_max_field(parser, max_field_size);
+
+    // Indexes need byte offsets into a regular file
+    if (build_index != NULL || use_index != NULL) {
+        struct stat sb;
+        off_t offset;
+
+        if (fileno(fp) == -1 || fstat(fileno(fp), &sb) == -1 || !S_ISREG(sb.st_mode))
+            errx(1, "%s: indexing requires uncompressed input from a regular file", input);
+        if ((offset = ftello(fp)) == -1)
+            err(1, "%s", input);
+        parser_seek(parser, offset, 1);
+        if (build_index != NULL)
+            index_out = index_create(index_interval);
+        else
+            index_in = index_load(use_index, fileno(fp), quote, fsep);
+    }
+
+    // Print split points
+    if (mode == MODE_SPLITS) {
+        const uint64_t header = read_column_names ? 1 : 0;
+        const uint64_t total = index_num_records(index_in) - header;
+        uint64_t start;
+        uint64_t end;
+        unsigned long i;
+
+        for (i = 0; i < num_splits; i++) {
+            start = i == 0 ? 1 : index_split(index_in, i, num_splits) - header;
+            end = i == num_splits - 1 ? total : index_split(index_in, i + 1, num_splits) - header - 1;
+            if (start <= end)
+                printf("%llu:%llu\n", (unsigned long long)start, (unsigned long long)end);
+        }
+        index_free(index_in);
+        csv_parser_free(parser);
+        fclose(fp);
+        return 0;
+    }
+
+    // Open output (compressing if needed)
+    if (compress != NULL || pipeline)
+        out = output_open(STDOUT_FILENO, compress);
+
+    // Checkpoints need to seek within the input and output; if resuming, discard output after the checkpoint
+    if (checkpoint_file != NULL) {
+        struct stat sb;
+
+        if (fileno(fp) == -1 || fstat(fileno(fp), &sb) == -1 || !S_ISREG(sb.st_mode))
+            errx(1, "%s: checkpointing requires uncompressed input from a regular file", input);
+        if (fstat(STDOUT_FILENO, &sb) == -1 || !S_ISREG(sb.st_mode))
+            errx(1, "checkpointing requires output to a regular file");
+        if (resume && checkpoint_load(checkpoint_file, &ck)) {
+            if (ck.quote != quote || ck.fsep != fsep)
+                errx(1, "%s: checkpoint was made with different quote or separator characters", checkpoint_file);
+            if (ck.output_offset > (uint64_t)sb.st_size)
+                errx(1, "%s: output is shorter than when the checkpoint was made", checkpoint_file);
+            if (ftruncate(STDOUT_FILENO, ck.output_offset) == -1 || lseek(STDOUT_FILENO, ck.output_offset, SEEK_SET) == -1)
+                err(1, "output");
+            resume_pending = 1;
+        } else if (resume) {
+
+            // Nothing was saved, so start over; the output was opened without truncating it
+            if (ftruncate(STDOUT_FILENO, 0) == -1 || lseek(STDOUT_FILENO, 0, SEEK_SET) == -1)
+                err(1, "output");
+        }
+        last_checkpoint = now_millis();
+    }
+
+    // Without a writer thread to count the output, measure it by its position in the output file (if it is one)
+    if (show_stats && out == stdout) {
+        struct stat sb;
+
+        if (fstat(STDOUT_FILENO, &sb) == 0 && S_ISREG(sb.st_mode))
+            stdout_start = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    }
+
+    // Set up output flushing; when the time is limited, also flush whenever we're about to wait for input
+    if (follow && flush_mode == FLUSH_DEFAULT)
+        flush_mode = FLUSH_RECORD;
+    if (flush_size > 0) {
+        char *flush_buf;
 
-    // Initialize iconv
+        // Supply the buffer, because some stdio implementations ignore the size without one; never freed, as stdio uses it until exit
+        if ((flush_buf = malloc(flush_size)) == NULL)
+            err(1, "malloc");
+        if (setvbuf(out, flush_buf, _IOFBF, flush_size) != 0)
+            err(1, "setvbuf");
+    }
+    if (flush_millis > 0) {
+        input_set_idle(flush_idle, out);
+        last_flush = now_millis();
+    }
+
+    // Create emitter
     switch (mode) {
     case MODE_XML_PLAIN:
     case MODE_XML_NAMES:
+        emitter = emitter_open(CSV_EMIT_XML, use_column_names, encoding);
+        break;
     case MODE_JSON:
-        if ((icd = iconv_open(XML_OUTPUT_ENCODING, encoding)) == (iconv_t)-1)
-            err(1, "%s", encoding);
+        emitter = emitter_open(CSV_EMIT_JSON, use_column_names, encoding);
+        break;
+    case MODE_BASH:
+        emitter = emitter_open(CSV_EMIT_BASH, use_column_names, encoding);
+        break;
+    case MODE_RAW:
+        emitter = emitter_open(CSV_EMIT_RAW, use_column_names, encoding);
+        csv_emitter_set_terminator(emitter, terminator);
+        break;
+    case MODE_SQLITE:
+        sqlite = sqlite_output_open(sqlite_file, sqlite_table, encoding, use_column_names, transaction_size, bulk_load);
         break;
     default:
         break;
     }
+    if (emitter != NULL)
+        csv_emitter_set_compact(emitter, compact);
+
+    // Set up partitioned output; each file gets its own XML opening and closing
+    if (partition_by != NULL) {
+        partition = partition_create(partition_by, output_template, num_partitions, memory_limit,
+          emitter != NULL ? partition_begin : NULL, emitter != NULL ? partition_end : NULL, emitter);
+    }
 
-    // XML opening
-    if (mode == MODE_XML_PLAIN || mode == MODE_XML_NAMES) {
-        printf("<?xml version=\"1.0\" encoding=\"%s\"?>\n", XML_OUTPUT_ENCODING);
-        printf("<csv>\n");
+    // XML opening (unless it's already there)
+    if (emitter != NULL && partition == NULL && !resume_pending)
+        csv_emitter_begin(emitter, out);
+
+    // Set up data row output
+    output_names = agg != NULL || profile != NULL ? &result_names : &column_names;
+    memset(&em, 0, sizeof(em));
+    em.mode = mode;
+    em.out = out;
+    em.emitter = emitter;
+    em.sqlite = sqlite;
+    em.partition = partition;
+    em.format = format;
+    em.nargs = nargs;
+    em.args = args;
+
+    // Set up "--out" outputs, chained after the standard output (if any)
+    for (o = outs; o < outs + num_outs; o++) {
+        out_open(o, read_column_names, use_column_names, terminator, compact, encoding);
+        o->next = o + 1 < outs + num_outs ? o + 1 : NULL;
     }
+    em.next = num_outs > 0 ? &outs[0] : NULL;
+    emits = mode == MODE_OUTS ? &outs[0] : &em;
+    if (sample_size > 0)
+        sample = sample_create(sample_size, seed);
+    if (keys != NULL && !read_column_names)
+        key_col = find_column(key_spec, NULL, 0);
+    if (join != NULL && !read_column_names)
+        join_resolve(join, NULL, 0);
+    if (unique != NULL && !read_column_names)
+        unique_resolve(unique, NULL, 0);
+    if (agg != NULL && !read_column_names)
+        agg_setup(agg, NULL, 0, &result_names);
+    if (profile != NULL && !read_column_names)
+        profile_resolve(profile, NULL, 0);
+    if (sorter != NULL && !read_column_names)
+        sort_resolve(sorter, result_names.fields, result_names.num);
+    if (partition != NULL && !read_column_names)
+        partition_resolve(partition, output_names->fields, output_names->num);
+
+    // Data rows that go straight to XML, JSON, or raw output can be output while they're being parsed
+    memset(&stream, 0, sizeof(stream));
+    stream.em = emits;
+    stream.parser = parser;
+    streaming = (mode == MODE_JSON || mode == MODE_XML_PLAIN || mode == MODE_XML_NAMES || mode == MODE_RAW)
+      && keys == NULL && join == NULL && unique == NULL && agg == NULL && profile == NULL && sample == NULL && sorter == NULL
+      && partition == NULL && num_outs == 0;
+
+    // Start collecting statistics
+    if (show_stats || show_progress)
+        stats_start(show_progress);
 
     // Read and parse input
     linenum = 1;
     first_row = 1;
     for (file_done = 0; !file_done; ) {
 
+        // Skip ahead to the start of the range using the index, once past any header row
+        if (index_in != NULL && !(first_row && read_column_names)) {
+            const uint64_t header = read_column_names ? 1 : 0;
+            uint64_t offset;
+            uint64_t line;
+            uint64_t entry;
+
+            if ((entry = index_lookup(index_in, range_start + header, &offset, &line)) > recnum + 1) {
+                parser_seek(parser, offset, line);
+                recnum = entry - 1;
+                datanum = recnum - header;
+            }
+            index_free(index_in);
+            index_in = NULL;
+        }
+
+        // Skip ahead to the checkpoint, once past any header row
+        if (resume_pending && !(first_row && read_column_names)) {
+            parser_seek(parser, ck.input_offset, ck.linenum);
+            recnum = ck.recnum;
+            datanum = ck.datanum;
+            emitted = ck.emitted;
+            resume_pending = 0;
+            if (datanum >= range_end || emitted >= limit)
+                file_done = 1;
+            continue;
+        }
+
+        // Once past any header row, pass along big fields in records that will be output as they're parsed
+        if (streaming && !(first_row && read_column_names)) {
+            csv_parser_set_chunk(parser, STREAM_CHUNK_SIZE, stream_chunk, &stream);
+            streaming = 0;
+        }
+        stream.active = datanum + 1 >= range_start && (every <= 1 || (datanum + 1 - range_start) % every == 0);
+        stream.started = 0;
+
         // Start parsing next row
-        switch ((ch = readch(fp, 1))) {
-        case EOF:
+        stats_phase(STATS_PARSE);
+        if (!parser_next(parser, &rec)) {
             file_done = 1;
             continue;
-        case '\n':                          // ignore completely empty lines
-            linenum++;
-            continue;
-        default:
-            ungetc(ch, fp);
-            break;
         }
-
-        // Read columns
-        while (readcol(fp, &row, &linenum))
-            ;
+        linenum = csv_parser_linenum(parser);
+        row.fields = rec.fields;
+        row.num = rec.num;
+        row.alloc = 0;
+
+        // Update counters
+        stats_phase(STATS_PROCESS);
+        recnum++;
+        totals.fields += row.num;
+        if (row.num > totals.max_width)
+            totals.max_width = row.num;
+        stats_progress(recnum, csv_parser_offset(parser));
+
+        // Update index
+        if (index_out != NULL) {
+            index_add(index_out, recnum, rec.offset, rec.linenum);
+            goto next;
+        }
 
         // Gather column names from first row, if configured
         if (first_row && read_column_names) {
-            int i, j;
+            int i;
 
-            // Convert to UTF-8 if needed
-            if (icd != NULL)
-                convert_to_utf8(icd, &row, linenum);
+            // Save column names, converted to UTF-8 if needed
+            for (i = 0; i < (int)row.num; i++) {
+                growrow(&column_names);
+                if (emitter != NULL) {
+                    if ((column_names.fields[column_names.num] = csv_emitter_to_utf8(emitter, row.fields[i], linenum)) == NULL)
+                        emitter_fail(emitter);
+                    column_names.num++;
+                } else
+                    addstring(&column_names, row.fields[i]);
+            }
+
+            // Resolve the key column
+            if (keys != NULL)
+                key_col = find_column(key_spec, column_names.fields, column_names.num);
+
+            // Resolve the join column and add the lookup file's columns
+            if (join != NULL) {
+                char *const *join_names;
+                size_t num_join_names;
 
-            // Save column names
-            memcpy(&column_names, &row, sizeof(row));
-            memset(&row, 0, sizeof(row));
+                join_resolve(join, column_names.fields, column_names.num);
+                join_width = column_names.num;
+                join_column_names(join, &join_names, &num_join_names);
+                for (i = 0; i < (int)num_join_names; i++)
+                    addstring(&column_names, join_names[i]);
+            }
+
+            // Resolve columns for duplicate detection, aggregation, profiling, sorting, and partitioning
+            if (unique != NULL)
+                unique_resolve(unique, column_names.fields, column_names.num);
+            if (agg != NULL)
+                agg_setup(agg, column_names.fields, column_names.num, &result_names);
+            if (profile != NULL)
+                profile_resolve(profile, column_names.fields, column_names.num);
+            if (sorter != NULL)
+                sort_resolve(sorter, output_names->fields, output_names->num);
+            if (partition != NULL)
+                partition_resolve(partition, output_names->fields, output_names->num);
 
             // If we had to defer parsing format string until we had the column names, do that now
-            if (mode == MODE_NORMAL)
-                nargs = parsefmt(format, &column_names, &args);
+            if (mode == MODE_NORMAL) {
+                em.nargs = nargs = parsefmt(format, output_names, &args);
+                em.args = args;
+            }
+
+            // Set up "--out" outputs' formats and column names
+            for (o = outs; o < outs + num_outs; o++) {
+                for (i = 0; i < (int)o->columns.num; i++) {
+                    if (!findstring(&column_names, o->columns.fields[i]))
+                        errx(1, "column \"%s\" not found", o->columns.fields[i]);
+                }
+                out_set_names(o, output_names, emitter != NULL && (mode == MODE_JSON
+                  || mode == MODE_XML_PLAIN || mode == MODE_XML_NAMES), name_prefix, linenum);
+            }
 
             // Check that all explicitly specified columns are actually present
             for (i = 0; i < allowed_column_names.num; i++) {
@@ -286,723 +1122,605 @@ main(int argc, char **argv)
                     errx(1, "column \"%s\" not found", allowed_column_names.fields[i]);
             }
 
-            // Check for illegal or duplicate column names
-            switch (mode) {
-            case MODE_JSON:
-                for (i = 0; i < column_names.num - 1; i++) {
-                    if (allowed_column_names.num > 0
-                      && !findstring(&allowed_column_names, column_names.fields[i]))
-                        continue;
-                    for (j = i + 1; j < column_names.num; j++) {
-                        if (strcmp(column_names.fields[i], column_names.fields[j]) == 0)
-                            errx(1, "duplicate column name \"%s\"", column_names.fields[i]);
-                    }
-                }
-                break;
-            case MODE_BASH:
-                for (i = 0; i < column_names.num; i++) {
-                    char *namei;
-
-                    if (allowed_column_names.num > 0
-                      && !findstring(&allowed_column_names, column_names.fields[i]))
-                        continue;
-                    if (asprintf(&namei, "%s%s", name_prefix, column_names.fields[i]) == -1)
-                        err(1, "asprintf");
-                    if (*namei == '\0')
-                        errx(1, "illegal empty string column name");
-                    for (j = i + 1; j < column_names.num; j++) {
-                        char *namej;
-                        int same = 1;
-                        int k;
-
-                        if (asprintf(&namej, "%s%s", name_prefix, column_names.fields[j]) == -1)
-                            err(1, "asprintf");
-                        for (k = 0; namei[k] != '\0' || namej[k] != '\0'; k++) {
-                            if (namei[k] == '\0' || namej[k] == '\0'
-                              || bash_name_safe(namei[k], k == 0) != bash_name_safe(namej[k], k == 0)) {
-                                same = 0;
-                                break;
-                            }
-                        }
-                        if (same)
-                            errx(1, "duplicate (bash variable) column names \"%s\" and \"%s\"", namei, namej);
-                        free(namej);
-                    }
-                    free(namei);
-                }
-                break;
-            default:
-                break;
+            // Set the output column names; this checks for illegal or duplicate column names
+            if (emitter != NULL && csv_emitter_set_names(emitter, output_names->fields, output_names->num,
+              name_prefix, allowed_column_names.fields, allowed_column_names.num) == -1)
+                emitter_fail(emitter);
+            if (sqlite != NULL) {
+                sqlite_output_set_names(sqlite, output_names->fields, output_names->num,
+                  name_prefix, allowed_column_names.fields, allowed_column_names.num);
             }
 
             // Proceed
             goto next;
         }
 
-        // Handle data row
-        switch (mode) {
-        case MODE_JSON:
-          {
-            int col;
-
-            // Convert columns to UTF-8
-            convert_to_utf8(icd, &row, linenum);
-
-            // Output row
-            printf("\x1e%c", use_column_names ? '{' : '[');
-            for (col = 0; col < row.num; col++) {
-
-                // Check whether column should be included
-                if (use_column_names
-                  && allowed_column_names.num > 0
-                  && (col >= column_names.num || !findstring(&allowed_column_names, column_names.fields[col])))
-                    continue;
-
-                // Add comma if needed
-                if (col > 0)
-                    putchar(',');
-
-                // Add column name (if using object notation)
-                if (use_column_names) {
-                    if (col < column_names.num) {
-                        putchar('"');
-                        print_json_string(name_prefix, linenum);
-                        print_json_string(column_names.fields[col], linenum);
-                        putchar('"');
-                    } else
-                        printf("\"col%d\"", col + 1);
-                    putchar(':');
-                }
-
-                // Add column value
-                putchar('"');
-                print_json_string(row.fields[col], linenum);
-                putchar('"');
-            }
-            printf("%c\n", use_column_names ? '}' : ']');
-            break;
-          }
-        case MODE_XML_PLAIN:
-        case MODE_XML_NAMES:
-          {
-            int col;
-
-            // Convert columns to UTF-8
-            convert_to_utf8(icd, &row, linenum);
-
-            // Output columns for row
-            printf("  <row>\n");
-            for (col = 0; col < row.num; col++) {
-                const char *ptr = row.fields[col];
-                int len = strlen(ptr);
-                int use_column_names_this_tag;
-                const char *esc;
-                int uchar;
-                int uclen;
-                int i;
-
-                // Check whether column should be included
-                if (use_column_names
-                  && allowed_column_names.num > 0
-                  && (col >= column_names.num || !findstring(&allowed_column_names, column_names.fields[col])))
-                    continue;
-
-                // Determine whether we can actually use column name for XML tag name
-                use_column_names_this_tag = use_column_names && col < column_names.num
-                  && (*name_prefix != '\0' || *column_names.fields[col] != '\0');
-
-                // Open XML tag
-                printf("    <");
-                if (use_column_names_this_tag) {
-                    print_xml_tag_name(name_prefix, linenum);
-                    print_xml_tag_name(column_names.fields[col], linenum);
-                } else
-                    printf("col%d", col + 1);
-                printf(">");
-
-                // Output XML characters, escaped as needed
-                while (len > 0) {
-                    uchar = decode_utf8(ptr, len, &uclen, linenum);
-                    if ((esc = escape_xml_char(uchar)) != NULL)
-                        printf("%s", esc);
-                    else {
-                        for (i = 0; i < uclen; i++)
-                            putchar(ptr[i]);
-                    }
-                    ptr += uclen;
-                    len -= uclen;
-                }
-
-                // Close XML tag
-                printf("</");
-                if (use_column_names_this_tag) {
-                    print_xml_tag_name(name_prefix, linenum);
-                    print_xml_tag_name(column_names.fields[col], linenum);
-                } else
-                    printf("col%d", col + 1);
-                printf(">\n");
-            }
-            printf("  </row>\n");
-            break;
-          }
-        case MODE_BASH:
-          {
-            char bash_name_buf[64];         // buffer just needs to be be enough to hold any of the bash_special_vars[]
-            int col;
-
-            // Start array (if needed)
-            if (!use_column_names)
-                printf("ROW=(");
-
-            // Output row
-            for (col = 0; col < row.num; col++) {
-
-                // Check whether column should be included
-                if (use_column_names
-                  && allowed_column_names.num > 0
-                  && (col >= column_names.num || !findstring(&allowed_column_names, column_names.fields[col])))
-                    continue;
-
-                // Elide any BASH special variable names
-                if (use_column_names && col < column_names.num) {
-                    snprintf(bash_name_buf, sizeof(bash_name_buf), "%s%s", name_prefix, column_names.fields[col]);
-                    if (findstring2(bash_special_vars, NUM_BASH_SPECIAL_VARS, bash_name_buf))
-                        continue;
-                }
-
-                // Add space
-                if (col > 0 || !use_column_names)
-                    putchar(' ');
-
-                // Add column name (if using column names)
-                if (use_column_names) {
-                    if (col < column_names.num) {
-                        print_bash_name(name_prefix);
-                        print_bash_name(column_names.fields[col]);
-                    } else
-                        printf("col%d", col + 1);
-                    putchar('=');
-                }
-
-                // Add column value
-                print_bash_value(row.fields[col]);
-
-                // Add separator
-                if (use_column_names)
-                    putchar(';');
-            }
-
-            // End array (if needed)
-            if (!use_column_names)
-                printf(" )");
-
-            // End line
-            printf("\n");
-            break;
-          }
-        case MODE_NORMAL:
-          {
-            char ncolbuf[32];
-            char empty[] = { '\0' };
-            pid_t pid;
-            pid_t result;
-            int status;
-            int i;
+        // Skip rows outside of the range
+        if (++datanum < range_start)
+            goto next;
 
-            fflush(stdout);
-            fflush(stderr);
-            switch ((pid = fork())) {
-            case -1:
-                err(1, "fork");
-            case 0:
-                close(0);
-                if ((argv = malloc((nargs + 3) * sizeof(*argv))) == NULL)
-                    err(1, "malloc");
-                argv[0] = strdup("printf");
-                if (argv[0] == NULL)
-                    err(1, "strdup");
-                argv[1] = format;
-                snprintf(ncolbuf, sizeof(ncolbuf), "%lu", (unsigned long)row.num);
-                for (i = 0; i < nargs; i++)
-                    argv[2 + i] = args[i] == 0 ? ncolbuf : args[i] <= row.num ? row.fields[args[i] - 1] : empty;
-                argv[2 + nargs] = NULL;
-                execvp(PRINTF_PROGRAM, argv);
-                err(1, "execvp");
-            default:
-                while (1) {
-                    if ((result = waitpid(pid, &status, 0)) == -1)
-                        err(1, "waitpid");
-                    if (WIFEXITED(status)) {
-                        if (WEXITSTATUS(status) != 0)
-                            exit(status);
-                        break;
-                    }
-                    if (WIFSIGNALED(status))
-                        exit(1);
-                }
-                break;
-            }
-            break;
-          }
-        default:
-            errx(1, "internal error");
+        // Handle data row
+        if (keys != NULL && keyset_contains(keys, key_col < row.num ? row.fields[key_col] : "") == drop_keys)
+            goto next;
+        if (every > 1 && (datanum - range_start) % every != 0)
+            goto next;
+        if (join != NULL && !join_row(join, &row, join_width))
+            goto next;
+        if (unique != NULL && !unique_check(unique, row.fields, row.num))
+            goto next;
+        if (agg != NULL) {
+            agg_add(agg, row.fields, row.num);
+            goto next;
+        }
+        if (profile != NULL) {
+            profile_add(profile, row.fields, row.num);
+            goto next;
+        }
+        if (sample != NULL) {
+            sample_add(sample, &row, linenum);
+            goto next;
         }
+        if (sorter != NULL) {
+            sort_add(sorter, row.fields, row.num, linenum);
+            goto next;
+        }
+        if (stream.started)
+            stream_finish(&stream, &row, linenum);
+        else
+            emit_row(emits, &row, linenum);
+        if (flush_mode == FLUSH_RECORD) {
+            fflush(out);
+            last_flush = now_millis();
+        }
+        if (++emitted >= limit)
+            file_done = 1;
 
 next:
         // Free row memory
         freerow(&row);
         first_row = 0;
+
+        // Flush output that has waited too long, even if this record wasn't output
+        if (flush_millis > 0 && now_millis() - last_flush >= flush_millis) {
+            fflush(out);
+            last_flush = now_millis();
+        }
+
+        // Stop after the end of the range
+        if (datanum >= range_end)
+            file_done = 1;
+
+        // Save a checkpoint every so often
+        if (checkpoint_file != NULL && !resume_pending && recnum % CHECKPOINT_RECORDS == 0
+          && now_millis() - last_checkpoint >= CHECKPOINT_MILLIS) {
+            save_checkpoint(checkpoint_file, out, parser, quote, fsep, recnum, datanum, emitted);
+            last_checkpoint = now_millis();
+        }
     }
 
-    // XML closing
-    if (mode == MODE_XML_PLAIN || mode == MODE_XML_NAMES)
-        printf("</csv>\n");
+    // Save a final checkpoint, so resuming a finished job just finishes the output
+    if (checkpoint_file != NULL && !resume_pending)
+        save_checkpoint(checkpoint_file, out, parser, quote, fsep, recnum, datanum, emitted);
+    linenum = csv_parser_linenum(parser);
+
+    stats_phase(STATS_PROCESS);
+    if (unique != NULL)
+        unique_free(unique);
+    if (join != NULL)
+        join_free(join);
+    if (keys != NULL)
+        keyset_free(keys);
+
+    // Output aggregation or profile results, sampled rows, and/or sorted rows
+    memset(&results, 0, sizeof(results));
+    results.em = emits;
+    results.sorter = sorter;
+    results.limit = limit;
+    results.linenum = linenum;
+    if (agg != NULL)
+        agg_finish(agg, output_summary_fields, &results);
+    if (profile != NULL)
+        profile_finish(profile, output_summary_fields, &results);
+    if (sample != NULL)
+        sample_emit(sample, &results);
+    if (sorter != NULL) {
+        results.sorter = NULL;
+        sort_finish(sorter, output_fields, &results);
+    }
 
-    // Clean up iconv
-    if (icd != NULL)
-        (void)iconv_close(icd);
+    // XML closing
+    if (partition != NULL)
+        partition_finish(partition);
+    if (emitter != NULL) {
+        if (partition == NULL)
+            csv_emitter_end(emitter, out);
+        csv_emitter_free(emitter);
+    }
+    if (sqlite != NULL)
+        sqlite_output_close(sqlite);
+    for (o = outs; o < outs + num_outs; o++)
+        out_close(o);
+    free(outs);
+
+    // Write index
+    if (index_out != NULL) {
+        index_save(index_out, build_index, fileno(fp), quote, fsep);
+        index_free(index_out);
+    }
+    if (index_in != NULL)
+        index_free(index_in);
 
     // Clean up
-    if (fp != stdin)
-        fclose(fp);
+    totals.bytes_in = csv_parser_offset(parser);
+    totals.allocations = num_allocations + csv_parser_allocations(parser);
+    csv_parser_free(parser);
+    fclose(fp);
     freerow(&column_names);
+    freerow(&result_names);
     free(args);
 
     // Done
+    if (out != stdout && fclose(out) == EOF)
+        err(1, "write");
     fflush(stdout);
+
+    // Report statistics
+    totals.records = recnum;
+    if (out != stdout)
+        totals.bytes_out = output_bytes();
+    else {
+        const off_t stdout_end = stdout_start != -1 ? lseek(STDOUT_FILENO, 0, SEEK_CUR) : -1;
+
+        totals.bytes_out = stdout_end != -1 ? stdout_end - stdout_start : STATS_UNKNOWN;
+    }
+    stats_finish(show_stats ? &totals : NULL);
     return 0;
 }
 
-// Output XML tag name, substituting invalid characters
+// Output one data row to each output in the chain
 static void
-print_xml_tag_name(const char *tag, int linenum)
+emit_row(const struct emit *em, struct row *row, int linenum)
 {
-    int first = 1;
-    int uchar;
-    int uclen;
-    int ok;
-    int i;
+    const int phase = stats_phase(STATS_OUTPUT);
+    char *const *utf8 = NULL;                   // fields converted to UTF-8, shared by XML and JSON outputs
 
-    while (*tag != '\0') {
-        uchar = decode_utf8(tag, strlen(tag), &uclen, linenum);
-        if (first) {
-            ok = isalpha(uchar) || uchar == '_';
-            first = 0;
-        } else
-            ok = isalpha(uchar) || isdigit(uchar) || uchar == '_' || uchar == '-' || uchar == '.';
-        if (!ok)
-            putchar('_');
-        else {
-            for (i = 0; i < uclen; i++)
-                putchar(tag[i]);
-        }
-        tag += uclen;
-    }
+    for (; em != NULL; em = em->next)
+        emit_one(em, row, &utf8, linenum);
+    stats_phase(phase);
 }
 
-static const char *
-escape_xml_char(int uchar)
+// Output one data row in the output's mode
+static void
+emit_one(const struct emit *em, struct row *row, char *const **utf8p, int linenum)
 {
-    static char buf[32];
+    FILE *const out = em->partition != NULL ? partition_select(em->partition, row->fields, row->num) : em->out;
 
-    switch (uchar) {
-    case '>':
-        return "&gt;";
+    switch (em->mode) {
+    case MODE_JSON:
+    case MODE_XML_PLAIN:
+    case MODE_XML_NAMES:
+        if (*utf8p == NULL) {
+            const int phase = stats_phase(STATS_TRANSCODE);
+
+            if ((*utf8p = csv_emitter_convert(em->emitter, row->fields, row->num, linenum)) == NULL)
+                emitter_fail(em->emitter);
+            stats_phase(phase);
+        }
+        csv_emitter_write_utf8(em->emitter, out, *utf8p, row->num, linenum);
         break;
-    case '<':
-        return "&lt;";
+    case MODE_BASH:
+    case MODE_RAW:
+        if (csv_emitter_write(em->emitter, out, row->fields, row->num, linenum) == -1)
+            emitter_fail(em->emitter);
         break;
-    case '&':
-        return "&amp;";
+    case MODE_SQLITE:
+        sqlite_output_add(em->sqlite, row->fields, row->num, linenum);
         break;
+    case MODE_NORMAL:
+      {
+        char ncolbuf[32];
+        char empty[] = { '\0' };
+        char buf[4096];
+        char **argv;
+        pid_t pid;
+        pid_t result;
+        ssize_t r;
+        int pfd[2];
+        int status;
+        int i;
+
+        // When not writing directly to stdout, capture printf(1) output through a pipe
+        if (out == stdout)
+            fflush(stdout);
+        else if (pipe(pfd) == -1)
+            err(1, "pipe");
+        fflush(stderr);
+        switch ((pid = fork())) {
+        case -1:
+            err(1, "fork");
+        case 0:
+            close(0);
+            if (out != stdout) {
+                if (dup2(pfd[1], STDOUT_FILENO) == -1)
+                    err(1, "dup2");
+                close(pfd[0]);
+                close(pfd[1]);
+            }
+            if ((argv = malloc((em->nargs + 3) * sizeof(*argv))) == NULL)
+                err(1, "malloc");
+            argv[0] = strdup("printf");
+            if (argv[0] == NULL)
+                err(1, "strdup");
+            argv[1] = em->format;
+            snprintf(ncolbuf, sizeof(ncolbuf), "%lu", (unsigned long)row->num);
+            for (i = 0; i < em->nargs; i++)
+                argv[2 + i] = em->args[i] == 0 ? ncolbuf : em->args[i] <= row->num ? row->fields[em->args[i] - 1] : empty;
+            argv[2 + em->nargs] = NULL;
+            execvp(PRINTF_PROGRAM, argv);
+            err(1, "execvp");
+        default:
+            if (out != stdout) {
+                close(pfd[1]);
+                while ((r = read(pfd[0], buf, sizeof(buf))) != 0) {
+                    if (r == -1) {
+                        if (errno == EINTR)
+                            continue;
+                        err(1, "read");
+                    }
+                    fwrite(buf, 1, r, out);
+                }
+                close(pfd[0]);
+            }
+            while (1) {
+                if ((result = waitpid(pid, &status, 0)) == -1)
+                    err(1, "waitpid");
+                if (WIFEXITED(status)) {
+                    if (WEXITSTATUS(status) != 0)
+                        exit(status);
+                    break;
+                }
+                if (WIFSIGNALED(status))
+                    exit(1);
+            }
+            break;
+        }
+        break;
+      }
     default:
+        errx(1, "internal error");
+    }
+}
 
-        // Pass valid and unrestricted characters through (but not CR)
-        // http://en.wikipedia.org/wiki/Valid_characters_in_XML
-        if ((uchar == '\n' || uchar == '\t'
-            || (uchar >= 0x0020 && uchar <= 0xd7ff)
-            || (uchar >= 0xe000 && uchar <= 0xfffd)
-            || (uchar >= 0x10000 && uchar <= 0x10ffff))
-          && !((uchar >= 0x007f && uchar <= 0x0084) || (uchar >= 0x0086 && uchar <= 0x009F)))
-            return NULL;
-
-        // Escape other characters
-        snprintf(buf, sizeof(buf), "&#%u;", uchar);
-        return buf;
+// Open an "--out" file and set up its output
+static void
+out_open(struct emit *o, int read_column_names, int use_column_names, int terminator, int compact, const char *encoding)
+{
+    if ((o->out = fopen(o->path, "w")) == NULL)
+        err(1, "%s", o->path);
+    if (setvbuf(o->out, NULL, _IOFBF, OUT_BUFFER_SIZE) != 0)
+        err(1, "setvbuf");
+    switch (o->mode) {
+    case MODE_XML_PLAIN:
+        o->emitter = emitter_open(CSV_EMIT_XML, 0, encoding);
+        break;
+    case MODE_XML_NAMES:
+        o->emitter = emitter_open(CSV_EMIT_XML, 1, encoding);
+        break;
+    case MODE_JSON:
+        o->emitter = emitter_open(CSV_EMIT_JSON, use_column_names, encoding);
+        break;
+    case MODE_BASH:
+        o->emitter = emitter_open(CSV_EMIT_BASH, use_column_names, encoding);
+        break;
+    case MODE_RAW:
+        o->emitter = emitter_open(CSV_EMIT_RAW, use_column_names, encoding);
+        csv_emitter_set_terminator(o->emitter, terminator);
+        break;
+    case MODE_NORMAL:
+        if (!read_column_names)
+            o->nargs = parsefmt(o->format, NULL, &o->args);
+        break;
+    default:
+        errx(1, "internal error");
+    }
+    if (o->emitter != NULL) {
+        csv_emitter_set_compact(o->emitter, compact);
+        csv_emitter_begin(o->emitter, o->out);
     }
 }
 
+// Give an "--out" output the column names, converting them to UTF-8 for XML and JSON if not already
 static void
-print_bash_name(const char *string)
+out_set_names(struct emit *o, const struct row *names, int names_utf8, const char *prefix, int linenum)
 {
-    int i;
+    struct row utf8_names;
+    size_t i;
+
+    if (o->mode == MODE_NORMAL) {
+        o->nargs = parsefmt(o->format, names, &o->args);
+        return;
+    }
+    if (names_utf8 || o->mode == MODE_BASH || o->mode == MODE_RAW) {
+        if (csv_emitter_set_names(o->emitter, names->fields, names->num, prefix, o->columns.fields, o->columns.num) == -1)
+            emitter_fail(o->emitter);
+        return;
+    }
+    memset(&utf8_names, 0, sizeof(utf8_names));
+    for (i = 0; i < names->num; i++) {
+        growrow(&utf8_names);
+        if ((utf8_names.fields[utf8_names.num] = csv_emitter_to_utf8(o->emitter, names->fields[i], linenum)) == NULL)
+            emitter_fail(o->emitter);
+        utf8_names.num++;
+    }
+    if (csv_emitter_set_names(o->emitter, utf8_names.fields, utf8_names.num, prefix, o->columns.fields, o->columns.num) == -1)
+        emitter_fail(o->emitter);
+    freerow(&utf8_names);
+}
 
-    for (i = 0; string[i] != '\0'; i++)
-        fputc(bash_name_safe(string[i], i == 0), stdout);
+// Finish and close an "--out" file
+static void
+out_close(struct emit *o)
+{
+    if (o->emitter != NULL) {
+        csv_emitter_end(o->emitter, o->out);
+        csv_emitter_free(o->emitter);
+    }
+    if (fclose(o->out) == EOF)
+        err(1, "%s", o->path);
+    freerow(&o->columns);
+    free(o->format);
+    free(o->args);
 }
 
+// Output a piece of a big field, first starting the record and outputting any complete fields before it
 static void
-print_bash_value(const char *string)
+stream_chunk(void *arg, char *const *fields, size_t col, const char *data, size_t len)
 {
-    int single_quotes = 1;
-    int i;
+    struct stream *const st = arg;
+    struct csv_emitter *const emitter = st->em->emitter;
+    FILE *const out = st->em->out;
+    const int linenum = csv_parser_linenum(st->parser);
+    int phase;
 
-    // See if plain single quotes will work
-    for (i = 0; string[i] != '\0'; i++) {
-        if (string[i] == '\'' || !isprint((unsigned char)string[i])) {
-            single_quotes = 0;
-            break;
-        }
+    if (!st->active)                            // the record will be skipped anyway
+        return;
+    phase = stats_phase(STATS_OUTPUT);
+    if (!st->started) {
+        if (csv_emitter_begin_record(emitter, out) == -1)
+            emitter_fail(emitter);
+        st->started = 1;
+        st->open = 0;
+        st->next_col = 0;
     }
 
-    // Output value
-    if (single_quotes)
-        printf("'%s'", string);
-    else {
-        printf("$'");
-        for (i = 0; string[i] != '\0'; i++) {
-            switch (string[i]) {
-            case '\'':
-                printf("\\'");
-                break;
-            case '\\':
-                printf("\\\\");
-                break;
-            case '\b':
-                printf("\\b");
-                break;
-            case '\f':
-                printf("\\f");
-                break;
-            case '\n':
-                printf("\\n");
-                break;
-            case '\r':
-                printf("\\r");
-                break;
-            case '\t':
-                printf("\\t");
-                break;
-            case '\v':
-                printf("\\v");
-                break;
-            default:
-                if (isprint((unsigned char)string[i]))
-                    putchar((unsigned char)string[i]);
-                else
-                    printf("\\x%02x", (unsigned char)string[i]);
-                break;
-            }
-        }
-        putchar('\'');
+    // Finish the previous big field, which is now complete
+    if (st->open && st->next_col <= col) {
+        if (csv_emitter_field_data(emitter, out, fields[st->next_col - 1], strlen(fields[st->next_col - 1]), linenum) == -1
+          || csv_emitter_end_field(emitter, out, linenum) == -1)
+            emitter_fail(emitter);
+        st->open = 0;
     }
+
+    // Output the complete fields before this one, then start this one
+    for ( ; st->next_col < col; st->next_col++) {
+        if (csv_emitter_begin_field(emitter, out, st->next_col, linenum) == -1
+          || csv_emitter_field_data(emitter, out, fields[st->next_col], strlen(fields[st->next_col]), linenum) == -1
+          || csv_emitter_end_field(emitter, out, linenum) == -1)
+            emitter_fail(emitter);
+    }
+    if (!st->open) {
+        if (csv_emitter_begin_field(emitter, out, col, linenum) == -1)
+            emitter_fail(emitter);
+        st->next_col = col + 1;
+        st->open = 1;
+    }
+    if (csv_emitter_field_data(emitter, out, data, len, linenum) == -1)
+        emitter_fail(emitter);
+    stats_phase(phase);
 }
 
-static char
-bash_name_safe(char ch, int first)
+// Finish outputting a record started by stream_chunk()
+static void
+stream_finish(struct stream *st, const struct row *row, int linenum)
 {
-    if (isupper((unsigned char)ch) || islower((unsigned char)ch) || ch == '_')
-        return ch;
-    if (!first && isdigit((unsigned char)ch))
-        return ch;
-    return '_';
+    struct csv_emitter *const emitter = st->em->emitter;
+    FILE *const out = st->em->out;
+    const int phase = stats_phase(STATS_OUTPUT);
+    size_t col;
+
+    if (st->open) {
+        col = st->next_col - 1;
+        if (csv_emitter_field_data(emitter, out, row->fields[col], strlen(row->fields[col]), linenum) == -1
+          || csv_emitter_end_field(emitter, out, linenum) == -1)
+            emitter_fail(emitter);
+    }
+    for (col = st->next_col; col < row->num; col++) {
+        if (csv_emitter_begin_field(emitter, out, col, linenum) == -1
+          || csv_emitter_field_data(emitter, out, row->fields[col], strlen(row->fields[col]), linenum) == -1
+          || csv_emitter_end_field(emitter, out, linenum) == -1)
+            emitter_fail(emitter);
+    }
+    csv_emitter_end_record(emitter, out);
+    stats_phase(phase);
 }
 
-// Output JSON string
+// Output the start and end of each partition's file
 static void
-print_json_string(const char *string, int linenum)
+partition_begin(void *arg, FILE *fp)
 {
-    int uchar;
-    int uclen;
+    csv_emitter_begin(arg, fp);
+}
 
-    while (*string != '\0') {
-        uchar = decode_utf8(string, strlen(string), &uclen, linenum);
-        switch (uchar) {
-        case '"':
-            printf("\\\"");
-            break;
-        case '\\':
-            printf("\\\\");
-            break;
-        case '\b':
-            printf("\\b");
-            break;
-        case '\f':
-            printf("\\f");
-            break;
-        case '\n':
-            printf("\\n");
-            break;
-        case '\r':
-            printf("\\r");
-            break;
-        case '\t':
-            printf("\\t");
-            break;
-        default:
-            if (isprint(uchar))
-                printf("%c", uchar);
-            else
-                printf("\\u%04x", uchar);
-            break;
-        }
-        string += uclen;
-    }
+static void
+partition_end(void *arg, FILE *fp)
+{
+    csv_emitter_end(arg, fp);
+}
+
+//
+// Reservoir sampling ("Algorithm R"): the first "size" rows fill the reservoir, after which
+// the n'th row replaces a random existing row with probability size/n. Rows that don't make it
+// are discarded without being converted or escaped.
+//
+static struct sample *
+sample_create(size_t size, uint64_t seed)
+{
+    struct sample *sample;
+
+    if ((sample = calloc(1, sizeof(*sample))) == NULL)
+        err(1, "calloc");
+    if ((sample->rows = calloc(size, sizeof(*sample->rows))) == NULL)
+        err(1, "calloc");
+    sample->size = size;
+    sample->rng = seed != 0 ? seed : 1;      // xorshift state must be non-zero
+    return sample;
 }
 
-// Convert row columns to UTF-8 encoding
+// Offer a row to the sample; if kept, the row's memory is taken over and *row is reset
 static void
-convert_to_utf8(iconv_t icd, struct row *row, int linenum)
+sample_add(struct sample *sample, struct row *row, int linenum)
 {
-    int col;
-
-    for (col = 0; col < row->num; col++) {
-        char *const ibuf = row->fields[col];
-        char *iptr;
-        char *obuf;
-        char *optr;
-        size_t iremain;
-        size_t oremain;
-        size_t olen;
-
-        // Convert column
-        if (iconv(icd, NULL, NULL, NULL, NULL) == (size_t)-1)
-            err(1, "iconv");
-        iremain = strlen(ibuf);
-        oremain = 64 + 4 * iremain;
-        if ((obuf = malloc(oremain)) == NULL)
-            err(1, "malloc");
-        iptr = ibuf;
-        optr = obuf;
-        if (iconv(icd, &iptr, &iremain, &optr, &oremain) == (size_t)-1) {
-            switch (errno) {
-            case EILSEQ:
-                errx(1, "line %d: %s multibyte sequence", linenum, "illegal");
-            case EINVAL:
-                errx(1, "line %d: %s multibyte sequence", linenum, "truncated");
-            default:
-                err(1, "line %d: iconv", linenum);
-            }
-        }
-        olen = optr - obuf;
-
-        // Replace column
-        if ((row->fields[col] = realloc(row->fields[col], olen + 1)) == NULL)
-            err(1, "realloc");
-        memcpy(row->fields[col], obuf, olen);
-        row->fields[col][olen] = '\0';
-        free(obuf);
+    struct sample_row *slot;
+    uint64_t r;
+
+    sample->seen++;
+    if (sample->num < sample->size)
+        slot = &sample->rows[sample->num++];
+    else {
+
+        // Next xorshift64* random number
+        sample->rng ^= sample->rng >> 12;
+        sample->rng ^= sample->rng << 25;
+        sample->rng ^= sample->rng >> 27;
+        r = sample->rng * 0x2545f4914f6cdd1dULL;
+
+        // Maybe replace an existing row
+        if ((r %= sample->seen) >= sample->size)
+            return;
+        slot = &sample->rows[r];
+        freerow(&slot->row);
     }
+    ownrow(row);
+    memcpy(&slot->row, row, sizeof(*row));
+    memset(row, 0, sizeof(*row));
+    slot->datanum = sample->seen;
+    slot->linenum = linenum;
 }
 
-// Decode UTF-8 character
-static int
-decode_utf8(const char *const obuf, size_t olen, int *lenp, int linenum)
+// Output the sampled rows in their original input order, then free the sample
+static void
+sample_emit(struct sample *sample, struct result_output *ro)
 {
-    int uchar;
-    int uclen;
-    int i = 0;
-
-    if ((obuf[i] & 0x80) == 0x00) {
-        uclen = 1;
-        uchar = obuf[i] & 0x7f;
-    } else if ((obuf[i] & 0xe0) == 0xc0 && i + 1 < olen) {
-        uclen = 2;
-        uchar = ((obuf[i] & 0x1f) <<  6)
-          | ((obuf[i + 1] & 0x3f) <<  0);
-    } else if ((obuf[i] & 0xf0) == 0xe0 && i + 2 < olen) {
-        uclen = 3;
-        uchar = ((obuf[i] & 0x0f) << 12)
-          | ((obuf[i + 1] & 0x3f) <<  6)
-          | ((obuf[i + 2] & 0x3f) <<  0);
-    } else if ((obuf[i] & 0xf8) == 0xf0 && i + 3 < olen) {
-        uclen = 4;
-        uchar = ((obuf[i] & 0x07) << 18)
-          | ((obuf[i + 1] & 0x3f) << 12)
-          | ((obuf[i + 2] & 0x3f) <<  6)
-          | ((obuf[i + 3] & 0x3f) <<  0);
-    } else if ((obuf[i] & 0xfc) == 0xf8 && i + 4 < olen) {
-        uclen = 5;
-        uchar = ((obuf[i] & 0x03) << 24)
-          | ((obuf[i + 1] & 0x3f) << 18)
-          | ((obuf[i + 2] & 0x3f) << 12)
-          | ((obuf[i + 3] & 0x3f) <<  6)
-          | ((obuf[i + 4] & 0x3f) <<  0);
-    } else if ((obuf[i] & 0xfe) == 0xfc && i + 5 < olen) {
-        uclen = 6;
-        uchar = ((obuf[i] & 0x01) << 30)
-          | ((obuf[i + 1] & 0x3f) << 24)
-          | ((obuf[i + 2] & 0x3f) << 18)
-          | ((obuf[i + 3] & 0x3f) << 12)
-          | ((obuf[i + 4] & 0x3f) <<  6)
-          | ((obuf[i + 5] & 0x3f) <<  0);
-    } else
-        errx(1, "line %d: internal error decoding UTF-8: 0x%02x", linenum, obuf[i] & 0xff);
+    size_t i;
 
-    // Done
-    *lenp = uclen;
-    return uchar;
+    qsort(sample->rows, sample->num, sizeof(*sample->rows), sample_cmp);
+    for (i = 0; i < sample->num; i++) {
+        output_result(ro, &sample->rows[i].row, sample->rows[i].linenum);
+        freerow(&sample->rows[i].row);
+    }
+    free(sample->rows);
+    free(sample);
 }
 
 static int
-readcol(FILE *fp, struct row *row, int *linenum)
+sample_cmp(const void *ptr1, const void *ptr2)
 {
-    struct col col;
-    int row_done;
-    int ch;
+    const struct sample_row *const row1 = ptr1;
+    const struct sample_row *const row2 = ptr2;
 
-    // Process initial stuff; skip leading whitespace, excluding our field separator (which could be TAB)
-    do {
-        if ((ch = readch(fp, 1)) == EOF)
-            ch = '\n';
-        if (ch == '\n') {           // end of line forces empty column and terminates the row
-            memset(&col, 0, sizeof(col));
-            addcolumn(row, &col);
-            (*linenum)++;
-            return 0;
-        }
-    } while (isspace(ch) && ch != fsep);
-    ungetc(ch, fp);
-
-    // Read quoted or unquoted value
-    if (ch == quote)
-        row_done = readqcol(fp, &col, linenum);
-    else
-        row_done = readuqcol(fp, &col, linenum);
-    addcolumn(row, &col);
-    return row_done;
+    return row1->datanum < row2->datanum ? -1 : row1->datanum > row2->datanum ? 1 : 0;
 }
 
-//
-// Read a quoted column, return true if there's more
-//
-static int
-readqcol(FILE *fp, struct col *col, int *linenum)
+// Resolve aggregation columns and get the names of the result columns
+static void
+agg_setup(struct agg *agg, char *const *names, size_t num_names, struct row *agg_names)
 {
-    int done = 0;
-    int escape = 0;
-    int ch;
+    char *const *result_names;
+    size_t num;
+    size_t i;
 
-    readch(fp, 0);
-    memset(col, 0, sizeof(*col));
-    while (1) {
-        assert(!escape || !done);
-        if ((ch = readch(fp, escape)) == EOF) {
-            if (escape || done)
-                ch = '\n';
-            else
-                errx(1, "line %d: premature EOF", *linenum);
-        }
-        if (done) {
-            if (ch == '\n') {
-                (*linenum)++;
-                return 0;
-            }
-            if (ch == fsep)
-                return 1;
-            if (isspace(ch))
-                continue;
-            errx(1, "line %d: unexpected character \"%c\"", *linenum, ch);
-        }
-        if (escape) {
-            if (ch == quote)
-                addchar(col, quote);
-            else {
-                ungetc(ch, fp);
-                done = 1;
-            }
-            escape = 0;
-            continue;
-        }
-        if (ch == quote) {
-            escape = 1;
-            continue;
-        }
-        addchar(col, ch);
-        if (ch == '\n')
-            (*linenum)++;
+    agg_resolve(agg, names, num_names);
+    agg_column_names(agg, &result_names, &num);
+    for (i = 0; i < num; i++)
+        addstring(agg_names, result_names[i]);
+}
+
+// Load the lookup file for a join, parsing it the same way as the main input
+static void
+join_setup(struct join *join, const char *path, int read_column_names, int quote, int fsep)
+{
+    struct csv_parser *parser;
+    struct csv_record rec;
+    int first_row = 1;
+    FILE *fp;
+
+    fp = input_open(path, 0);
+    parser = parser_open(fp, quote, fsep);
+    if (!read_column_names)
+        join_load_names(join, NULL, 0);
+    while (parser_next(parser, &rec)) {
+        if (first_row && read_column_names)
+            join_load_names(join, rec.fields, rec.num);
+        else
+            join_load(join, rec.fields, rec.num);
+        first_row = 0;
     }
+    if (ferror(fp))
+        err(1, "%s", path);
+    csv_parser_free(parser);
+    fclose(fp);
+    if (first_row && read_column_names)
+        errx(1, "%s: lookup file is empty", path);
 }
 
-//
-// Read an unquoted column, return true if there's more
-//
+// Append the matching lookup fields to a row; returns zero if there's no match and this is an inner join
 static int
-readuqcol(FILE *fp, struct col *col, int *linenum)
+join_row(struct join *join, struct row *row, size_t width)
 {
-    int ch;
+    char *const *fields = NULL;
+    size_t num = 0;
+    size_t i;
 
-    memset(col, 0, sizeof(*col));
-    while (1) {
-        if ((ch = readch(fp, 1)) == EOF)
-            ch = '\n';
-        if (ch == '\n') {
-            (*linenum)++;
-            trim(col);
-            return 0;
-        }
-        if (ch == fsep) {
-            trim(col);
-            return 1;
-        }
-        addchar(col, ch);
-    }
+    if (!join_lookup(join, row->fields, row->num, &fields, &num) && !join_is_left(join))
+        return 0;
+    ownrow(row);
+    while (row->num < width)
+        addstring(row, "");
+    for (i = 0; i < join_num_columns(join); i++)
+        addstring(row, i < num ? fields[i] : "");
+    return 1;
 }
 
-//
-// Trims whitespace around a column
-//
+// Output a row (or send it to the sorter), subject to "--limit"
 static void
-trim(struct col *col)
+output_result(struct result_output *ro, struct row *row, int linenum)
 {
-    size_t skip;
-
-    while (col->len > 0 && isspace((unsigned char)col->buf[col->len - 1]))
-        col->len--;
-    for (skip = 0; skip < col->len && isspace((unsigned char)col->buf[skip]); skip++)
-        ;
-    col->len -= skip;
-    memmove(col->buf, col->buf + skip, col->len);
+    if (ro->sorter != NULL)
+        sort_add(ro->sorter, row->fields, row->num, linenum);
+    else if (ro->emitted++ < ro->limit)
+        emit_row(ro->em, row, linenum);
 }
 
-//
-// Adds the character to the column
-//
 static void
-addchar(struct col *col, int ch)
+output_summary_fields(void *arg, char *const *fields, size_t num)
 {
-    if (col->alloc <= col->len) {
-        int new_alloc;
-        char *new_buf;
-
-        new_alloc = col->alloc == 0 ? 32 : col->alloc * 2;
-        if ((new_buf = realloc(col->buf, new_alloc)) == NULL)
-            err(1, "realloc");
-        col->buf = new_buf;
-        col->alloc = new_alloc;
-    }
-    col->buf[col->len++] = ch;
+    struct result_output *const ro = arg;
+
+    output_fields(ro, fields, num, ro->linenum);
 }
 
-//
-// Adds the column to the row, then frees the column
-//
 static void
-addcolumn(struct row *row, const struct col *col)
+output_fields(void *arg, char *const *fields, size_t num, int linenum)
 {
-    growrow(row);
-    if (col->alloc >= col->len + 1) {
-        col->buf[col->len] = '\0';
-        row->fields[row->num] = col->buf;
-    } else {
-        if ((row->fields[row->num] = malloc(col->len + 1)) == NULL)
-            err(1, "malloc");
-        memcpy(row->fields[row->num], col->buf, col->len);
-        row->fields[row->num][col->len] = '\0';
-        free(col->buf);
-    }
-    memset(&col, 0, sizeof(col));
-    row->num++;
+    struct result_output *const ro = arg;
+    struct row row;
+    size_t i;
+
+    memset(&row, 0, sizeof(row));
+    for (i = 0; i < num; i++)
+        addstring(&row, fields[i]);
+    output_result(ro, &row, linenum);
+    freerow(&row);
 }
 
 // Copy given string and add to row
@@ -1012,21 +1730,16 @@ addstring(struct row *row, const char *const string)
     growrow(row);
     if ((row->fields[row->num++] = strdup(string)) == NULL)
         err(1, "strdup");
+    num_allocations++;
 }
 
 static int
 findstring(struct row *row, const char *const string)
-{
-    return findstring2((const char *const *)row->fields, row->num, string);
-}
-
-static int
-findstring2(const char *const *list, size_t num, const char *const string)
 {
     size_t i;
 
-    for (i = 0; i < num; i++) {
-        if (strcmp(list[i], string) == 0)
+    for (i = 0; i < row->num; i++) {
+        if (strcmp(row->fields[i], string) == 0)
             return 1;
     }
     return 0;
@@ -1043,6 +1756,7 @@ growrow(struct row *row)
     new_alloc = row->alloc == 0 ? 32 : row->alloc * 2;
     if ((new_fields = realloc(row->fields, new_alloc * sizeof(*row->fields))) == NULL)
         err(1, "realloc");
+    num_allocations++;
     row->fields = new_fields;
     row->alloc = new_alloc;
     memset(row->fields + row->num, 0, (row->alloc - row->num) * sizeof(*row->fields));
@@ -1086,6 +1800,177 @@ parsefmt(char *fmt, const struct row *column_names, unsigned int **argsp)
     return nargs;
 }
 
+// Parse a non-negative decimal number
+static uint64_t
+parsecount(const char *optname, const char *str, int allow_zero)
+{
+    unsigned long long value;
+    char *eptr;
+
+    errno = 0;
+    value = strtoull(str, &eptr, 10);
+    if (!isdigit((unsigned char)*str) || *eptr != '\0' || errno == ERANGE || (value == 0 && !allow_zero))
+        errx(1, "invalid argument to \"--%s\"", optname);
+    return value;
+}
+
+// Parse a record range of the form "start:end" where either may be omitted
+static void
+parserange(const char *optname, const char *str, uint64_t *startp, uint64_t *endp)
+{
+    const char *const colon = strchr(str, ':');
+    char *buf;
+
+    if (colon == NULL)
+        errx(1, "invalid argument to \"--%s\"", optname);
+    if ((buf = strndup(str, colon - str)) == NULL)
+        err(1, "strndup");
+    *startp = *buf != '\0' ? parsecount(optname, buf, 0) : 1;
+    *endp = colon[1] != '\0' ? parsecount(optname, colon + 1, 0) : UINT64_MAX;
+    if (*startp > *endp)
+        errx(1, "invalid argument to \"--%s\"", optname);
+    free(buf);
+}
+
+// Parse a byte count with optional "K", "M", or "G" suffix
+static size_t
+parsesize(const char *optname, const char *str)
+{
+    unsigned long long value;
+    int shift = 0;
+    char *eptr;
+
+    errno = 0;
+    value = strtoull(str, &eptr, 10);
+    if (!isdigit((unsigned char)*str) || errno == ERANGE)
+        errx(1, "invalid argument to \"--%s\"", optname);
+    switch (*eptr) {
+    case 'k':
+    case 'K':
+        shift = 10;
+        eptr++;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        eptr++;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        eptr++;
+        break;
+    default:
+        break;
+    }
+    if (*eptr != '\0' || value > (SIZE_MAX >> shift))
+        errx(1, "invalid argument to \"--%s\"", optname);
+    return (size_t)value << shift;
+}
+
+// Parse "record", "size:N", "time:ms", or "auto"
+static void
+parseflush(const char *str, int *modep, size_t *sizep, uint64_t *millisp)
+{
+    *sizep = 0;
+    *millisp = 0;
+    if (strcmp(str, "record") == 0)
+        *modep = FLUSH_RECORD;
+    else if (strncmp(str, "size:", 5) == 0) {
+        *modep = FLUSH_SIZE;
+        if ((*sizep = parsesize("flush", str + 5)) == 0)
+            errx(1, "invalid argument to \"--%s\"", "flush");
+    } else if (strncmp(str, "time:", 5) == 0) {
+        *modep = FLUSH_TIME;
+        *millisp = parsecount("flush", str + 5, 0);
+    } else if (strcmp(str, "auto") == 0) {
+        *modep = FLUSH_AUTO;
+        *sizep = FLUSH_AUTO_BUFFER_SIZE;
+        *millisp = FLUSH_AUTO_MILLIS;
+    } else
+        errx(1, "invalid argument to \"--%s\"", "flush");
+}
+
+// Parse "type[,col,...]:file" or "fmt:format:file"
+static void
+parseout(const char *str, struct emit *em)
+{
+    const char *colon;
+    char *spec;
+    char *type;
+    char *col;
+
+    memset(em, 0, sizeof(*em));
+    if ((colon = strchr(str, ':')) == NULL || colon[1] == '\0')
+        errx(1, "invalid argument to \"--%s\"", "out");
+    if (strncmp(str, "fmt:", 4) == 0) {
+        em->mode = MODE_NORMAL;
+        if ((colon = strrchr(str + 4, ':')) == NULL || colon[1] == '\0')
+            errx(1, "invalid argument to \"--%s\"", "out");
+        if ((em->format = strndup(str + 4, colon - (str + 4))) == NULL)
+            err(1, "strndup");
+        em->path = colon + 1;
+        return;
+    }
+    em->path = colon + 1;
+    if ((spec = strndup(str, colon - str)) == NULL)
+        err(1, "strndup");
+    col = spec;
+    type = strsep(&col, ",");
+    if (strcmp(type, "json") == 0)
+        em->mode = MODE_JSON;
+    else if (strcmp(type, "xml") == 0)
+        em->mode = MODE_XML_PLAIN;
+    else if (strcmp(type, "xml-names") == 0)
+        em->mode = MODE_XML_NAMES;
+    else if (strcmp(type, "bash") == 0)
+        em->mode = MODE_BASH;
+    else if (strcmp(type, "raw") == 0)
+        em->mode = MODE_RAW;
+    else
+        errx(1, "invalid output type \"%s\" in \"--%s\"", type, "out");
+    while (col != NULL)
+        addstring(&em->columns, strsep(&col, ","));
+    free(spec);
+}
+
+static uint64_t
+now_millis(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        err(1, "clock_gettime");
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Input is about to block, so flush any output that's waiting
+static void
+flush_idle(void *arg)
+{
+    FILE *const out = arg;
+
+    fflush(out);
+}
+
+// Save our position at the current record boundary
+static void
+save_checkpoint(const char *path, FILE *out, const struct csv_parser *parser, int quote, int fsep,
+    uint64_t recnum, uint64_t datanum, uint64_t emitted)
+{
+    struct checkpoint ck;
+
+    memset(&ck, 0, sizeof(ck));
+    ck.quote = quote;
+    ck.fsep = fsep;
+    ck.input_offset = csv_parser_offset(parser);
+    ck.linenum = csv_parser_linenum(parser);
+    ck.recnum = recnum;
+    ck.datanum = datanum;
+    ck.emitted = emitted;
+    checkpoint_save(path, &ck, out);
+}
+
 static int
 parsechar(const char *str)
 {
@@ -1204,46 +2089,98 @@ eataccessor(const char *const fspec, const char *desc, const struct row *column_
     return start;
 }
 
-// Like getc() but optionally collapses CR or CR, LF into a single LF
-static int
-readch(FILE *fp, int collapse)
+// Make a row borrowed from the parser into one that we own
+static void
+ownrow(struct row *row)
 {
-    int ch;
+    struct row copy;
+    size_t i;
 
-    ch = getc(fp);
-    if (collapse && ch == '\r') {
-        if ((ch = getc(fp)) != '\n') {
-            ungetc(ch, fp);
-            ch = '\n';
-        }
-    }
-    return ch;
+    if (row->alloc > 0)
+        return;
+    memset(&copy, 0, sizeof(copy));
+    for (i = 0; i < row->num; i++)
+        addstring(&copy, row->fields[i]);
+    memcpy(row, &copy, sizeof(*row));
 }
 
 static void
 freerow(struct row *row)
 {
-    while (row->num > 0)
-        free(row->fields[--row->num]);
-    free(row->fields);
+    if (row->alloc > 0) {
+        while (row->num > 0)
+            free(row->fields[--row->num]);
+        free(row->fields);
+    }
     memset(row, 0, sizeof(*row));
 }
 
+// Wrappers for the library functions that exit on error
+
+static struct csv_parser *
+parser_open(FILE *fp, int quote, int fsep)
+{
+    struct csv_parser *parser;
+
+    if ((parser = csv_parser_create(fp, quote, fsep)) == NULL)
+        err(1, "calloc");
+    return parser;
+}
+
+static int
+parser_next(struct csv_parser *parser, struct csv_record *rec)
+{
+    int r;
+
+    if ((r = csv_parser_next(parser, rec)) == -1)
+        errx(1, "%s", csv_parser_error(parser));
+    return r;
+}
+
+static void
+parser_seek(struct csv_parser *parser, uint64_t offset, int linenum)
+{
+    if (csv_parser_seek(parser, offset, linenum) == -1)
+        errx(1, "%s", csv_parser_error(parser));
+}
+
+static struct csv_emitter *
+emitter_open(int format, int use_names, const char *encoding)
+{
+    struct csv_emitter *emitter;
+
+    if ((emitter = csv_emitter_create(format, use_names, encoding)) == NULL)
+        err(1, "%s", encoding);
+    return emitter;
+}
+
+static void
+emitter_fail(const struct csv_emitter *emitter)
+{
+    errx(1, "%s", csv_emitter_error(emitter));
+}
+
 static void
 usage(void)
 {
 
     fprintf(stderr, "Usage:\n");
     fprintf(stderr, "  csvprintf [options] format\n");
+    fprintf(stderr, "  csvprintf -0 [options]\n");
     fprintf(stderr, "  csvprintf -b [options]\n");
     fprintf(stderr, "  csvprintf -j [options]\n");
     fprintf(stderr, "  csvprintf -x [options]\n");
     fprintf(stderr, "  csvprintf -X [options]\n");
+    fprintf(stderr, "  csvprintf --sqlite file [options]\n");
+    fprintf(stderr, "  csvprintf --build-index file [options]\n");
+    fprintf(stderr, "  csvprintf --splits num --index file [options]\n");
+    fprintf(stderr, "  csvprintf --check | --count [options]\n");
     fprintf(stderr, "  csvprintf -h\n");
     fprintf(stderr, "  csvprintf -v\n");
     fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -0\t\tOutput raw field values, each followed by NUL, for xargs -0, mapfile -d '', etc.\n");
     fprintf(stderr, "  -b\t\tConvert input to bash(1) variable assignments\n");
-    fprintf(stderr, "  -e encoding\tSpecify input character encoding (XML and JSON modes only; default ISO-8859-1)\n");
+    fprintf(stderr, "  -e encoding\tSpecify input character encoding (XML, JSON, SQLite, and \"--check\" only; default ISO-8859-1)\n");
     fprintf(stderr, "  -f input\tRead CSV input from specified file (default stdin)\n");
     fprintf(stderr, "  -i\t\tAssume the first CSV record contains column names\n");
     fprintf(stderr, "  -j\t\tConvert input to JSON text sequences\n");
@@ -1251,6 +2188,76 @@ usage(void)
     fprintf(stderr, "  -s char\tSpecify field separator character (default `%c')\n", DEFAULT_FSEP_CHAR);
     fprintf(stderr, "  -x\t\tConvert input to XML using numeric tags\n");
     fprintf(stderr, "  -X\t\tConvert input to XML using column name tags (implies \"-i\")\n");
+    fprintf(stderr, "  --compress=format[:level]\n");
+    fprintf(stderr, "\t\tCompress output using gzip or zstd\n");
+    fprintf(stderr, "  --pipeline\tRead input and write output on separate threads\n");
+    fprintf(stderr, "  --io-uring\tLike \"--pipeline\", but use io_uring for regular files if available\n");
+    fprintf(stderr, "  --record-terminator char\n");
+    fprintf(stderr, "\t\tOutput char after each record with \"-0\" (default newline; empty for none)\n");
+    fprintf(stderr, "  --compact\tWrite XML without indentation, and JSON column names only once\n");
+    fprintf(stderr, "  --short-tags\tLike \"--compact\", but also use short XML tag names\n");
+    fprintf(stderr, "  --out type[,col,...]:file\n");
+    fprintf(stderr, "\t\tAlso write json, xml, xml-names, bash, or raw output (or fmt:format) to file\n");
+    fprintf(stderr, "  --sqlite file\tInsert records into a table in the specified SQLite database\n");
+    fprintf(stderr, "  --table name\tTable for \"--sqlite\" (default \"%s\")\n", DEFAULT_SQLITE_TABLE);
+    fprintf(stderr, "  --transaction-size num\n");
+    fprintf(stderr, "\t\tCommit every num records (default %d)\n", DEFAULT_TRANSACTION_SIZE);
+    fprintf(stderr, "  --bulk-load\tTurn off SQLite journaling and syncing (faster, but a crash can corrupt the database)\n");
+    fprintf(stderr, "  --build-index file\n");
+    fprintf(stderr, "\t\tWrite an index of record offsets to the specified file\n");
+    fprintf(stderr, "  --index file\tUse the specified index (built with \"--build-index\") to seek within the input\n");
+    fprintf(stderr, "  --index-interval num\n");
+    fprintf(stderr, "\t\tIndex every num'th record (default %d)\n", DEFAULT_INDEX_INTERVAL);
+    fprintf(stderr, "  --range start:end\n");
+    fprintf(stderr, "\t\tOnly output data records start through end (starting from one)\n");
+    fprintf(stderr, "  --splits num\tPrint record ranges dividing the input into num parts (requires \"--index\")\n");
+    fprintf(stderr, "  --check\tCheck the input, reporting records with the wrong number of fields, etc.\n");
+    fprintf(stderr, "  --count\tJust print the number of records\n");
+    fprintf(stderr, "  --limit num\tStop after outputting num data records\n");
+    fprintf(stderr, "  --sample num\tOutput a random sample of num data records\n");
+    fprintf(stderr, "  --seed num\tRandom seed for \"--sample\"\n");
+    fprintf(stderr, "  --every num\tOnly output every num'th data record\n");
+    fprintf(stderr, "  --group-by col1,col2,...\n");
+    fprintf(stderr, "\t\tOutput one row per distinct combination of the given columns\n");
+    fprintf(stderr, "  --agg func1,func2,...\n");
+    fprintf(stderr, "\t\tAggregate functions for each group: count, sum(col), min(col), max(col),\n");
+    fprintf(stderr, "\t\tavg(col), count-distinct(col) (default count)\n");
+    fprintf(stderr, "  --sort-by col[:num|:str][:desc],...\n");
+    fprintf(stderr, "\t\tSort output records by the given columns\n");
+    fprintf(stderr, "  --unique\tOmit duplicate data records\n");
+    fprintf(stderr, "  --unique-by col1,col2,...\n");
+    fprintf(stderr, "\t\tOmit data records whose values in the given columns have been seen before\n");
+    fprintf(stderr, "  --unique-approx\n");
+    fprintf(stderr, "\t\tDetect duplicates using bounded memory (some unique records may be omitted)\n");
+    fprintf(stderr, "  --join file\tAppend columns from the matching record in the given lookup file\n");
+    fprintf(stderr, "  --on col[=col]\tJoin on this column in the input (and lookup file, if different)\n");
+    fprintf(stderr, "  --join-type inner|left\n");
+    fprintf(stderr, "\t\tOmit (inner, the default) or keep (left) records with no match\n");
+    fprintf(stderr, "  --keep-keys file\n");
+    fprintf(stderr, "\t\tOnly output records whose \"--key\" column value is a line in file\n");
+    fprintf(stderr, "  --drop-keys file\n");
+    fprintf(stderr, "\t\tOmit records whose \"--key\" column value is a line in file\n");
+    fprintf(stderr, "  --key col\tColumn for \"--keep-keys\" or \"--drop-keys\"\n");
+    fprintf(stderr, "  --profile\tOutput statistics for each column instead of the records\n");
+    fprintf(stderr, "  --partition-by col\n");
+    fprintf(stderr, "\t\tWrite each record to one of several files chosen by this column\n");
+    fprintf(stderr, "  --partitions num\n");
+    fprintf(stderr, "\t\tChoose among num files by hashing the column (default one file per distinct value)\n");
+    fprintf(stderr, "  --output-template name\n");
+    fprintf(stderr, "\t\tFile name for \"--partition-by\", with %%d for the partition number or %%s for the value\n");
+    fprintf(stderr, "  --stats\tReport record counts, sizes, and where time was spent on exit\n");
+    fprintf(stderr, "  --progress\tReport records/s and MB/s every second\n");
+    fprintf(stderr, "  --follow\tAt end of input, wait for more data to be appended (like \"tail -f\")\n");
+    fprintf(stderr, "  --checkpoint file\n");
+    fprintf(stderr, "\t\tPeriodically save the input and output positions in file\n");
+    fprintf(stderr, "  --resume\tContinue from the position saved in the \"--checkpoint\" file, if any\n");
+    fprintf(stderr, "  --flush=record|size:N|time:ms|auto\n");
+    fprintf(stderr, "\t\tFlush output after every record, when N bytes are buffered, within ms milliseconds,\n");
+    fprintf(stderr, "\t\tor using a large buffer but within %d milliseconds\n", FLUSH_AUTO_MILLIS);
+    fprintf(stderr, "  --memory-limit size\n");
+    fprintf(stderr, "\t\tUse temporary files beyond this much memory (default 256M)\n");
+    fprintf(stderr, "  --max-field-size size\n");
+    fprintf(stderr, "\t\tFail if any input field is bigger than this\n");
     fprintf(stderr, "  -h\t\tOutput this help message and exit\n");
     fprintf(stderr, "  -v\t\tOutput version information and exit\n");
 }
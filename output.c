@@ -0,0 +1,509 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if HAVE_LIBZ
+#include <zlib.h>
+#endif
+#if HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#define OUTPUT_BLOCK_SIZE       (1024 * 1024)
+#define OUTPUT_NUM_BLOCKS       4
+#define OUTPUT_URING_DEPTH      (OUTPUT_NUM_BLOCKS - 1)
+
+struct output;
+
+// Compressed output format
+struct compressor {
+    const char          *name;
+    int                 min_level;
+    int                 max_level;
+    int                 default_level;
+    void                (*init)(struct output *out);
+    size_t              (*compress)(struct output *out, const struct ring_block *block);
+    void                (*cleanup)(struct output *out);
+};
+
+// Output state, used as the stdio cookie
+struct output {
+    int                     fd;
+    const struct compressor *comp;          // NULL for uncompressed output
+    int                     level;
+    struct ring             *ring;          // rendered data for the writer thread
+    pthread_t               thread;
+    char                    *obuf;          // compressed frame
+    size_t                  obuf_size;
+    char                    error[256];     // writer thread's error, reported by the main thread
+    int                     reported;       // error has been reported
+#if HAVE_LIBZ
+    z_stream                z;
+#endif
+#if HAVE_LIBZSTD
+    ZSTD_CCtx               *zcctx;
+#endif
+};
+
+#if HAVE_LIBZ
+static void gzip_init(struct output *out);
+static size_t gzip_compress(struct output *out, const struct ring_block *block);
+static void gzip_cleanup(struct output *out);
+#endif
+#if HAVE_LIBZSTD
+static void zstd_init(struct output *out);
+static size_t zstd_compress(struct output *out, const struct ring_block *block);
+static void zstd_cleanup(struct output *out);
+#endif
+static void *output_main(void *arg);
+static void output_uring(struct output *out, struct uring *u, off_t offset);
+static void output_write_fd(struct output *out, const char *buf, size_t len);
+static void output_fail(struct output *out, int errnum, const char *fmt, ...);
+static void output_report(struct output *out);
+static ssize_t output_cookie_write(void *cookie, const char *buf, size_t len);
+#if !HAVE_FOPENCOOKIE
+static int output_cookie_write_int(void *cookie, const char *buf, int len);
+#endif
+static int output_cookie_close(void *cookie);
+static void output_atexit(void);
+
+static const struct compressor compressors[] = {
+#if HAVE_LIBZ
+    { "gzip",   1,  9,  6,  gzip_init,  gzip_compress,  gzip_cleanup },
+#else
+    { "gzip",   1,  9,  6,  NULL,       NULL,           NULL },
+#endif
+#if HAVE_LIBZSTD
+    { "zstd",   1,  19, 3,  zstd_init,  zstd_compress,  zstd_cleanup },
+#else
+    { "zstd",   1,  19, 3,  NULL,       NULL,           NULL },
+#endif
+};
+#define NUM_COMPRESSORS         (sizeof(compressors) / sizeof(*compressors))
+
+static FILE *output_fp;                     // for output_atexit()
+static struct output *output_state;
+static pthread_t output_owner;              // the thread that opened the output
+static int output_exiting;                  // output_atexit() is closing the output
+static uint64_t output_total;               // bytes written to output streams (before compression)
+
+//
+// Open an output stream writing to the given file descriptor via a writer thread.
+//
+// Data written to the returned stream is collected into blocks which a separate thread
+// writes out, so output runs in parallel with parsing and rendering.
+//
+// If "spec" is not NULL, it has the form "name[:level]" and the writer thread compresses
+// each block into an independent frame before writing it.
+//
+FILE *
+output_open(int fd, const char *spec)
+{
+    struct output *out;
+    const char *colon;
+    size_t namelen;
+    char *eptr;
+    FILE *fp;
+    long level;
+    int i;
+
+    if ((out = calloc(1, sizeof(*out))) == NULL)
+        err(1, "calloc");
+    out->fd = fd;
+
+    // Parse compression spec
+    if (spec == NULL)
+        goto no_compression;
+    namelen = (colon = strchr(spec, ':')) != NULL ? colon - spec : strlen(spec);
+    for (i = 0; i < NUM_COMPRESSORS; i++) {
+        if (strncmp(spec, compressors[i].name, namelen) == 0 && compressors[i].name[namelen] == '\0') {
+            out->comp = &compressors[i];
+            break;
+        }
+    }
+    if (out->comp == NULL)
+        errx(1, "unsupported compression format \"%.*s\"", (int)namelen, spec);
+    if (out->comp->init == NULL)
+        errx(1, "%s compression is not supported by this build", out->comp->name);
+    out->level = out->comp->default_level;
+    if (colon != NULL) {
+        level = strtol(colon + 1, &eptr, 10);
+        if (colon[1] == '\0' || *eptr != '\0' || level < out->comp->min_level || level > out->comp->max_level) {
+            errx(1, "invalid %s compression level \"%s\" (must be %d..%d)",
+              out->comp->name, colon + 1, out->comp->min_level, out->comp->max_level);
+        }
+        out->level = (int)level;
+    }
+    (*out->comp->init)(out);
+
+no_compression:
+    // Start writer thread
+    out->ring = ring_create(OUTPUT_NUM_BLOCKS, OUTPUT_BLOCK_SIZE);
+    if ((errno = pthread_create(&out->thread, NULL, output_main, out)) != 0)
+        err(1, "pthread_create");
+
+    // Wrap in a stdio stream
+#if HAVE_FOPENCOOKIE
+    {
+        cookie_io_functions_t funcs;
+
+        memset(&funcs, 0, sizeof(funcs));
+        funcs.write = output_cookie_write;
+        funcs.close = output_cookie_close;
+        if ((fp = fopencookie(out, "w", funcs)) == NULL)
+            err(1, "fopencookie");
+    }
+#else
+    if ((fp = funopen(out, NULL, output_cookie_write_int, NULL, output_cookie_close)) == NULL)
+        err(1, "funopen");
+#endif
+
+    // Make stdio hand us one block at a time; each write then becomes one frame.
+    // But preserve line buffering for uncompressed terminal output.
+    if (setvbuf(fp, NULL, out->comp == NULL && isatty(fd) ? _IOLBF : _IOFBF, OUTPUT_BLOCK_SIZE) != 0)
+        err(1, "setvbuf");
+
+    // Ensure everything gets compressed and written even if we exit early
+    output_fp = fp;
+    output_state = out;
+    output_owner = pthread_self();
+    atexit(output_atexit);
+    return fp;
+}
+
+//
+// Get the total number of bytes written to output streams, before any compression.
+//
+uint64_t
+output_bytes(void)
+{
+    return output_total;
+}
+
+// Only the thread that opened the output closes it; on any other thread, closing could block forever
+static void
+output_atexit(void)
+{
+    if (output_fp == NULL || !pthread_equal(pthread_self(), output_owner))
+        return;
+    output_exiting = 1;
+    fclose(output_fp);
+}
+
+// Writer thread entry point
+static void *
+output_main(void *arg)
+{
+    struct output *const out = arg;
+    struct ring_block *block;
+    struct uring *u;
+    struct stat sb;
+    off_t offset;
+    size_t len;
+    int flags;
+
+    // Use io_uring for uncompressed output to a regular file, if we can
+    if (out->comp == NULL
+      && fstat(out->fd, &sb) == 0 && S_ISREG(sb.st_mode)
+      && (flags = fcntl(out->fd, F_GETFL)) != -1 && (flags & O_APPEND) == 0
+      && (offset = lseek(out->fd, 0, SEEK_CUR)) != -1
+      && (u = uring_create(OUTPUT_URING_DEPTH)) != NULL) {
+        output_uring(out, u, offset);
+        uring_destroy(u);
+        return NULL;
+    }
+
+    // Write (and maybe compress) one block at a time
+    while (*out->error == '\0' && (block = ring_get_full(out->ring)) != NULL) {
+        if (out->comp == NULL)
+            output_write_fd(out, block->buf, block->len);
+        else if (block->len > 0 && (len = (*out->comp->compress)(out, block)) != (size_t)-1)
+            output_write_fd(out, out->obuf, len);
+        ring_put_free(out->ring, block);
+    }
+    return NULL;
+}
+
+//
+// Write uncompressed output to a regular file using io_uring(7), keeping several writes outstanding at once.
+//
+// Each block is written at its own file offset, so the writes may finish in any order; blocks go back
+// to the ring as soon as they're written. When we're done, the file offset is left at the end of the output.
+//
+static void
+output_uring(struct output *out, struct uring *u, off_t offset)
+{
+    struct {
+        struct ring_block   *block;
+        uint64_t            offset;
+        size_t              done;
+    } slots[OUTPUT_URING_DEPTH];
+    struct ring_block *block;
+    unsigned int count = 0;
+    unsigned int tag;
+    int closed = 0;
+    int r;
+
+    memset(slots, 0, sizeof(slots));
+    while (!closed || count > 0) {
+
+        // Wait for a write to finish if we're full, done, or have nothing new to write
+        if (count == OUTPUT_URING_DEPTH || (count > 0 && (closed || !ring_has_full(out->ring)))) {
+            if ((r = uring_wait(u, &tag)) < 0 && r != -EINTR && r != -EAGAIN) {
+                output_fail(out, -r, "write");
+                while (--count > 0)                     // let the other writes finish before their blocks go away
+                    (void)uring_wait(u, &tag);
+                return;
+            }
+            block = slots[tag].block;
+            if (r > 0)
+                slots[tag].done += r;
+            if (slots[tag].done < block->len) {
+                uring_write(u, out->fd, block->buf + slots[tag].done,
+                  block->len - slots[tag].done, slots[tag].offset + slots[tag].done, tag);
+                uring_submit(u);
+                continue;
+            }
+            ring_put_free(out->ring, block);
+            slots[tag].block = NULL;
+            count--;
+            continue;
+        }
+
+        // Start writing the next block
+        if ((block = ring_get_full(out->ring)) == NULL) {
+            closed = 1;
+            continue;
+        }
+        if (block->len == 0) {
+            ring_put_free(out->ring, block);
+            continue;
+        }
+        for (tag = 0; slots[tag].block != NULL; tag++)
+            ;
+        slots[tag].block = block;
+        slots[tag].offset = offset;
+        slots[tag].done = 0;
+        uring_write(u, out->fd, block->buf, block->len, offset, tag);
+        uring_submit(u);
+        offset += block->len;
+        count++;
+    }
+
+    // Leave the file offset where write(2) would have
+    if (lseek(out->fd, offset, SEEK_SET) == -1)
+        output_fail(out, errno, "lseek");
+}
+
+#if HAVE_LIBZ
+static void
+gzip_init(struct output *out)
+{
+    if (deflateInit2(&out->z, out->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)    // 15 + 16 means gzip header
+        errx(1, "gzip: %s", "can't initialize compressor");
+    out->obuf_size = deflateBound(&out->z, OUTPUT_BLOCK_SIZE);
+    if ((out->obuf = malloc(out->obuf_size)) == NULL)
+        err(1, "malloc");
+}
+
+// Compress one block into a complete gzip member; members may be concatenated
+static size_t
+gzip_compress(struct output *out, const struct ring_block *block)
+{
+    if (deflateReset(&out->z) != Z_OK) {
+        output_fail(out, 0, "gzip: %s", "can't reset compressor");
+        return (size_t)-1;
+    }
+    out->z.next_in = (unsigned char *)block->buf;
+    out->z.avail_in = block->len;
+    out->z.next_out = (unsigned char *)out->obuf;
+    out->z.avail_out = out->obuf_size;
+    if (deflate(&out->z, Z_FINISH) != Z_STREAM_END) {
+        output_fail(out, 0, "gzip: %s", out->z.msg != NULL ? out->z.msg : "compression error");
+        return (size_t)-1;
+    }
+    return out->obuf_size - out->z.avail_out;
+}
+
+static void
+gzip_cleanup(struct output *out)
+{
+    deflateEnd(&out->z);
+}
+#endif
+
+#if HAVE_LIBZSTD
+static void
+zstd_init(struct output *out)
+{
+    long ncpu;
+
+    if ((out->zcctx = ZSTD_createCCtx()) == NULL)
+        errx(1, "zstd: %s", "can't initialize compressor");
+    if (ZSTD_isError(ZSTD_CCtx_setParameter(out->zcctx, ZSTD_c_compressionLevel, out->level)))
+        errx(1, "zstd: %s", "can't set compression level");
+
+    // Let zstd use the other CPUs too; this quietly fails if libzstd was built without thread support
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 1)
+        (void)ZSTD_CCtx_setParameter(out->zcctx, ZSTD_c_nbWorkers, (int)(ncpu - 1));
+    out->obuf_size = ZSTD_compressBound(OUTPUT_BLOCK_SIZE);
+    if ((out->obuf = malloc(out->obuf_size)) == NULL)
+        err(1, "malloc");
+}
+
+// Compress one block into a complete zstd frame; frames may be concatenated
+static size_t
+zstd_compress(struct output *out, const struct ring_block *block)
+{
+    size_t r;
+
+    if (ZSTD_isError(r = ZSTD_compress2(out->zcctx, out->obuf, out->obuf_size, block->buf, block->len))) {
+        output_fail(out, 0, "zstd: %s", ZSTD_getErrorName(r));
+        return (size_t)-1;
+    }
+    return r;
+}
+
+static void
+zstd_cleanup(struct output *out)
+{
+    ZSTD_freeCCtx(out->zcctx);
+}
+#endif
+
+static void
+output_write_fd(struct output *out, const char *buf, size_t len)
+{
+    ssize_t r;
+
+    while (len > 0) {
+        if ((r = write(out->fd, buf, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            output_fail(out, errno, "write");
+            return;
+        }
+        buf += r;
+        len -= r;
+    }
+}
+
+static ssize_t
+output_cookie_write(void *cookie, const char *buf, size_t len)
+{
+    struct output *const out = cookie;
+    struct ring_block *block;
+    size_t total = len;
+    size_t num;
+    int phase;
+
+    output_total += len;
+    while (len > 0) {
+        phase = stats_phase(STATS_OUTPUT_WAIT);
+        block = ring_get_free(out->ring);
+        stats_phase(phase);
+        if (block == NULL) {
+            output_report(out);
+            return -1;
+        }
+        num = len < block->size ? len : block->size;
+        memcpy(block->buf, buf, num);
+        block->len = num;
+        ring_put_full(out->ring, block);
+        buf += num;
+        len -= num;
+    }
+    return total;
+}
+
+#if !HAVE_FOPENCOOKIE
+static int
+output_cookie_write_int(void *cookie, const char *buf, int len)
+{
+    return (int)output_cookie_write(cookie, buf, len);
+}
+#endif
+
+static int
+output_cookie_close(void *cookie)
+{
+    struct output *const out = cookie;
+
+    ring_close(out->ring);
+    if ((errno = pthread_join(out->thread, NULL)) != 0)
+        err(1, "pthread_join");
+    if (*out->error != '\0')
+        output_report(out);
+    ring_destroy(out->ring);
+    if (out->comp != NULL)
+        (*out->comp->cleanup)(out);
+    free(out->obuf);
+    if (out == output_state)
+        output_fp = NULL;
+    free(out);
+    return 0;
+}
+
+//
+// Record an error in the writer thread, like err(3) if "errnum" is not zero and errx(3) otherwise.
+//
+// The writer thread must not exit the process itself: the main thread could be blocked waiting for it,
+// or in the middle of a stdio call on the output stream. Instead, it stops taking blocks, and the main
+// thread reports the error the next time it hands over a block or closes the stream.
+//
+static void
+output_fail(struct output *out, int errnum, const char *fmt, ...)
+{
+    va_list args;
+    size_t len;
+
+    va_start(args, fmt);
+    vsnprintf(out->error, sizeof(out->error), fmt, args);
+    va_end(args);
+    if (errnum != 0 && (len = strlen(out->error)) < sizeof(out->error))
+        snprintf(out->error + len, sizeof(out->error) - len, ": %s", strerror(errnum));
+    ring_abort(out->ring);
+}
+
+// Report the writer thread's error and exit, unless we're exiting already
+static void
+output_report(struct output *out)
+{
+    if (out->reported)
+        return;
+    out->reported = 1;
+    if (output_exiting) {
+        warnx("%s", out->error);
+        return;
+    }
+    if (out == output_state)
+        output_fp = NULL;
+    errx(1, "%s", out->error);
+}
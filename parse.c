@@ -0,0 +1,638 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// CSV parser.
+//
+// Each record is parsed into a single buffer holding all of its fields, NUL-terminated and
+// back to back, so parsing a record normally does no memory allocation at all. The caller gets
+// a view of the fields that remains valid until the next record is parsed.
+//
+// The parser keeps its own byte offset and line number, so there's no global state and any
+// number of parsers can be used at once.
+//
+// Errors are returned rather than reported, with a message saved for csv_parser_error(). They
+// are passed back up from wherever they happen by return value; this costs nothing per character,
+// because the only failures are at the end of a field or when the buffer fills up.
+//
+// A field's size can be capped, and a caller that can consume a field a piece at a time can ask
+// for its data once it reaches a chunk size; the piece is then dropped from the buffer, so memory
+// stays bounded no matter how big the field. Both are checked only when the current field reaches
+// "limit", which is normally just the end of the buffer, so they cost nothing per character.
+//
+// The common quote and separator combinations get their own tokenizer (see tokenize.h), chosen
+// when the parser is created; anything else uses the generic one below.
+//
+
+// Character classes for the specialized tokenizers
+#define CLS_SPACE               0x01        // isspace(3), but not the field separator
+#define CLS_STOP                0x02        // ends an unquoted value: CR, LF, or the field separator
+
+struct csv_parser {
+    FILE        *fp;
+    int         quote;
+    int         fsep;
+    int         (*readrec)(struct csv_parser *p);
+    unsigned char cls[256];             // character classes
+    uint64_t    offset;                 // byte offset of the next input character
+    int         linenum;                // current line number
+    char        *buf;                   // field values for the current record
+    size_t      len;
+    size_t      alloc;
+    size_t      limit;                  // check the current field when it reaches this offset
+    size_t      field_start;            // offset of the current field in "buf"
+    uint64_t    field_chunked;          // bytes of the current field already passed to "chunk"
+    int         field_quoted;           // current field is quoted, so no whitespace will be trimmed
+    int         bounded;                // "max_field" or "chunk" is set
+    size_t      max_field;              // maximum field size, or zero for none
+    size_t      chunk_size;
+    void        (*chunk)(void *arg, char *const *fields, size_t col, const char *data, size_t len);
+    void        *chunk_arg;
+    size_t      *starts;                // offset of each field in "buf"
+    char        **fields;               // pointers to each field in "buf"
+    size_t      num_fields;
+    size_t      alloc_fields;
+    uint64_t    allocations;            // number of memory allocations, for statistics
+    char        error[256];             // description of the last error
+};
+
+static int parser_readrec(struct csv_parser *p);
+static int parser_readcol(struct csv_parser *p);
+static int parser_readqcol(struct csv_parser *p);
+static int parser_readuqcol(struct csv_parser *p, size_t start);
+static int parser_endcol(struct csv_parser *p, size_t start);
+static int parser_addfield(struct csv_parser *p, size_t start);
+static void parser_startcol(struct csv_parser *p, size_t start);
+static int parser_full(struct csv_parser *p);
+static void parser_set_limit(struct csv_parser *p);
+static int parser_grow(struct csv_parser *p);
+static void parser_trim(struct csv_parser *p, size_t start);
+static int parser_addchar(struct csv_parser *p, int ch);
+static int parser_fail(struct csv_parser *p, int errnum, const char *fmt, ...);
+static int parser_readch(struct csv_parser *p, int collapse);
+static void parser_unreadch(struct csv_parser *p, int ch);
+static inline int tok_skip_lf(FILE *fp);
+
+// Add a character in a specialized tokenizer, which keeps the buffer in local variables (returns on error)
+#define TOK_ADDCHAR(ch)                                 \
+    do {                                                \
+        if (len == limit) {                             \
+            p->len = len;                               \
+            if (parser_full(p) == -1)                   \
+                return -1;                              \
+            buf = p->buf;                               \
+            len = p->len;                               \
+            limit = p->limit;                           \
+        }                                               \
+        buf[len++] = (ch);                              \
+    } while (0)
+
+// Terminate a column in a specialized tokenizer; the NUL doesn't count toward the field's size (returns on error)
+#define TOK_ENDCOL()                                    \
+    do {                                                \
+        if (len == p->alloc) {                          \
+            p->len = len;                               \
+            if (parser_grow(p) == -1)                   \
+                return -1;                              \
+            buf = p->buf;                               \
+            limit = p->limit;                           \
+        }                                               \
+        buf[len++] = '\0';                              \
+    } while (0)
+
+#define TOKENIZER               tokenize_comma
+#define QUOTE_CHAR              '"'
+#define FSEP_CHAR               ','
+#include "tokenize.h"
+#undef TOKENIZER
+#undef QUOTE_CHAR
+#undef FSEP_CHAR
+
+#define TOKENIZER               tokenize_tab
+#define QUOTE_CHAR              '"'
+#define FSEP_CHAR               '\t'
+#include "tokenize.h"
+#undef TOKENIZER
+#undef QUOTE_CHAR
+#undef FSEP_CHAR
+
+#define TOKENIZER               tokenize_semicolon
+#define QUOTE_CHAR              '"'
+#define FSEP_CHAR               ';'
+#include "tokenize.h"
+#undef TOKENIZER
+#undef QUOTE_CHAR
+#undef FSEP_CHAR
+
+#define TOKENIZER               tokenize_pipe
+#define QUOTE_CHAR              '"'
+#define FSEP_CHAR               '|'
+#include "tokenize.h"
+#undef TOKENIZER
+#undef QUOTE_CHAR
+#undef FSEP_CHAR
+
+//
+// Create a parser. Returns NULL (with errno set) if there's not enough memory.
+//
+struct csv_parser *
+csv_parser_create(FILE *fp, int quote, int fsep)
+{
+    struct csv_parser *p;
+    int ch;
+
+    if ((p = calloc(1, sizeof(*p))) == NULL)
+        return NULL;
+    p->fp = fp;
+    p->quote = quote;
+    p->fsep = fsep;
+    p->linenum = 1;
+
+    // Pick a tokenizer
+    if (quote == '"' && fsep == ',')
+        p->readrec = tokenize_comma;
+    else if (quote == '"' && fsep == '\t')
+        p->readrec = tokenize_tab;
+    else if (quote == '"' && fsep == ';')
+        p->readrec = tokenize_semicolon;
+    else if (quote == '"' && fsep == '|')
+        p->readrec = tokenize_pipe;
+    else
+        p->readrec = parser_readrec;
+
+    // Classify characters
+    for (ch = 0; ch < 256; ch++) {
+        if (isspace(ch) && ch != fsep)
+            p->cls[ch] |= CLS_SPACE;
+        if (ch == '\r' || ch == '\n' || ch == fsep)
+            p->cls[ch] |= CLS_STOP;
+    }
+    return p;
+}
+
+//
+// Set the maximum size of any one field, or zero for no limit. A bigger field is an error.
+//
+void
+csv_parser_set_max_field(struct csv_parser *p, size_t max)
+{
+    p->max_field = max;
+    p->bounded = p->max_field != 0 || p->chunk != NULL;
+}
+
+//
+// Pass each field's data to "chunk" in pieces of at least "size" bytes as it's read, instead of
+// buffering it all, once the field reaches that size; a NULL "chunk" turns this off. The pieces
+// are passed in order and are followed by whatever is left, which is the field's value in the
+// record returned by csv_parser_next(). Smaller fields are returned whole as usual. The fields
+// before column "col" are complete, and are passed along too.
+//
+void
+csv_parser_set_chunk(struct csv_parser *p, size_t size,
+    void (*chunk)(void *arg, char *const *fields, size_t col, const char *data, size_t len), void *arg)
+{
+    p->chunk_size = size > 0 ? size : 1;
+    p->chunk = chunk;
+    p->chunk_arg = arg;
+    p->bounded = p->max_field != 0 || p->chunk != NULL;
+}
+
+void
+csv_parser_free(struct csv_parser *p)
+{
+    free(p->buf);
+    free(p->starts);
+    free(p->fields);
+    free(p);
+}
+
+//
+// Parse the next record, skipping completely empty lines. Returns one if a record was parsed,
+// zero at end of input, or -1 on error; after an error, the parser may only be freed.
+//
+int
+csv_parser_next(struct csv_parser *p, struct csv_record *rec)
+{
+    size_t i;
+    int ch;
+
+    // Find the start of the next record
+    while (1) {
+        rec->offset = p->offset;
+        rec->linenum = p->linenum;
+        switch ((ch = parser_readch(p, 1))) {
+        case EOF:
+            return 0;
+        case '\n':
+            p->linenum++;
+            continue;
+        default:
+            parser_unreadch(p, ch);
+            break;
+        }
+        break;
+    }
+
+    // Read columns
+    p->len = 0;
+    p->num_fields = 0;
+    if ((*p->readrec)(p) == -1)
+        return -1;
+
+    // Point at the fields (only now, because the buffer may have moved)
+    for (i = 0; i < p->num_fields; i++)
+        p->fields[i] = p->buf + p->starts[i];
+    rec->fields = p->fields;
+    rec->num = p->num_fields;
+    return 1;
+}
+
+//
+// Reposition the input; the offset must be at a record boundary. Returns zero, or -1 on error.
+//
+int
+csv_parser_seek(struct csv_parser *p, uint64_t offset, int linenum)
+{
+    if (fseeko(p->fp, offset, SEEK_SET) == -1)
+        return parser_fail(p, errno, "fseeko");
+    p->offset = offset;
+    p->linenum = linenum;
+    return 0;
+}
+
+uint64_t
+csv_parser_offset(const struct csv_parser *p)
+{
+    return p->offset;
+}
+
+int
+csv_parser_linenum(const struct csv_parser *p)
+{
+    return p->linenum;
+}
+
+uint64_t
+csv_parser_allocations(const struct csv_parser *p)
+{
+    return p->allocations;
+}
+
+//
+// Describe the last error.
+//
+const char *
+csv_parser_error(const struct csv_parser *p)
+{
+    return p->error;
+}
+
+// Generic tokenizer: read all of the columns in a record
+static int
+parser_readrec(struct csv_parser *p)
+{
+    int r;
+
+    while ((r = parser_readcol(p)) == 1)
+        ;
+    return r;
+}
+
+//
+// Read a column, return 1 if there's more, 0 if not, or -1 on error
+//
+static int
+parser_readcol(struct csv_parser *p)
+{
+    const size_t start = p->len;
+    int row_done;
+    int ch;
+
+    // Process initial stuff; skip leading whitespace, excluding our field separator (which could be TAB)
+    do {
+        if ((ch = parser_readch(p, 1)) == EOF)
+            ch = '\n';
+        if (ch == '\n') {           // end of line forces empty column and terminates the row
+            if (parser_endcol(p, start) == -1)
+                return -1;
+            p->linenum++;
+            return 0;
+        }
+    } while (isspace(ch) && ch != p->fsep);
+    parser_unreadch(p, ch);
+    parser_startcol(p, start);
+
+    // Read quoted or unquoted value
+    if (ch == p->quote)
+        row_done = parser_readqcol(p);
+    else
+        row_done = parser_readuqcol(p, start);
+    if (row_done == -1 || parser_endcol(p, start) == -1)
+        return -1;
+    return row_done;
+}
+
+//
+// Read a quoted column, return 1 if there's more, 0 if not, or -1 on error
+//
+static int
+parser_readqcol(struct csv_parser *p)
+{
+    int done = 0;
+    int escape = 0;
+    int ch;
+
+    p->field_quoted = 1;
+    parser_readch(p, 0);
+    while (1) {
+        assert(!escape || !done);
+        if ((ch = parser_readch(p, escape)) == EOF) {
+            if (escape || done)
+                ch = '\n';
+            else
+                return parser_fail(p, 0, "line %d: premature EOF", p->linenum);
+        }
+        if (done) {
+            if (ch == '\n') {
+                p->linenum++;
+                return 0;
+            }
+            if (ch == p->fsep)
+                return 1;
+            if (isspace(ch))
+                continue;
+            return parser_fail(p, 0, "line %d: unexpected character \"%c\"", p->linenum, ch);
+        }
+        if (escape) {
+            if (ch == p->quote) {
+                if (parser_addchar(p, p->quote) == -1)
+                    return -1;
+            } else {
+                parser_unreadch(p, ch);
+                done = 1;
+            }
+            escape = 0;
+            continue;
+        }
+        if (ch == p->quote) {
+            escape = 1;
+            continue;
+        }
+        if (parser_addchar(p, ch) == -1)
+            return -1;
+        if (ch == '\n')
+            p->linenum++;
+    }
+}
+
+//
+// Read an unquoted column, return 1 if there's more, 0 if not, or -1 on error
+//
+static int
+parser_readuqcol(struct csv_parser *p, size_t start)
+{
+    int ch;
+
+    while (1) {
+        if ((ch = parser_readch(p, 1)) == EOF)
+            ch = '\n';
+        if (ch == '\n') {
+            p->linenum++;
+            parser_trim(p, start);
+            return 0;
+        }
+        if (ch == p->fsep) {
+            parser_trim(p, start);
+            return 1;
+        }
+        if (parser_addchar(p, ch) == -1)
+            return -1;
+    }
+}
+
+// Terminate the column starting at "start" and add it to the record
+static int
+parser_endcol(struct csv_parser *p, size_t start)
+{
+    if (p->len == p->alloc && parser_grow(p) == -1)
+        return -1;
+    p->buf[p->len++] = '\0';
+    return parser_addfield(p, start);
+}
+
+// Record the start of a column in the buffer
+static int
+parser_addfield(struct csv_parser *p, size_t start)
+{
+    if (p->num_fields == p->alloc_fields) {
+        const size_t alloc = p->alloc_fields == 0 ? 32 : p->alloc_fields * 2;
+        size_t *starts;
+        char **fields;
+
+        if ((starts = realloc(p->starts, alloc * sizeof(*p->starts))) == NULL)
+            return parser_fail(p, errno, "realloc");
+        p->starts = starts;
+        if ((fields = realloc(p->fields, alloc * sizeof(*p->fields))) == NULL)
+            return parser_fail(p, errno, "realloc");
+        p->fields = fields;
+        p->alloc_fields = alloc;
+        p->allocations += 2;
+    }
+    p->starts[p->num_fields++] = start;
+    return 0;
+}
+
+// Trim whitespace around the column starting at "start"
+static void
+parser_trim(struct csv_parser *p, size_t start)
+{
+    size_t skip;
+
+    while (p->len > start && isspace((unsigned char)p->buf[p->len - 1]))
+        p->len--;
+    if (p->field_chunked > 0)                   // what's left doesn't start the value
+        return;
+    for (skip = 0; start + skip < p->len && isspace((unsigned char)p->buf[start + skip]); skip++)
+        ;
+    memmove(p->buf + start, p->buf + start + skip, p->len - start - skip);
+    p->len -= skip;
+}
+
+static int
+parser_addchar(struct csv_parser *p, int ch)
+{
+    if (p->len == p->limit && parser_full(p) == -1)
+        return -1;
+    p->buf[p->len++] = ch;
+    return 0;
+}
+
+// Start a new field at "start"
+static void
+parser_startcol(struct csv_parser *p, size_t start)
+{
+    p->field_start = start;
+    p->field_chunked = 0;
+    p->field_quoted = 0;
+    parser_set_limit(p);
+}
+
+// The current field has reached "limit": enforce the maximum field size, pass along a chunk, and/or grow the buffer
+static int
+parser_full(struct csv_parser *p)
+{
+    const size_t field_len = p->len - p->field_start;
+    size_t keep = 0;
+
+    // Enforce the maximum field size (we're about to add another byte)
+    if (p->max_field != 0 && p->field_chunked + field_len >= p->max_field)
+        return parser_fail(p, 0, "line %d: field exceeds maximum size of %lu bytes", p->linenum, (unsigned long)p->max_field);
+
+    // Pass along a chunk, holding back trailing whitespace that might yet be trimmed
+    if (p->chunk != NULL && field_len >= p->chunk_size) {
+        if (!p->field_quoted) {
+            while (keep < field_len && isspace((unsigned char)p->buf[p->len - 1 - keep]))
+                keep++;
+        }
+        if (keep < field_len) {
+            size_t i;
+
+            for (i = 0; i < p->num_fields; i++)
+                p->fields[i] = p->buf + p->starts[i];
+            (*p->chunk)(p->chunk_arg, p->fields, p->num_fields, p->buf + p->field_start, field_len - keep);
+            memmove(p->buf + p->field_start, p->buf + p->len - keep, keep);
+            p->field_chunked += field_len - keep;
+            p->len = p->field_start + keep;
+        }
+    }
+
+    // Grow the buffer if still needed
+    if (p->len == p->alloc && parser_grow(p) == -1)
+        return -1;
+    parser_set_limit(p);
+    return 0;
+}
+
+// Compute "limit" for the current field: end of buffer, chunk size, or maximum size, whichever comes first
+static void
+parser_set_limit(struct csv_parser *p)
+{
+    size_t room;
+
+    if (!p->bounded) {
+        p->limit = p->alloc;
+        return;
+    }
+    room = p->alloc - p->field_start;
+    if (p->chunk != NULL && room > p->chunk_size)
+        room = p->chunk_size;
+    if (p->max_field != 0 && room > p->max_field - p->field_chunked)
+        room = p->max_field - p->field_chunked;
+    p->limit = p->field_start + room;
+    if (p->limit <= p->len)                     // e.g., a long run of held back whitespace
+        p->limit = p->len + 1;
+    if (p->limit > p->alloc)
+        p->limit = p->alloc;
+}
+
+static int
+parser_grow(struct csv_parser *p)
+{
+    const size_t alloc = p->alloc == 0 ? 1024 : p->alloc * 2;
+    char *buf;
+
+    if ((buf = realloc(p->buf, alloc)) == NULL)
+        return parser_fail(p, errno, "realloc");
+    p->buf = buf;
+    p->alloc = alloc;
+    p->allocations++;
+    if (!p->bounded)
+        p->limit = p->alloc;
+    return 0;
+}
+
+// Like getc() but optionally collapses CR or CR, LF into a single LF
+// Each parser's input stream is only read by one thread, so we can skip stdio locking
+static int
+parser_readch(struct csv_parser *p, int collapse)
+{
+    int ch;
+
+    if ((ch = getc_unlocked(p->fp)) == EOF)
+        return ch;
+    p->offset++;
+    if (collapse && ch == '\r') {
+        if ((ch = getc_unlocked(p->fp)) != EOF)
+            p->offset++;
+        if (ch != '\n') {
+            parser_unreadch(p, ch);
+            ch = '\n';
+        }
+    }
+    return ch;
+}
+
+// Like ungetc() but keeps track of our input offset
+static void
+parser_unreadch(struct csv_parser *p, int ch)
+{
+    if (ch == EOF)
+        return;
+    ungetc(ch, p->fp);
+    p->offset--;
+}
+
+// Having read a CR, consume a following LF if there is one; returns the number of bytes consumed
+static inline int
+tok_skip_lf(FILE *fp)
+{
+    int ch;
+
+    if ((ch = getc_unlocked(fp)) == '\n')
+        return 1;
+    if (ch != EOF)
+        ungetc(ch, fp);
+    return 0;
+}
+
+// Save an error message, like err(3) if "errnum" is not zero and errx(3) otherwise, and return -1
+static int
+parser_fail(struct csv_parser *p, int errnum, const char *fmt, ...)
+{
+    va_list args;
+    size_t len;
+
+    va_start(args, fmt);
+    vsnprintf(p->error, sizeof(p->error), fmt, args);
+    va_end(args);
+    if (errnum != 0 && (len = strlen(p->error)) < sizeof(p->error))
+        snprintf(p->error + len, sizeof(p->error) - len, ": %s", strerror(errnum));
+    return -1;
+}
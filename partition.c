@@ -0,0 +1,429 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PARTITION_BUFFER_SIZE   (64 * 1024) // write out a partition's data once this much is buffered
+#define PARTITION_MAX_OPEN      64          // maximum number of partition files open at once
+#define PARTITION_MIN_SLOTS     64
+#define PARTITION_MIN_ALLOC     256
+
+//
+// Output partitioned into multiple files.
+//
+// Each record is routed to a partition chosen by one of its fields: either the field's hash
+// modulo a fixed number of partitions, or (without a fixed number) the field's value itself.
+// Records are rendered through a single stdio stream whose data goes into the buffer of the
+// current partition; each partition's buffer is appended to its file once it fills up. Only a
+// limited number of files are kept open at once; when another is needed, the least recently
+// written one is closed, and reopened for appending later if necessary.
+//
+// By value, partitions are kept in an open-addressing hash table keyed on the field value,
+// and the value appears in the file name with unsafe characters percent-encoded.
+//
+
+struct part {
+    char                *key;               // by value: field value, or NULL if slot is empty
+    uint64_t            hash;
+    unsigned long       index;              // by hash: partition number
+    char                *path;              // NULL until the file is created
+    int                 fd;                 // -1 if not open
+    int                 started;            // "begin" has been output
+    uint64_t            last_write;         // for choosing which file to close
+    char                *buf;
+    size_t              len;
+    size_t              alloc;
+};
+
+struct partition {
+    char                *spec;
+    size_t              col;
+    const char          *template;
+    int                 by_value;
+    struct part         *parts;             // by hash: one per partition; by value: hash table
+    size_t              num_parts;
+    size_t              num_slots;          // by value only
+    struct part         *current;           // partition that "fp" writes to
+    FILE                *fp;
+    size_t              buffered;           // total memory used by all buffers
+    size_t              memory_limit;
+    unsigned int        num_open;
+    uint64_t            clock;
+    void                (*begin)(void *arg, FILE *fp);
+    void                (*end)(void *arg, FILE *fp);
+    void                *arg;
+};
+
+static void check_template(const char *template, int by_value);
+static struct part *partition_lookup(struct partition *p, const char *key);
+static void partition_switch(struct partition *p, struct part *part);
+static void partition_grow(struct partition *p);
+static void part_write(struct partition *p, struct part *part);
+static void part_open(struct partition *p, struct part *part);
+static char *part_path(const struct partition *p, const struct part *part);
+static ssize_t partition_cookie_write(void *cookie, const char *buf, size_t len);
+#if !HAVE_FOPENCOOKIE
+static int partition_cookie_write_int(void *cookie, const char *buf, int len);
+#endif
+
+//
+// Create partitioned output; "by" is the column to partition on, and "template" is the output file name
+// containing "%d" for the partition number (if "num" is non-zero) or "%s" for the column value (if zero).
+// The "begin" and "end" functions, if not NULL, output whatever comes before the first and after the last
+// record in each file. Buffered data is written out early if it exceeds "memory_limit".
+//
+struct partition *
+partition_create(const char *by, const char *template, unsigned long num, size_t memory_limit,
+    void (*begin)(void *arg, FILE *fp), void (*end)(void *arg, FILE *fp), void *arg)
+{
+    struct partition *p;
+    unsigned long i;
+
+    if ((p = calloc(1, sizeof(*p))) == NULL)
+        err(1, "calloc");
+    if ((p->spec = strdup(by)) == NULL)
+        err(1, "strdup");
+    check_template(template, num == 0);
+    p->template = template;
+    p->by_value = num == 0;
+    p->memory_limit = memory_limit;
+    p->begin = begin;
+    p->end = end;
+    p->arg = arg;
+    if (p->by_value) {
+        p->num_slots = PARTITION_MIN_SLOTS;
+        if ((p->parts = calloc(p->num_slots, sizeof(*p->parts))) == NULL)
+            err(1, "calloc");
+    } else {
+        if ((p->parts = calloc(num, sizeof(*p->parts))) == NULL)
+            err(1, "calloc");
+        for (i = 0; i < num; i++) {
+            p->parts[i].index = i;
+            p->parts[i].fd = -1;
+        }
+        p->num_parts = num;
+    }
+
+    // Create the stream that records are rendered into
+#if HAVE_FOPENCOOKIE
+    {
+        cookie_io_functions_t funcs;
+
+        memset(&funcs, 0, sizeof(funcs));
+        funcs.write = partition_cookie_write;
+        if ((p->fp = fopencookie(p, "w", funcs)) == NULL)
+            err(1, "fopencookie");
+    }
+#else
+    if ((p->fp = funopen(p, NULL, partition_cookie_write_int, NULL, NULL)) == NULL)
+        err(1, "funopen");
+#endif
+    flockfile(p->fp);
+    return p;
+}
+
+// Resolve the partition column, given the output column names (or NULL if there is no header row)
+void
+partition_resolve(struct partition *p, char *const *names, size_t num_names)
+{
+    p->col = find_column(p->spec, names, num_names);
+}
+
+//
+// Get the stream to output a record to; this starts the file with "begin" if this is its first record.
+//
+FILE *
+partition_select(struct partition *p, char *const *fields, size_t num)
+{
+    const char *const key = p->col < num ? fields[p->col] : "";
+    struct part *part;
+
+    if (p->by_value)
+        part = partition_lookup(p, key);
+    else
+        part = &p->parts[hash_bytes(key, strlen(key)) % p->num_parts];
+    if (part != p->current)
+        partition_switch(p, part);
+    return p->fp;
+}
+
+//
+// Finish each file with "end", write out all buffered data, and free the partitions.
+// With a fixed number of partitions, every file is created, even if it has no records.
+//
+void
+partition_finish(struct partition *p)
+{
+    struct part *part;
+    size_t i;
+
+    for (i = 0; i < (p->by_value ? p->num_slots : p->num_parts); i++) {
+        part = &p->parts[i];
+        if (p->by_value && part->key == NULL)
+            continue;
+        partition_switch(p, part);
+        if (p->end != NULL)
+            (*p->end)(p->arg, p->fp);
+        if (fflush(p->fp) == EOF)
+            err(1, "write");
+        part_write(p, part);
+        if (close(part->fd) == -1)
+            err(1, "%s", part->path);
+        part->fd = -1;
+        p->num_open--;
+    }
+    for (i = 0; i < (p->by_value ? p->num_slots : p->num_parts); i++) {
+        free(p->parts[i].key);
+        free(p->parts[i].path);
+        free(p->parts[i].buf);
+    }
+    funlockfile(p->fp);
+    fclose(p->fp);
+    free(p->parts);
+    free(p->spec);
+    free(p);
+}
+
+// Verify the template has exactly one conversion, which is "%d" or "%s" as appropriate
+static void
+check_template(const char *template, int by_value)
+{
+    const char *s;
+    int count = 0;
+
+    for (s = template; *s != '\0'; s++) {
+        if (*s != '%')
+            continue;
+        if (*++s == '%')
+            continue;
+        while (*s == '-' || *s == '0')
+            s++;
+        while (isdigit((unsigned char)*s))
+            s++;
+        if (*s != (by_value ? 's' : 'd'))
+            errx(1, "invalid \"--%s\": expecting a single \"%%%c\"", "output-template", by_value ? 's' : 'd');
+        count++;
+    }
+    if (count != 1)
+        errx(1, "invalid \"--%s\": expecting a single \"%%%c\"", "output-template", by_value ? 's' : 'd');
+}
+
+// Find (or add) the partition for a field value
+static struct part *
+partition_lookup(struct partition *p, const char *key)
+{
+    const size_t keylen = strlen(key);
+    const uint64_t hash = hash_bytes(key, keylen);
+    struct part *part;
+    size_t slot;
+
+    // Check the current partition first, as consecutive records often go to the same place
+    if (p->current != NULL && p->current->hash == hash && strcmp(p->current->key, key) == 0)
+        return p->current;
+    for (slot = hash & (p->num_slots - 1); (part = &p->parts[slot])->key != NULL; slot = (slot + 1) & (p->num_slots - 1)) {
+        if (part->hash == hash && strcmp(part->key, key) == 0)
+            return part;
+    }
+
+    // Add a new partition; the table moves if it grows, so first flush to the current partition
+    if (2 * (p->num_parts + 1) > p->num_slots) {
+        if (fflush(p->fp) == EOF)
+            err(1, "write");
+        p->current = NULL;
+        partition_grow(p);
+        for (slot = hash & (p->num_slots - 1); (part = &p->parts[slot])->key != NULL; slot = (slot + 1) & (p->num_slots - 1))
+            ;
+    }
+    if ((part->key = malloc(keylen + 1)) == NULL)
+        err(1, "malloc");
+    memcpy(part->key, key, keylen + 1);
+    part->hash = hash;
+    part->fd = -1;
+    p->num_parts++;
+    return part;
+}
+
+// Make "part" the partition that "fp" writes to
+static void
+partition_switch(struct partition *p, struct part *part)
+{
+    if (fflush(p->fp) == EOF)
+        err(1, "write");
+    p->current = part;
+    if (!part->started) {
+        part->started = 1;
+        if (p->begin != NULL)
+            (*p->begin)(p->arg, p->fp);
+    }
+}
+
+static void
+partition_grow(struct partition *p)
+{
+    struct part *const old_parts = p->parts;
+    const size_t old_num_slots = p->num_slots;
+    struct part *part;
+    size_t slot;
+    size_t i;
+
+    p->num_slots *= 2;
+    if ((p->parts = calloc(p->num_slots, sizeof(*p->parts))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < old_num_slots; i++) {
+        if (old_parts[i].key == NULL)
+            continue;
+        for (slot = old_parts[i].hash & (p->num_slots - 1); (part = &p->parts[slot])->key != NULL; slot = (slot + 1) & (p->num_slots - 1))
+            ;
+        *part = old_parts[i];
+    }
+    free(old_parts);
+}
+
+// Append a partition's buffered data to its file
+static void
+part_write(struct partition *p, struct part *part)
+{
+    const char *buf = part->buf;
+    size_t len = part->len;
+    ssize_t r;
+
+    if (part->fd == -1)
+        part_open(p, part);
+    part->last_write = ++p->clock;
+    while (len > 0) {
+        if ((r = write(part->fd, buf, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            err(1, "%s", part->path);
+        }
+        buf += r;
+        len -= r;
+    }
+    part->len = 0;
+}
+
+// Open a partition's file, first closing the least recently written file if too many are open
+static void
+part_open(struct partition *p, struct part *part)
+{
+    struct part *victim = NULL;
+    size_t i;
+
+    if (p->num_open == PARTITION_MAX_OPEN) {
+        for (i = 0; i < (p->by_value ? p->num_slots : p->num_parts); i++) {
+            if (p->parts[i].path != NULL && p->parts[i].fd != -1 && (victim == NULL || p->parts[i].last_write < victim->last_write))
+                victim = &p->parts[i];
+        }
+        if (close(victim->fd) == -1)
+            err(1, "%s", victim->path);
+        victim->fd = -1;
+        p->num_open--;
+    }
+    if (part->path == NULL) {
+        part->path = part_path(p, part);
+        part->fd = open(part->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    } else
+        part->fd = open(part->path, O_WRONLY | O_APPEND);
+    if (part->fd == -1)
+        err(1, "%s", part->path);
+    p->num_open++;
+}
+
+// Build a partition's file name; field values are percent-encoded, except for characters that are always safe
+static char *
+part_path(const struct partition *p, const struct part *part)
+{
+    static const char hexdig[] = "0123456789ABCDEF";
+    const unsigned char *s;
+    char *value;
+    char *path;
+    char *t;
+
+    if (!p->by_value) {
+        if (asprintf(&path, p->template, (int)part->index) == -1)
+            err(1, "asprintf");
+        return path;
+    }
+    if ((value = malloc(3 * strlen(part->key) + 1)) == NULL)
+        err(1, "malloc");
+    for (s = (const unsigned char *)part->key, t = value; *s != '\0'; s++) {
+        if (isalnum(*s) || *s == '-' || *s == '_' || (*s == '.' && t > value))
+            *t++ = *s;
+        else {
+            *t++ = '%';
+            *t++ = hexdig[*s >> 4];
+            *t++ = hexdig[*s & 0x0f];
+        }
+    }
+    *t = '\0';
+    if (asprintf(&path, p->template, value) == -1)
+        err(1, "asprintf");
+    free(value);
+    return path;
+}
+
+static ssize_t
+partition_cookie_write(void *cookie, const char *buf, size_t len)
+{
+    struct partition *const p = cookie;
+    struct part *const part = p->current;
+    size_t i;
+
+    // Append to the current partition's buffer; start small, in case there are lots of partitions
+    if (part->len + len > part->alloc) {
+        p->buffered -= part->alloc;
+        while (part->len + len > part->alloc)
+            part->alloc = part->alloc > 0 ? 2 * part->alloc : PARTITION_MIN_ALLOC;
+        if ((part->buf = realloc(part->buf, part->alloc)) == NULL)
+            err(1, "realloc");
+        p->buffered += part->alloc;
+    }
+    memcpy(part->buf + part->len, buf, len);
+    part->len += len;
+
+    // Write out the buffer when it's full; if we're using too much memory, write out everything
+    if (part->len >= PARTITION_BUFFER_SIZE)
+        part_write(p, part);
+    if (p->buffered > p->memory_limit) {
+        for (i = 0; i < (p->by_value ? p->num_slots : p->num_parts); i++) {
+            if (p->parts[i].len > 0)
+                part_write(p, &p->parts[i]);
+            free(p->parts[i].buf);
+            p->parts[i].buf = NULL;
+            p->parts[i].alloc = 0;
+        }
+        p->buffered = 0;
+    }
+    return len;
+}
+
+#if !HAVE_FOPENCOOKIE
+static int
+partition_cookie_write_int(void *cookie, const char *buf, int len)
+{
+    return (int)partition_cookie_write(cookie, buf, len);
+}
+#endif
@@ -0,0 +1,578 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PROFILE_MAX_THREADS     8
+#define PROFILE_BLOCK_SIZE      (64 * 1024)
+#define PROFILE_RING_BLOCKS     4
+
+#define HLL_BITS                14
+#define HLL_REGISTERS           (1 << HLL_BITS)
+
+#define TDIGEST_COMPRESSION     100.0
+#define TDIGEST_BUFFER_SIZE     500
+
+//
+// Column profiling.
+//
+// Each column gets exact counts plus two sketches: a HyperLogLog for the number of distinct
+// values, and a merging t-digest for quantiles of numeric values. Both sketches can be merged,
+// so when there are spare CPUs the parsed records are handed out, a block at a time, to worker
+// threads (over rings, like the reader and writer threads) that each keep their own statistics;
+// these are merged at the end.
+//
+
+static const char *const profile_names[] = {
+    "column", "records", "empty", "min_length", "max_length", "distinct", "non_ascii",
+    "numeric", "min", "max", "p50", "p90", "p99"
+};
+#define PROFILE_NUM_NAMES       (sizeof(profile_names) / sizeof(*profile_names))
+
+struct centroid {
+    double              mean;
+    double              weight;
+};
+
+struct tdigest {
+    struct centroid     *centroids;         // sorted by mean
+    size_t              num;
+    struct centroid     *buf;               // not yet merged
+    size_t              num_buf;
+    double              weight;             // total weight of "centroids"
+};
+
+struct profile_col {
+    uint64_t            empty;
+    uint64_t            non_ascii;
+    uint64_t            numeric;
+    size_t              min_len;
+    size_t              max_len;
+    double              min;
+    double              max;
+    uint8_t             *hll;
+    struct tdigest      digest;
+};
+
+struct profile_stats {
+    struct profile_col  *cols;
+    size_t              num_cols;
+    uint64_t            records;
+};
+
+struct profile_worker {
+    struct ring         *ring;
+    struct profile_stats stats;
+    pthread_t           thread;
+};
+
+struct profile {
+    char                **names;            // input column names, if known
+    size_t              num_names;
+    struct profile_stats stats;             // for this thread
+    struct profile_worker *workers;
+    size_t              num_workers;
+    size_t              next_worker;
+    struct ring_block   *block;             // block being filled for "next_worker"
+};
+
+static void *profile_worker_main(void *arg);
+static void profile_send(struct profile *p);
+static void profile_update(struct profile_stats *stats, char *const *fields, size_t num);
+static void profile_merge(struct profile_stats *stats, const struct profile_stats *other);
+static void profile_grow(struct profile_stats *stats, size_t num);
+static void profile_free_stats(struct profile_stats *stats);
+static char *profile_format(double value);
+static int profile_number(const char *value, double *dp);
+static double hll_estimate(const uint8_t *hll);
+static void tdigest_add(struct tdigest *td, double mean, double weight);
+static void tdigest_compress(struct tdigest *td);
+static double tdigest_quantile(struct tdigest *td, double q);
+static int centroid_cmp(const void *ptr1, const void *ptr2);
+
+struct profile *
+profile_create(void)
+{
+    struct profile *p;
+    long ncpu;
+    size_t i;
+
+    if ((p = calloc(1, sizeof(*p))) == NULL)
+        err(1, "calloc");
+
+    // Start a worker thread for each spare CPU
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 1) {
+        p->num_workers = ncpu - 1 < PROFILE_MAX_THREADS ? ncpu - 1 : PROFILE_MAX_THREADS;
+        if ((p->workers = calloc(p->num_workers, sizeof(*p->workers))) == NULL)
+            err(1, "calloc");
+        for (i = 0; i < p->num_workers; i++) {
+            p->workers[i].ring = ring_create(PROFILE_RING_BLOCKS, PROFILE_BLOCK_SIZE);
+            if ((errno = pthread_create(&p->workers[i].thread, NULL, profile_worker_main, &p->workers[i])) != 0)
+                err(1, "pthread_create");
+        }
+    }
+    return p;
+}
+
+// Set the input column names
+void
+profile_resolve(struct profile *p, char *const *names, size_t num_names)
+{
+    size_t i;
+
+    if ((p->names = calloc(num_names > 0 ? num_names : 1, sizeof(*p->names))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < num_names; i++) {
+        if ((p->names[i] = strdup(names[i])) == NULL)
+            err(1, "strdup");
+    }
+    p->num_names = num_names;
+}
+
+void
+profile_column_names(const char *const **namesp, size_t *nump)
+{
+    *namesp = profile_names;
+    *nump = PROFILE_NUM_NAMES;
+}
+
+void
+profile_add(struct profile *p, char *const *fields, size_t num)
+{
+    struct ring_block *block;
+    size_t size;
+    size_t len;
+    size_t i;
+
+    // Do it ourselves if there are no workers
+    if (p->num_workers == 0) {
+        profile_update(&p->stats, fields, num);
+        return;
+    }
+
+    // Encode the record: field count, then NUL-terminated fields
+    size = sizeof(num);
+    for (i = 0; i < num; i++)
+        size += strlen(fields[i]) + 1;
+    if (size > PROFILE_BLOCK_SIZE) {                // too big for a block; do it ourselves
+        profile_update(&p->stats, fields, num);
+        return;
+    }
+    if (p->block != NULL && p->block->len + size > p->block->size)
+        profile_send(p);
+    if (p->block == NULL && (p->block = ring_get_free(p->workers[p->next_worker].ring)) == NULL)
+        errx(1, "internal error");
+    block = p->block;
+    memcpy(block->buf + block->len, &num, sizeof(num));
+    block->len += sizeof(num);
+    for (i = 0; i < num; i++) {
+        len = strlen(fields[i]) + 1;
+        memcpy(block->buf + block->len, fields[i], len);
+        block->len += len;
+    }
+}
+
+//
+// Output one record per column, then free everything.
+//
+void
+profile_finish(struct profile *p, void (*emit)(void *arg, char *const *fields, size_t num), void *arg)
+{
+    char *result[PROFILE_NUM_NAMES];
+    struct profile_col *col;
+    char namebuf[32];
+    size_t i;
+    size_t j;
+
+    // Stop workers and merge their statistics
+    if (p->block != NULL)
+        profile_send(p);
+    for (i = 0; i < p->num_workers; i++) {
+        ring_close(p->workers[i].ring);
+        if ((errno = pthread_join(p->workers[i].thread, NULL)) != 0)
+            err(1, "pthread_join");
+        ring_destroy(p->workers[i].ring);
+        profile_merge(&p->stats, &p->workers[i].stats);
+        profile_free_stats(&p->workers[i].stats);
+    }
+
+    // Output a record for each column
+    profile_grow(&p->stats, p->num_names);
+    for (i = 0; i < p->stats.num_cols; i++) {
+        col = &p->stats.cols[i];
+        if (i < p->num_names)
+            result[0] = strdup(p->names[i]);
+        else {
+            snprintf(namebuf, sizeof(namebuf), "col%lu", (unsigned long)i + 1);
+            result[0] = strdup(namebuf);
+        }
+        if (result[0] == NULL)
+            err(1, "strdup");
+        result[1] = profile_format(p->stats.records);
+        result[2] = profile_format(col->empty);
+        result[3] = profile_format(col->empty < p->stats.records ? col->min_len : 0);
+        result[4] = profile_format(col->max_len);
+        result[5] = profile_format(col->hll != NULL ? round(hll_estimate(col->hll)) : 0);
+        result[6] = profile_format(col->non_ascii);
+        result[7] = profile_format(col->numeric);
+        result[8] = profile_format(col->numeric > 0 ? col->min : NAN);
+        result[9] = profile_format(col->numeric > 0 ? col->max : NAN);
+        result[10] = profile_format(col->numeric > 0 ? tdigest_quantile(&col->digest, 0.50) : NAN);
+        result[11] = profile_format(col->numeric > 0 ? tdigest_quantile(&col->digest, 0.90) : NAN);
+        result[12] = profile_format(col->numeric > 0 ? tdigest_quantile(&col->digest, 0.99) : NAN);
+        (*emit)(arg, result, PROFILE_NUM_NAMES);
+        for (j = 0; j < PROFILE_NUM_NAMES; j++)
+            free(result[j]);
+    }
+
+    // Free
+    profile_free_stats(&p->stats);
+    for (i = 0; i < p->num_names; i++)
+        free(p->names[i]);
+    free(p->names);
+    free(p->workers);
+    free(p);
+}
+
+static void *
+profile_worker_main(void *arg)
+{
+    struct profile_worker *const worker = arg;
+    struct ring_block *block;
+    char **fields = NULL;
+    size_t alloc = 0;
+    size_t num;
+    size_t off;
+    size_t i;
+
+    while ((block = ring_get_full(worker->ring)) != NULL) {
+        for (off = 0; off < block->len; ) {
+            memcpy(&num, block->buf + off, sizeof(num));
+            off += sizeof(num);
+            if (num > alloc) {
+                alloc = num * 2;
+                if ((fields = realloc(fields, alloc * sizeof(*fields))) == NULL)
+                    err(1, "realloc");
+            }
+            for (i = 0; i < num; i++) {
+                fields[i] = block->buf + off;
+                off += strlen(fields[i]) + 1;
+            }
+            profile_update(&worker->stats, fields, num);
+        }
+        ring_put_free(worker->ring, block);
+    }
+    free(fields);
+    return NULL;
+}
+
+// Hand off the current block and move on to the next worker
+static void
+profile_send(struct profile *p)
+{
+    ring_put_full(p->workers[p->next_worker].ring, p->block);
+    p->block = NULL;
+    p->next_worker = (p->next_worker + 1) % p->num_workers;
+}
+
+static void
+profile_update(struct profile_stats *stats, char *const *fields, size_t num)
+{
+    struct profile_col *col;
+    const char *s;
+    uint64_t hash;
+    size_t reg;
+    size_t len;
+    double d;
+    int rank;
+    size_t i;
+
+    profile_grow(stats, num);
+    stats->records++;
+    for (i = 0; i < stats->num_cols; i++) {
+        col = &stats->cols[i];
+
+        // Empty or missing?
+        if (i >= num || *fields[i] == '\0') {
+            col->empty++;
+            continue;
+        }
+
+        // Length and non-ASCII
+        for (s = fields[i]; *s != '\0' && (*s & 0x80) == 0; s++)
+            ;
+        len = strlen(s) + (s - fields[i]);
+        if (*s != '\0')
+            col->non_ascii++;
+        if (len < col->min_len)
+            col->min_len = len;
+        if (len > col->max_len)
+            col->max_len = len;
+
+        // Distinct values: the low bits choose the register, the rest give the rank
+        if (col->hll == NULL && (col->hll = calloc(HLL_REGISTERS, 1)) == NULL)
+            err(1, "calloc");
+        hash = hash_bytes(fields[i], len);
+        reg = hash & (HLL_REGISTERS - 1);
+        for (rank = 1, hash >>= HLL_BITS; rank <= 64 - HLL_BITS && (hash & 1) == 0; rank++, hash >>= 1)
+            ;
+        if (rank > col->hll[reg])
+            col->hll[reg] = rank;
+
+        // Numeric values
+        if (profile_number(fields[i], &d)) {
+            if (col->numeric == 0 || d < col->min)
+                col->min = d;
+            if (col->numeric == 0 || d > col->max)
+                col->max = d;
+            col->numeric++;
+            tdigest_add(&col->digest, d, 1.0);
+        }
+    }
+}
+
+static void
+profile_merge(struct profile_stats *stats, const struct profile_stats *other)
+{
+    const struct profile_col *ocol;
+    struct profile_col *col;
+    size_t i;
+    size_t j;
+
+    profile_grow(stats, other->num_cols);
+    for (i = 0; i < stats->num_cols; i++) {
+        col = &stats->cols[i];
+        if (i >= other->num_cols) {         // all of the other's records were missing this column
+            col->empty += other->records;
+            continue;
+        }
+        ocol = &other->cols[i];
+        col->empty += ocol->empty;
+        col->non_ascii += ocol->non_ascii;
+        if (ocol->min_len < col->min_len)
+            col->min_len = ocol->min_len;
+        if (ocol->max_len > col->max_len)
+            col->max_len = ocol->max_len;
+        if (ocol->numeric > 0) {
+            if (col->numeric == 0 || ocol->min < col->min)
+                col->min = ocol->min;
+            if (col->numeric == 0 || ocol->max > col->max)
+                col->max = ocol->max;
+            col->numeric += ocol->numeric;
+        }
+        if (ocol->hll != NULL) {
+            if (col->hll == NULL && (col->hll = calloc(HLL_REGISTERS, 1)) == NULL)
+                err(1, "calloc");
+            for (j = 0; j < HLL_REGISTERS; j++) {
+                if (ocol->hll[j] > col->hll[j])
+                    col->hll[j] = ocol->hll[j];
+            }
+        }
+        for (j = 0; j < ocol->digest.num; j++)
+            tdigest_add(&col->digest, ocol->digest.centroids[j].mean, ocol->digest.centroids[j].weight);
+        for (j = 0; j < ocol->digest.num_buf; j++)
+            tdigest_add(&col->digest, ocol->digest.buf[j].mean, ocol->digest.buf[j].weight);
+    }
+    stats->records += other->records;
+}
+
+// Make sure we have at least "num" columns; new columns were missing (i.e., empty) in all previous records
+static void
+profile_grow(struct profile_stats *stats, size_t num)
+{
+    struct profile_col *col;
+
+    if (num <= stats->num_cols)
+        return;
+    if ((stats->cols = realloc(stats->cols, num * sizeof(*stats->cols))) == NULL)
+        err(1, "realloc");
+    while (stats->num_cols < num) {
+        col = &stats->cols[stats->num_cols++];
+        memset(col, 0, sizeof(*col));
+        col->min_len = SIZE_MAX;
+        col->empty = stats->records;
+    }
+}
+
+static void
+profile_free_stats(struct profile_stats *stats)
+{
+    size_t i;
+
+    for (i = 0; i < stats->num_cols; i++) {
+        free(stats->cols[i].hll);
+        free(stats->cols[i].digest.centroids);
+        free(stats->cols[i].digest.buf);
+    }
+    free(stats->cols);
+    memset(stats, 0, sizeof(*stats));
+}
+
+// Format a number, or the empty string for NaN; caller must free it
+static char *
+profile_format(double value)
+{
+    char *result;
+
+    if (asprintf(&result, isnan(value) ? "" : "%.15g", value) == -1)
+        err(1, "asprintf");
+    return result;
+}
+
+static int
+profile_number(const char *value, double *dp)
+{
+    char *eptr;
+
+    *dp = strtod(value, &eptr);
+    return eptr != value && *eptr == '\0' && isfinite(*dp);
+}
+
+// HyperLogLog estimate, using linear counting for small cardinalities
+static double
+hll_estimate(const uint8_t *hll)
+{
+    const double m = HLL_REGISTERS;
+    const double alpha = 0.7213 / (1.0 + 1.079 / m);
+    double sum = 0;
+    int zeros = 0;
+    double estimate;
+    int i;
+
+    for (i = 0; i < HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -hll[i]);
+        if (hll[i] == 0)
+            zeros++;
+    }
+    estimate = alpha * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0)
+        estimate = m * log(m / zeros);
+    return estimate;
+}
+
+//
+// Merging t-digest: values are buffered, then periodically sorted and merged into the
+// centroids, where each centroid may grow only as far as the k1 scale function allows
+// (so centroids near the tails stay small and extreme quantiles stay accurate).
+//
+static void
+tdigest_add(struct tdigest *td, double mean, double weight)
+{
+    if (td->buf == NULL && (td->buf = malloc(TDIGEST_BUFFER_SIZE * sizeof(*td->buf))) == NULL)
+        err(1, "malloc");
+    td->buf[td->num_buf].mean = mean;
+    td->buf[td->num_buf].weight = weight;
+    if (++td->num_buf == TDIGEST_BUFFER_SIZE)
+        tdigest_compress(td);
+}
+
+static void
+tdigest_compress(struct tdigest *td)
+{
+    struct centroid *all;
+    struct centroid *cur;
+    double total;
+    double sofar;
+    double qlimit;
+    size_t num;
+    size_t i;
+
+    if (td->num_buf == 0)
+        return;
+
+    // Combine and sort
+    num = td->num + td->num_buf;
+    if ((all = malloc(num * sizeof(*all))) == NULL)
+        err(1, "malloc");
+    memcpy(all, td->centroids, td->num * sizeof(*all));
+    memcpy(all + td->num, td->buf, td->num_buf * sizeof(*all));
+    total = td->weight;
+    for (i = 0; i < td->num_buf; i++)
+        total += td->buf[i].weight;
+    qsort(all, num, sizeof(*all), centroid_cmp);
+
+    // Merge neighbors while they stay within the size limit
+    cur = &all[0];
+    sofar = 0;
+    qlimit = (sin(fmin(M_PI / 2, asin(2 * 0 - 1) + 2 * M_PI / TDIGEST_COMPRESSION)) + 1) / 2;
+    for (i = 1; i < num; i++) {
+        if ((sofar + cur->weight + all[i].weight) / total <= qlimit) {
+            cur->mean += (all[i].mean - cur->mean) * all[i].weight / (cur->weight + all[i].weight);
+            cur->weight += all[i].weight;
+        } else {
+            sofar += cur->weight;
+            qlimit = (sin(fmin(M_PI / 2, asin(2 * (sofar / total) - 1) + 2 * M_PI / TDIGEST_COMPRESSION)) + 1) / 2;
+            *++cur = all[i];
+        }
+    }
+    free(td->centroids);
+    td->centroids = all;
+    td->num = cur - all + 1;
+    td->weight = total;
+    td->num_buf = 0;
+}
+
+static double
+tdigest_quantile(struct tdigest *td, double q)
+{
+    const struct centroid *c;
+    double target;
+    double sofar = 0;
+    double left;
+    double right;
+    size_t i;
+
+    tdigest_compress(td);
+    if (td->num == 0)
+        return NAN;
+    if (td->num == 1)
+        return td->centroids[0].mean;
+    target = q * td->weight;
+    for (i = 0; i < td->num; i++) {
+        c = &td->centroids[i];
+        if (sofar + c->weight / 2 >= target) {
+
+            // Interpolate between the centers of this centroid and the previous one
+            if (i == 0)
+                return c->mean;
+            left = sofar - td->centroids[i - 1].weight / 2;
+            right = sofar + c->weight / 2;
+            return td->centroids[i - 1].mean
+              + (c->mean - td->centroids[i - 1].mean) * (target - left) / (right - left);
+        }
+        sofar += c->weight;
+    }
+    return td->centroids[td->num - 1].mean;
+}
+
+static int
+centroid_cmp(const void *ptr1, const void *ptr2)
+{
+    const struct centroid *const c1 = ptr1;
+    const struct centroid *const c2 = ptr2;
+
+    return c1->mean < c2->mean ? -1 : c1->mean > c2->mean ? 1 : 0;
+}
@@ -0,0 +1,244 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How many times to poll an empty queue before going to sleep
+#define RING_SPIN_COUNT         256
+
+//
+// A ring is a fixed pool of data blocks shared between exactly one producer thread
+// and exactly one consumer thread. Blocks circulate from the producer (who fills them)
+// to the consumer (who drains them) and back again, so no allocation happens after setup.
+//
+// The "full" queue carries blocks from producer to consumer; the "free" queue carries them back.
+// Both queues can hold every block, so a put never blocks.
+//
+// Each queue is a lock-free single-producer/single-consumer circular buffer. The mutex and
+// condition variables are only used when a thread has to sleep because its queue is empty;
+// the "sleeping" flag tells the other side it needs to wake it up.
+//
+
+struct queue {
+    _Atomic unsigned int    head;           // free-running index of next slot to get; written by consumer only
+    _Atomic unsigned int    tail;           // free-running index of next slot to put; written by producer only
+    _Atomic int             sleeping;       // consumer is blocked (or about to block) on "cond"
+    pthread_cond_t          cond;
+    struct ring_block       **slots;
+};
+
+struct ring {
+    pthread_mutex_t         mutex;
+    struct ring_block       *blocks;
+    unsigned int            nblocks;
+    struct queue            full;           // producer -> consumer
+    struct queue            free;           // consumer -> producer
+    _Atomic int             closed;         // producer has no more data
+    _Atomic int             aborted;        // consumer wants no more data
+};
+
+static void queue_init(struct ring *ring, struct queue *q);
+static void queue_put(struct ring *ring, struct queue *q, struct ring_block *block);
+static struct ring_block *queue_get(struct ring *ring, struct queue *q, _Atomic int *stop);
+static void ring_wakeup(struct ring *ring);
+
+struct ring *
+ring_create(unsigned int nblocks, size_t blocksize)
+{
+    struct ring *ring;
+    unsigned int i;
+
+    if ((ring = calloc(1, sizeof(*ring))) == NULL)
+        err(1, "calloc");
+    if ((ring->blocks = calloc(nblocks, sizeof(*ring->blocks))) == NULL)
+        err(1, "calloc");
+    ring->nblocks = nblocks;
+    if ((errno = pthread_mutex_init(&ring->mutex, NULL)) != 0)
+        err(1, "pthread_mutex_init");
+    queue_init(ring, &ring->full);
+    queue_init(ring, &ring->free);
+    for (i = 0; i < nblocks; i++) {
+        if ((ring->blocks[i].buf = malloc(blocksize)) == NULL)
+            err(1, "malloc");
+        ring->blocks[i].size = blocksize;
+        ring->free.slots[i] = &ring->blocks[i];
+    }
+    atomic_store(&ring->free.tail, nblocks);
+    return ring;
+}
+
+void
+ring_destroy(struct ring *ring)
+{
+    unsigned int i;
+
+    pthread_cond_destroy(&ring->full.cond);
+    pthread_cond_destroy(&ring->free.cond);
+    pthread_mutex_destroy(&ring->mutex);
+    for (i = 0; i < ring->nblocks; i++)
+        free(ring->blocks[i].buf);
+    free(ring->blocks);
+    free(ring->full.slots);
+    free(ring->free.slots);
+    free(ring);
+}
+
+//
+// Producer: get an empty block to fill. Returns NULL if the consumer has aborted.
+//
+struct ring_block *
+ring_get_free(struct ring *ring)
+{
+    struct ring_block *block;
+
+    if (atomic_load(&ring->aborted) || (block = queue_get(ring, &ring->free, &ring->aborted)) == NULL)
+        return NULL;
+    block->len = 0;
+    return block;
+}
+
+//
+// Producer: hand a filled block to the consumer.
+//
+void
+ring_put_full(struct ring *ring, struct ring_block *block)
+{
+    queue_put(ring, &ring->full, block);
+}
+
+//
+// Producer: indicate no more data is coming.
+//
+void
+ring_close(struct ring *ring)
+{
+    atomic_store(&ring->closed, 1);
+    ring_wakeup(ring);
+}
+
+//
+// Consumer: determine whether a filled block is available, i.e., whether ring_get_full() would return without waiting.
+//
+int
+ring_has_full(struct ring *ring)
+{
+    return atomic_load(&ring->full.tail) != atomic_load_explicit(&ring->full.head, memory_order_relaxed)
+      || atomic_load(&ring->closed);
+}
+
+//
+// Consumer: get the next filled block. Returns NULL once the producer has closed the ring and all blocks are consumed.
+//
+struct ring_block *
+ring_get_full(struct ring *ring)
+{
+    return queue_get(ring, &ring->full, &ring->closed);
+}
+
+//
+// Consumer: return a drained block to the producer.
+//
+void
+ring_put_free(struct ring *ring, struct ring_block *block)
+{
+    queue_put(ring, &ring->free, block);
+}
+
+//
+// Consumer: indicate no more data is wanted; wakes up a blocked producer.
+//
+void
+ring_abort(struct ring *ring)
+{
+    atomic_store(&ring->aborted, 1);
+    ring_wakeup(ring);
+}
+
+static void
+queue_init(struct ring *ring, struct queue *q)
+{
+    if ((q->slots = calloc(ring->nblocks, sizeof(*q->slots))) == NULL)
+        err(1, "calloc");
+    if ((errno = pthread_cond_init(&q->cond, NULL)) != 0)
+        err(1, "pthread_cond_init");
+}
+
+static void
+queue_put(struct ring *ring, struct queue *q, struct ring_block *block)
+{
+    const unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    q->slots[tail % ring->nblocks] = block;
+
+    // Publish the slot, then see if the consumer went to sleep before it could see it.
+    // Both sides use sequentially consistent operations here so at least one of them notices the other.
+    atomic_store(&q->tail, tail + 1);
+    if (atomic_load(&q->sleeping)) {
+        pthread_mutex_lock(&ring->mutex);
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+}
+
+// Get the next block from the queue; returns NULL if the queue is empty and "stop" is set
+static struct ring_block *
+queue_get(struct ring *ring, struct queue *q, _Atomic int *stop)
+{
+    const unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    struct ring_block *block;
+    int spins = 0;
+
+    while (atomic_load_explicit(&q->tail, memory_order_acquire) == head) {
+
+        // Check for end of stream (the last block was published before "stop" was set)
+        if (atomic_load(stop)) {
+            if (atomic_load(&q->tail) == head)
+                return NULL;
+            break;
+        }
+
+        // Spin a while, then sleep until woken up
+        if (spins++ < RING_SPIN_COUNT)
+            continue;
+        pthread_mutex_lock(&ring->mutex);
+        atomic_store(&q->sleeping, 1);
+        while (atomic_load(&q->tail) == head && !atomic_load(stop))
+            pthread_cond_wait(&q->cond, &ring->mutex);
+        atomic_store(&q->sleeping, 0);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+    block = q->slots[head % ring->nblocks];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return block;
+}
+
+// Wake up anyone sleeping (used when "closed" or "aborted" changes)
+static void
+ring_wakeup(struct ring *ring)
+{
+    pthread_mutex_lock(&ring->mutex);
+    pthread_cond_broadcast(&ring->full.cond);
+    pthread_cond_broadcast(&ring->free.cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
@@ -0,0 +1,544 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SORT_INSERTION_MAX      16          // use insertion sort below this many rows
+#define SORT_MIN_PER_THREAD     65536       // don't bother with another thread for fewer rows than this
+#define SORT_MAX_THREADS        16
+#define SORT_MAX_FANIN          64          // maximum number of runs to merge at once
+
+//
+// External merge sort.
+//
+// Rows are copied into an arena until the memory limit is reached. Then that "run" is sorted,
+// using several threads that each sort part of it followed by merging the parts, and written
+// to a temporary file. At the end, the runs are merged using a loser tree (a tournament tree
+// that needs only one comparison per level to replace the winner). If there are too many runs
+// to merge at once, groups of runs are first merged into longer runs; this also happens
+// as runs are created, to limit the number of open files.
+//
+// The sort is stable: rows with equal keys are output in input order.
+//
+
+struct sort_key {
+    size_t              col;
+    char                *colspec;
+    int                 numeric;
+    int                 descending;
+};
+
+// A row and its pre-parsed numeric keys, allocated as a single block
+struct sort_row {
+    char                **fields;
+    double              *nums;              // NAN if not a number
+    size_t              num;
+    int                 linenum;
+};
+
+struct sorter {
+    struct sort_key     *keys;
+    size_t              num_keys;
+    size_t              memory_limit;
+    struct arena        *arena;
+    struct sort_row     **rows;             // current run
+    struct sort_row     **tmp;              // merge buffer, same size as rows
+    size_t              num_rows;
+    size_t              alloc_rows;
+    struct spill        **runs;             // in input order
+    unsigned int        *levels;            // how many times each run has been merged
+    size_t              num_runs;
+};
+
+struct sort_job {
+    const struct sorter *s;
+    struct sort_row     **rows;
+    struct sort_row     **tmp;
+    size_t              num;
+    pthread_t           thread;
+};
+
+struct sort_merge {
+    const struct sorter *s;
+    struct spill        **runs;
+    size_t              k;
+    struct sort_row     **heads;            // next row from each run, or NULL if exhausted
+    size_t              *tree;              // tree[0] is the winner, tree[1..k-1] are the losers
+};
+
+static struct sort_row *sort_make_row(const struct sorter *s, struct arena *arena,
+    char *const *fields, size_t num, int linenum);
+static void sort_flush(struct sorter *s);
+static void sort_run(struct sorter *s);
+static void *sort_job_main(void *arg);
+static void sort_rows(const struct sorter *s, struct sort_row **rows, struct sort_row **tmp, size_t num);
+static void sort_merge_rows(const struct sorter *s, struct sort_row **rows1, size_t num1,
+    struct sort_row **rows2, size_t num2, struct sort_row **out);
+static int sort_compare(const struct sorter *s, const struct sort_row *row1, const struct sort_row *row2);
+static void sort_merge_runs(const struct sorter *s, struct spill **runs, size_t k, struct spill *out,
+    void (*emit)(void *arg, char *const *fields, size_t num, int linenum), void *arg);
+static struct sort_row *sort_merge_read(struct sort_merge *m, size_t i);
+static int sort_merge_less(const struct sort_merge *m, size_t i, size_t j);
+static void sort_merge_adjust(struct sort_merge *m, size_t i);
+
+//
+// Parse a list of sort keys of the form "col[:num|:str][:asc|:desc]".
+//
+struct sorter *
+sort_create(const char *spec, size_t memory_limit)
+{
+    struct sort_key *key;
+    struct sorter *s;
+    const char *next;
+    char *colon;
+    char *buf;
+
+    if ((s = calloc(1, sizeof(*s))) == NULL)
+        err(1, "calloc");
+    s->memory_limit = memory_limit;
+    s->arena = arena_create();
+    for (; ; spec = next + 1) {
+        if ((next = strchr(spec, ',')) == NULL)
+            next = spec + strlen(spec);
+        if ((buf = strndup(spec, next - spec)) == NULL)
+            err(1, "strndup");
+        if ((s->keys = realloc(s->keys, (s->num_keys + 1) * sizeof(*s->keys))) == NULL)
+            err(1, "realloc");
+        key = &s->keys[s->num_keys++];
+        memset(key, 0, sizeof(*key));
+
+        // Strip modifiers from the right, so column names may contain colons
+        while ((colon = strrchr(buf, ':')) != NULL) {
+            if (strcmp(colon + 1, "num") == 0)
+                key->numeric = 1;
+            else if (strcmp(colon + 1, "str") == 0)
+                key->numeric = 0;
+            else if (strcmp(colon + 1, "desc") == 0)
+                key->descending = 1;
+            else if (strcmp(colon + 1, "asc") == 0)
+                key->descending = 0;
+            else
+                break;
+            *colon = '\0';
+        }
+        if (*buf == '\0')
+            errx(1, "invalid argument to \"--%s\"", "sort-by");
+        key->colspec = buf;
+        if (*next == '\0')
+            break;
+    }
+    return s;
+}
+
+void
+sort_resolve(struct sorter *s, char *const *names, size_t num_names)
+{
+    size_t i;
+
+    for (i = 0; i < s->num_keys; i++)
+        s->keys[i].col = find_column(s->keys[i].colspec, names, num_names);
+}
+
+void
+sort_add(struct sorter *s, char *const *fields, size_t num, int linenum)
+{
+    if (s->num_rows == s->alloc_rows) {
+        s->alloc_rows = s->alloc_rows > 0 ? s->alloc_rows * 2 : 1024;
+        if ((s->rows = realloc(s->rows, s->alloc_rows * sizeof(*s->rows))) == NULL)
+            err(1, "realloc");
+        if ((s->tmp = realloc(s->tmp, s->alloc_rows * sizeof(*s->tmp))) == NULL)
+            err(1, "realloc");
+    }
+    s->rows[s->num_rows++] = sort_make_row(s, s->arena, fields, num, linenum);
+    if (s->memory_limit != 0 && arena_size(s->arena) + s->alloc_rows * 2 * sizeof(*s->rows) > s->memory_limit)
+        sort_flush(s);
+}
+
+//
+// Output all rows in sorted order, then free everything.
+//
+void
+sort_finish(struct sorter *s, void (*emit)(void *arg, char *const *fields, size_t num, int linenum), void *arg)
+{
+    struct spill *out;
+    size_t i;
+    size_t j;
+    size_t n;
+
+    // Everything fit in memory?
+    if (s->num_runs == 0) {
+        sort_run(s);
+        for (i = 0; i < s->num_rows; i++)
+            (*emit)(arg, s->rows[i]->fields, s->rows[i]->num, s->rows[i]->linenum);
+    } else {
+
+        // Write out the last run and free up memory
+        if (s->num_rows > 0)
+            sort_flush(s);
+        free(s->rows);
+        free(s->tmp);
+        s->rows = s->tmp = NULL;
+        arena_reset(s->arena);
+
+        // Merge consecutive groups of runs (keeping them in input order) until there are few enough to merge at once
+        while (s->num_runs > SORT_MAX_FANIN) {
+            for (i = j = 0; i < s->num_runs; i += n, j++) {
+                if ((n = s->num_runs - i) > SORT_MAX_FANIN)
+                    n = SORT_MAX_FANIN;
+                if (n == 1) {
+                    s->runs[j] = s->runs[i];
+                    continue;
+                }
+                out = spill_create();
+                sort_merge_runs(s, s->runs + i, n, out, NULL, NULL);
+                s->runs[j] = out;
+            }
+            s->num_runs = j;
+        }
+        sort_merge_runs(s, s->runs, s->num_runs, NULL, emit, arg);
+    }
+
+    // Free
+    for (i = 0; i < s->num_keys; i++)
+        free(s->keys[i].colspec);
+    free(s->keys);
+    free(s->rows);
+    free(s->tmp);
+    free(s->runs);
+    free(s->levels);
+    arena_destroy(s->arena);
+    free(s);
+}
+
+// Copy a row (and parse its numeric keys) into a single block from the arena, or from malloc() if arena is NULL
+static struct sort_row *
+sort_make_row(const struct sorter *s, struct arena *arena, char *const *fields, size_t num, int linenum)
+{
+    struct sort_row *row;
+    size_t size;
+    size_t len;
+    size_t i;
+    char *ptr;
+    char *eptr;
+
+    size = sizeof(*row) + num * sizeof(*row->fields) + s->num_keys * sizeof(*row->nums);
+    for (i = 0; i < num; i++)
+        size += strlen(fields[i]) + 1;
+    if (arena != NULL)
+        row = arena_alloc(arena, size);
+    else if ((row = malloc(size)) == NULL)
+        err(1, "malloc");
+    row->nums = (double *)(row + 1);
+    row->fields = (char **)(row->nums + s->num_keys);
+    row->num = num;
+    row->linenum = linenum;
+    ptr = (char *)(row->fields + num);
+    for (i = 0; i < num; i++) {
+        len = strlen(fields[i]) + 1;
+        row->fields[i] = memcpy(ptr, fields[i], len);
+        ptr += len;
+    }
+    for (i = 0; i < s->num_keys; i++) {
+        row->nums[i] = NAN;
+        if (!s->keys[i].numeric || s->keys[i].col >= num)
+            continue;
+        row->nums[i] = strtod(row->fields[s->keys[i].col], &eptr);
+        if (eptr == row->fields[s->keys[i].col])
+            row->nums[i] = NAN;
+    }
+    return row;
+}
+
+// Sort the current run and write it to a new temporary file
+static void
+sort_flush(struct sorter *s)
+{
+    struct spill *run;
+    size_t i;
+
+    sort_run(s);
+    run = spill_create();
+    for (i = 0; i < s->num_rows; i++)
+        spill_write(run, s->rows[i]->linenum, s->rows[i]->fields, s->rows[i]->num);
+    if ((s->runs = realloc(s->runs, (s->num_runs + 1) * sizeof(*s->runs))) == NULL)
+        err(1, "realloc");
+    if ((s->levels = realloc(s->levels, (s->num_runs + 1) * sizeof(*s->levels))) == NULL)
+        err(1, "realloc");
+    s->levels[s->num_runs] = 0;
+    s->runs[s->num_runs++] = run;
+    s->num_rows = 0;
+    arena_reset(s->arena);
+
+    // Whenever the last SORT_MAX_FANIN runs have the same level, merge them into one run at the next level
+    while (s->num_runs >= SORT_MAX_FANIN) {
+        const size_t first = s->num_runs - SORT_MAX_FANIN;
+
+        for (i = first + 1; i < s->num_runs && s->levels[i] == s->levels[first]; i++)
+            ;
+        if (i < s->num_runs)
+            break;
+        run = spill_create();
+        sort_merge_runs(s, s->runs + first, SORT_MAX_FANIN, run, NULL, NULL);
+        s->runs[first] = run;
+        s->levels[first]++;
+        s->num_runs = first + 1;
+    }
+}
+
+// Sort the current run, splitting the work across threads if it's big enough
+static void
+sort_run(struct sorter *s)
+{
+    struct sort_job jobs[SORT_MAX_THREADS];
+    size_t num_jobs;
+    size_t width;
+    size_t start;
+    size_t mid;
+    size_t end;
+    long ncpu;
+    size_t i;
+
+    // Decide how many threads to use
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    num_jobs = s->num_rows / SORT_MIN_PER_THREAD;
+    if (num_jobs > (size_t)ncpu)
+        num_jobs = ncpu;
+    if (num_jobs > SORT_MAX_THREADS)
+        num_jobs = SORT_MAX_THREADS;
+    if (num_jobs < 2) {
+        sort_rows(s, s->rows, s->tmp, s->num_rows);
+        return;
+    }
+
+    // Sort each slice in its own thread (this thread does the first one)
+    for (i = 0; i < num_jobs; i++) {
+        start = s->num_rows * i / num_jobs;
+        jobs[i].s = s;
+        jobs[i].rows = s->rows + start;
+        jobs[i].tmp = s->tmp + start;
+        jobs[i].num = s->num_rows * (i + 1) / num_jobs - start;
+        if (i > 0 && (errno = pthread_create(&jobs[i].thread, NULL, sort_job_main, &jobs[i])) != 0)
+            err(1, "pthread_create");
+    }
+    sort_job_main(&jobs[0]);
+    for (i = 1; i < num_jobs; i++) {
+        if ((errno = pthread_join(jobs[i].thread, NULL)) != 0)
+            err(1, "pthread_join");
+    }
+
+    // Merge adjacent slices until there's only one
+    for (width = 1; width < num_jobs; width *= 2) {
+        for (i = 0; i + width < num_jobs; i += 2 * width) {
+            start = jobs[i].rows - s->rows;
+            mid = jobs[i + width].rows - s->rows;
+            end = i + 2 * width < num_jobs ? (size_t)(jobs[i + 2 * width].rows - s->rows) : s->num_rows;
+            sort_merge_rows(s, s->rows + start, mid - start, s->rows + mid, end - mid, s->tmp + start);
+            memcpy(s->rows + start, s->tmp + start, (end - start) * sizeof(*s->rows));
+        }
+    }
+}
+
+static void *
+sort_job_main(void *arg)
+{
+    struct sort_job *const job = arg;
+
+    sort_rows(job->s, job->rows, job->tmp, job->num);
+    return NULL;
+}
+
+// Stable merge sort
+static void
+sort_rows(const struct sorter *s, struct sort_row **rows, struct sort_row **tmp, size_t num)
+{
+    struct sort_row *row;
+    size_t mid;
+    size_t i;
+    size_t j;
+
+    if (num <= SORT_INSERTION_MAX) {
+        for (i = 1; i < num; i++) {
+            row = rows[i];
+            for (j = i; j > 0 && sort_compare(s, rows[j - 1], row) > 0; j--)
+                rows[j] = rows[j - 1];
+            rows[j] = row;
+        }
+        return;
+    }
+    mid = num / 2;
+    sort_rows(s, rows, tmp, mid);
+    sort_rows(s, rows + mid, tmp + mid, num - mid);
+    if (sort_compare(s, rows[mid - 1], rows[mid]) <= 0)
+        return;
+    sort_merge_rows(s, rows, mid, rows + mid, num - mid, tmp);
+    memcpy(rows, tmp, num * sizeof(*rows));
+}
+
+static void
+sort_merge_rows(const struct sorter *s, struct sort_row **rows1, size_t num1,
+    struct sort_row **rows2, size_t num2, struct sort_row **out)
+{
+    while (num1 > 0 && num2 > 0) {
+        if (sort_compare(s, *rows2, *rows1) < 0) {
+            *out++ = *rows2++;
+            num2--;
+        } else {
+            *out++ = *rows1++;
+            num1--;
+        }
+    }
+    memcpy(out, rows1, num1 * sizeof(*out));
+    memcpy(out + num1, rows2, num2 * sizeof(*out));
+}
+
+// Compare rows by key; missing columns are treated as empty, and non-numbers sort before numbers
+static int
+sort_compare(const struct sorter *s, const struct sort_row *row1, const struct sort_row *row2)
+{
+    const struct sort_key *key;
+    double num1;
+    double num2;
+    size_t i;
+    int diff;
+
+    for (i = 0; i < s->num_keys; i++) {
+        key = &s->keys[i];
+        if (key->numeric) {
+            num1 = row1->nums[i];
+            num2 = row2->nums[i];
+            if (isnan(num1) || isnan(num2))
+                diff = !isnan(num1) - !isnan(num2);
+            else
+                diff = (num1 > num2) - (num1 < num2);
+        } else {
+            diff = strcmp(key->col < row1->num ? row1->fields[key->col] : "",
+              key->col < row2->num ? row2->fields[key->col] : "");
+        }
+        if (diff != 0)
+            return key->descending ? -diff : diff;
+    }
+    return 0;
+}
+
+//
+// Merge k sorted runs into "out", or pass the rows to "emit" if "out" is NULL. Frees the runs.
+//
+static void
+sort_merge_runs(const struct sorter *s, struct spill **runs, size_t k, struct spill *out,
+    void (*emit)(void *arg, char *const *fields, size_t num, int linenum), void *arg)
+{
+    struct sort_merge merge;
+    struct sort_row *row;
+    size_t i;
+
+    // Initialize
+    memset(&merge, 0, sizeof(merge));
+    merge.s = s;
+    merge.runs = runs;
+    merge.k = k;
+    if ((merge.heads = calloc(k, sizeof(*merge.heads))) == NULL)
+        err(1, "calloc");
+    if ((merge.tree = calloc(k, sizeof(*merge.tree))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < k; i++) {
+        spill_rewind(runs[i]);
+        merge.heads[i] = sort_merge_read(&merge, i);
+        merge.tree[i] = k;                  // "k" is a virtual leaf that beats everything
+    }
+    for (i = k; i-- > 0; )
+        sort_merge_adjust(&merge, i);
+
+    // Merge
+    while ((row = merge.heads[i = merge.tree[0]]) != NULL) {
+        if (out != NULL)
+            spill_write(out, row->linenum, row->fields, row->num);
+        else
+            (*emit)(arg, row->fields, row->num, row->linenum);
+        free(row);
+        merge.heads[i] = sort_merge_read(&merge, i);
+        sort_merge_adjust(&merge, i);
+    }
+
+    // Clean up
+    for (i = 0; i < k; i++)
+        spill_destroy(runs[i]);
+    free(merge.heads);
+    free(merge.tree);
+}
+
+static struct sort_row *
+sort_merge_read(struct sort_merge *m, size_t i)
+{
+    struct sort_row *row;
+    uint64_t linenum;
+    char **fields;
+    size_t num;
+
+    if (!spill_read(m->runs[i], &linenum, &fields, &num))
+        return NULL;
+    row = sort_make_row(m->s, NULL, fields, num, (int)linenum);
+    while (num > 0)
+        free(fields[--num]);
+    free(fields);
+    return row;
+}
+
+// Does run "i" come before run "j"? Exhausted runs come last; ties go to the earlier run, for stability.
+static int
+sort_merge_less(const struct sort_merge *m, size_t i, size_t j)
+{
+    int diff;
+
+    if (i == m->k)
+        return 1;
+    if (j == m->k)
+        return 0;
+    if (m->heads[i] == NULL)
+        return 0;
+    if (m->heads[j] == NULL)
+        return 1;
+    if ((diff = sort_compare(m->s, m->heads[i], m->heads[j])) != 0)
+        return diff < 0;
+    return i < j;
+}
+
+// Replay the matches from leaf "i" up to the root after its run's head has changed
+static void
+sort_merge_adjust(struct sort_merge *m, size_t i)
+{
+    size_t winner = i;
+    size_t node;
+    size_t tmp;
+
+    for (node = (i + m->k) / 2; node > 0; node /= 2) {
+        if (sort_merge_less(m, m->tree[node], winner)) {
+            tmp = m->tree[node];
+            m->tree[node] = winner;
+            winner = tmp;
+        }
+    }
+    m->tree[0] = winner;
+}
@@ -0,0 +1,177 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SPILL_BUFFER_SIZE       (64 * 1024)
+
+//
+// A spill file is an anonymous temporary file holding a sequence of rows, used when
+// an operation needs more memory than it's allowed. Rows are written in one pass,
+// then read back in the same order after spill_rewind().
+//
+// Each row is a varint tag (for the caller's use), a varint field count, and then
+// (varint length, bytes) for each field.
+//
+
+struct spill {
+    FILE        *fp;
+    uint64_t    num_rows;
+};
+
+static void spill_write_varint(struct spill *spill, uint64_t value);
+static int spill_read_varint(struct spill *spill, uint64_t *valuep);
+
+struct spill *
+spill_create(void)
+{
+    const char *tmpdir;
+    struct spill *spill;
+    char *path;
+    int fd;
+
+    if ((tmpdir = getenv("TMPDIR")) == NULL || *tmpdir == '\0')
+        tmpdir = "/tmp";
+    if (asprintf(&path, "%s/csvprintf.XXXXXX", tmpdir) == -1)
+        err(1, "asprintf");
+    if ((fd = mkstemp(path)) == -1)
+        err(1, "%s", path);
+    (void)unlink(path);
+    if ((spill = calloc(1, sizeof(*spill))) == NULL)
+        err(1, "calloc");
+    if ((spill->fp = fdopen(fd, "w+")) == NULL)
+        err(1, "%s", path);
+    setvbuf(spill->fp, NULL, _IOFBF, SPILL_BUFFER_SIZE);
+    free(path);
+    return spill;
+}
+
+void
+spill_destroy(struct spill *spill)
+{
+    fclose(spill->fp);
+    free(spill);
+}
+
+uint64_t
+spill_num_rows(const struct spill *spill)
+{
+    return spill->num_rows;
+}
+
+void
+spill_write(struct spill *spill, uint64_t tag, char *const *fields, size_t num)
+{
+    size_t len;
+    size_t i;
+
+    spill_write_varint(spill, tag);
+    spill_write_varint(spill, num);
+    for (i = 0; i < num; i++) {
+        len = strlen(fields[i]);
+        spill_write_varint(spill, len);
+        if (fwrite(fields[i], 1, len, spill->fp) != len)
+            err(1, "spill file");
+    }
+    spill->num_rows++;
+}
+
+// Finish writing and prepare to read rows back from the beginning
+void
+spill_rewind(struct spill *spill)
+{
+    if (fflush(spill->fp) == EOF || fseeko(spill->fp, 0, SEEK_SET) == -1)
+        err(1, "spill file");
+}
+
+//
+// Read the next row. The fields array and each field are malloc'd and belong to the caller.
+// Returns zero at end of file.
+//
+int
+spill_read(struct spill *spill, uint64_t *tagp, char ***fieldsp, size_t *nump)
+{
+    uint64_t tag;
+    uint64_t num;
+    uint64_t len;
+    char **fields;
+    size_t i;
+
+    if (!spill_read_varint(spill, &tag))
+        return 0;
+    if (!spill_read_varint(spill, &num))
+        errx(1, "spill file: truncated");
+    if ((fields = calloc(num > 0 ? num : 1, sizeof(*fields))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < num; i++) {
+        if (!spill_read_varint(spill, &len))
+            errx(1, "spill file: truncated");
+        if ((fields[i] = malloc(len + 1)) == NULL)
+            err(1, "malloc");
+        if (fread(fields[i], 1, len, spill->fp) != len)
+            errx(1, "spill file: truncated");
+        fields[i][len] = '\0';
+    }
+    if (tagp != NULL)
+        *tagp = tag;
+    *fieldsp = fields;
+    *nump = num;
+    return 1;
+}
+
+static void
+spill_write_varint(struct spill *spill, uint64_t value)
+{
+    while (value >= 0x80) {
+        putc_unlocked((value & 0x7f) | 0x80, spill->fp);
+        value >>= 7;
+    }
+    if (putc_unlocked(value, spill->fp) == EOF)
+        err(1, "spill file");
+}
+
+// Returns zero on EOF at the start of the value
+static int
+spill_read_varint(struct spill *spill, uint64_t *valuep)
+{
+    uint64_t value = 0;
+    int shift = 0;
+    int ch;
+
+    do {
+        if ((ch = getc_unlocked(spill->fp)) == EOF) {
+            if (ferror(spill->fp))
+                err(1, "spill file");
+            if (shift == 0)
+                return 0;
+            errx(1, "spill file: truncated");
+        }
+        if (shift > 63)
+            errx(1, "spill file: invalid varint");
+        value |= (uint64_t)(ch & 0x7f) << shift;
+        shift += 7;
+    } while ((ch & 0x80) != 0);
+    *valuep = value;
+    return 1;
+}
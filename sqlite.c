@@ -0,0 +1,301 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_LIBSQLITE3
+#include <sqlite3.h>
+#endif
+
+#define SQLITE_ENCODING         "UTF-8"
+
+//
+// SQLite output ("--sqlite").
+//
+// Records are inserted directly into a database table using one prepared INSERT statement,
+// committing every so often so each transaction holds many records. The table is created
+// (unless it already exists) from the column names if we have them, or else from the width
+// of the first record, with columns named "col1", "col2", etc.
+//
+// Values are converted to UTF-8 and bound as text; missing trailing values are NULL.
+//
+
+#if HAVE_LIBSQLITE3
+
+struct sqlite_output {
+    sqlite3         *db;
+    sqlite3_stmt    *insert;
+    const char      *path;
+    char            *table;
+    iconv_t         icd;
+    int             use_names;
+    uint64_t        batch;                  // records per transaction
+    uint64_t        pending;                // records in the current transaction
+    size_t          *cols;                  // input field for each table column
+    size_t          num_cols;
+    size_t          max_fields;             // more input fields than this is an error
+    char            **conv;                 // UTF-8 converted fields
+    size_t          *conv_alloc;
+};
+
+static void sqlite_output_exec(struct sqlite_output *s, const char *sql);
+static void sqlite_output_create_table(struct sqlite_output *s, char *const *names, size_t num_cols);
+static size_t sqlite_output_utf8(struct sqlite_output *s, const char *ibuf, char **obufp, size_t *allocp, int linenum);
+
+struct sqlite_output *
+sqlite_output_open(const char *path, const char *table, const char *encoding, int use_names, uint64_t batch, int bulk)
+{
+    struct sqlite_output *s;
+
+    if ((s = calloc(1, sizeof(*s))) == NULL)
+        err(1, "calloc");
+    s->path = path;
+    s->use_names = use_names;
+    s->batch = batch;
+    if ((s->table = strdup(table)) == NULL)
+        err(1, "strdup");
+    if ((s->icd = iconv_open(SQLITE_ENCODING, encoding)) == (iconv_t)-1)
+        err(1, "%s", encoding);
+    if (sqlite3_open_v2(path, &s->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+        errx(1, "%s: %s", path, s->db != NULL ? sqlite3_errmsg(s->db) : "can't open database");
+
+    // Trade safety for speed when bulk loading: a crash can leave the database corrupted
+    if (bulk) {
+        sqlite_output_exec(s, "PRAGMA journal_mode = OFF");
+        sqlite_output_exec(s, "PRAGMA synchronous = OFF");
+    }
+    return s;
+}
+
+//
+// Set the column names, an optional prefix for each name, and an optional list of the only names to output.
+//
+void
+sqlite_output_set_names(struct sqlite_output *s, char *const *names, size_t num_names,
+    const char *prefix, char *const *allowed, size_t num_allowed)
+{
+    char **table_names;
+    size_t alloc = 0;
+    size_t i;
+    size_t j;
+
+    if (!s->use_names)
+        return;
+    if ((s->cols = calloc(num_names > 0 ? num_names : 1, sizeof(*s->cols))) == NULL)
+        err(1, "calloc");
+    if ((table_names = calloc(num_names > 0 ? num_names : 1, sizeof(*table_names))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < num_names; i++) {
+        char *name;
+
+        // Skip columns not in the allowed list
+        if (num_allowed > 0) {
+            for (j = 0; j < num_allowed && strcmp(allowed[j], names[i]) != 0; j++)
+                ;
+            if (j == num_allowed)
+                continue;
+        }
+
+        // Add prefix and convert to UTF-8
+        if (asprintf(&name, "%s%s", prefix, names[i]) == -1)
+            err(1, "asprintf");
+        if (*name == '\0') {
+            free(name);
+            if (asprintf(&name, "col%d", (int)i + 1) == -1)
+                err(1, "asprintf");
+        }
+        table_names[s->num_cols] = NULL;
+        alloc = 0;
+        sqlite_output_utf8(s, name, &table_names[s->num_cols], &alloc, 1);
+        free(name);
+        s->cols[s->num_cols++] = i;
+    }
+    s->max_fields = num_allowed > 0 ? SIZE_MAX : num_names;
+    sqlite_output_create_table(s, table_names, s->num_cols);
+    for (i = 0; i < s->num_cols; i++)
+        free(table_names[i]);
+    free(table_names);
+}
+
+void
+sqlite_output_add(struct sqlite_output *s, char *const *fields, size_t num, int linenum)
+{
+    size_t i;
+    int r;
+
+    // Create table from the first record, if we don't have column names
+    if (s->insert == NULL) {
+        char **table_names;
+
+        if ((s->cols = calloc(num > 0 ? num : 1, sizeof(*s->cols))) == NULL)
+            err(1, "calloc");
+        if ((table_names = calloc(num > 0 ? num : 1, sizeof(*table_names))) == NULL)
+            err(1, "calloc");
+        for (i = 0; i < num; i++) {
+            if (asprintf(&table_names[i], "col%d", (int)i + 1) == -1)
+                err(1, "asprintf");
+            s->cols[i] = i;
+        }
+        s->num_cols = num;
+        s->max_fields = num;
+        sqlite_output_create_table(s, table_names, num);
+        for (i = 0; i < num; i++)
+            free(table_names[i]);
+        free(table_names);
+    }
+    if (num > s->max_fields)
+        errx(1, "line %d: record has %lu columns but table \"%s\" has %lu", linenum, (unsigned long)num, s->table, (unsigned long)s->max_fields);
+
+    // Start a new transaction if needed
+    if (s->pending == 0)
+        sqlite_output_exec(s, "BEGIN");
+
+    // Bind values and insert
+    for (i = 0; i < s->num_cols; i++) {
+        const size_t col = s->cols[i];
+
+        if (col < num) {
+            const size_t len = sqlite_output_utf8(s, fields[col], &s->conv[i], &s->conv_alloc[i], linenum);
+
+            r = sqlite3_bind_text(s->insert, i + 1, s->conv[i], len, SQLITE_STATIC);
+        } else
+            r = sqlite3_bind_null(s->insert, i + 1);
+        if (r != SQLITE_OK)
+            errx(1, "%s: %s", s->path, sqlite3_errmsg(s->db));
+    }
+    if (sqlite3_step(s->insert) != SQLITE_DONE)
+        errx(1, "%s: line %d: %s", s->path, linenum, sqlite3_errmsg(s->db));
+    if (sqlite3_reset(s->insert) != SQLITE_OK)
+        errx(1, "%s: %s", s->path, sqlite3_errmsg(s->db));
+
+    // Commit every so often
+    if (++s->pending == s->batch) {
+        sqlite_output_exec(s, "COMMIT");
+        s->pending = 0;
+    }
+}
+
+void
+sqlite_output_close(struct sqlite_output *s)
+{
+    size_t i;
+
+    if (s->pending > 0)
+        sqlite_output_exec(s, "COMMIT");
+    if (s->insert != NULL)
+        sqlite3_finalize(s->insert);
+    if (sqlite3_close(s->db) != SQLITE_OK)
+        errx(1, "%s: %s", s->path, sqlite3_errmsg(s->db));
+    (void)iconv_close(s->icd);
+    for (i = 0; i < s->num_cols; i++)
+        free(s->conv[i]);
+    free(s->conv);
+    free(s->conv_alloc);
+    free(s->cols);
+    free(s->table);
+    free(s);
+}
+
+static void
+sqlite_output_exec(struct sqlite_output *s, const char *sql)
+{
+    char *errmsg;
+
+    if (sqlite3_exec(s->db, sql, NULL, NULL, &errmsg) != SQLITE_OK)
+        errx(1, "%s: %s", s->path, errmsg);
+}
+
+// Convert a value to UTF-8
+static size_t
+sqlite_output_utf8(struct sqlite_output *s, const char *ibuf, char **obufp, size_t *allocp, int linenum)
+{
+    char error[256];
+    size_t len;
+
+    if ((len = utf8_convert(s->icd, ibuf, obufp, allocp)) == (size_t)-1) {
+        utf8_strerror(errno, linenum, error, sizeof(error));
+        errx(1, "%s", error);
+    }
+    return len;
+}
+
+// Create the table (if needed) and prepare the INSERT statement
+static void
+sqlite_output_create_table(struct sqlite_output *s, char *const *names, size_t num_cols)
+{
+    char *create;
+    char *insert;
+    size_t i;
+
+    if (num_cols == 0)
+        errx(1, "%s: table \"%s\" would have no columns", s->path, s->table);
+    create = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\" (", s->table);
+    insert = sqlite3_mprintf("INSERT INTO \"%w\" VALUES (", s->table);
+    for (i = 0; i < num_cols; i++) {
+        create = sqlite3_mprintf("%z%s\"%w\" TEXT", create, i > 0 ? ", " : "", names[i]);
+        insert = sqlite3_mprintf("%z%s?", insert, i > 0 ? ", " : "");
+    }
+    create = sqlite3_mprintf("%z)", create);
+    insert = sqlite3_mprintf("%z)", insert);
+    if (create == NULL || insert == NULL)
+        errx(1, "sqlite3_mprintf: out of memory");
+    sqlite_output_exec(s, create);
+    if (sqlite3_prepare_v2(s->db, insert, -1, &s->insert, NULL) != SQLITE_OK)
+        errx(1, "%s: %s", s->path, sqlite3_errmsg(s->db));
+    sqlite3_free(create);
+    sqlite3_free(insert);
+
+    // Allocate conversion buffers
+    if ((s->conv = calloc(num_cols, sizeof(*s->conv))) == NULL)
+        err(1, "calloc");
+    if ((s->conv_alloc = calloc(num_cols, sizeof(*s->conv_alloc))) == NULL)
+        err(1, "calloc");
+}
+
+#else   /* !HAVE_LIBSQLITE3 */
+
+struct sqlite_output *
+sqlite_output_open(const char *path, const char *table, const char *encoding, int use_names, uint64_t batch, int bulk)
+{
+    errx(1, "SQLite output is not supported by this build");
+}
+
+void
+sqlite_output_set_names(struct sqlite_output *s, char *const *names, size_t num_names,
+    const char *prefix, char *const *allowed, size_t num_allowed)
+{
+    errx(1, "internal error");
+}
+
+void
+sqlite_output_add(struct sqlite_output *s, char *const *fields, size_t num, int linenum)
+{
+    errx(1, "internal error");
+}
+
+void
+sqlite_output_close(struct sqlite_output *s)
+{
+    errx(1, "internal error");
+}
+
+#endif  /* !HAVE_LIBSQLITE3 */
@@ -0,0 +1,231 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <sys/resource.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// How often to sample the current phase
+#define STATS_SAMPLE_NANOS      (1000 * 1000)
+
+// How often to report progress
+#define STATS_PROGRESS_NANOS    (1000 * 1000 * 1000)
+
+//
+// Runtime statistics.
+//
+// The main thread announces which phase it's in by storing to "stats_current_phase"; that's
+// all it does, so it's cheap enough to leave in place when statistics are not wanted. When they
+// are, a sampling thread wakes up every millisecond and charges the elapsed time to whichever
+// phase it finds, and also prints progress reports if configured.
+//
+
+static const char *const phase_names[STATS_NUM_PHASES] = {
+    [STATS_PARSE]       = "parse",
+    [STATS_TRANSCODE]   = "transcode",
+    [STATS_OUTPUT]      = "output",
+    [STATS_PROCESS]     = "process",
+    [STATS_INPUT_WAIT]  = "input wait",
+    [STATS_OUTPUT_WAIT] = "output wait",
+};
+
+static _Atomic int stats_current_phase;
+static _Atomic uint64_t stats_records;
+static _Atomic uint64_t stats_bytes;
+static _Atomic int stats_done;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stats_cond;
+static pthread_t stats_thread;
+static int stats_running;
+static int stats_show_progress;
+static uint64_t stats_start_time;
+static uint64_t stats_phase_nanos[STATS_NUM_PHASES];
+
+static void *stats_main(void *arg);
+static uint64_t stats_now(void);
+static void stats_print(const char *name, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+//
+// Start sampling; if "progress" is set, report progress on stderr every second.
+//
+void
+stats_start(int progress)
+{
+    pthread_condattr_t attr;
+
+    stats_show_progress = progress;
+    stats_start_time = stats_now();
+    if ((errno = pthread_condattr_init(&attr)) != 0)
+        err(1, "pthread_condattr_init");
+    if ((errno = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) != 0)
+        err(1, "pthread_condattr_setclock");
+    if ((errno = pthread_cond_init(&stats_cond, &attr)) != 0)
+        err(1, "pthread_cond_init");
+    pthread_condattr_destroy(&attr);
+    if ((errno = pthread_create(&stats_thread, NULL, stats_main, NULL)) != 0)
+        err(1, "pthread_create");
+    stats_running = 1;
+}
+
+//
+// Set the current phase of the main thread; returns the previous phase.
+//
+int
+stats_phase(int phase)
+{
+    const int prev = atomic_load_explicit(&stats_current_phase, memory_order_relaxed);
+
+    atomic_store_explicit(&stats_current_phase, phase, memory_order_relaxed);
+    return prev;
+}
+
+//
+// Update the progress counters.
+//
+void
+stats_progress(uint64_t records, uint64_t bytes)
+{
+    atomic_store_explicit(&stats_records, records, memory_order_relaxed);
+    atomic_store_explicit(&stats_bytes, bytes, memory_order_relaxed);
+}
+
+//
+// Stop sampling and, if "totals" is not NULL, print a report on stderr.
+//
+void
+stats_finish(const struct stats_totals *totals)
+{
+    struct rusage ru;
+    uint64_t elapsed;
+    int i;
+
+    if (!stats_running)
+        return;
+    pthread_mutex_lock(&stats_mutex);
+    atomic_store(&stats_done, 1);
+    pthread_cond_signal(&stats_cond);
+    pthread_mutex_unlock(&stats_mutex);
+    if ((errno = pthread_join(stats_thread, NULL)) != 0)
+        err(1, "pthread_join");
+    stats_running = 0;
+    if (totals == NULL)
+        return;
+
+    // Print totals
+    elapsed = stats_now() - stats_start_time;
+    if (getrusage(RUSAGE_SELF, &ru) == -1)
+        err(1, "getrusage");
+    stats_print("records", "%llu", (unsigned long long)totals->records);
+    stats_print("fields", "%llu", (unsigned long long)totals->fields);
+    stats_print("max record width", "%llu", (unsigned long long)totals->max_width);
+    stats_print("bytes in", "%llu", (unsigned long long)totals->bytes_in);
+    if (totals->bytes_out != STATS_UNKNOWN)
+        stats_print("bytes out", "%llu", (unsigned long long)totals->bytes_out);
+    else
+        stats_print("bytes out", "%s", "unknown (not a regular file; use \"--pipeline\" to count)");
+    stats_print("parser allocations", "%llu", (unsigned long long)totals->allocations);
+    stats_print("peak RSS", "%ld KB", ru.ru_maxrss);
+    stats_print("elapsed time", "%.3fs", elapsed / 1e9);
+    stats_print("user CPU time", "%ld.%03lds", (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec / 1000);
+    stats_print("system CPU time", "%ld.%03lds", (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec / 1000);
+    if (elapsed > 0) {
+        stats_print("records/s", "%.0f", totals->records / (elapsed / 1e9));
+        stats_print("MB/s in", "%.1f", totals->bytes_in / (elapsed / 1e9) / 1e6);
+    }
+
+    // Print the time spent in each phase, as sampled
+    for (i = 0; i < STATS_NUM_PHASES; i++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "%s time", phase_names[i]);
+        stats_print(name, "%.3fs (%.1f%%)", stats_phase_nanos[i] / 1e9,
+          elapsed > 0 ? 100.0 * stats_phase_nanos[i] / elapsed : 0.0);
+    }
+}
+
+// Sampling thread entry point
+static void *
+stats_main(void *arg)
+{
+    uint64_t last_progress;
+    uint64_t last_records = 0;
+    uint64_t last_bytes = 0;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t last;
+    uint64_t now;
+    struct timespec wakeup;
+
+    last = last_progress = stats_start_time;
+    pthread_mutex_lock(&stats_mutex);
+    while (!atomic_load(&stats_done)) {
+
+        // Sleep until the next sample time
+        wakeup.tv_sec = (last + STATS_SAMPLE_NANOS) / 1000000000;
+        wakeup.tv_nsec = (last + STATS_SAMPLE_NANOS) % 1000000000;
+        (void)pthread_cond_timedwait(&stats_cond, &stats_mutex, &wakeup);
+
+        // Charge the elapsed time to the current phase
+        now = stats_now();
+        stats_phase_nanos[atomic_load_explicit(&stats_current_phase, memory_order_relaxed)] += now - last;
+        last = now;
+
+        // Report progress
+        if (stats_show_progress && now - last_progress >= STATS_PROGRESS_NANOS) {
+            records = atomic_load_explicit(&stats_records, memory_order_relaxed);
+            bytes = atomic_load_explicit(&stats_bytes, memory_order_relaxed);
+            fprintf(stderr, "csvprintf: %llu records, %.0f records/s, %.1f MB/s\n", (unsigned long long)records,
+              (records - last_records) / ((now - last_progress) / 1e9), (bytes - last_bytes) / ((now - last_progress) / 1e3));
+            last_records = records;
+            last_bytes = bytes;
+            last_progress = now;
+        }
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    return NULL;
+}
+
+static uint64_t
+stats_now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        err(1, "clock_gettime");
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+stats_print(const char *name, const char *fmt, ...)
+{
+    va_list args;
+
+    fprintf(stderr, "csvprintf: %-18s ", name);
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
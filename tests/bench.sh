@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Compare plain stdio, "--pipeline", and "--io-uring" on a large generated file, checking they produce the same output.
+# Usage: ./bench.sh [rows]
+
+set -e
+
+TIMEFORMAT='%R real %U user %S sys'
+
+ROWS="${1:-2000000}"
+INPUT="bench.tmp.csv"
+OUTPUT="bench.tmp.out"
+EXPECTED="bench.tmp.expected"
+
+trap 'rm -f "${INPUT}" "${OUTPUT}" "${EXPECTED}"*' 0 2 15
+
+echo "*** generating ${ROWS} rows..." 1>&2
+awk -v rows="${ROWS}" 'BEGIN {
+    print "id,name,amount,comment";
+    for (i = 1; i <= rows; i++)
+        printf "%d,name%d,%d.%02d,\"some \"\"quoted\"\", text, %d\"\n", i, i % 1000, i % 100000, i % 100, i;
+}' > "${INPUT}"
+ls -l "${INPUT}" 1>&2
+
+for FLAGS in '' '--pipeline' '--io-uring'; do
+    for MODE in -x -j; do
+        echo "*** csvprintf ${MODE} ${FLAGS}" 1>&2
+        rm -f "${OUTPUT}"
+        time ../csvprintf ${MODE} ${FLAGS} -f "${INPUT}" > "${OUTPUT}"
+
+        # Every mode must produce exactly what plain stdio does
+        if [ -z "${FLAGS}" ]; then
+            mv "${OUTPUT}" "${EXPECTED}${MODE}"
+        elif ! cmp "${EXPECTED}${MODE}" "${OUTPUT}"; then
+            echo "*** FAILED: csvprintf ${MODE} ${FLAGS} output differs from plain stdio" 1>&2
+            exit 1
+        fi
+    done
+done
@@ -0,0 +1,293 @@
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+//
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+//
+
+//
+// Tests for libcsvprintf, using only its public header.
+//
+
+#include "libcsvprintf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "libtest: %s:%d: check failed: %s\n",               \
+              __FILE__, __LINE__, #cond);                                       \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+#define BIG_FIELD_SIZE      100000
+
+static int failures;
+
+// Strings the API takes as "char *"
+static char name_a[] = "a";
+static char name_b[] = "b";
+static char value_1[] = "1";
+static char value_escapes[] = "x<&>\"";
+static char value_utf8[] = "caf\xc3\xa9";
+static char value_quote[] = "\"";
+static char value_ok[] = "ok";
+static char value_bad[] = "bad\xff";
+
+static void test_parser(void);
+static void test_parser_error(void);
+static void test_format(void);
+static void test_format_big(void);
+static void test_pieces(void);
+static void test_emitter_errors(void);
+static FILE *open_string(char *string);
+
+int
+main(int argc, char **argv)
+{
+    test_parser();
+    test_parser_error();
+    test_format();
+    test_format_big();
+    test_pieces();
+    test_emitter_errors();
+    if (failures > 0) {
+        fprintf(stderr, "libtest: %d check(s) failed\n", failures);
+        return 1;
+    }
+    fprintf(stderr, "libtest: ok\n");
+    return 0;
+}
+
+// Parse quoted fields, CR/LF line endings and embedded newlines, then seek back to a record
+static void
+test_parser(void)
+{
+    static char input[] = "a,b\r\n\"x \"\"q\"\"\",\"y\nz\"\n,\n";
+    struct csv_parser *p;
+    struct csv_record rec;
+    uint64_t offset;
+    FILE *fp;
+
+    fp = open_string(input);
+    CHECK((p = csv_parser_create(fp, '"', ',')) != NULL);
+
+    CHECK(csv_parser_next(p, &rec) == 1);
+    CHECK(rec.num == 2 && strcmp(rec.fields[0], "a") == 0 && strcmp(rec.fields[1], "b") == 0);
+    CHECK(rec.linenum == 1 && rec.offset == 0);
+
+    CHECK(csv_parser_next(p, &rec) == 1);
+    CHECK(rec.num == 2 && strcmp(rec.fields[0], "x \"q\"") == 0 && strcmp(rec.fields[1], "y\nz") == 0);
+    CHECK(rec.linenum == 2 && rec.offset == 5);
+    offset = rec.offset;
+
+    CHECK(csv_parser_next(p, &rec) == 1);
+    CHECK(rec.num == 2 && *rec.fields[0] == '\0' && *rec.fields[1] == '\0');
+    CHECK(rec.linenum == 4);
+
+    CHECK(csv_parser_next(p, &rec) == 0);
+    CHECK(csv_parser_offset(p) == sizeof(input) - 1);
+
+    // Seek back and read the second record again
+    CHECK(csv_parser_seek(p, offset, 2) == 0);
+    CHECK(csv_parser_next(p, &rec) == 1);
+    CHECK(rec.num == 2 && strcmp(rec.fields[1], "y\nz") == 0 && rec.linenum == 2);
+
+    csv_parser_free(p);
+    fclose(fp);
+}
+
+// Parse errors are returned, not fatal
+static void
+test_parser_error(void)
+{
+    static char unterminated[] = "a,b\n\"unterminated\n";
+    static char long_field[] = "abcdef\n";
+    struct csv_parser *p;
+    struct csv_record rec;
+    FILE *fp;
+
+    fp = open_string(unterminated);
+    CHECK((p = csv_parser_create(fp, '"', ',')) != NULL);
+    CHECK(csv_parser_next(p, &rec) == 1);
+    CHECK(csv_parser_next(p, &rec) == -1);
+    CHECK(strstr(csv_parser_error(p), "premature EOF") != NULL);
+    csv_parser_free(p);
+    fclose(fp);
+
+    fp = open_string(long_field);
+    CHECK((p = csv_parser_create(fp, '"', ',')) != NULL);
+    csv_parser_set_max_field(p, 3);
+    CHECK(csv_parser_next(p, &rec) == -1);
+    CHECK(*csv_parser_error(p) != '\0');
+    csv_parser_free(p);
+    fclose(fp);
+}
+
+// csv_emitter_format() has snprintf(3) semantics
+static void
+test_format(void)
+{
+    static const char expect[] = "\x1e{\"a\":\"1\",\"b\":\"x<&>\\\"\"}\n";
+    char *names[] = { name_a, name_b };
+    char *fields[] = { value_1, value_escapes };
+    struct csv_emitter *e;
+    char buf[64];
+    size_t len;
+
+    CHECK((e = csv_emitter_create(CSV_EMIT_JSON, 1, "UTF-8")) != NULL);
+    CHECK(csv_emitter_set_names(e, names, 2, NULL, NULL, 0) == 0);
+
+    // Enough room
+    len = csv_emitter_format(e, buf, sizeof(buf), fields, 2, 2);
+    CHECK(len == sizeof(expect) - 1);
+    CHECK(strcmp(buf, expect) == 0);
+
+    // Truncated: still returns the full length, and the result is NUL-terminated
+    memset(buf, 'X', sizeof(buf));
+    len = csv_emitter_format(e, buf, 8, fields, 2, 2);
+    CHECK(len == sizeof(expect) - 1);
+    CHECK(memcmp(buf, expect, 7) == 0 && buf[7] == '\0' && buf[8] == 'X');
+
+    // Exactly one byte short
+    len = csv_emitter_format(e, buf, sizeof(expect) - 1, fields, 2, 2);
+    CHECK(len == sizeof(expect) - 1);
+    CHECK(strlen(buf) == sizeof(expect) - 2 && strncmp(buf, expect, sizeof(expect) - 2) == 0);
+
+    // No buffer at all, just measure
+    CHECK(csv_emitter_format(e, NULL, 0, fields, 2, 2) == sizeof(expect) - 1);
+    csv_emitter_free(e);
+
+    // XML escapes
+    CHECK((e = csv_emitter_create(CSV_EMIT_XML, 0, "UTF-8")) != NULL);
+    len = csv_emitter_format(e, buf, sizeof(buf), fields + 1, 1, 1);
+    CHECK(strcmp(buf, "  <row>\n    <col1>x&lt;&amp;&gt;\"</col1>\n  </row>\n") == 0);
+    CHECK(len == strlen(buf));
+    csv_emitter_free(e);
+}
+
+// Output bigger than any stdio buffer is accumulated, and truncated, correctly
+static void
+test_format_big(void)
+{
+    struct csv_emitter *e;
+    char *fields[1];
+    char *buf;
+    size_t len;
+
+    if ((fields[0] = malloc(BIG_FIELD_SIZE + 1)) == NULL || (buf = malloc(BIG_FIELD_SIZE + 16)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(fields[0], 'z', BIG_FIELD_SIZE);
+    fields[0][BIG_FIELD_SIZE] = '\0';
+    CHECK((e = csv_emitter_create(CSV_EMIT_RAW, 0, NULL)) != NULL);
+
+    len = csv_emitter_format(e, buf, BIG_FIELD_SIZE + 16, fields, 1, 1);
+    CHECK(len == BIG_FIELD_SIZE + 2);          // NUL terminator and newline
+    CHECK(memcmp(buf, fields[0], BIG_FIELD_SIZE) == 0 && buf[BIG_FIELD_SIZE] == '\0');
+
+    memset(buf, 'X', BIG_FIELD_SIZE + 16);
+    len = csv_emitter_format(e, buf, BIG_FIELD_SIZE / 2, fields, 1, 1);
+    CHECK(len == BIG_FIELD_SIZE + 2);          // NUL terminator and newline
+    CHECK(strlen(buf) == BIG_FIELD_SIZE / 2 - 1 && buf[BIG_FIELD_SIZE / 2] == 'X');
+
+    csv_emitter_free(e);
+    free(fields[0]);
+    free(buf);
+}
+
+// Output a piece at a time, with a multibyte character split between pieces; must match csv_emitter_format()
+static void
+test_pieces(void)
+{
+    char *fields[] = { value_utf8, value_quote };
+    struct csv_emitter *e;
+    char expect[64];
+    char *actual;
+    size_t len;
+    FILE *fp;
+
+    CHECK((e = csv_emitter_create(CSV_EMIT_JSON, 0, "UTF-8")) != NULL);
+    CHECK(csv_emitter_format(e, expect, sizeof(expect), fields, 2, 1) < sizeof(expect));
+    if ((fp = open_memstream(&actual, &len)) == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+    CHECK(csv_emitter_begin_record(e, fp) == 0);
+    CHECK(csv_emitter_begin_field(e, fp, 0, 1) == 0);
+    CHECK(csv_emitter_field_data(e, fp, fields[0], 4, 1) == 0);
+    CHECK(csv_emitter_field_data(e, fp, fields[0] + 4, 1, 1) == 0);
+    CHECK(csv_emitter_end_field(e, fp, 1) == 0);
+    CHECK(csv_emitter_begin_field(e, fp, 1, 1) == 0);
+    CHECK(csv_emitter_field_data(e, fp, fields[1], 1, 1) == 0);
+    CHECK(csv_emitter_end_field(e, fp, 1) == 0);
+    csv_emitter_end_record(e, fp);
+    fclose(fp);
+    CHECK(strcmp(actual, expect) == 0);
+    free(actual);
+
+    // A field that ends mid-character is an error
+    if ((fp = open_memstream(&actual, &len)) == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+    CHECK(csv_emitter_begin_record(e, fp) == 0);
+    CHECK(csv_emitter_begin_field(e, fp, 0, 7) == 0);
+    CHECK(csv_emitter_field_data(e, fp, fields[0], 4, 7) == 0);
+    CHECK(csv_emitter_end_field(e, fp, 7) == -1);
+    CHECK(strstr(csv_emitter_error(e), "line 7") != NULL);
+    fclose(fp);
+    free(actual);
+    csv_emitter_free(e);
+}
+
+// Emitter errors are returned, not fatal
+static void
+test_emitter_errors(void)
+{
+    char *dup_names[] = { name_a, name_a };
+    char *bad_fields[] = { value_ok, value_bad };
+    struct csv_emitter *e;
+    char buf[64];
+
+    CHECK(csv_emitter_create(CSV_EMIT_XML, 0, "no-such-encoding") == NULL);
+    CHECK(csv_emitter_create(0, 0, "UTF-8") == NULL);
+
+    // Duplicate names leave the emitter without names, and still usable
+    CHECK((e = csv_emitter_create(CSV_EMIT_JSON, 1, "UTF-8")) != NULL);
+    CHECK(csv_emitter_set_names(e, dup_names, 2, NULL, NULL, 0) == -1);
+    CHECK(strstr(csv_emitter_error(e), "duplicate column name") != NULL);
+    CHECK(csv_emitter_format(e, buf, sizeof(buf), dup_names, 2, 1) != (size_t)-1);
+    CHECK(strcmp(buf, "\x1e{\"col1\":\"a\",\"col2\":\"a\"}\n") == 0);
+
+    // Invalid input
+    CHECK(csv_emitter_format(e, buf, sizeof(buf), bad_fields, 2, 3) == (size_t)-1);
+    CHECK(strcmp(csv_emitter_error(e), "line 3: illegal multibyte sequence") == 0);
+    CHECK(csv_emitter_to_utf8(e, bad_fields[1], 4) == NULL);
+    csv_emitter_free(e);
+}
+
+static FILE *
+open_string(char *string)
+{
+    FILE *fp;
+
+    if ((fp = fmemopen(string, strlen(string), "r")) == NULL) {
+        perror("fmemopen");
+        exit(1);
+    }
+    return fp;
+}
@@ -4,6 +4,19 @@ set -e
 set -o pipefail
 
 FAILED_TESTS=''
+
+# Wait up to five seconds for a shell condition to become true
+waitfor()
+{
+    for i in `seq 50`; do
+        if eval "${1}"; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
 for INPUT_FILE in *.in; do
     OUTPUT_FILE1=`echo "${INPUT_FILE}" | sed -n 's/\.in$/.out1/gp'`
     OUTPUT_FILE2=`echo "${INPUT_FILE}" | sed -n 's/\.in$/.out2/gp'`
@@ -29,6 +42,41 @@ for INPUT_FILE in *.in; do
         echo "*** FAILED: [3a] ${INPUT_FILE}" 1>&2
         FAILED_TESTS="${FAILED_TESTS} ${INPUT_FILE}/${OUTPUT_FILE3A}"
     fi
+    if ! ../csvprintf -j --compress=gzip -f "${INPUT_FILE}" | gzip -dc | diff -u "${OUTPUT_FILE3A}" -; then
+        echo "*** FAILED: [3c] ${INPUT_FILE}" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} ${INPUT_FILE}/compress"
+    fi
+    if [ `../csvprintf --count -f "${INPUT_FILE}"` -ne `../csvprintf -j -f "${INPUT_FILE}" | wc -l` ]; then
+        echo "*** FAILED: [3e] ${INPUT_FILE}" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} ${INPUT_FILE}/count"
+    fi
+    ../csvprintf -j -f "${INPUT_FILE}" | tail -n +2 > "${INPUT_FILE}.range"
+    if ! ../csvprintf --build-index "${INPUT_FILE}.idx" --index-interval 1 -f "${INPUT_FILE}" \
+      || ! ../csvprintf -j --index "${INPUT_FILE}.idx" --range 2: -f "${INPUT_FILE}" | diff -u "${INPUT_FILE}.range" -; then
+        echo "*** FAILED: [3d] ${INPUT_FILE}" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} ${INPUT_FILE}/index"
+    fi
+    rm -f "${INPUT_FILE}.idx" "${INPUT_FILE}.range"
+    if ! ../csvprintf -X --limit 2 --checkpoint "${INPUT_FILE}.ckpt" -f "${INPUT_FILE}" > "${INPUT_FILE}.resume" \
+      || ! ../csvprintf -X --resume --checkpoint "${INPUT_FILE}.ckpt" -f "${INPUT_FILE}" >> "${INPUT_FILE}.resume" \
+      || ! diff -u "${OUTPUT_FILE2}" "${INPUT_FILE}.resume"; then
+        echo "*** FAILED: [2r] ${INPUT_FILE}" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} ${INPUT_FILE}/resume"
+    fi
+    rm -f "${INPUT_FILE}.ckpt" "${INPUT_FILE}.resume"
+    echo 'stale output' > "${INPUT_FILE}.resume"
+    if ! ../csvprintf -X --resume --checkpoint "${INPUT_FILE}.ckpt" -f "${INPUT_FILE}" >> "${INPUT_FILE}.resume" \
+      || ! diff -u "${OUTPUT_FILE2}" "${INPUT_FILE}.resume"; then
+        echo "*** FAILED: [2n] ${INPUT_FILE}" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} ${INPUT_FILE}/resume-new"
+    fi
+    rm -f "${INPUT_FILE}.ckpt" "${INPUT_FILE}.resume"
+    if ! ../csvprintf -j --io-uring -f "${INPUT_FILE}" > "${INPUT_FILE}.uring" \
+      || ! cmp "${OUTPUT_FILE3A}" "${INPUT_FILE}.uring"; then
+        echo "*** FAILED: [3u] ${INPUT_FILE}" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} ${INPUT_FILE}/io-uring"
+    fi
+    rm -f "${INPUT_FILE}.uring"
     if ! ../csvprintf -ij -f "${INPUT_FILE}" | diff -u "${OUTPUT_FILE3B}" -; then
         echo "*** FAILED: [3b] ${INPUT_FILE}" 1>&2
         FAILED_TESTS="${FAILED_TESTS} ${INPUT_FILE}/${OUTPUT_FILE3B}"
@@ -47,6 +95,164 @@ for INPUT_FILE in *.in; do
     fi
 done
 
+# SQLite output, if this build supports it and sqlite3(1) is available
+rm -f sqlite.tmp
+if command -v sqlite3 >/dev/null 2>&1 && ../csvprintf --sqlite sqlite.tmp < /dev/null 2>/dev/null; then
+    echo "*** testing --sqlite..." 1>&2
+    if ! printf 'a,b\n1,"x,""y"""\n2\n3,\n' | ../csvprintf -i --sqlite sqlite.tmp --transaction-size 2 \
+      || ! sqlite3 sqlite.tmp 'SELECT a, quote(b) FROM csv' | diff -u sqlite.out -; then
+        echo "*** FAILED: [s] sqlite" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} sqlite"
+    fi
+fi
+rm -f sqlite.tmp
+
+# Partitioned output: every record lands in exactly one file, each a complete XML document
+echo "*** testing --partition-by..." 1>&2
+rm -f part.tmp.*
+../csvprintf -ij -f lookup.csv | sort > part.tmp.out
+if ! ../csvprintf -X --partition-by 1 --partitions 3 --output-template 'part.tmp.%d.xml' -f lookup.csv \
+  || [ `cat part.tmp.*.xml | grep -c '^<csv>$'` -ne 3 ] \
+  || ! ../csvprintf -ij --partition-by region --output-template 'part.tmp.%s.json' -f lookup.csv \
+  || ! cat part.tmp.*.json | sort | diff -u part.tmp.out -; then
+    echo "*** FAILED: [p] partition" 1>&2
+    FAILED_TESTS="${FAILED_TESTS} partition"
+fi
+rm -f part.tmp.*
+
+# Several outputs from one pass match the same outputs from separate runs
+echo "*** testing --out..." 1>&2
+rm -f out.tmp.*
+if ! ../csvprintf -ij --out 'xml-names,region:out.tmp.xml' --out 'fmt:%{region}s\n:out.tmp.txt' -f lookup.csv > out.tmp.json \
+  || ! ../csvprintf -ij -f lookup.csv | diff -u - out.tmp.json \
+  || ! ../csvprintf -X -c region -f lookup.csv | diff -u - out.tmp.xml \
+  || ! ../csvprintf -i '%{region}s\n' -f lookup.csv | diff -u - out.tmp.txt; then
+    echo "*** FAILED: [o] out" 1>&2
+    FAILED_TESTS="${FAILED_TESTS} out"
+fi
+rm -f out.tmp.*
+
+# Reading and writing regular files with "--io-uring" and "--pipeline", over many buffers, matches plain stdio
+echo "*** testing --io-uring..." 1>&2
+rm -f uring.tmp.*
+awk 'BEGIN {
+    print "id,name,comment";
+    for (i = 1; i <= 60000; i++)
+        printf "%d,name%d,\"some \"\"quoted\"\", text\r\nline %d\"\n", i, i % 1000, i;
+}' > uring.tmp.csv
+../csvprintf -j -f uring.tmp.csv > uring.tmp.stdio
+for FLAGS in '--io-uring' '--pipeline'; do
+    if ! ../csvprintf -j ${FLAGS} -f uring.tmp.csv > uring.tmp.out || ! cmp uring.tmp.stdio uring.tmp.out; then
+        echo "*** FAILED: [u] ${FLAGS}" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} ${FLAGS}"
+    fi
+done
+rm -f uring.tmp.*
+
+# An error in a helper thread makes csvprintf exit with an error, instead of hanging
+echo "*** testing helper thread errors..." 1>&2
+rm -f thread.tmp.*
+awk 'BEGIN {
+    print "id,name";
+    for (i = 1; i <= 100000; i++)
+        printf "%d,name%d\n", i, i;
+}' | gzip > thread.tmp.gz
+head -c `expr \`wc -c < thread.tmp.gz\` / 2` thread.tmp.gz > thread.tmp.trunc.gz
+while IFS='|' read FLAGS INPUT OUTPUT MESSAGE; do
+    if [ "${OUTPUT}" = '/dev/full' ] && ! [ -w /dev/full ]; then
+        continue
+    fi
+    RESULT=0
+    timeout 30 ../csvprintf -j ${FLAGS} -f "${INPUT}" < /dev/null > "${OUTPUT}" 2> thread.tmp.err || RESULT=$?
+    if [ "${RESULT}" -ne 1 ] || ! grep -q "${MESSAGE}" thread.tmp.err; then
+        echo "*** FAILED: [te] ${FLAGS} -f ${INPUT} > ${OUTPUT}: exit status ${RESULT}" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} thread-error"
+    fi
+done << 'EOF'
+--compress=gzip|thread.tmp.trunc.gz|/dev/null|truncated input
+--pipeline|thread.tmp.trunc.gz|/dev/null|truncated input
+--compress=gzip|thread.tmp.gz|/dev/full|No space left on device
+--pipeline|thread.tmp.gz|/dev/full|No space left on device
+EOF
+rm -f thread.tmp.*
+
+# Following a file: records completed by appended data are output as they arrive
+echo "*** testing --follow..." 1>&2
+rm -f follow.tmp.*
+printf 'a,b\n1,"x' > follow.tmp.csv
+../csvprintf -ij --follow --limit 2 -f follow.tmp.csv > follow.tmp.out &
+FOLLOW_PID=$!
+printf '\036{"a":"1","b":"xy\\nz"}\n' > follow.tmp.expected1
+printf '\036{"a":"3","b":"4"}\n' | cat follow.tmp.expected1 - > follow.tmp.expected2
+sleep 0.3
+printf 'y\nz"' >> follow.tmp.csv
+sleep 0.3
+printf '\n3,' >> follow.tmp.csv
+if ! waitfor 'cmp -s follow.tmp.expected1 follow.tmp.out'; then
+    echo "*** FAILED: [f] follow: first record" 1>&2
+    FAILED_TESTS="${FAILED_TESTS} follow"
+fi
+printf '4\n' >> follow.tmp.csv
+if ! waitfor '! kill -0 ${FOLLOW_PID} 2>/dev/null' || ! wait ${FOLLOW_PID} || ! cmp follow.tmp.expected2 follow.tmp.out; then
+    echo "*** FAILED: [f] follow: second record" 1>&2
+    FAILED_TESTS="${FAILED_TESTS} follow"
+    kill ${FOLLOW_PID} 2>/dev/null || true
+fi
+rm -f follow.tmp.*
+
+# Flushing: a record is written out while csvprintf is still waiting for more input, unless buffering by default
+echo "*** testing --flush..." 1>&2
+rm -f flush.tmp.*
+for FLUSH in '--flush=record' '--flush=size:4' '--flush=time:100' '--flush=auto' ''; do
+    printf '\036["a"]\n' > flush.tmp.expected
+    if [ "${FLUSH}" = '--flush=size:4' ]; then
+        FLUSH_CHECK='[ -s flush.tmp.out ] && cmp -s -n `wc -c < flush.tmp.out` flush.tmp.expected flush.tmp.out'   # part of the record
+    else
+        FLUSH_CHECK='cmp -s flush.tmp.expected flush.tmp.out'
+    fi
+    (printf 'a\n'; sleep 2; printf 'b\n') | ../csvprintf -j ${FLUSH} > flush.tmp.out &
+    FLUSH_PID=$!
+    if [ -n "${FLUSH}" ]; then
+        waitfor "${FLUSH_CHECK}" || true
+    else
+        sleep 1
+    fi
+    if ! kill -0 ${FLUSH_PID} 2>/dev/null; then
+        echo "*** FAILED: [fl] ${FLUSH:-default}: finished too soon" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} flush"
+    elif [ -n "${FLUSH}" ] && ! eval "${FLUSH_CHECK}"; then
+        echo "*** FAILED: [fl] ${FLUSH}: first record was not flushed" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} flush"
+    elif [ -z "${FLUSH}" ] && [ -s flush.tmp.out ]; then
+        echo "*** FAILED: [fl] default: output was not buffered" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} flush"
+    fi
+    wait ${FLUSH_PID}
+done
+rm -f flush.tmp.*
+
+# Statistics don't change the output, and report every total
+echo "*** testing --stats..." 1>&2
+rm -f stats.tmp.*
+../csvprintf -ij -f lookup.csv > stats.tmp.expected
+for FLAGS in '' '--pipeline'; do
+    if ! ../csvprintf -ij --stats ${FLAGS} -f lookup.csv > stats.tmp.out 2> stats.tmp.err \
+      || ! cmp stats.tmp.expected stats.tmp.out; then
+        echo "*** FAILED: [st] --stats ${FLAGS}" 1>&2
+        FAILED_TESTS="${FAILED_TESTS} stats${FLAGS}"
+        continue
+    fi
+    for KEY in 'records *3$' 'fields *6$' 'max record width *2$' 'bytes in *34$' "bytes out *`wc -c < stats.tmp.expected | tr -d ' '`\$" \
+      'parser allocations' 'peak RSS' 'elapsed time' 'user CPU time' 'system CPU time' \
+      'parse time' 'transcode time' 'output time' 'process time' 'input wait time' 'output wait time'; do
+        if ! grep -q "^csvprintf: ${KEY}" stats.tmp.err; then
+            echo "*** FAILED: [st] --stats ${FLAGS}: no \"${KEY}\"" 1>&2
+            FAILED_TESTS="${FAILED_TESTS} stats${FLAGS}"
+        fi
+    done
+done
+rm -f stats.tmp.*
+
 if [ -z "${FAILED_TESTS}" ]; then
     echo "*** all tests passed"
 else
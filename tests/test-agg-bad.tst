@@ -0,0 +1,5 @@
+FLAGS='-j --agg sum'
+STDIN='a,b\n'
+STDOUT=''
+STDERR='csvprintf: invalid aggregate function "sum"\n'
+EXITVAL='1'
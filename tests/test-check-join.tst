@@ -0,0 +1,5 @@
+FLAGS='--check -i --join lookup.csv --on cust'
+STDIN='cust,amount\n1,2\n'
+STDOUT=''
+STDERR='csvprintf: "--check" is incompatible with "--join"\n'
+EXITVAL='1'
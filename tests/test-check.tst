@@ -0,0 +1,5 @@
+FLAGS='--check -i'
+STDIN='a,b,c\n1,2,3\n\n4,5\n"6" x,7,8\n9,10,11,12\n"13'
+STDOUT='records: 5\nfields: 3\nragged: 2\nerrors: 2\n'
+STDERR='csvprintf: line 4: found 2 fields but expected 3\ncsvprintf: line 5: unexpected character "x"\ncsvprintf: line 6: found 4 fields but expected 3\ncsvprintf: line 7: premature EOF\n'
+EXITVAL='1'
@@ -0,0 +1,5 @@
+FLAGS='-ij --compact -c b -c c'
+STDIN='a,b,c\n1,"x""y",3\n4,5\n'
+STDOUT='\x1e["b","c"]\n\x1e["x\\"y","3"]\n\x1e["5"]\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-ij --compact -c a -c b'
+STDIN='a,b,c\n1,"x""y",3\n4,5\n'
+STDOUT='\x1e["a","b"]\n\x1e["1","x\\"y"]\n\x1e["4","5"]\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-X --short-tags'
+STDIN='aaa,bbb\n"a1","b<1"\n"a2"\n'
+STDOUT='<?xml version="1.0" encoding="UTF-8"?>\n<csv>\n<r><c1>a1</c1><c2>b&lt;1</c2></r>\n<r><c1>a2</c1></r>\n</csv>\n'
+STDERR=''
+EXITVAL='0'
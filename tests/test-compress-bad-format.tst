@@ -0,0 +1,5 @@
+FLAGS='-j --compress=bogus'
+STDIN='aaa,bbb\n'
+STDOUT=''
+STDERR='csvprintf: unsupported compression format "bogus"\n'
+EXITVAL='1'
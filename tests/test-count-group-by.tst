@@ -0,0 +1,5 @@
+FLAGS='--count -i --group-by a'
+STDIN='a,b\n1,2\n'
+STDOUT=''
+STDERR='csvprintf: "--count" is incompatible with "--group-by"\n'
+EXITVAL='1'
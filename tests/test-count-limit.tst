@@ -0,0 +1,5 @@
+FLAGS='--count --limit 1'
+STDIN='a,b\n1,2\n'
+STDOUT=''
+STDERR='csvprintf: "--count" is incompatible with "--limit"\n'
+EXITVAL='1'
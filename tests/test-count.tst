@@ -0,0 +1,5 @@
+FLAGS='--count -n'
+STDIN='a,b\r\n1,"2\n3"\r\n\r\n4\n'
+STDOUT='2\n'
+STDERR=''
+EXITVAL='0'
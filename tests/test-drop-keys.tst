@@ -0,0 +1,5 @@
+FLAGS='-j --drop-keys keys.txt --key 2'
+STDIN='x,a1\ny,a2\nz,longerthaneight2\n'
+STDOUT='\x1e["y","a2"]\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-b --every 2'
+STDIN='a1,b1\na2,b2\na3,b3\na4,b4\na5,b5\n'
+STDOUT="ROW=( 'a1' 'b1' )\nROW=( 'a3' 'b3' )\nROW=( 'a5' 'b5' )\n"
+STDERR=''
+EXITVAL='0'
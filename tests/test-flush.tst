@@ -0,0 +1,5 @@
+FLAGS='-j --flush=time:1000'
+STDIN='a,b\nc,d\n'
+STDOUT='\x1e["a","b"]\n\x1e["c","d"]\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-i --follow --limit 2 -f lookup.csv %{cust}s:%{region}s\n'
+STDIN=''
+STDOUT='1:west\n2:east\ncoast\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-i --group-by k --agg sum(v) --memory-limit 1 %{k}s=%{sum(v)}s\n'
+STDIN='k,v\na,1\nb,2\nc,3\na,4\nb,5\nd,6\n'
+STDOUT='a=5\nc=3\nd=6\nb=7\n'
+STDERR=''
+EXITVAL='0'
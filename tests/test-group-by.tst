@@ -0,0 +1,5 @@
+FLAGS='-i --group-by k --agg count,sum(v),max(v),count-distinct(v) %{k}s:%{count}s:%{sum(v)}s:%{max(v)}s:%{count-distinct(v)}s\n'
+STDIN='k,v\na,1\nb,2.5\na,3\nb,\na,3\n'
+STDOUT='a:3:7:3:2\nb:2:2.5:2.5:1\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-ij'
+STDIN='\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03\x4b\x4c\x4c\xd4\x49\x4a\x4a\xe2\x52\x4a\x34\x54\xd2\x51\x4a\x32\x54\xe2\x02\x00\x3b\xb3\x79\xcd\x12\x00\x00\x00'
+STDOUT='\x1e{"aaa":"a1","bbb":"b1"}\n'
+STDERR=''
+EXITVAL='0'
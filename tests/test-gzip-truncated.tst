@@ -0,0 +1,5 @@
+FLAGS='-j'
+STDIN='\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03\x4b\x4c\x4c\xd4\x49\x4a\x4a\xe2\x52\x4a\x34'
+STDOUT='!IGNORE!'
+STDERR='csvprintf: stdin: gzip: truncated input\n'
+EXITVAL='1'
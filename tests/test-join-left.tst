@@ -0,0 +1,5 @@
+FLAGS='-j --join lookup.csv --on 2=1 --join-type left'
+STDIN='10,1\n11,3\n'
+STDOUT='\x1e["10","1","west"]\n\x1e["11","3",""]\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-i --join lookup.csv --on cust %{id}s:%{region}s\n'
+STDIN='id,cust\n10,1\n11,3\n12,2\n'
+STDOUT='10:west\n12:east\ncoast\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-ij -c b -c c'
+STDIN='a,b,c\n1,2,3\n4,5\n'
+STDOUT='\x1e{"b":"2","c":"3"}\n\x1e{"b":"5"}\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-i --keep-keys keys.txt --key id %{id}s\n'
+STDIN='id\na1\na2\nlongerthaneight1\nlongerthaneight2\n'
+STDOUT='a1\nlongerthaneight2\n'
+STDERR=''
+EXITVAL='0'
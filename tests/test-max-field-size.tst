@@ -0,0 +1,5 @@
+FLAGS='-j --max-field-size 4'
+STDIN='abcd,"wx""y"\nabcde,z\n'
+STDOUT='\x1e["abcd","wx\\"y"]\n'
+STDERR='csvprintf: line 2: field exceeds maximum size of 4 bytes\n'
+EXITVAL='1'
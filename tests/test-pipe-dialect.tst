@@ -0,0 +1,5 @@
+FLAGS='-j -s |'
+STDIN=' a | "b|""c"" " \r\n\r\nd|\te \t|"f\r\ng"\r\n'
+STDOUT='\x1e["a","b|\\"c\\" "]\n\x1e["d","e","f\\r\\ng"]\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-ij --pipeline'
+STDIN='aaa,bbb\n"a1","b1"\n"a2","b2"\n'
+STDOUT='\x1e{"aaa":"a1","bbb":"b1"}\n\x1e{"aaa":"a2","bbb":"b2"}\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-i --profile %{column}s:%{records}s:%{empty}s:%{min_length}s:%{max_length}s:%{distinct}s:%{non_ascii}s:%{numeric}s:%{min}s:%{max}s:%{p50}s\n'
+STDIN='name,n\nfoo,3\nbar,1\nfoo,\n\xc3\xa9t\xc3\xa9,2\nx\n'
+STDOUT='name:5:0:1:5:4:1:0:::\nn:5:2:1:1:3:0:3:1:3:2\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-j --range 3:2'
+STDIN='a,b\n'
+STDOUT=''
+STDERR='csvprintf: invalid argument to "--range"\n'
+EXITVAL='1'
@@ -0,0 +1,5 @@
+FLAGS='-ij --range 2:3'
+STDIN='aaa,bbb\n"a1","b1"\n"a2","b2"\n"a3","b3"\n"a4","b4"\n'
+STDOUT='\x1e{"aaa":"a2","bbb":"b2"}\n\x1e{"aaa":"a3","bbb":"b3"}\n'
+STDERR=''
+EXITVAL='0'
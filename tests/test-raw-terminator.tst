@@ -0,0 +1,5 @@
+FLAGS='-0 --record-terminator='
+STDIN='a,b\nc\n'
+STDOUT='a\x00b\x00c\x00'
+STDERR=''
+EXITVAL='0'
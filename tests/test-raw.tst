@@ -0,0 +1,5 @@
+FLAGS='-0 -n -c c -c a'
+STDIN='a,b,c\nx,"y\\z",\n"p""q",r,s t\n'
+STDOUT='x\x00\x00\np"q\x00s t\x00\n'
+STDERR=''
+EXITVAL='0'
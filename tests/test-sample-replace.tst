@@ -0,0 +1,5 @@
+FLAGS='-j --sample 3 --seed 7'
+STDIN='a1\na2\na3\na4\na5\na6\na7\na8\na9\na10\n'
+STDOUT='\x1e["a4"]\n\x1e["a7"]\n\x1e["a8"]\n'
+STDERR=''
+EXITVAL='0'
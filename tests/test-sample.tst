@@ -0,0 +1,5 @@
+FLAGS='-j --sample 4 --seed 1'
+STDIN='a1\na2\na3\n'
+STDOUT='\x1e["a1"]\n\x1e["a2"]\n\x1e["a3"]\n'
+STDERR=''
+EXITVAL='0'
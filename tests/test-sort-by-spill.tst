@@ -0,0 +1,5 @@
+FLAGS='-b --sort-by 1 --memory-limit 1'
+STDIN='c,1\na,2\nb,3\na,4\n'
+STDOUT="ROW=( 'a' '2' )\nROW=( 'a' '4' )\nROW=( 'b' '3' )\nROW=( 'c' '1' )\n"
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-ij --sort-by v:num:desc,k'
+STDIN='k,v\n"b\nb",2\na,10\nc,x\n"a,a",2\n'
+STDOUT='\x1e{"k":"a","v":"10"}\n\x1e{"k":"a,a","v":"2"}\n\x1e{"k":"b\\nb","v":"2"}\n\x1e{"k":"c","v":"x"}\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-j -s \t'
+STDIN=' a \t "b\t""c"" " \r\n\r\nd\t e \t"f\r\ng"\r\n'
+STDOUT='\x1e["a","b\\t\\"c\\" "]\n\x1e["d","e","f\\r\\ng"]\n'
+STDERR=''
+EXITVAL='0'
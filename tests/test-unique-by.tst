@@ -0,0 +1,5 @@
+FLAGS='-i --unique-by k --unique-approx %{k}s=%{v}s\n'
+STDIN='k,v\na,1\nb,2\na,3\nc,4\nb,5\n'
+STDOUT='a=1\nb=2\nc=4\n'
+STDERR=''
+EXITVAL='0'
@@ -0,0 +1,5 @@
+FLAGS='-j --unique'
+STDIN='a,1\n"x\ny",2\n"a",1\na,2\nx\ny,2\n"x\ny",2\n'
+STDOUT='\x1e["a","1"]\n\x1e["x\\ny","2"]\n\x1e["a","2"]\n\x1e["x"]\n\x1e["y","2"]\n'
+STDERR=''
+EXITVAL='0'
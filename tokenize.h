@@ -0,0 +1,132 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+
+//
+// Tokenizer specialized for one quote character and field separator, included by parse.c once
+// for each with TOKENIZER, QUOTE_CHAR, and FSEP_CHAR defined. Neither character may be CR or LF,
+// and the quote character may not be whitespace.
+//
+// This reads a whole record with the same results as the generic parser_readcol(), but with the
+// characters known at compile time, a table lookup in place of isspace(3), and the buffer and
+// offset kept in local variables. Unquoted values never look for the quote character.
+// Returns zero, or -1 on error.
+//
+
+static int
+TOKENIZER(struct csv_parser *p)
+{
+    FILE *const fp = p->fp;
+    const unsigned char *const cls = p->cls;
+    char *buf = p->buf;
+    size_t len = p->len;
+    size_t limit = p->limit;
+    uint64_t offset = p->offset;
+    size_t start;
+    int ch;
+
+    while (1) {
+
+        // Skip leading whitespace, excluding our field separator
+        start = len;
+        if (p->bounded) {
+            p->len = len;
+            parser_startcol(p, start);
+            limit = p->limit;
+        }
+        while (1) {
+            if ((ch = getc_unlocked(fp)) == EOF) {
+                ch = '\n';
+                break;
+            }
+            offset++;
+            if ((cls[ch] & CLS_SPACE) == 0)
+                break;
+            if (ch == '\r') {
+                offset += tok_skip_lf(fp);
+                ch = '\n';
+            }
+            if (ch == '\n')
+                break;
+        }
+
+        // Read quoted or unquoted value
+        if (ch != QUOTE_CHAR) {
+            while ((cls[ch] & CLS_STOP) == 0) {
+                TOK_ADDCHAR(ch);
+                if ((ch = getc_unlocked(fp)) == EOF) {
+                    ch = '\n';
+                    break;
+                }
+                offset++;
+            }
+            if (ch == '\r') {
+                offset += tok_skip_lf(fp);
+                ch = '\n';
+            }
+
+            // Trim trailing whitespace (leading whitespace is already gone)
+            while (len > start && (cls[(unsigned char)buf[len - 1]] & CLS_SPACE) != 0)
+                len--;
+        } else {
+            p->field_quoted = 1;
+            while (1) {
+                if ((ch = getc_unlocked(fp)) == EOF)
+                    return parser_fail(p, 0, "line %d: premature EOF", p->linenum);
+                offset++;
+                if (ch == QUOTE_CHAR) {             // doubled quote or end of value
+                    if ((ch = getc_unlocked(fp)) == EOF) {
+                        ch = '\n';
+                        break;
+                    }
+                    offset++;
+                    if (ch == '\r') {
+                        offset += tok_skip_lf(fp);
+                        ch = '\n';
+                    }
+                    if (ch != QUOTE_CHAR)
+                        break;
+                }
+                TOK_ADDCHAR(ch);
+                if (ch == '\n')
+                    p->linenum++;
+            }
+
+            // Allow only whitespace before the next separator or end of line
+            while (ch != '\n' && ch != FSEP_CHAR) {
+                if ((cls[ch] & CLS_SPACE) == 0)
+                    return parser_fail(p, 0, "line %d: unexpected character \"%c\"", p->linenum, ch);
+                if ((ch = getc_unlocked(fp)) == EOF) {
+                    ch = '\n';
+                    break;
+                }
+                offset++;
+            }
+        }
+
+        // Add column
+        TOK_ENDCOL();
+        if (parser_addfield(p, start) == -1)
+            return -1;
+        if (ch == '\n')
+            break;
+    }
+    p->linenum++;
+    p->len = len;
+    p->offset = offset;
+    return 0;
+}
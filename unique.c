@@ -0,0 +1,223 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UNIQUE_MIN_SLOTS        1024
+#define UNIQUE_BLOOM_HASHES     7
+#define UNIQUE_BLOOM_MIN_BITS   ((size_t)1 << 20)
+#define UNIQUE_BLOOM_BLOCK_BITS 512
+
+//
+// Duplicate record detection.
+//
+// The key is the chosen fields (or all of them), each followed by a NUL byte; since fields
+// can't contain NUL bytes, this is unambiguous. In exact mode, keys are kept in an
+// open-addressing hash table with the keys themselves in an arena. In approximate mode,
+// only a Bloom filter of fixed size is kept, so memory use is bounded, but occasionally a
+// record will be wrongly considered a duplicate. The filter is "blocked": all of a key's
+// bits are in the same 64-byte block, so each check costs at most one cache miss.
+//
+
+struct unique_entry {
+    uint64_t            hash;
+    const char          *key;               // NULL if slot is empty
+    size_t              keylen;
+};
+
+struct unique {
+    char                **specs;            // NULL means use the whole record
+    size_t              num_specs;
+    size_t              *cols;
+    struct unique_entry *slots;
+    size_t              num_slots;
+    size_t              num_entries;
+    struct arena        *arena;
+    uint64_t            *bloom;             // if not NULL, we're in approximate mode
+    size_t              bloom_bits;         // always a power of two
+    char                *keybuf;
+    size_t              keyalloc;
+};
+
+static int unique_check_exact(struct unique *u, uint64_t hash, size_t keylen);
+static int unique_check_bloom(struct unique *u, uint64_t hash);
+static void unique_grow(struct unique *u);
+
+//
+// Create a duplicate detector; "cols" is a comma-separated list of columns, or NULL for whole records.
+// In approximate mode, the Bloom filter uses about "memory_limit" bytes.
+//
+struct unique *
+unique_create(const char *cols, int approximate, size_t memory_limit)
+{
+    struct unique *u;
+    const char *next;
+
+    if ((u = calloc(1, sizeof(*u))) == NULL)
+        err(1, "calloc");
+    for (; cols != NULL; cols = next + 1) {
+        if ((next = strchr(cols, ',')) == NULL)
+            next = cols + strlen(cols);
+        if (next == cols)
+            errx(1, "invalid argument to \"--%s\"", "unique-by");
+        if ((u->specs = realloc(u->specs, (u->num_specs + 1) * sizeof(*u->specs))) == NULL)
+            err(1, "realloc");
+        if ((u->specs[u->num_specs++] = strndup(cols, next - cols)) == NULL)
+            err(1, "strndup");
+        if (*next == '\0')
+            break;
+    }
+    if (approximate) {
+        for (u->bloom_bits = UNIQUE_BLOOM_MIN_BITS; u->bloom_bits / 8 * 2 <= memory_limit; u->bloom_bits *= 2)
+            ;
+        if ((u->bloom = calloc(u->bloom_bits / 64, sizeof(*u->bloom))) == NULL)
+            err(1, "calloc");
+    } else {
+        u->num_slots = UNIQUE_MIN_SLOTS;
+        if ((u->slots = calloc(u->num_slots, sizeof(*u->slots))) == NULL)
+            err(1, "calloc");
+        u->arena = arena_create();
+    }
+    return u;
+}
+
+void
+unique_resolve(struct unique *u, char *const *names, size_t num_names)
+{
+    size_t i;
+
+    if ((u->cols = calloc(u->num_specs + 1, sizeof(*u->cols))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < u->num_specs; i++)
+        u->cols[i] = find_column(u->specs[i], names, num_names);
+}
+
+//
+// Returns non-zero if this is the first time we've seen this record (or key).
+//
+int
+unique_check(struct unique *u, char *const *fields, size_t num)
+{
+    const size_t num_key = u->specs != NULL ? u->num_specs : num;
+    const char *field;
+    size_t keylen = 0;
+    size_t len;
+    size_t i;
+
+    // Build key
+    for (i = 0; i < num_key; i++) {
+        if (u->specs == NULL)
+            field = fields[i];
+        else
+            field = u->cols[i] < num ? fields[u->cols[i]] : "";
+        len = strlen(field) + 1;
+        if (keylen + len > u->keyalloc) {
+            u->keyalloc = (keylen + len) * 2;
+            if ((u->keybuf = realloc(u->keybuf, u->keyalloc)) == NULL)
+                err(1, "realloc");
+        }
+        memcpy(u->keybuf + keylen, field, len);
+        keylen += len;
+    }
+
+    // Check it
+    if (u->bloom != NULL)
+        return unique_check_bloom(u, hash_bytes(u->keybuf, keylen));
+    return unique_check_exact(u, hash_bytes(u->keybuf, keylen), keylen);
+}
+
+void
+unique_free(struct unique *u)
+{
+    size_t i;
+
+    for (i = 0; i < u->num_specs; i++)
+        free(u->specs[i]);
+    free(u->specs);
+    free(u->cols);
+    free(u->slots);
+    if (u->arena != NULL)
+        arena_destroy(u->arena);
+    free(u->bloom);
+    free(u->keybuf);
+    free(u);
+}
+
+static int
+unique_check_exact(struct unique *u, uint64_t hash, size_t keylen)
+{
+    struct unique_entry *entry;
+    size_t slot;
+
+    for (slot = hash & (u->num_slots - 1); (entry = &u->slots[slot])->key != NULL; slot = (slot + 1) & (u->num_slots - 1)) {
+        if (entry->hash == hash && entry->keylen == keylen && memcmp(entry->key, u->keybuf, keylen) == 0)
+            return 0;
+    }
+    entry->hash = hash;
+    entry->keylen = keylen;
+    entry->key = memcpy(arena_alloc(u->arena, keylen), u->keybuf, keylen);
+    if (++u->num_entries * 4 > u->num_slots * 3)
+        unique_grow(u);
+    return 1;
+}
+
+// Set the filter bits for this hash; the low bits choose the block, and a remix chooses the bits within it
+static int
+unique_check_bloom(struct unique *u, uint64_t hash)
+{
+    uint64_t *const block = u->bloom + (hash & (u->bloom_bits / UNIQUE_BLOOM_BLOCK_BITS - 1)) * (UNIQUE_BLOOM_BLOCK_BITS / 64);
+    uint64_t bits = ((hash >> 32) | (hash << 32)) * 0x9e3779b97f4a7c15ULL;
+    int found = 1;
+    unsigned int bit;
+    int i;
+
+    for (i = 0; i < UNIQUE_BLOOM_HASHES; i++) {
+        bit = bits % UNIQUE_BLOOM_BLOCK_BITS;
+        bits /= UNIQUE_BLOOM_BLOCK_BITS;
+        if ((block[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0) {
+            block[bit / 64] |= (uint64_t)1 << (bit % 64);
+            found = 0;
+        }
+    }
+    return !found;
+}
+
+static void
+unique_grow(struct unique *u)
+{
+    struct unique_entry *const old = u->slots;
+    const size_t num_old = u->num_slots;
+    size_t slot;
+    size_t i;
+
+    u->num_slots *= 2;
+    if ((u->slots = calloc(u->num_slots, sizeof(*u->slots))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < num_old; i++) {
+        if (old[i].key == NULL)
+            continue;
+        for (slot = old[i].hash & (u->num_slots - 1); u->slots[slot].key != NULL; slot = (slot + 1) & (u->num_slots - 1))
+            ;
+        u->slots[slot] = old[i];
+    }
+    free(old);
+}
@@ -0,0 +1,284 @@
+
+//
+// csvprintf - Simple CSV file parser for the UNIX command line
+// 
+// Copyright 2010 Archie L. Cobbs <archie@dellroad.org>
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may
+// not use this file except in compliance with the License. You may obtain
+// a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations
+// under the License.
+// 
+
+#include "csvprintf.h"
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#endif
+
+//
+// Minimal io_uring(7) support, using the system calls directly so we don't need liburing.
+//
+// The reader and writer threads use this to keep several large reads or writes outstanding
+// at once, instead of waiting for each one in turn. Each request is identified by a small
+// "tag" chosen by the caller, which must be less than the number of entries and not in use
+// by another outstanding request.
+//
+// io_uring is only used if asked for with uring_enable(), and if the kernel supports it
+// (it may be missing, or disabled by a container's security policy); otherwise uring_create()
+// returns NULL and the caller falls back to read(2) and write(2).
+//
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+
+struct uring {
+    int                     fd;
+    unsigned int            entries;
+    unsigned int            pending;        // requests queued but not yet submitted
+    _Atomic unsigned int    *sq_head;
+    _Atomic unsigned int    *sq_tail;
+    unsigned int            sq_mask;
+    unsigned int            *sq_array;
+    struct io_uring_sqe     *sqes;
+    _Atomic unsigned int    *cq_head;
+    _Atomic unsigned int    *cq_tail;
+    unsigned int            cq_mask;
+    struct io_uring_cqe     *cqes;
+    struct iovec            *iov;           // one per tag
+    void                    *sq_ptr;
+    size_t                  sq_size;
+    void                    *cq_ptr;
+    size_t                  cq_size;
+    size_t                  sqes_size;
+};
+
+static void uring_queue(struct uring *u, int opcode, int fd, void *buf, size_t len, uint64_t offset, unsigned int tag);
+static int uring_enter(struct uring *u, unsigned int min_complete);
+
+static int uring_enabled;
+
+//
+// Use io_uring for reading and writing where possible.
+//
+void
+uring_enable(void)
+{
+    uring_enabled = 1;
+}
+
+//
+// Create an io_uring instance with room for "entries" outstanding requests.
+// Returns NULL if io_uring isn't enabled or isn't available.
+//
+struct uring *
+uring_create(unsigned int entries)
+{
+    struct io_uring_params params;
+    struct uring *u;
+    char *sq;
+    char *cq;
+    int fd;
+
+    // Set up ring
+    if (!uring_enabled)
+        return NULL;
+    memset(&params, 0, sizeof(params));
+    if ((fd = syscall(__NR_io_uring_setup, entries, &params)) == -1)
+        return NULL;
+    if ((u = calloc(1, sizeof(*u))) == NULL)
+        err(1, "calloc");
+    u->fd = fd;
+    u->entries = entries;
+    if ((u->iov = calloc(entries, sizeof(*u->iov))) == NULL)
+        err(1, "calloc");
+
+    // Map the submission and completion queues (which newer kernels put in a single mapping)
+    u->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    u->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0 && u->cq_size > u->sq_size)
+        u->sq_size = u->cq_size;
+    if ((u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+        err(1, "io_uring: mmap");
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+        u->cq_ptr = u->sq_ptr;
+    else if ((u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        err(1, "io_uring: mmap");
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if ((u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES)) == MAP_FAILED)
+        err(1, "io_uring: mmap");
+
+    // Find the queue fields
+    sq = u->sq_ptr;
+    u->sq_head = (_Atomic unsigned int *)(sq + params.sq_off.head);
+    u->sq_tail = (_Atomic unsigned int *)(sq + params.sq_off.tail);
+    u->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    cq = u->cq_ptr;
+    u->cq_head = (_Atomic unsigned int *)(cq + params.cq_off.head);
+    u->cq_tail = (_Atomic unsigned int *)(cq + params.cq_off.tail);
+    u->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return u;
+}
+
+void
+uring_destroy(struct uring *u)
+{
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_ptr != u->sq_ptr)
+        munmap(u->cq_ptr, u->cq_size);
+    munmap(u->sq_ptr, u->sq_size);
+    (void)close(u->fd);
+    free(u->iov);
+    free(u);
+}
+
+//
+// Queue a read or write of "len" bytes at "offset". Requests are started by uring_submit() or uring_wait().
+//
+void
+uring_read(struct uring *u, int fd, void *buf, size_t len, uint64_t offset, unsigned int tag)
+{
+    uring_queue(u, IORING_OP_READV, fd, buf, len, offset, tag);
+}
+
+void
+uring_write(struct uring *u, int fd, const void *buf, size_t len, uint64_t offset, unsigned int tag)
+{
+    uring_queue(u, IORING_OP_WRITEV, fd, (void *)(uintptr_t)buf, len, offset, tag);
+}
+
+//
+// Start any queued requests.
+//
+void
+uring_submit(struct uring *u)
+{
+    if (u->pending > 0)
+        (void)uring_enter(u, 0);
+}
+
+//
+// Start any queued requests and wait for one to finish. Returns its result, which is
+// the number of bytes transferred or a negated errno value, and sets "*tagp" to its tag.
+//
+int
+uring_wait(struct uring *u, unsigned int *tagp)
+{
+    const struct io_uring_cqe *cqe;
+    unsigned int head;
+    int result;
+
+    while (1) {
+        head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+        if (head != atomic_load_explicit(u->cq_tail, memory_order_acquire))
+            break;
+        (void)uring_enter(u, 1);
+    }
+    cqe = &u->cqes[head & u->cq_mask];
+    *tagp = (unsigned int)cqe->user_data;
+    result = cqe->res;
+    atomic_store_explicit(u->cq_head, head + 1, memory_order_release);
+    return result;
+}
+
+// Add a request to the submission queue
+static void
+uring_queue(struct uring *u, int opcode, int fd, void *buf, size_t len, uint64_t offset, unsigned int tag)
+{
+    const unsigned int tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    const unsigned int index = tail & u->sq_mask;
+    struct io_uring_sqe *const sqe = &u->sqes[index];
+
+    assert(tag < u->entries);
+    assert(tail - atomic_load_explicit(u->sq_head, memory_order_acquire) < u->entries);
+    u->iov[tag].iov_base = buf;
+    u->iov[tag].iov_len = len;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t)&u->iov[tag];
+    sqe->len = 1;
+    sqe->user_data = tag;
+    u->sq_array[index] = index;
+    atomic_store_explicit(u->sq_tail, tail + 1, memory_order_release);
+    u->pending++;
+}
+
+// Submit queued requests and optionally wait for completions
+static int
+uring_enter(struct uring *u, unsigned int min_complete)
+{
+    int r;
+
+    while ((r = syscall(__NR_io_uring_enter, u->fd, u->pending, min_complete,
+      min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) == -1) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            err(1, "io_uring_enter");
+    }
+    u->pending -= r < u->pending ? r : u->pending;
+    return r;
+}
+
+#else   /* !HAVE_LINUX_IO_URING_H */
+
+void
+uring_enable(void)
+{
+}
+
+struct uring *
+uring_create(unsigned int entries)
+{
+    return NULL;
+}
+
+void
+uring_destroy(struct uring *u)
+{
+}
+
+void
+uring_read(struct uring *u, int fd, void *buf, size_t len, uint64_t offset, unsigned int tag)
+{
+    errx(1, "internal error");
+}
+
+void
+uring_write(struct uring *u, int fd, const void *buf, size_t len, uint64_t offset, unsigned int tag)
+{
+    errx(1, "internal error");
+}
+
+void
+uring_submit(struct uring *u)
+{
+}
+
+int
+uring_wait(struct uring *u, unsigned int *tagp)
+{
+    errx(1, "internal error");
+}
+
+#endif  /* !HAVE_LINUX_IO_URING_H */